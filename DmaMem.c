@@ -1,46 +1,110 @@
 #include "DmaMem.h"
+#include "DmaMemEngine.h"
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/io.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/compiler.h>
+#include <linux/bitops.h>
+#include <linux/limits.h>
+#include <linux/jiffies.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/stdarg.h>
 
-#define HEIGHT(_tree)       (_tree==NULL ? -1 : _tree->height)
 #define MAX(_a, _b)         (_a >= _b ? _a : _b)
+#define MIN(_a, _b)         (_a <= _b ? _a : _b)
 
-static avl_node_t* DmaMem_popfront(DmaMem_t *mm);
-static void DmaMem_pushback(DmaMem_t *mm, avl_node_t* node);
+/* alloc_aligned flag of the allocator's calls on its own behalf, which stay out of the trace */
+#define DMA_MEM_NESTED      0x80000000u
 
+/* longest message DmaMem_log hands to a backend */
+#define DMA_MEM_LOG_MAX     192
 
-static DmaMemKey_t MAKE_KEY(unsigned long key0, unsigned long key1) {
-    DmaMemKey_t vKey;
-    vKey.key[0] = key0;
-    vKey.key[1] = key1;
-    return vKey;
+static void* kernel_alloc(void* ctx, unsigned long bytes, gfp_t gfp) {
+    return kvmalloc(bytes, gfp);
 }
 
-static unsigned long KEY_TO_VALUE(DmaMemKey_t vKey) {
-    return vKey.key[0];
+static void kernel_free(void* ctx, const void* ptr) {
+    kvfree(ptr);
 }
 
-static avl_node_t* make_avl_node(DmaMem_t* mm, DmaMemKey_t key,  DmaPage_t* page) {
-    avl_node_t* node = (avl_node_t*)DmaMem_popfront(mm);
-    if ( node == NULL ) {
-        printk("[VDI] failed to allocate memory to make_avl_node\n");
-        return NULL;
-    }
-    node->key     = key;
-    node->page    = page;
-    node->height  = 0;
-    node->left    = NULL;
-    node->right   = NULL;
-    return node;
+static void* kernel_map(void* ctx, unsigned long addr, unsigned long size, unsigned long flags) {
+    return memremap(addr, size, flags);
+}
+
+static void kernel_unmap(void* ctx, void* kaddr) {
+    memunmap(kaddr);
+}
+
+static void kernel_log(void* ctx, const char* msg) {
+    printk("%s", msg);
 }
 
-static int get_balance_factor(avl_node_t* tree) {
-    int factor = 0;
-    if (tree) {
-        factor = HEIGHT(tree->right) - HEIGHT(tree->left);
+const DmaMemBackend_t DmaMem_kernel_backend = {
+    .alloc = kernel_alloc,
+    .free  = kernel_free,
+    .map   = kernel_map,
+    .unmap = kernel_unmap,
+    .log   = kernel_log,
+};
+
+void DmaMem_vlog(const DmaMemBackend_t* backend, void* ctx, const char* fmt, va_list args) {
+    char msg[DMA_MEM_LOG_MAX];
+
+    if ((backend == NULL) || (backend == &DmaMem_kernel_backend)) {
+        vprintk(fmt, args);
+    } else {
+        vsnprintf(msg, sizeof(msg), fmt, args);
+        backend->log(ctx, msg);
     }
+}
+
+void DmaMem_log(const DmaMem_t* mm, const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    DmaMem_vlog(mm ? mm->backend : NULL, mm ? mm->backend_ctx : NULL, fmt, args);
+    va_end(args);
+}
 
-    return factor;
+/*
+ * One AVL tree per region holds every block, free or allocated, ordered by
+ * first page. Nodes are linked by 32-bit pool indices and node 0 is the
+ * shared leaf sentinel DMA_TREE_NIL with height 0 and nothing free, so no
+ * NULL checks are needed. Each node caches maxfree, the largest free block
+ * in its subtree. It steers first-fit searches down a single path and
+ * keeps best-fit searches out of the subtrees without a fit.
+ * All operations are iterative: the way down is recorded in a path of at
+ * most DMA_TREE_MAX_DEPTH indices and retraced to rebalance and refresh
+ * maxfree. At most one node may be out of date when a retrace starts.
+ */
+#define DMA_TREE_MAX_DEPTH  48      /* AVL height bound for 2^32 nodes is 46 */
+
+#define NODE(_mm, _idx)     DmaMem_node(_mm, _idx)
+
+static inline u32 own_free(const avl_node_t* node) {
+    return node->used ? 0 : node->npages;
+}
+
+/* recomputes height and maxfree from the children */
+static inline void fix_node(DmaMem_t* mm, avl_node_t* node) {
+    const avl_node_t* l = NODE(mm, node->left);
+    const avl_node_t* r = NODE(mm, node->right);
+    u32 maxfree = own_free(node);
+
+    node->height = MAX(l->height, r->height) + 1;
+    if (l->maxfree > maxfree) {
+        maxfree = l->maxfree;
+    }
+    if (r->maxfree > maxfree) {
+        maxfree = r->maxfree;
+    }
+    node->maxfree = maxfree;
 }
 
 /*
@@ -53,548 +117,3437 @@ static int get_balance_factor(avl_node_t* tree) {
 *      D    C                 D
 *
 */
-static avl_node_t* rotation_left(avl_node_t* tree) {
-    avl_node_t* rchild;
-    avl_node_t* lchild;
-    if (tree == NULL) {
-        return NULL;
-    }
-
-    rchild = tree->right;
-    if (rchild == NULL) {
-        return tree;
-    }
-
-    lchild = rchild->left;
-    rchild->left = tree;
-    tree->right = lchild;
-
-    tree->height   = MAX(HEIGHT(tree->left), HEIGHT(tree->right)) + 1;
-    rchild->height = MAX(HEIGHT(rchild->left), HEIGHT(rchild->right)) + 1;
-    return rchild;
+static u32 rotation_left(DmaMem_t* mm, u32 a) {
+    avl_node_t* na = NODE(mm, a);
+    u32 b = na->right;
+    avl_node_t* nb = NODE(mm, b);
+
+    na->right = nb->left;
+    nb->left  = a;
+    fix_node(mm, na);
+    fix_node(mm, nb);
+    return b;
 }
 
 /*
-* Reft Rotation
+* Right Rotation
 *
 *         A                  B
-*       \                  /  \
-*      B         =>       D    A
-*    /  \                     /
-*   D    C                   C
+*        /                  /  \
+*       B        =>        D    A
+*     /  \                     /
+*    D    C                   C
 *
 */
-static avl_node_t* rotation_right(avl_node_t* tree) {
-    avl_node_t* rchild;
-    avl_node_t* lchild;
-    if (tree == NULL) {
-        return NULL;
+static u32 rotation_right(DmaMem_t* mm, u32 a) {
+    avl_node_t* na = NODE(mm, a);
+    u32 b = na->left;
+    avl_node_t* nb = NODE(mm, b);
+
+    na->left  = nb->right;
+    nb->right = a;
+    fix_node(mm, na);
+    fix_node(mm, nb);
+    return b;
+}
+
+/* restores the AVL invariant at idx, whose subtrees are balanced; returns the subtree's new root */
+static u32 do_balance(DmaMem_t* mm, u32 idx) {
+    avl_node_t* node = NODE(mm, idx);
+    int lh = NODE(mm, node->left)->height, rh = NODE(mm, node->right)->height;
+    avl_node_t* child;
+
+    if (rh - lh >= 2) {
+        child = NODE(mm, node->right);
+        if (NODE(mm, child->left)->height > NODE(mm, child->right)->height) {
+            node->right = rotation_right(mm, node->right);
+        }
+        return rotation_left(mm, idx);
+    }
+    if (lh - rh >= 2) {
+        child = NODE(mm, node->left);
+        if (NODE(mm, child->right)->height > NODE(mm, child->left)->height) {
+            node->left = rotation_left(mm, node->left);
+        }
+        return rotation_right(mm, idx);
     }
+    fix_node(mm, node);
+    return idx;
+}
 
-    lchild = tree->left;
-    if (lchild == NULL) {
-        return NULL;
+static void replace_child(DmaMem_t* mm, u32 parent, u32 old, u32 child) {
+    avl_node_t* node;
+    if (parent == DMA_TREE_NIL) {
+        mm->block_tree = child;
+        return;
+    }
+    node = NODE(mm, parent);
+    if (node->left == old) {
+        node->left = child;
+    } else {
+        node->right = child;
     }
+}
 
-    rchild = lchild->right;
-    lchild->right = tree;
-    tree->left = rchild;
+/*
+ * Rebalances path[depth-1] .. path[0] bottom-up. From path[keep-1] upwards
+ * it stops as soon as a subtree keeps its root, height and maxfree.
+ */
+static void retrace(DmaMem_t* mm, u32* path, int depth, int keep) {
+    int d;
+    for (d = depth - 1; d >= 0; --d) {
+        u32 idx = path[d];
+        avl_node_t* node = NODE(mm, idx);
+        u8  height  = node->height;
+        u32 maxfree = node->maxfree;
+        u32 sub = do_balance(mm, idx);
+        if (sub != idx) {
+            replace_child(mm, d > 0 ? path[d - 1] : DMA_TREE_NIL, idx, sub);
+        } else if ((d < keep) && (node->height == height) && (node->maxfree == maxfree)) {
+            break;
+        }
+    }
+    if (NODE(mm, mm->block_tree)->height > mm->tree_peak) {
+        mm->tree_peak = NODE(mm, mm->block_tree)->height;
+    }
+}
 
-    tree->height   = MAX(HEIGHT(tree->left), HEIGHT(tree->right)) + 1;
-    lchild->height = MAX(HEIGHT(lchild->left), HEIGHT(lchild->right)) + 1;
+/* the path to the block starting at pageno; returns its depth or 0 */
+static int avltree_find(DmaMem_t* mm, unsigned long pageno, u32* path) {
+    u32 cur = mm->block_tree;
+    int depth = 0;
+    while (cur != DMA_TREE_NIL) {
+        avl_node_t* n = NODE(mm, cur);
+        path[depth++] = cur;
+        if (pageno == n->pageno) {
+            return depth;
+        }
+        cur = (pageno > n->pageno) ? n->right : n->left;
+    }
+    return 0;
+}
 
-    return lchild;
+static void avltree_insert(DmaMem_t* mm, avl_node_t* node) {
+    u32 path[DMA_TREE_MAX_DEPTH];
+    u32 cur = mm->block_tree, parent = DMA_TREE_NIL;
+    int depth = 0;
+
+    node->left    = DMA_TREE_NIL;
+    node->right   = DMA_TREE_NIL;
+    node->height  = 1;
+    node->maxfree = own_free(node);
+    while (cur != DMA_TREE_NIL) {
+        avl_node_t* n = NODE(mm, cur);
+        path[depth++] = parent = cur;
+        cur = (node->pageno > n->pageno) ? n->right : n->left;
+    }
+    if (parent == DMA_TREE_NIL) {
+        mm->block_tree = node->index;
+        return;
+    }
+    if (node->pageno > NODE(mm, parent)->pageno) {
+        NODE(mm, parent)->right = node->index;
+    } else {
+        NODE(mm, parent)->left  = node->index;
+    }
+    retrace(mm, path, depth, depth);
 }
 
-static avl_node_t* do_balance(avl_node_t* tree) {
-    int bfactor = 0, child_bfactor;       /* balancing factor */
-    bfactor = get_balance_factor(tree);
-    if (bfactor >= 2) {
-        child_bfactor = get_balance_factor(tree->right);
-        if (child_bfactor == 1 || child_bfactor == 0) {
-            tree = rotation_left(tree);
-        } else if (child_bfactor == -1) {
-            tree->right = rotation_right(tree->right);
-            tree        = rotation_left(tree);
-        } else {
-            printk("invalid balancing factor: %d\n", child_bfactor);
-            return NULL;
-        }
-    } else if (bfactor <= -2) {
-        child_bfactor = get_balance_factor(tree->left);
-        if (child_bfactor == -1 || child_bfactor == 0) {
-            tree = rotation_right(tree);
-        } else if (child_bfactor == 1) {
-            tree->left = rotation_left(tree->left);
-            tree       = rotation_right(tree);
-        } else {
-            printk("invalid balancing factor: %d\n", child_bfactor);
-            return NULL;
+/*
+ * Inserts node right after path[depth-1] in address order, reusing the
+ * path to it. The anchor may have changed in place; the retrace refreshes
+ * it on the way up.
+ */
+static void avltree_insert_after(DmaMem_t* mm, u32* path, int depth, avl_node_t* node) {
+    avl_node_t* prev = NODE(mm, path[depth - 1]);
+    int anchor = depth;
+    u32 cur;
+
+    node->left    = DMA_TREE_NIL;
+    node->right   = DMA_TREE_NIL;
+    node->height  = 1;
+    node->maxfree = own_free(node);
+    if (prev->right == DMA_TREE_NIL) {
+        prev->right = node->index;
+    } else {
+        cur = prev->right;
+        while (NODE(mm, cur)->left != DMA_TREE_NIL) {
+            path[depth++] = cur;
+            cur = NODE(mm, cur)->left;
         }
+        path[depth++] = cur;
+        NODE(mm, cur)->left = node->index;
+    }
+    retrace(mm, path, depth, anchor);
+}
+
+/*
+ * Unlinks path[depth-1] from the tree; path[0..depth-2] are its ancestors.
+ * A node with two children is replaced by its in-order successor. Nodes
+ * from path[keep-1] down are always refreshed, for ancestors that changed
+ * in place.
+ */
+static void unlink_path(DmaMem_t* mm, u32* path, int depth, int keep) {
+    u32 idx = path[depth - 1];
+    avl_node_t* node = NODE(mm, idx);
+    u32 parent = (depth > 1) ? path[depth - 2] : DMA_TREE_NIL;
+    avl_node_t* succ;
+    u32 s;
+    int slot;
+
+    if ((node->left == DMA_TREE_NIL) || (node->right == DMA_TREE_NIL)) {
+        replace_child(mm, parent, idx, (node->left != DMA_TREE_NIL) ? node->left : node->right);
+        retrace(mm, path, depth - 1, MIN(keep, depth - 1));
+        return;
     }
 
-    return tree;
+    /* walk to the successor, which takes idx's place in the path */
+    slot = depth - 1;
+    s = node->right;
+    while (NODE(mm, s)->left != DMA_TREE_NIL) {
+        path[depth++] = s;
+        s = NODE(mm, s)->left;
+    }
+    succ = NODE(mm, s);
+    if (depth - 1 > slot) {
+        NODE(mm, path[depth - 1])->left = succ->right;
+        succ->right = node->right;
+    }
+    /* succ inherits idx's position and cached values; everything below it is recomputed */
+    succ->left    = node->left;
+    succ->height  = node->height;
+    succ->maxfree = node->maxfree;
+    replace_child(mm, parent, idx, s);
+    path[slot] = s;
+    retrace(mm, path, depth, MIN(keep, slot + 1));
 }
 
-static avl_node_t* unlink_end_node(avl_node_t* tree, int dir, avl_node_t** found_node) {
-    *found_node = NULL;
-    if (tree == NULL) {
-        return NULL;
+static void avltree_remove(DmaMem_t* mm, avl_node_t* node) {
+    u32 path[DMA_TREE_MAX_DEPTH];
+    int depth = avltree_find(mm, node->pageno, path);
+    if (depth == 0) {
+        DmaMem_log(mm, "failed to find block %u\n", node->pageno);
+        return;
     }
+    unlink_path(mm, path, depth, depth);
+}
 
-    if (dir == LEFT) {
-        if (tree->left == NULL) {
-            *found_node = tree;
-            return NULL;
-        }
-    } else {
-        if (tree->right == NULL) {
-            *found_node = tree;
-            return NULL;
-        }
+/* refreshes maxfree above a node whose size or state changed in place */
+static void avltree_update(DmaMem_t* mm, avl_node_t* node) {
+    u32 path[DMA_TREE_MAX_DEPTH];
+    int depth = avltree_find(mm, node->pageno, path);
+    if (depth == 0) {
+        DmaMem_log(mm, "failed to find block %u\n", node->pageno);
+        return;
     }
+    retrace(mm, path, depth, depth);
+}
 
-    if (dir == LEFT) {
-        tree->left = unlink_end_node(tree->left, LEFT, found_node);
-        if (tree->left == NULL) {
-            tree->left = (*found_node)->right;
-            (*found_node)->left  = NULL;
-            (*found_node)->right = NULL;
+/*
+ * Merges the block low with the block high that follows it in address
+ * order into one free block. Of two neighbours in an in-order walk one is
+ * always an ancestor of the other, so a single descent finds both: the
+ * ancestor survives, taking over the whole range, and the descendant,
+ * which lacks the child on the neighbour's side, is unlinked. One retrace
+ * refreshes both. Returns the surviving node.
+ */
+static avl_node_t* avltree_merge(DmaMem_t* mm, avl_node_t* low, avl_node_t* high) {
+    u32 path[DMA_TREE_MAX_DEPTH];
+    avl_node_t* keep_node;
+    avl_node_t* gone;
+    u32 cur = mm->block_tree;
+    int depth = 0, keep = 0;
+
+    /* down to low, noting where high is passed */
+    while (cur != low->index) {
+        avl_node_t* n = NODE(mm, cur);
+        path[depth++] = cur;
+        if (cur == high->index) {
+            keep = depth;
         }
-    } else {
-        tree->right = unlink_end_node(tree->right, RIGHT, found_node);
-        if (tree->right == NULL) {
-            tree->right = (*found_node)->left;
-            (*found_node)->left  = NULL;
-            (*found_node)->right = NULL;
+        cur = (low->pageno > n->pageno) ? n->right : n->left;
+    }
+    path[depth++] = cur;
+    if (keep == 0) {
+        /* high is the leftmost node of low's right subtree */
+        keep = depth;
+        cur  = low->right;
+        while (cur != high->index) {
+            path[depth++] = cur;
+            cur = NODE(mm, cur)->left;
         }
+        path[depth++] = cur;
+        keep_node = low;
+        gone      = high;
+    } else {
+        keep_node = high;
+        gone      = low;
     }
 
-    tree->height = MAX(HEIGHT(tree->left), HEIGHT(tree->right)) + 1;
-    return do_balance(tree);
+    DmaMem_clear_block(mm, low->pageno, low->npages);
+    DmaMem_clear_block(mm, high->pageno, high->npages);
+    keep_node->npages = low->npages + high->npages;
+    keep_node->pageno = low->pageno;
+    DmaMem_mark_block(mm, keep_node, 0);
+    unlink_path(mm, path, depth, keep);
+    DmaMem_pushback(mm, gone);
+    return keep_node;
 }
 
-static avl_node_t* avltree_insert(DmaMem_t* mm, avl_node_t* tree, DmaMemKey_t key, DmaPage_t* page) {
-    if (tree == NULL) {
-        tree = make_avl_node(mm, key, page);
-    } else {
-          if ((key.key[0] > tree->key.key[0]) || ((key.key[0] == tree->key.key[0]) && (key.key[1] >= tree->key.key[1]))) {
-            tree->right = avltree_insert(mm, tree->right, key, page);
+/* the lowest free block of at least npages and the path to it; returns the depth or 0 */
+static int first_fit(DmaMem_t* mm, unsigned long npages, u32* path) {
+    u32 cur = mm->block_tree;
+    int depth = 0;
+
+    if (NODE(mm, cur)->maxfree < npages) {
+        return 0;
+    }
+    for (;;) {
+        avl_node_t* node = NODE(mm, cur);
+        path[depth++] = cur;
+        if (NODE(mm, node->left)->maxfree >= npages) {
+            cur = node->left;
+        } else if (own_free(node) >= npages) {
+            return depth;
         } else {
-            tree->left  = avltree_insert(mm, tree->left, key, page);
+            cur = node->right;
         }
     }
+}
 
-    tree = do_balance(tree);
-    tree->height = MAX(HEIGHT(tree->left), HEIGHT(tree->right)) + 1;
-    return tree;
+/* the highest free block of at least npages and the path to it; returns the depth or 0 */
+static int last_fit(DmaMem_t* mm, unsigned long npages, u32* path) {
+    u32 cur = mm->block_tree;
+    int depth = 0;
+
+    if (NODE(mm, cur)->maxfree < npages) {
+        return 0;
+    }
+    for (;;) {
+        avl_node_t* node = NODE(mm, cur);
+        path[depth++] = cur;
+        if (NODE(mm, node->right)->maxfree >= npages) {
+            cur = node->right;
+        } else if (own_free(node) >= npages) {
+            return depth;
+        } else {
+            cur = node->left;
+        }
+    }
 }
 
-static avl_node_t* do_unlink(avl_node_t* tree) {
+/*
+ * The smallest free block of at least npages, the lowest of equal ones, and
+ * the path to it; returns the depth or 0. An in-order walk that maxfree
+ * keeps out of every subtree without a fit, ended by the first exact fit.
+ */
+static int best_fit(DmaMem_t* mm, unsigned long npages, u32* path) {
+    u32 stack[DMA_TREE_MAX_DEPTH];
+    u32 cur = mm->block_tree, best = DMA_TREE_NIL;
+    unsigned long best_free = (unsigned long)-1;
     avl_node_t* node;
-    avl_node_t* end_node;
-    node = unlink_end_node(tree->right, LEFT, &end_node);
-    if (node) {
-        tree->right = node;
-    } else {
-        node = unlink_end_node(tree->left, RIGHT, &end_node);
-        if (node) tree->left = node;
+    int top = 0;
+
+    for (;;) {
+        /* DMA_TREE_NIL has nothing free, so this also stops at the leaves */
+        while (NODE(mm, cur)->maxfree >= npages) {
+            stack[top++] = cur;
+            cur = NODE(mm, cur)->left;
+        }
+        if (top == 0) {
+            break;
+        }
+        node = NODE(mm, stack[--top]);
+        if ((own_free(node) >= npages) && (own_free(node) < best_free)) {
+            best      = node->index;
+            best_free = own_free(node);
+            if (best_free == npages) {
+                break;
+            }
+        }
+        cur = node->right;
     }
+    return (best == DMA_TREE_NIL) ? 0 : avltree_find(mm, NODE(mm, best)->pageno, path);
+}
 
-    if (node == NULL) {
-        node = tree->right ? tree->right : tree->left;
-        end_node = node;
+static avl_node_t* make_avl_node(DmaMem_t* mm, unsigned long pageno, unsigned long npages) {
+    avl_node_t* node = (avl_node_t*)DmaMem_popfront(mm);
+    if ( node == NULL ) {
+        DmaMem_log(mm, "[VDI] failed to allocate memory to make_avl_node\n");
+        return NULL;
     }
+    node->pageno  = pageno;
+    node->npages  = npages;
+    node->parked  = 0;
+    node->kaddr   = NULL;
+    return node;
+}
 
-    if (end_node) {
-        end_node->left  = (tree->left != end_node) ? tree->left : end_node->left;
-        end_node->right = (tree->right != end_node) ? tree->right : end_node->right;
-        end_node->height = MAX(HEIGHT(end_node->left), HEIGHT(end_node->right)) + 1;
-    } 
+/* adds a block that is not in the tree yet */
+static void set_blocks(DmaMem_t *mm, unsigned long pageno, unsigned long npages, int used) {
+    avl_node_t* node;
+    if (pageno + npages > mm->num_pages) {
+        DmaMem_log(mm, "set_blocks: invalid last page number: %lu\n", pageno + npages - 1);
+        return;
+    }
 
-    tree = end_node;
-    return tree;
+    node = make_avl_node(mm, pageno, npages);
+    DmaMem_mark_block(mm, node, used);
+    avltree_insert(mm, node);
 }
 
-static avl_node_t* avltree_remove(avl_node_t* tree, avl_node_t** found_node, DmaMemKey_t key) {
-    *found_node = NULL;
-    if (tree == NULL) {
-        printk("failed to find key %lu %lu\n", key.key[0], key.key[1]);
-        return NULL;
-    } 
-
-    if (key.key[0] == tree->key.key[0]) {
-        if(key.key[1] == tree->key.key[1]) {
-            *found_node = tree;
-            tree = do_unlink(tree);
-        } else if (key.key[1] > tree->key.key[1]) {
-            tree->right = avltree_remove(tree->right, found_node, key);
-        } else {
-            tree->left  = avltree_remove(tree->left, found_node, key);
+/*
+ * Node pool. Recycled nodes go to node_Free; fresh ones are handed out in
+ * index order from the last chunk, and a chunk is only allocated when the
+ * bump pointer reaches it, so nothing is initialised ahead of use.
+ */
+static int node_grow(DmaMem_t *mm) {
+    avl_node_t* chunk;
+
+    if (mm->node_chunk_count == mm->node_chunk_max) {
+        return -1;
+    }
+    chunk = (avl_node_t*)DmaMem_meta_alloc(mm, DMA_MEM_NODE_CHUNK * sizeof(avl_node_t), GFP_ATOMIC);
+    if (chunk == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate node chunk\n");
+        return -1;
+    }
+    mm->node_chunks[mm->node_chunk_count++] = chunk;
+    return 0;
+}
+
+/* makes sure count nodes can be taken without allocating */
+static int node_reserve(DmaMem_t *mm, unsigned int count) {
+    while (mm->node_free_count + mm->node_chunk_count * DMA_MEM_NODE_CHUNK - mm->node_next < count) {
+        if (node_grow(mm) != 0) {
+            return -1;
         }
-    } else if (key.key[0] > tree->key.key[0]) {
-        tree->right = avltree_remove(tree->right, found_node, key);
-    } else {
-        tree->left  = avltree_remove(tree->left, found_node, key);
     }
+    return 0;
+}
 
-    if (tree) tree->height = MAX(HEIGHT(tree->left), HEIGHT(tree->right)) + 1;
+/* node_Free is protected by node_Lock, which the tree operations already hold */
+avl_node_t* DmaMem_popfront(DmaMem_t *mm) {
+    avl_node_t* node;
 
-    tree = do_balance(tree);
-    return tree;
-}
+    if (!list_empty(&(mm->node_Free))) {
+        node = list_first_entry(&(mm->node_Free), avl_node_t, ListEntry);
+        list_del(&(node->ListEntry));
+        mm->node_free_count--;
+        node->is_slab = 0;
+        return node;
+    }
 
-static avl_node_t* remove_approx_value(avl_node_t* tree, avl_node_t** found, DmaMemKey_t key) {
-    *found = NULL;
-    if (tree == NULL) {
+    if ((mm->node_next == mm->node_chunk_count * DMA_MEM_NODE_CHUNK) && (node_grow(mm) != 0)) {
         return NULL;
     }
+    node = DmaMem_node(mm, mm->node_next);
+    node->index   = mm->node_next;
+    node->pageno  = DMA_MEM_NO_PAGE;
+    node->parked  = 0;
+    node->is_slab = 0;
+    /* pairs with the acquire in DmaMem_block_at */
+    smp_store_release(&mm->node_next, mm->node_next + 1);
+    return node;
+}
 
-    if (key.key[0] == tree->key.key[0]) {
-        *found = tree;
-        tree = do_unlink(tree);
-    } else if (key.key[0] > tree->key.key[0]) {
-        tree->right = remove_approx_value(tree->right, found, key);
-    } else {
-        tree->left  = remove_approx_value(tree->left, found, key);
-        if (*found == NULL) {
-            *found = tree;
-            tree = do_unlink(tree);
+void DmaMem_pushback(DmaMem_t *mm, avl_node_t* node) {
+    node->pageno = DMA_MEM_NO_PAGE;
+    list_add(&(node->ListEntry), &(mm->node_Free));
+    mm->node_free_count++;
+}
+
+static void node_pool_destroy(DmaMem_t *mm) {
+    unsigned int i;
+    if (mm->node_chunks) {
+        for (i = 0; i < mm->node_chunk_count; ++i) {
+            DmaMem_meta_free(mm, mm->node_chunks[i]);
         }
+        DmaMem_meta_free(mm, mm->node_chunks);
+        mm->node_chunks = NULL;
     }
-    if (tree) tree->height = MAX(HEIGHT(tree->left), HEIGHT(tree->right)) + 1;
-    tree = do_balance(tree);
-    return tree;
+    mm->node_chunk_count = 0;
+    mm->node_next        = 0;
+    mm->node_free_count  = 0;
+    INIT_LIST_HEAD(&(mm->node_Free));
 }
 
-static void set_pages_free(DmaMem_t *mm, int pageno, int npages) {
-    int last_pageno     = pageno + npages - 1;
-    int i;
-    DmaPage_t  *page, *last_page;
+static int mag_create(DmaMem_t* mm) {
+    unsigned int cpu;
+    int i, classes = 0;
+    unsigned long* addrs;
 
-    if (last_pageno >= mm->num_pages) {
-        printk("set_pages_free: invalid last page number: %d\n", last_pageno);
-        return;
+    for (i = 0; i < DMA_MEM_MAG_CLASSES; ++i) {
+        if (mm->config.mag_pages[i] < 0) {
+            DmaMem_log(mm, "vmem_init: invalid magazine size %d\n", mm->config.mag_pages[i]);
+            return -1;
+        }
+        if (mm->config.mag_pages[i] > 0) {
+            classes++;
+        }
+    }
+    if ((classes == 0) || (mm->config.mag_depth <= 0)) {
+        mm->mags    = NULL;
+        mm->nr_mags = 0;
+        return 0;
+    }
+
+    mm->nr_mags = nr_cpu_ids;
+    mm->mags    = (DmaMag_t*)DmaMem_meta_alloc(mm, mm->nr_mags * sizeof(DmaMag_t), GFP_KERNEL | __GFP_ZERO);
+    addrs       = (unsigned long*)DmaMem_meta_alloc(mm, mm->nr_mags * DMA_MEM_MAG_CLASSES * mm->config.mag_depth * sizeof(unsigned long), GFP_KERNEL);
+    if ((mm->mags == NULL) || (addrs == NULL)) {
+        DmaMem_log(mm, "[VDI] failed to allocate magazines when vmem_init\n");
+        DmaMem_meta_free(mm, mm->mags);
+        DmaMem_meta_free(mm, addrs);
+        mm->mags = NULL;
+        return -1;
     }
 
-    for (i = pageno; i <= last_pageno; ++i) {
-        mm->page_list[i].used         =  0;
-        mm->page_list[i].alloc_pages  =  0;
-        mm->page_list[i].first_pageno = -1;
+    for (cpu = 0; cpu < mm->nr_mags; ++cpu) {
+        spin_lock_init(&(mm->mags[cpu].lock));
+        mm->mags[cpu].addrs = addrs + cpu * DMA_MEM_MAG_CLASSES * mm->config.mag_depth;
     }
+    return 0;
 }
 
-static void set_blocks_free(DmaMem_t *mm, int pageno, int npages) {
-    int last_pageno     = pageno + npages - 1;
-    int i;
-    DmaPage_t  *page, *last_page;
-    if (last_pageno >= mm->num_pages) {
-        printk("set_blocks_free: invalid last page number: %d\n", last_pageno);
-        return;
+static void mag_destroy(DmaMem_t* mm) {
+    if (mm->mags) {
+        DmaMem_meta_free(mm, mm->mags[0].addrs);
+        DmaMem_meta_free(mm, mm->mags);
+        mm->mags = NULL;
     }
+    mm->nr_mags = 0;
+}
 
-    page                 =  &mm->page_list[pageno];
-    page->used           =  0;
-    page->first_pageno   = -1;
-    page->alloc_pages    = npages;
+static int stats_create(DmaMem_t* mm) {
+    mm->stats = (DmaMemCpuStats_t*)DmaMem_meta_alloc(mm, nr_cpu_ids * sizeof(DmaMemCpuStats_t), GFP_KERNEL | __GFP_ZERO);
+    if (mm->stats == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate statistics when vmem_init\n");
+        return -1;
+    }
+    return 0;
+}
 
-    last_page            = &mm->page_list[last_pageno];
-    last_page->used      = 0;
-    last_page->first_pageno = pageno;
-    mm->free_tree = avltree_insert(mm, mm->free_tree, MAKE_KEY(npages, pageno), page); /*lint !e571 Suspicious cast*/
+/* the counters of the CPU we run on; a migration only moves a count to another CPU's slot */
+static inline DmaMemCpuStats_t* cpu_stats(DmaMem_t* mm) {
+    return &mm->stats[raw_smp_processor_id()];
 }
 
-static void set_blocks_alloc(DmaMem_t *mm, int pageno, int npages) {
-    int last_pageno     = pageno + npages - 1;
-    int i;
-    DmaPage_t  *page, *last_page;
-    if (last_pageno >= mm->num_pages) {
-        printk("set_blocks_free: invalid last page number: %d\n", last_pageno);
-        return;
+static inline int lat_bucket(u64 ns) {
+    return (ns < 128) ? 0 : (int)MIN(__fls((unsigned long)ns) - 6, DMA_MEM_LAT_BUCKETS - 1);
+}
+
+static int trace_create(DmaMem_t* mm) {
+    atomic_long_set(&mm->trace_head, 0);
+    if (mm->config.trace == 0) {
+        mm->trace_slots = NULL;
+        return 0;
+    }
+    if (mm->config.trace & (mm->config.trace - 1)) {
+        DmaMem_log(mm, "vmem_init: trace ring of %lu slots is not a power of two\n", mm->config.trace);
+        return -1;
+    }
+    mm->trace_slots = (DmaMemTraceSlot_t*)DmaMem_meta_alloc(mm, mm->config.trace * sizeof(DmaMemTraceSlot_t), GFP_KERNEL | __GFP_ZERO);
+    if (mm->trace_slots == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate the trace ring when vmem_init\n");
+        return -1;
+    }
+    mm->trace_mask = mm->config.trace - 1;
+    return 0;
+}
+
+/*
+ * Writers claim record numbers and own their slots for the lap, so
+ * recording is lock-free and fine from any context. A reader checks seq
+ * around its copy, dropping the record when a writer a lap ahead got
+ * there, and stops at a claimed one not committed yet. A free claims
+ * before the block can be handed out again and an allocation once it has
+ * the block, so on every address the records are in the order of the calls.
+ */
+static long trace_claim(DmaMem_t* mm, unsigned long count) {
+    long n = atomic_long_add_return(count, &mm->trace_head) - count, i;
+
+    for (i = n; i < n + (long)count; ++i) {
+        atomic_long_set(&mm->trace_slots[i & mm->trace_mask].seq, 2 * i + 1);
     }
+    smp_wmb();
+    return n;
+}
 
-    page                 = &mm->page_list[pageno];
-    page->used           =  1;
-    page->first_pageno   = -1;
-    page->alloc_pages    = npages;
+static void trace_commit(DmaMem_t* mm, long n, const DmaMemTrace_t* rec) {
+    DmaMemTraceSlot_t* slot = &mm->trace_slots[n & mm->trace_mask];
 
-    last_page            = &mm->page_list[last_pageno];
-    last_page->used      = 1;
-    last_page->first_pageno = pageno;
-    mm->alloc_tree = avltree_insert(mm, mm->alloc_tree, MAKE_KEY(page->addr, 0), page);
+    slot->rec = *rec;
+    atomic_long_set_release(&slot->seq, 2 * n + 2);
 }
 
-avl_node_t* DmaMem_popfront(DmaMem_t *mm) {
-	avl_node_t* node = NULL;
-    struct list_head    *pEntry;
-//    spin_lock(&(mm->node_Lock));
-    pEntry = mm->node_Free.next;
-
-    // Traverse list to find the desired list object
-    while (pEntry != &(mm->node_Free)) {
-        // Get the object
-        node = list_entry(pEntry, avl_node_t, ListEntry);
-        // Remove the object from the list
-        list_del(pEntry);
-//       spin_unlock(&(mm->node_Lock));
-        return node;// Jump to next item in the list
-    }
-//    spin_unlock(&(mm->node_Lock));
-    return node;
+static void trace_put(DmaMem_t* mm, const DmaMemTrace_t* rec) {
+    trace_commit(mm, trace_claim(mm, 1), rec);
 }
 
-void DmaMem_pushback(DmaMem_t *mm, avl_node_t* node) {
- //   spin_lock(&(mm->node_Lock));
-    list_add_tail(&(node->ListEntry), &(mm->node_Free));
- //   spin_unlock(&(mm->node_Lock));
+static inline u32 trace_ns(u64 ns) {
+    return (u32)MIN(ns, (u64)U32_MAX);
 }
 
+/* a bulk call claims at most the whole ring, so it never overwrites its own records */
+static long trace_claim_bulk(DmaMem_t* mm, unsigned long count) {
+    return trace_claim(mm, MIN(count, mm->trace_mask + 1));
+}
 
-static void avltree_free(DmaMem_t *mm, avl_node_t* tree) {
-    if ((mm == NULL) || (tree == NULL)) {
+/*
+ * Commits records n on, claimed by trace_claim_bulk, for the count blocks of
+ * a bulk call that started at start, NULL ptrs when it failed, each charged
+ * an equal share. Past the size of the ring only the last blocks are kept.
+ */
+static void trace_bulk(DmaMem_t* mm, long n, unsigned int op, u64 start, unsigned long size, const unsigned long* ptrs, unsigned long count) {
+    DmaMemTrace_t rec = { .ts = start, .size = size, .align = 0, .ptr = (unsigned long)-1, .old = 0,
+                          .latency = 0, .flags = 0, .op = op };
+    unsigned long skip = count - MIN(count, mm->trace_mask + 1), i;
+
+    if (count == 0) {
         return;
     }
-
-    if (tree->left == NULL && tree->right == NULL) {
-        DmaMem_pushback(mm, tree);
-        return;
+    rec.latency = trace_ns((ktime_get_ns() - start) / count);
+    for (i = skip; i < count; ++i) {
+        if (ptrs) {
+            rec.ptr = ptrs[i];
+        }
+        trace_commit(mm, n + (long)(i - skip), &rec);
     }
-
-    avltree_free(mm, tree->left);
-    tree->left = NULL;
-    avltree_free(mm, tree->right);
-    tree->right = NULL;
-    DmaMem_pushback(mm, tree);
 }
 
-int DmaMem_init(DmaMem_t* mm, unsigned long addr, unsigned long size, unsigned long pageSize) {
-    int i;
-    const unsigned long VMEM_PAGE_SIZE = pageSize;
-    mm->base_addr  = (addr + (VMEM_PAGE_SIZE - 1)) & (~(VMEM_PAGE_SIZE - 1));
-    mm->mem_size   = size & (~VMEM_PAGE_SIZE);
-    mm->page_size  = pageSize;
-    mm->num_pages  = mm->mem_size / VMEM_PAGE_SIZE;
-    mm->page_list  = (DmaPage_t*)kmalloc(mm->num_pages * sizeof(DmaPage_t), GFP_KERNEL);
-    if (mm->page_list == NULL) {
-        printk("[VDI] failed to allocate when vmem_init\n");
+/*
+ * The deferred free ring is a bounded MPSC queue: slot i is free for the
+ * producer that claims position i while its seq equals i, holds a queued
+ * address once seq is i + 1, and becomes free again for position i + size
+ * when the drain releases it. Producers only race on defer_tail.
+ */
+static int defer_create(DmaMem_t* mm) {
+    unsigned long i;
+
+    atomic_long_set(&mm->defer_head, 0);
+    atomic_long_set(&mm->defer_tail, 0);
+    mutex_init(&(mm->defer_Lock));
+    if (mm->config.deferred == 0) {
+        mm->defer_slots = NULL;
+        return 0;
+    }
+    if (mm->config.deferred & (mm->config.deferred - 1)) {
+        DmaMem_log(mm, "vmem_init: deferred ring of %lu slots is not a power of two\n", mm->config.deferred);
         return -1;
     }
-    mm->node_list  = (avl_node_t*)kmalloc(mm->num_pages * sizeof(avl_node_t), GFP_KERNEL);
-    if (mm->node_list == NULL) {
-        printk("[VDI] failed to allocate when vmem_init\n");
-        kfree(mm->page_list);
+    mm->defer_slots = (DmaMemDefer_t*)DmaMem_meta_alloc(mm, mm->config.deferred * sizeof(DmaMemDefer_t), GFP_KERNEL);
+    if (mm->defer_slots == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate the deferred free ring when vmem_init\n");
         return -1;
     }
-    memset(mm->node_list, 0, mm->num_pages * sizeof(avl_node_t));
-    mm->free_tree  = NULL;
-    mm->alloc_tree = NULL;
-    mm->free_page_count = mm->num_pages;
-    mm->alloc_page_count = 0;
-    //printf("[VDI] vmem_init address %p, size %lx, pages %d\n", mm->base_addr, mm->mem_size, mm->num_pages);
-//    spin_lock_init(&(mm->node_Lock));
-    INIT_LIST_HEAD( &(mm->node_Free));
-    for (i = 0; i < mm->num_pages; ++i) {
-        mm->page_list[i].pageno       = i;
-        mm->page_list[i].addr         = mm->base_addr + i * VMEM_PAGE_SIZE;
-        mm->page_list[i].kaddr        = 0;
-        mm->page_list[i].alloc_pages  = 0;
-        mm->page_list[i].used         = 0;
-        mm->page_list[i].first_pageno = -1;
-        list_add_tail(&(mm->node_list[i].ListEntry), &(mm->node_Free));
+    for (i = 0; i < mm->config.deferred; ++i) {
+        atomic_long_set(&mm->defer_slots[i].seq, i);
     }
-
-    set_blocks_free(mm, 0, mm->num_pages);
+    mm->defer_mask = mm->config.deferred - 1;
     return 0;
 }
 
-int DmaMem_exit(DmaMem_t* mm) {
-    if (mm == NULL) {
-        printk("vmem_exit: invalid handle\n");
-        return -1;
+static void defer_destroy(DmaMem_t* mm) {
+    if (mm->defer_slots) {
+        mutex_destroy(&(mm->defer_Lock));
     }
+    DmaMem_meta_free(mm, mm->defer_slots);
+    mm->defer_slots = NULL;
+}
 
-    if (mm->free_tree) {
-        avltree_free(mm, mm->free_tree);
-        mm->free_tree = NULL;
+static void region_exit(DmaMem_t* mm) {
+    DmaTlsf_exit(mm);
+    DmaBuddy_exit(mm);
+    mm->block_tree = DMA_TREE_NIL;
+    node_pool_destroy(mm);
+
+    if (mm->tags) {
+        DmaMem_meta_free(mm, mm->tags);
+        mm->tags = NULL;
     }
-    if (mm->alloc_tree) {
-        avltree_free(mm, mm->alloc_tree);
-        mm->alloc_tree = NULL;
+    if (mm->pb_used) {
+        DmaMem_meta_free(mm, mm->pb_used);
+        mm->pb_used = NULL;
     }
-
-    if (mm->page_list) {
-        kfree(mm->page_list);
-        mm->page_list = NULL;
+    if (mm->dirty) {
+        DmaMem_meta_free(mm, mm->dirty);
+        mm->dirty = NULL;
     }
+}
 
-    if (mm->node_list) {
-        kfree(mm->node_list);
-        mm->node_list = NULL;
+/* pageblock counts with the pages outside the region counted as allocated */
+static int pb_init(DmaMem_t* mm, unsigned long pageblock_pages) {
+    unsigned long first_pfn = mm->base_addr / mm->page_size;
+    unsigned long last_pfn  = first_pfn + mm->num_pages - 1;
+
+    mm->pb_shift      = __fls(pageblock_pages);
+    mm->pb_first      = first_pfn >> mm->pb_shift;
+    mm->nr_pageblocks = (last_pfn >> mm->pb_shift) - mm->pb_first + 1;
+    mm->pb_used       = (u32*)DmaMem_meta_alloc(mm, mm->nr_pageblocks * sizeof(u32), GFP_KERNEL);
+    if (mm->pb_used == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate pageblocks when vmem_init\n");
+        return -1;
     }
-
-//   spin_lock(&(mm->node_Lock));
-    INIT_LIST_HEAD( &(mm->node_Free));
-//    spin_unlock(&(mm->node_Lock));
+    memset(mm->pb_used, 0, mm->nr_pageblocks * sizeof(u32));
+    mm->pb_used[0]                     += first_pfn & (pageblock_pages - 1);
+    mm->pb_used[mm->nr_pageblocks - 1] += (pageblock_pages - 1) - (last_pfn & (pageblock_pages - 1));
     return 0;
 }
 
-unsigned long DmaMem_alloc(DmaMem_t* mm, int size) {
-    avl_node_t* node;
-    DmaPage_t*  free_page;
-    int         npages, free_npages;
-    int         alloc_pageno;
-    unsigned long  ptr;
-    const unsigned long VMEM_PAGE_SIZE = mm->page_size;
-    if (mm == NULL) {
-    	printk("vmem_alloc: invalid handle\n");
-        return (unsigned long)-1;
-    }
+/* whether npages at pageno would touch a pageblock without allocated pages */
+static int pb_breaks(const DmaMem_t* mm, unsigned long pageno, unsigned long npages) {
+    unsigned long pb, last = DmaMem_pb_of(mm, pageno + npages - 1);
 
-    if (size <= 0) {
-        printk("%d size of vmem_alloc, failed\n", size);
-        return (unsigned long)-1;
+    for (pb = DmaMem_pb_of(mm, pageno); pb <= last; ++pb) {
+        if (mm->pb_used[pb] == 0) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    npages = (size + VMEM_PAGE_SIZE -1)/VMEM_PAGE_SIZE;
-    mm->free_tree = remove_approx_value(mm->free_tree, &node, MAKE_KEY(npages, 0)); /*lint !e571 Suspicious cast*/
-    if (node == NULL) {
-        printk("pages all:%d used:%d free:%d mm->free_tree:%p\n" , mm->num_pages, mm->alloc_page_count, mm->free_page_count, mm->free_tree);
-        return (unsigned long)-1;
-    }
-    free_page = node->page;
-    free_npages = KEY_TO_VALUE(node->key);
-    DmaMem_pushback(mm, node);
+/* adds npages at pageno to the allocated pages of their pageblocks, or takes them off */
+static void pb_account(DmaMem_t* mm, unsigned long pageno, unsigned long npages, int used) {
+    unsigned long end = pageno + npages;
+    unsigned long pfn, next;
 
-    alloc_pageno = free_page->pageno;
-    set_blocks_alloc(mm, alloc_pageno, npages);
-    if (npages < free_npages) {
-        int free_pageno = alloc_pageno + npages;
-        set_blocks_free(mm, free_pageno, (free_npages - npages));
+    if (mm->pb_used == NULL) {
+        return;
     }
+    while (pageno < end) {
+        pfn  = mm->base_addr / mm->page_size + pageno;
+        next = MIN(end, pageno + ((pfn | ((1UL << mm->pb_shift) - 1)) + 1 - pfn));
+        if (used) {
+            mm->pb_used[DmaMem_pb_of(mm, pageno)] += next - pageno;
+        } else {
+            mm->pb_used[DmaMem_pb_of(mm, pageno)] -= next - pageno;
+        }
+        pageno = next;
+    }
+}
 
-    ptr = free_page->addr;
-    mm->page_list[alloc_pageno].kaddr = memremap(ptr, size, MEMREMAP_WB);
-    mm->alloc_page_count += npages;
-    mm->free_page_count  -= npages;
-    return ptr;
+/*
+ * The dirty map of a region has one bit per page, set when the page is
+ * freed and cleared once the zeroing thread has zeroed it while free. An
+ * allocation leaves the bits alone, so those of an allocated block say
+ * which of its pages still need clearing. The bits are only written under
+ * node_Lock, and only those of free pages, so the owner of a block may
+ * read its own without the lock.
+ */
+static inline int dirty_test(const DmaMem_t* mm, unsigned long pageno) {
+    return (READ_ONCE(mm->dirty[pageno / BITS_PER_LONG]) >> (pageno % BITS_PER_LONG)) & 1;
 }
 
-int DmaMem_free(DmaMem_t* mm, unsigned long ptr) {
-    unsigned long addr;
-    avl_node_t* found;
-    DmaPage_t*  page;
-    int pageno, last_pageno = -1;
-    int merge_page_no, merge_page_size, free_page_size;
+/* first dirty page in [pageno, end), or end */
+static unsigned long dirty_next(const DmaMem_t* mm, unsigned long pageno, unsigned long end) {
+    unsigned long word;
 
-    if (mm == NULL) {
-	    printk("vmem_free: invalid handle\n");
-        return -1;
+    while (pageno < end) {
+        word = READ_ONCE(mm->dirty[pageno / BITS_PER_LONG]) >> (pageno % BITS_PER_LONG);
+        if (word) {
+            return MIN(end, pageno + __ffs(word));
+        }
+        pageno = (pageno | (BITS_PER_LONG - 1)) + 1;
     }
+    return end;
+}
 
-    addr = ptr;
-    mm->alloc_tree = avltree_remove(mm->alloc_tree, &found, MAKE_KEY(addr, 0));
-    if (found == NULL) {
-        printk("vmem_free: 0x%08x not found\n", addr);
-        return -1;
+/* sets the npages bits at pageno when op > 0, clears them when op < 0; returns how many were set before */
+static unsigned long dirty_bits(DmaMem_t* mm, unsigned long pageno, unsigned long npages, int op) {
+    unsigned long end = pageno + npages, was = 0, mask, word, next;
+
+    while (pageno < end) {
+        next = MIN(end, (pageno | (BITS_PER_LONG - 1)) + 1);
+        mask = (~0UL >> (BITS_PER_LONG - (next - pageno))) << (pageno % BITS_PER_LONG);
+        word = mm->dirty[pageno / BITS_PER_LONG];
+        was += hweight_long(word & mask);
+        if (op != 0) {
+            WRITE_ONCE(mm->dirty[pageno / BITS_PER_LONG], (op > 0) ? (word | mask) : (word & ~mask));
+        }
+        pageno = next;
     }
+    return was;
+}
 
-    /* find previous free block */
-    page = found->page;
-    DmaMem_pushback(mm, found);
-    iounmap(page->kaddr);
-    page->kaddr = 0;
-    pageno = page->pageno;
-    free_page_size = page->alloc_pages;
-
-    /* find previous free block */
-    {
-        int prev_free_pageno = pageno - 1;
-        int prev_size = -1;
-        if (prev_free_pageno >= 0) {
-            if (mm->page_list[prev_free_pageno].used == 0) {
-                prev_free_pageno = mm->page_list[prev_free_pageno].first_pageno;
-                if (prev_free_pageno >= 0) {
-                   prev_size = mm->page_list[prev_free_pageno].alloc_pages;
-                }
-            }
+/* npages at pageno were allocated (used) or freed: keeps the pageblock counts and the dirty map in step */
+static void page_account(DmaMem_t* mm, unsigned long pageno, unsigned long npages, int used) {
+    if (mm->dirty) {
+        if (used) {
+            mm->dirty_pages -= dirty_bits(mm, pageno, npages, 0);
+        } else {
+            dirty_bits(mm, pageno, npages, 1);
+            mm->dirty_pages += npages;
         }
+    }
+    pb_account(mm, pageno, npages, used);
+}
 
-        /* merge */
-        merge_page_no = page->pageno;
-        merge_page_size = page->alloc_pages;
-        if (prev_size > 0) {
-            mm->free_tree = avltree_remove(mm->free_tree, &found, MAKE_KEY(prev_size, prev_free_pageno)); /*lint !e571 Suspicious cast*/
-            if (found == NULL) {
-                printk("vmem_free prev: %d %d not found\n", prev_size, prev_free_pageno);
-                return -1;
-            }
-            merge_page_no    = found->page->pageno;
-            merge_page_size += found->page->alloc_pages;
-            found->page->alloc_pages  =   0;
-            found->page->first_pageno =  -1;
-            mm->page_list[pageno - 1].first_pageno = -1;
-            DmaMem_pushback(mm, found);
-        }
-    }
-
-   /* find next free block */
-   {
-        int next_free_pageno = pageno + page->alloc_pages;
-        int next_size = -1;
-        next_free_pageno = (next_free_pageno >= mm->num_pages) ? -1 : next_free_pageno;
-        if (next_free_pageno >= 0) {
-            if (mm->page_list[next_free_pageno].used == 0) {
-                next_size = mm->page_list[next_free_pageno].alloc_pages;
-            }
-        }
-        /* merge */
-        if (next_size > 0) {
-            mm->free_tree = avltree_remove(mm->free_tree, &found, MAKE_KEY(next_size, next_free_pageno)); /*lint !e571 Suspicious cast*/
-            if (found == NULL) {
-                printk("vmem_free next: %d %d not found\n", next_size, next_free_pageno);
-                return -1;
-            }
-            merge_page_size += found->page->alloc_pages;
-            last_pageno      = found->page->pageno + found->page->alloc_pages - 1;
-            found->page->alloc_pages  =   0;
-            found->page->first_pageno =  -1;
-            if (last_pageno < mm->num_pages) {
-                mm->page_list[last_pageno].first_pageno = -1;
-            }
-            DmaMem_pushback(mm, found);
+/* sets up one region: boundary tags, an empty node pool and the engine's free blocks */
+static int region_init(DmaMem_t* mm, unsigned long addr, unsigned long size, unsigned long pageSize, DmaMemEngine_t engine,
+                       unsigned long pageblock_pages, int prezero) {
+    const unsigned long VMEM_PAGE_SIZE = pageSize;
+    unsigned long end = (addr + size) & (~(VMEM_PAGE_SIZE - 1));
+    unsigned long num_pages;
+    avl_node_t* nil;
+    int ret = 0;
+    mm->engine      = engine;
+    mm->tlsf        = NULL;
+    mm->buddy       = NULL;
+    mm->block_tree  = DMA_TREE_NIL;
+    mm->tags        = NULL;
+    mm->pb_used     = NULL;
+    mm->dirty       = NULL;
+    mm->tree_peak   = 0;
+    mm->node_chunks = NULL;
+    mm->node_chunk_count = 0;
+    mm->node_next        = 0;
+    mm->node_free_count  = 0;
+    mm->shards     = NULL;
+    mm->num_shards = 0;
+    mm->base_addr  = (addr + (VMEM_PAGE_SIZE - 1)) & (~(VMEM_PAGE_SIZE - 1));
+    mm->mem_size   = (end > mm->base_addr) ? (end - mm->base_addr) : 0;
+    mm->page_size  = pageSize;
+    num_pages      = mm->mem_size / VMEM_PAGE_SIZE;
+    INIT_LIST_HEAD( &(mm->node_Free));
+    if ((num_pages == 0) || (num_pages > DMA_MEM_MAX_PAGES)) {
+        DmaMem_log(mm, "[VDI] vmem_init: %lu pages in 0x%lx+0x%lx, expected 1..%u\n", num_pages, addr, size, DMA_MEM_MAX_PAGES);
+        return -1;
+    }
+    mm->num_pages  = num_pages;
+
+    /*
+     * Nothing is walked or cleared per page: tags are only trusted at block
+     * boundaries, which are written before they are read, and a head tag is
+     * cross-checked against its node so a stale or uninitialised word in
+     * the middle of a block never resolves to a block.
+     */
+    mm->tags = (u32*)DmaMem_meta_alloc(mm, num_pages * sizeof(u32), GFP_KERNEL);
+    /* every block owns a node and blocks never outnumber pages */
+    mm->node_chunk_max = (num_pages + DMA_MEM_NODE_RESERVE) / DMA_MEM_NODE_CHUNK + 2;
+    mm->node_chunks    = (avl_node_t**)DmaMem_meta_alloc(mm, mm->node_chunk_max * sizeof(avl_node_t*), GFP_KERNEL);
+    if ((mm->tags == NULL) || (mm->node_chunks == NULL)) {
+        DmaMem_log(mm, "[VDI] failed to allocate when vmem_init\n");
+        region_exit(mm);
+        return -1;
+    }
+    if (pageblock_pages && (pb_init(mm, pageblock_pages) != 0)) {
+        region_exit(mm);
+        return -1;
+    }
+    /* nothing is known about the carve-out's contents yet */
+    if (prezero) {
+        mm->dirty = (unsigned long*)DmaMem_meta_alloc(mm, BITS_TO_LONGS(num_pages) * sizeof(unsigned long), GFP_KERNEL);
+        if (mm->dirty == NULL) {
+            DmaMem_log(mm, "[VDI] failed to allocate the dirty map when vmem_init\n");
+            region_exit(mm);
+            return -1;
         }
+        memset(mm->dirty, 0xff, BITS_TO_LONGS(num_pages) * sizeof(unsigned long));
+        mm->dirty_pages = num_pages;
+        mm->zero_cursor = 0;
     }
+    mm->free_page_count = mm->num_pages;
+    mm->alloc_page_count = 0;
+    //printf("[VDI] vmem_init address %p, size %lx, pages %d\n", mm->base_addr, mm->mem_size, mm->num_pages);
+    spin_lock_init(&(mm->node_Lock));
 
-
-    page->used        = 0;
-    page->alloc_pages = 0;
-    last_pageno       = page->pageno + page->alloc_pages - 1;
-    if (last_pageno < mm->num_pages) {
-        mm->page_list[last_pageno].used         = 0;
-        mm->page_list[last_pageno].alloc_pages  = 0;
-        mm->page_list[last_pageno].first_pageno = -1;
+    /* the first node is the tree sentinel, see DMA_TREE_NIL */
+    nil = DmaMem_popfront(mm);
+    if (nil == NULL) {
+        region_exit(mm);
+        return -1;
     }
-    set_blocks_free(mm, merge_page_no, merge_page_size);
-
-    mm->alloc_page_count -= free_page_size;
-    mm->free_page_count  += free_page_size;
-    //printk("FREE: total(%d) alloc(%d) free(%d)\n", mm->num_pages, mm->alloc_page_count, mm->free_page_count);
-    return 0;
+    nil->left    = DMA_TREE_NIL;
+    nil->right   = DMA_TREE_NIL;
+    nil->height  = 0;
+    nil->maxfree = 0;
+    nil->used    = 1;
+
+    switch (engine) {
+    case DMA_MEM_ENGINE_TLSF:
+        ret = DmaTlsf_init(mm);
+        break;
+    case DMA_MEM_ENGINE_BUDDY:
+        ret = DmaBuddy_init(mm);
+        break;
+    default:
+        set_blocks(mm, 0, mm->num_pages, 0);
+        break;
+    }
+    if (ret != 0) {
+        region_exit(mm);
+    }
+    return ret;
 }
 
-int DmaMem_get_info(DmaMem_t* mm, DmaMemInfo_t* info) {
-    int i, pos = 0;
-    if ((mm == NULL) || (info == NULL)) {
-		//printk("vmem_get_info: invalid handle\n");
+/*
+ * Splits the carve-out into config.shards sub-regions of equal size (the
+ * last one takes the remainder), each a DmaMem_t with its own trees, node
+ * pool and lock. The parent only routes requests.
+ */
+static int shard_create(DmaMem_t* mm, unsigned long addr, unsigned long size, unsigned long pageSize) {
+    const unsigned long VMEM_PAGE_SIZE = pageSize;
+    unsigned long end = (addr + size) & (~(VMEM_PAGE_SIZE - 1));
+    unsigned long shard_pages;
+    int i;
+
+    mm->tlsf       = NULL;
+    mm->buddy      = NULL;
+    mm->block_tree = DMA_TREE_NIL;
+    mm->tags        = NULL;
+    mm->pb_used     = NULL;
+    mm->dirty       = NULL;
+    mm->node_chunks = NULL;
+    mm->shards     = NULL;
+    mm->num_shards = 0;
+    mm->base_addr  = (addr + (VMEM_PAGE_SIZE - 1)) & (~(VMEM_PAGE_SIZE - 1));
+    mm->mem_size   = (end > mm->base_addr) ? (end - mm->base_addr) : 0;
+    mm->page_size  = pageSize;
+    mm->num_pages  = mm->mem_size / VMEM_PAGE_SIZE;
+    shard_pages    = mm->num_pages / mm->config.shards;
+    if (shard_pages == 0) {
+        DmaMem_log(mm, "[VDI] vmem_init: %lu pages cannot be split into %d shards\n", mm->num_pages, mm->config.shards);
+        return -1;
+    }
+    mm->shard_size = shard_pages * VMEM_PAGE_SIZE;
+    mm->shards     = (DmaMem_t*)DmaMem_meta_alloc(mm, mm->config.shards * sizeof(DmaMem_t), GFP_KERNEL | __GFP_ZERO);
+    if (mm->shards == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate shards when vmem_init\n");
+        return -1;
+    }
+
+    for (i = 0; i < mm->config.shards; ++i) {
+        unsigned long shard_addr = mm->base_addr + i * mm->shard_size;
+        unsigned long shard_size = (i == mm->config.shards - 1) ? (mm->mem_size - i * mm->shard_size) : mm->shard_size;
+        mm->shards[i].backend     = mm->backend;
+        mm->shards[i].backend_ctx = mm->backend_ctx;
+        if (region_init(&mm->shards[i], shard_addr, shard_size, pageSize, mm->config.engine, mm->config.pageblock_pages,
+                        mm->config.prezero) != 0) {
+            break;
+        }
+        mm->num_shards++;
+    }
+    if (mm->num_shards != mm->config.shards) {
+        return -1;
+    }
+    return 0;
+}
+
+/* pages zeroed per hold of node_Lock, and per pass of the zeroing thread */
+#define DMA_MEM_ZERO_RUN        16
+#define DMA_MEM_ZERO_BATCH      1024
+
+/*
+ * Zeroes up to max dirty pages of the free blocks of region, a run of at
+ * most DMA_MEM_ZERO_RUN pages per hold of the lock; returns the pages
+ * zeroed. The walk follows the tags block by block from zero_cursor and
+ * starts over at page 0 whenever the block it stood on was merged away
+ * while the lock was dropped.
+ */
+static unsigned long region_prezero(DmaMem_t* mm, DmaMem_t* region, unsigned long max) {
+    unsigned char* kbase = mm->kbase + (region->base_addr - mm->base_addr);
+    unsigned long  done = 0, walked = 0, pageno, from, end, first, last;
+    avl_node_t*    node;
+
+    spin_lock(&(region->node_Lock));
+    pageno = (region->zero_cursor < region->num_pages) ? region->zero_cursor : 0;
+    from   = pageno;
+    while ((walked < region->num_pages) && (done < max) && (region->dirty_pages > 0)) {
+        node = DmaMem_block_at(region, pageno);
+        if ((node == NULL) && (pageno > 0)) {
+            pageno = from = 0;
+            continue;
+        }
+        if (node == NULL) {
+            break;
+        }
+        end = node->pageno + node->npages;
+        if (!node->used) {
+            first = dirty_next(region, MAX(from, pageno), end);
+            if (first < end) {
+                for (last = first + 1; (last < MIN(end, first + DMA_MEM_ZERO_RUN)) && dirty_test(region, last); ++last) {
+                }
+                memset(kbase + first * region->page_size, 0, (last - first) * region->page_size);
+                dirty_bits(region, first, last - first, -1);
+                region->dirty_pages -= last - first;
+                done += last - first;
+                from  = last;
+                spin_unlock(&(region->node_Lock));
+                cond_resched();
+                spin_lock(&(region->node_Lock));
+                continue;
+            }
+        }
+        walked += node->npages;
+        pageno  = (end == region->num_pages) ? 0 : end;
+        from    = pageno;
+    }
+    region->zero_cursor = pageno;
+    spin_unlock(&(region->node_Lock));
+    return done;
+}
+
+/*
+ * The zeroing thread: runs at the lowest priority and sleeps while every
+ * free page is clean. zero_idle is raised before each pass and dropped by
+ * zero_kick on a free, so a free during a pass costs one more pass rather
+ * than a missed wakeup; the timeout picks up frees that do not kick, like
+ * those of a magazine flush.
+ */
+static int zero_thread(void* data) {
+    DmaMem_t* mm = (DmaMem_t*)data;
+    unsigned long done;
+    int i;
+
+    set_user_nice(current, MAX_NICE);
+    while (!kthread_should_stop()) {
+        atomic_long_set(&mm->zero_idle, 1);
+        done = 0;
+        for (i = 0; i < (mm->shards ? mm->num_shards : 1); ++i) {
+            done += region_prezero(mm, mm->shards ? &mm->shards[i] : mm, DMA_MEM_ZERO_BATCH);
+        }
+        if (done == 0) {
+            wait_event_interruptible_timeout(mm->zero_wait, (atomic_long_read(&mm->zero_idle) == 0) || kthread_should_stop(), HZ);
+        }
+    }
+    return 0;
+}
+
+/* tells an idle zeroing thread there are dirty pages again */
+static void zero_kick(DmaMem_t* mm) {
+    if ((mm->zero_task == NULL) || (atomic_long_read(&mm->zero_idle) == 0)) {
+        return;
+    }
+    if (atomic_long_cmpxchg(&mm->zero_idle, 1, 0) == 1) {
+        wake_up_all(&mm->zero_wait);
+    }
+}
+
+static int zero_start(DmaMem_t* mm) {
+    struct task_struct* task;
+
+    init_waitqueue_head(&mm->zero_wait);
+    atomic_long_set(&mm->zero_idle, 0);
+    task = kthread_run(zero_thread, mm, "vmem_zero");
+    if (IS_ERR(task)) {
+        DmaMem_log(mm, "[VDI] failed to start the zeroing thread when vmem_init\n");
+        return -1;
+    }
+    mm->zero_task = task;
+    return 0;
+}
+
+int DmaMem_init(DmaMem_t* mm, unsigned long addr, unsigned long size, unsigned long pageSize) {
+    return DmaMem_init_config(mm, addr, size, pageSize, NULL);
+}
+
+int DmaMem_init_config(DmaMem_t* mm, unsigned long addr, unsigned long size, unsigned long pageSize, const DmaMemConfig_t* config) {
+    int ret;
+    if (mm == NULL) {
+        DmaMem_log(mm, "vmem_init: invalid handle\n");
+        return -1;
+    }
+
+    if (config) {
+        mm->config = *config;
+    } else {
+        memset(&mm->config, 0, sizeof(mm->config));
+    }
+    if (mm->config.map_flags == 0) {
+        mm->config.map_flags = MEMREMAP_WB;
+    }
+    mm->backend     = mm->config.backend ? mm->config.backend : &DmaMem_kernel_backend;
+    mm->backend_ctx = mm->config.backend_ctx;
+    mm->mags    = NULL;
+    mm->nr_mags = 0;
+    mm->kbase   = NULL;
+    mm->slab_caches     = NULL;
+    mm->nr_slab_classes = 0;
+    mm->stats   = NULL;
+    mm->debugfs = NULL;
+    mm->debugfs_trace = NULL;
+    mm->trace_slots   = NULL;
+    atomic_long_set(&mm->resize_in_place, 0);
+    atomic_long_set(&mm->resize_moved, 0);
+    mm->pb_used = NULL;
+    mm->handles = NULL;
+    mm->defer_slots = NULL;
+    init_waitqueue_head(&mm->free_wait);
+    atomic_long_set(&mm->wait_pages, LONG_MAX);
+    atomic_long_set(&mm->wm_below, 0);
+    mm->wm_notify = NULL;
+    mm->zero_task = NULL;
+
+    if (mm->config.pageblock_pages & (mm->config.pageblock_pages - 1)) {
+        DmaMem_log(mm, "vmem_init: pageblock of %lu pages is not a power of two\n", mm->config.pageblock_pages);
+        return -1;
+    }
+    /* the zeroing thread writes under a spinlock, where nothing can be mapped */
+    if (mm->config.prezero && !mm->config.map_once) {
+        DmaMem_log(mm, "vmem_init: prezero needs map_once\n");
+        return -1;
+    }
+
+    /* a region addresses at most DMA_MEM_MAX_PAGES pages, bigger pools are always sharded */
+    if ((pageSize > 0) && (size / pageSize > DMA_MEM_MAX_PAGES)) {
+        int min_shards = (int)(size / pageSize / (DMA_MEM_MAX_PAGES / 2) + 1);
+        if (mm->config.shards < min_shards) {
+            mm->config.shards = min_shards;
+        }
+    }
+
+    if (mm->config.shards > 1) {
+        ret = shard_create(mm, addr, size, pageSize);
+    } else {
+        ret = region_init(mm, addr, size, pageSize, mm->config.engine, mm->config.pageblock_pages, mm->config.prezero);
+    }
+    atomic_long_set(&mm->avail, mm->num_pages);
+    if ((ret == 0) && mm->config.map_once) {
+        mm->kbase = (unsigned char*)DmaMem_map(mm, mm->base_addr, mm->mem_size);
+        if (mm->kbase == NULL) {
+            DmaMem_log(mm, "[VDI] vmem_init: failed to map 0x%lx+0x%lx\n", mm->base_addr, mm->mem_size);
+            ret = -1;
+        }
+    }
+    if ((ret != 0) || (stats_create(mm) != 0) || (trace_create(mm) != 0) || (mag_create(mm) != 0) || (defer_create(mm) != 0) || (mm->config.slab && (DmaSlab_init(mm) != 0)) ||
+        (mm->config.handles && (DmaHandle_init(mm) != 0)) || (mm->config.prezero && (zero_start(mm) != 0))) {
+        DmaMem_exit(mm);
+        return -1;
+    }
+    return 0;
+}
+
+int DmaMem_exit(DmaMem_t* mm) {
+    int i;
+    if (mm == NULL) {
+        DmaMem_log(mm, "vmem_exit: invalid handle\n");
+        return -1;
+    }
+
+    debugfs_remove(mm->debugfs);
+    debugfs_remove(mm->debugfs_trace);
+    mm->debugfs = NULL;
+    mm->debugfs_trace = NULL;
+    if (mm->zero_task) {
+        kthread_stop(mm->zero_task);
+        mm->zero_task = NULL;
+    }
+    if (mm->handles) {
+        DmaHandle_exit(mm);
+    }
+    if (mm->slab_caches) {
+        DmaSlab_exit(mm);
+    }
+    mag_destroy(mm);
+    defer_destroy(mm);
+    DmaMem_meta_free(mm, mm->stats);
+    mm->stats = NULL;
+    DmaMem_meta_free(mm, mm->trace_slots);
+    mm->trace_slots = NULL;
+    if (mm->kbase) {
+        DmaMem_unmap(mm, mm->kbase);
+        mm->kbase = NULL;
+    }
+    if (mm->shards) {
+        for (i = 0; i < mm->num_shards; ++i) {
+            region_exit(&mm->shards[i]);
+        }
+        DmaMem_meta_free(mm, mm->shards);
+        mm->shards     = NULL;
+        mm->num_shards = 0;
+    } else {
+        region_exit(mm);
+    }
+    return 0;
+}
+
+/*
+ * Lowest free block that holds npages at an aligned page, or the highest
+ * one when top_down. Only subtrees whose maxfree reaches npages are visited.
+ */
+static avl_node_t* find_aligned(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, int top_down) {
+    u32 stack[DMA_TREE_MAX_DEPTH];
+    u32 cur = mm->block_tree;
+    int sp = 0;
+    avl_node_t* node;
+
+    while ((cur != DMA_TREE_NIL) || (sp > 0)) {
+        while ((cur != DMA_TREE_NIL) && (NODE(mm, cur)->maxfree >= npages)) {
+            stack[sp++] = cur;
+            cur = top_down ? NODE(mm, cur)->right : NODE(mm, cur)->left;
+        }
+        if (sp == 0) {
+            break;
+        }
+        node = NODE(mm, stack[--sp]);
+        if (own_free(node) >= npages) {
+            if (top_down ? (DmaMem_fit_top(mm, node, npages, align_pages) >= 0) :
+                (DmaMem_align_pageno(mm, node->pageno, align_pages) + npages <= node->pageno + node->npages)) {
+                return node;
+            }
+        }
+        cur = top_down ? node->left : node->right;
+    }
+    return NULL;
+}
+
+/*
+ * The lowest of the first DMA_MEM_PB_SCAN free blocks holding npages where
+ * npages can go without breaking a free pageblock; stores that page in
+ * *pageno. NULL sends the caller back to the plain first fit.
+ */
+static avl_node_t* find_pageblock(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned long* pageno) {
+    u32 stack[DMA_TREE_MAX_DEPTH];
+    u32 cur = mm->block_tree;
+    int sp = 0, scanned = 0;
+    avl_node_t* node;
+    long place;
+
+    while (((cur != DMA_TREE_NIL) || (sp > 0)) && (scanned < DMA_MEM_PB_SCAN)) {
+        while ((cur != DMA_TREE_NIL) && (NODE(mm, cur)->maxfree >= npages)) {
+            stack[sp++] = cur;
+            cur = NODE(mm, cur)->left;
+        }
+        if (sp == 0) {
+            break;
+        }
+        node = NODE(mm, stack[--sp]);
+        if (own_free(node) >= npages) {
+            scanned++;
+            place = DmaMem_pb_place(mm, node, npages, align_pages);
+            if (place >= 0) {
+                *pageno = place;
+                return node;
+            }
+        }
+        cur = node->right;
+    }
+    return NULL;
+}
+
+/* a block of the tree, not yet linked, with a node reserved by the caller */
+static avl_node_t* new_block(DmaMem_t* mm, unsigned long pageno, unsigned long npages, int used) {
+    avl_node_t* node = make_avl_node(mm, pageno, npages);
+    DmaMem_mark_block(mm, node, used);
+    return node;
+}
+
+/*
+ * Carves npages at alloc_pageno out of the free block at path[depth-1].
+ * Its node stays in place as whichever piece starts at its page and the
+ * next piece is linked right after it through the same path, so one
+ * retrace refreshes both.
+ */
+static void tree_carve(DmaMem_t* mm, u32* path, int depth, unsigned long alloc_pageno, unsigned long npages) {
+    avl_node_t*   node        = NODE(mm, path[depth - 1]);
+    unsigned long free_pageno = node->pageno;
+    unsigned long free_npages = node->npages;
+    unsigned long lead_npages = alloc_pageno - free_pageno;
+    unsigned long rest_npages = free_npages - lead_npages - npages;
+
+    if (lead_npages > 0) {
+        node->npages = lead_npages;
+        DmaMem_mark_block(mm, node, 0);
+        avltree_insert_after(mm, path, depth, new_block(mm, alloc_pageno, npages, 1));
+        if (rest_npages > 0) {
+            set_blocks(mm, alloc_pageno + npages, rest_npages, 0);
+        }
+        return;
+    }
+    node->npages = npages;
+    node->parked = 0;
+    node->kaddr  = NULL;
+    DmaMem_mark_block(mm, node, 1);
+    if (rest_npages > 0) {
+        avltree_insert_after(mm, path, depth, new_block(mm, alloc_pageno + npages, rest_npages, 0));
+    } else {
+        retrace(mm, path, depth, depth);
+    }
+}
+
+/*
+ * Untagged requests take the best fit. The tree is address-ordered, so
+ * short-lived and first-fit ones take the first fit, which is bottom-up;
+ * long-lived requests search from the top and are carved from the top of
+ * their block. Aligned requests take the first or last block that is big
+ * enough for any alignment. With pageblocks, small requests without the
+ * long-lived or first-fit hint try find_pageblock first.
+ */
+static long tree_alloc(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags) {
+    u32 path[DMA_TREE_MAX_DEPTH];
+    avl_node_t*   node;
+    unsigned long alloc_pageno;
+    int top_down = (flags & DMA_MEM_LONG_LIVED) != 0;
+    int depth;
+    long place;
+
+    if (!(flags & (DMA_MEM_LONG_LIVED | DMA_MEM_FIRST_FIT)) && DmaMem_pb_small(mm, npages)) {
+        /* the first fit mostly lands in a used pageblock already, the scan is for when it does not */
+        depth = (align_pages == 1) ? first_fit(mm, npages, path) : 0;
+        place = (depth > 0) ? DmaMem_pb_place(mm, NODE(mm, path[depth - 1]), npages, 1) : -1;
+        if (place < 0) {
+            node  = find_pageblock(mm, npages, align_pages, &alloc_pageno);
+            depth = node ? avltree_find(mm, node->pageno, path) : 0;
+            place = node ? (long)alloc_pageno : -1;
+        }
+        if (place >= 0) {
+            tree_carve(mm, path, depth, place, npages);
+            return place;
+        }
+    }
+
+    if (align_pages > 1) {
+        /* any block of npages + align_pages - 1 holds an aligned range; only
+         * when none is left are the tighter blocks searched one by one */
+        depth = top_down ? last_fit(mm, npages + align_pages - 1, path) : first_fit(mm, npages + align_pages - 1, path);
+        if (depth == 0) {
+            node = find_aligned(mm, npages, align_pages, top_down);
+            if (node == NULL) {
+                return -1;
+            }
+            depth = avltree_find(mm, node->pageno, path);
+        }
+    } else if (top_down) {
+        depth = last_fit(mm, npages, path);
+    } else if (flags & (DMA_MEM_SHORT_LIVED | DMA_MEM_FIRST_FIT)) {
+        depth = first_fit(mm, npages, path);
+    } else {
+        depth = best_fit(mm, npages, path);
+    }
+    if (depth == 0) {
+        return -1;
+    }
+
+    node = NODE(mm, path[depth - 1]);
+    if (top_down) {
+        alloc_pageno = DmaMem_fit_top(mm, node, npages, align_pages);
+    } else {
+        alloc_pageno = (align_pages > 1) ? DmaMem_align_pageno(mm, node->pageno, align_pages) : node->pageno;
+    }
+    tree_carve(mm, path, depth, alloc_pageno, npages);
+    return alloc_pageno;
+}
+
+/*
+ * Turns the allocated block node into a free one, merged with its free
+ * neighbours, which the boundary tags name without a search.
+ */
+static void tree_release(DmaMem_t* mm, avl_node_t* node) {
+    unsigned long pageno = node->pageno;
+    unsigned long npages = node->npages;
+    avl_node_t* next = NULL;
+    avl_node_t* prev = NULL;
+
+    /* next free block, through its head tag */
+    if ((pageno + npages < mm->num_pages) && !DmaMem_page_used(mm, pageno + npages)) {
+        next = DmaMem_block_at(mm, pageno + npages);
+    }
+    /* previous free block, through its tail tag */
+    if ((pageno > 0) && !DmaMem_page_used(mm, pageno - 1)) {
+        prev = DmaMem_block_at(mm, DmaMem_block_head(mm, pageno - 1));
+    }
+
+    if (next) {
+        node = avltree_merge(mm, node, next);
+    }
+    if (prev) {
+        node = avltree_merge(mm, prev, node);
+    }
+    if ((next == NULL) && (prev == NULL)) {
+        DmaMem_mark_block(mm, node, 0);
+        avltree_update(mm, node);
+    }
+}
+
+/* the allocated block at ptr, found by index arithmetic on the tags */
+static avl_node_t* tree_alloc_block(DmaMem_t* mm, unsigned long ptr) {
+    avl_node_t* node = DmaMem_lookup_block(mm, ptr);
+    if ((node == NULL) || !node->used) {
+        DmaMem_log(mm, "vmem_free: 0x%08lx not found\n", ptr);
+        return NULL;
+    }
+    return node;
+}
+
+/* returns the number of pages released, or -1 */
+static long tree_free(DmaMem_t* mm, unsigned long ptr) {
+    avl_node_t* node = tree_alloc_block(mm, ptr);
+    long npages;
+
+    if (node == NULL) {
+        return -1;
+    }
+    npages = node->npages;
+    tree_release(mm, node);
+    return npages;
+}
+
+/* the lowest of the largest free blocks and the path to it; returns the depth or 0 */
+static int tree_largest_free(DmaMem_t* mm, u32* path) {
+    unsigned long largest = NODE(mm, mm->block_tree)->maxfree;
+    return largest ? first_fit(mm, largest, path) : 0;
+}
+
+/*
+ * Carves up to count blocks of npages out of as few free blocks as
+ * possible: the first that fits the whole remainder when one exists, the
+ * largest free block otherwise. Each free block is split in one pass.
+ * Returns the number of blocks whose first pages were stored in pagenos.
+ */
+static unsigned long tree_alloc_bulk(DmaMem_t* mm, unsigned long npages, unsigned long count, unsigned long* pagenos) {
+    u32 path[DMA_TREE_MAX_DEPTH];
+    avl_node_t*   node;
+    unsigned long free_pageno, free_npages, take, i;
+    unsigned long done = 0;
+    int depth;
+
+    while (done < count) {
+        depth = first_fit(mm, (count - done) * npages, path);
+        if (depth == 0) {
+            depth = tree_largest_free(mm, path);
+            if ((depth == 0) || (NODE(mm, path[depth - 1])->npages < npages)) {
+                break;
+            }
+        }
+        node        = NODE(mm, path[depth - 1]);
+        free_pageno = node->pageno;
+        free_npages = node->npages;
+
+        take = free_npages / npages;
+        if (take > count - done) {
+            take = count - done;
+        }
+        /* the free block's node becomes the first piece */
+        node->npages = npages;
+        node->parked = 0;
+        node->kaddr  = NULL;
+        DmaMem_mark_block(mm, node, 1);
+        retrace(mm, path, depth, depth);
+        pagenos[done++] = free_pageno;
+        for (i = 1; i < take; ++i) {
+            set_blocks(mm, free_pageno + i * npages, npages, 1);
+            pagenos[done++] = free_pageno + i * npages;
+        }
+        if (take * npages < free_npages) {
+            set_blocks(mm, free_pageno + take * npages, free_npages - take * npages, 0);
+        }
+    }
+    return done;
+}
+
+/*
+ * Frees the blocks at ptrs, sorted by address. Runs of adjacent blocks are
+ * folded into the node of the run's first block before anything is
+ * merged, so each run is released with one merge.
+ * Returns the number of addresses that were not allocated blocks and
+ * stores the pages released.
+ */
+static unsigned long tree_free_bulk(DmaMem_t* mm, const unsigned long* ptrs, unsigned long count, unsigned long* released) {
+    avl_node_t* run = NULL;
+    avl_node_t* node;
+    unsigned long failed = 0, i;
+
+    *released = 0;
+    for (i = 0; i < count; ++i) {
+        node = tree_alloc_block(mm, ptrs[i]);
+        if (node == NULL) {
+            failed++;
+            continue;
+        }
+        *released += node->npages;
+        page_account(mm, node->pageno, node->npages, 0);
+        if ((run != NULL) && (run->pageno + run->npages == node->pageno)) {
+            /* allocated blocks carry no free pages, so maxfree is unaffected */
+            avltree_remove(mm, node);
+            DmaMem_clear_block(mm, node->pageno, node->npages);
+            run->npages += node->npages;
+            DmaMem_pushback(mm, node);
+            continue;
+        }
+        if (run != NULL) {
+            tree_release(mm, run);
+        }
+        run = node;
+    }
+    if (run != NULL) {
+        tree_release(mm, run);
+    }
+    return failed;
+}
+
+/*
+ * Resizes the allocated block node to npages in place. A shrink gives the
+ * tail back, merged with a free successor; a grow takes what it lacks from
+ * the bottom of a free successor. Returns 0, or -1 when the successor is
+ * allocated or too small.
+ */
+static int tree_resize(DmaMem_t* mm, avl_node_t* node, unsigned long npages) {
+    unsigned long end = node->pageno + node->npages;
+    unsigned long extra;
+    avl_node_t*   next;
+
+    if (npages < node->npages) {
+        node->npages = npages;
+        DmaMem_mark_block(mm, node, 1);
+        /* the tail goes in as an allocated block and is released like one */
+        set_blocks(mm, node->pageno + npages, end - node->pageno - npages, 1);
+        tree_release(mm, DmaMem_block_at(mm, node->pageno + npages));
+        return 0;
+    }
+
+    if ((end == mm->num_pages) || DmaMem_page_used(mm, end)) {
+        return -1;
+    }
+    next  = DmaMem_block_at(mm, end);
+    extra = npages - node->npages;
+    if ((next == NULL) || (next->npages < extra)) {
+        return -1;
+    }
+    DmaMem_clear_block(mm, next->pageno, next->npages);
+    if (next->npages == extra) {
+        avltree_remove(mm, next);
+        DmaMem_pushback(mm, next);
+    } else {
+        /* still between the same neighbours, so it keeps its place in the tree */
+        next->pageno += extra;
+        next->npages -= extra;
+        DmaMem_mark_block(mm, next, 0);
+        avltree_update(mm, next);
+    }
+    node->npages = npages;
+    DmaMem_mark_block(mm, node, 1);
+    return 0;
+}
+
+static long alloc_blocks(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags) {
+    long pageno;
+    if (node_reserve(mm, DMA_MEM_NODE_RESERVE) != 0) {
+        return -1;
+    }
+    switch (mm->engine) {
+    case DMA_MEM_ENGINE_TLSF:
+        pageno = DmaTlsf_alloc(mm, npages, align_pages, flags);
+        break;
+    case DMA_MEM_ENGINE_BUDDY:
+        pageno = DmaBuddy_alloc(mm, npages, align_pages, flags);
+        break;
+    default:
+        pageno = tree_alloc(mm, npages, align_pages, flags);
+        break;
+    }
+
+    if (pageno >= 0) {
+        mm->alloc_page_count += npages;
+        mm->free_page_count  -= npages;
+        page_account(mm, pageno, npages, 1);
+    }
+    return pageno;
+}
+
+/* returns the number of pages released, or -1 */
+static long free_blocks(DmaMem_t* mm, unsigned long ptr) {
+    long npages;
+    switch (mm->engine) {
+    case DMA_MEM_ENGINE_TLSF:
+        npages = DmaTlsf_free(mm, ptr);
+        break;
+    case DMA_MEM_ENGINE_BUDDY:
+        npages = DmaBuddy_free(mm, ptr);
+        break;
+    default:
+        npages = tree_free(mm, ptr);
+        break;
+    }
+
+    if (npages > 0) {
+        mm->alloc_page_count -= npages;
+        mm->free_page_count  += npages;
+        page_account(mm, (ptr - mm->base_addr) / mm->page_size, npages, 0);
+    }
+    return npages;
+}
+
+/*
+ * Allocates up to count blocks of npages under one hold of the lock; returns
+ * how many were stored in pagenos. The tree engine carves them out of as
+ * few free blocks as it can, the others allocate them one by one.
+ */
+static unsigned long alloc_blocks_bulk(DmaMem_t* mm, unsigned long npages, unsigned long count, unsigned long* pagenos) {
+    unsigned long done = 0, i;
+    long pageno;
+
+    if (node_reserve(mm, count + DMA_MEM_NODE_RESERVE) != 0) {
+        return 0;
+    }
+    if (mm->engine == DMA_MEM_ENGINE_TREE) {
+        done = tree_alloc_bulk(mm, npages, count, pagenos);
+        mm->alloc_page_count += done * npages;
+        mm->free_page_count  -= done * npages;
+        for (i = 0; i < done; ++i) {
+            page_account(mm, pagenos[i], npages, 1);
+        }
+        return done;
+    }
+    while (done < count) {
+        pageno = alloc_blocks(mm, npages, 1, 0);
+        if (pageno < 0) {
+            break;
+        }
+        pagenos[done++] = pageno;
+    }
+    return done;
+}
+
+/* frees blocks sorted by address; returns the number that could not be freed */
+static unsigned long free_blocks_bulk(DmaMem_t* mm, const unsigned long* ptrs, unsigned long count) {
+    unsigned long failed = 0, released, i;
+
+    if (mm->engine == DMA_MEM_ENGINE_TREE) {
+        failed = tree_free_bulk(mm, ptrs, count, &released);
+        mm->alloc_page_count -= released;
+        mm->free_page_count  += released;
+        return failed;
+    }
+    for (i = 0; i < count; ++i) {
+        if (free_blocks(mm, ptrs[i]) < 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static long region_alloc(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags) {
+    long pageno;
+    spin_lock(&(mm->node_Lock));
+    pageno = alloc_blocks(mm, npages, align_pages, flags);
+    spin_unlock(&(mm->node_Lock));
+    return pageno;
+}
+
+/* fills ptrs with the addresses of up to count blocks, returns how many */
+static unsigned long region_alloc_bulk(DmaMem_t* mm, unsigned long npages, unsigned long count, unsigned long* ptrs) {
+    unsigned long done, i;
+    spin_lock(&(mm->node_Lock));
+    done = alloc_blocks_bulk(mm, npages, count, ptrs);
+    spin_unlock(&(mm->node_Lock));
+    for (i = 0; i < done; ++i) {
+        ptrs[i] = mm->base_addr + ptrs[i] * mm->page_size;
+    }
+    return done;
+}
+
+static long region_free(DmaMem_t* mm, unsigned long ptr) {
+    long npages;
+    spin_lock(&(mm->node_Lock));
+    npages = free_blocks(mm, ptr);
+    spin_unlock(&(mm->node_Lock));
+    return npages;
+}
+
+/*
+ * Resizes the block at ptr to npages without moving it and stores its old
+ * size in *old_npages. Returns 0, 1 when the neighbours leave no room, -1
+ * when ptr is not an allocated block.
+ */
+static int region_resize(DmaMem_t* mm, unsigned long ptr, unsigned long npages, unsigned long* old_npages) {
+    avl_node_t* node;
+    int ret;
+
+    spin_lock(&(mm->node_Lock));
+    node = DmaMem_lookup_block(mm, ptr);
+    if ((node == NULL) || !node->used || node->parked || node->is_slab) {
+        spin_unlock(&(mm->node_Lock));
+        DmaMem_log(mm, "vmem_resize: 0x%08lx not found\n", ptr);
+        return -1;
+    }
+    *old_npages = node->npages;
+    if (npages == node->npages) {
+        spin_unlock(&(mm->node_Lock));
+        return 0;
+    }
+    if (node_reserve(mm, DMA_MEM_NODE_RESERVE) != 0) {
+        spin_unlock(&(mm->node_Lock));
+        return 1;
+    }
+    switch (mm->engine) {
+    case DMA_MEM_ENGINE_TLSF:
+        ret = DmaTlsf_resize(mm, node, npages);
+        break;
+    case DMA_MEM_ENGINE_BUDDY:
+        ret = DmaBuddy_resize(mm, node, npages);
+        break;
+    default:
+        ret = tree_resize(mm, node, npages);
+        break;
+    }
+    if (ret != 0) {
+        spin_unlock(&(mm->node_Lock));
+        return 1;
+    }
+
+    if (npages > *old_npages) {
+        mm->alloc_page_count += npages - *old_npages;
+        mm->free_page_count  -= npages - *old_npages;
+        page_account(mm, node->pageno + *old_npages, npages - *old_npages, 1);
+    } else {
+        mm->alloc_page_count -= *old_npages - npages;
+        mm->free_page_count  += *old_npages - npages;
+        page_account(mm, node->pageno + npages, *old_npages - npages, 0);
+    }
+    spin_unlock(&(mm->node_Lock));
+    return 0;
+}
+
+/* routes an address to the region (shard) that owns it */
+DmaMem_t* DmaMem_region_of(DmaMem_t* mm, unsigned long ptr) {
+    unsigned long idx;
+    if (mm->shards == NULL) {
+        return mm;
+    }
+    if (ptr < mm->base_addr) {
+        return NULL;
+    }
+    idx = (ptr - mm->base_addr) / mm->shard_size;
+    if (idx >= (unsigned long)mm->num_shards) {
+        idx = mm->num_shards - 1;
+    }
+    return &mm->shards[idx];
+}
+
+/* finds a block by its address through the head tag, without searching the tree */
+avl_node_t* DmaMem_lookup_block(DmaMem_t* mm, unsigned long ptr) {
+    unsigned long pageno;
+    if ((mm == NULL) || (ptr < mm->base_addr) || ((ptr - mm->base_addr) % mm->page_size)) {
+        return NULL;
+    }
+    pageno = (ptr - mm->base_addr) / mm->page_size;
+    if (pageno >= (unsigned long)mm->num_pages) {
+        return NULL;
+    }
+    return DmaMem_block_at(mm, pageno);
+}
+
+avl_node_t* DmaMem_walk_fit(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, int top_down) {
+    avl_node_t*   node;
+    unsigned long pageno;
+
+    if (!top_down) {
+        for (pageno = 0; pageno < mm->num_pages; pageno += node->npages) {
+            node = DmaMem_block_at(mm, pageno);
+            if (!node->used && (DmaMem_align_pageno(mm, pageno, align_pages) + npages <= pageno + node->npages)) {
+                return node;
+            }
+        }
+        return NULL;
+    }
+    for (pageno = mm->num_pages; pageno > 0; pageno = node->pageno) {
+        node = DmaMem_block_at(mm, DmaMem_block_head(mm, pageno - 1));
+        if (!node->used && (DmaMem_fit_top(mm, node, npages, align_pages) >= 0)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+long DmaMem_pb_place(const DmaMem_t* mm, const avl_node_t* node, unsigned long npages, unsigned long align_pages) {
+    unsigned long bottom = DmaMem_align_pageno(mm, node->pageno, align_pages);
+    long top;
+
+    if (bottom + npages > node->pageno + node->npages) {
+        return -1;
+    }
+    if (!pb_breaks(mm, bottom, npages)) {
+        return bottom;
+    }
+    top = DmaMem_fit_top(mm, node, npages, align_pages);
+    return ((top >= 0) && !pb_breaks(mm, top, npages)) ? top : -1;
+}
+
+/* the slab page holding the object at ptr, or NULL when ptr is not a slab object */
+static avl_node_t* slab_page_of(DmaMem_t* mm, unsigned long ptr) {
+    DmaMem_t*   region;
+    avl_node_t* node;
+
+    if (mm->slab_caches == NULL) {
+        return NULL;
+    }
+    region = DmaMem_region_of(mm, ptr);
+    if ((region == NULL) || (ptr < region->base_addr)) {
+        return NULL;
+    }
+    node = DmaMem_lookup_block(region, ptr - (ptr - region->base_addr) % region->page_size);
+    return (node && READ_ONCE(node->is_slab)) ? node : NULL;
+}
+
+static int mag_class(DmaMem_t* mm, unsigned long npages) {
+    int i;
+    for (i = 0; i < DMA_MEM_MAG_CLASSES; ++i) {
+        if ((mm->config.mag_pages[i] > 0) && ((unsigned long)mm->config.mag_pages[i] == npages)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static unsigned long* mag_slots(DmaMem_t* mm, DmaMag_t* mag, int cls) {
+    return mag->addrs + cls * mm->config.mag_depth;
+}
+
+/* marks a block taken out of a magazine as allocated again */
+static void mag_unpark(DmaMem_t* mm, unsigned long ptr) {
+    avl_node_t* node = DmaMem_lookup_block(DmaMem_region_of(mm, ptr), ptr);
+    if (node) {
+        WRITE_ONCE(node->parked, 0);
+    }
+}
+
+/* hands back a block parked on this CPU, or -1 */
+static unsigned long mag_pop(DmaMem_t* mm, unsigned long npages) {
+    DmaMag_t* mag;
+    unsigned long ptr = (unsigned long)-1;
+    int cls;
+
+    cls = mag_class(mm, npages);
+    if ((mm->mags == NULL) || (cls < 0)) {
+        return ptr;
+    }
+
+    mag = &mm->mags[raw_smp_processor_id()];
+    spin_lock(&mag->lock);
+    if (mag->count[cls] > 0) {
+        ptr = mag_slots(mm, mag, cls)[--mag->count[cls]];
+        mag_unpark(mm, ptr);
+        mag->parked_pages -= npages;
+    }
+    spin_unlock(&mag->lock);
+    return ptr;
+}
+
+static void mag_flush_class(DmaMem_t* mm, DmaMag_t* mag, int cls) {
+    unsigned long* slots = mag_slots(mm, mag, cls);
+    while (mag->count[cls] > 0) {
+        unsigned long ptr = slots[--mag->count[cls]];
+        mag_unpark(mm, ptr);
+        mag->parked_pages -= mm->config.mag_pages[cls];
+        region_free(DmaMem_region_of(mm, ptr), ptr);
+    }
+}
+
+/* parks a freed block on this CPU; returns 0 when parked, -1 when the block has no magazine */
+static int mag_push(DmaMem_t* mm, DmaMem_t* region, avl_node_t* node) {
+    DmaMag_t* mag;
+    int cls;
+
+    cls = mag_class(mm, node->npages);
+    if ((mm->mags == NULL) || (cls < 0)) {
+        return -1;
+    }
+
+    mag = &mm->mags[raw_smp_processor_id()];
+    spin_lock(&mag->lock);
+    if (mag->count[cls] == mm->config.mag_depth) {
+        mag_flush_class(mm, mag, cls);
+    }
+    WRITE_ONCE(node->parked, 1);
+    mag_slots(mm, mag, cls)[mag->count[cls]++] = DmaMem_block_addr(region, node);
+    mag->parked_pages += node->npages;
+    spin_unlock(&mag->lock);
+    return 0;
+}
+
+int DmaMem_free_deferred(DmaMem_t* mm, unsigned long ptr) {
+    DmaMemDefer_t* slot;
+    long pos, seq, found;
+
+    if ((mm == NULL) || (mm->defer_slots == NULL)) {
+        DmaMem_log(mm, "vmem_free_deferred: invalid handle\n");
+        return -1;
+    }
+
+    pos = atomic_long_read(&mm->defer_tail);
+    for (;;) {
+        slot = &mm->defer_slots[pos & mm->defer_mask];
+        seq  = atomic_long_read_acquire(&slot->seq);
+        if (seq < pos) {
+            /* still holds the address queued one lap ago */
+            return -1;
+        }
+        if (seq == pos) {
+            found = atomic_long_cmpxchg(&mm->defer_tail, pos, pos + 1);
+            if (found == pos) {
+                break;
+            }
+            pos = found;
+        } else {
+            pos = atomic_long_read(&mm->defer_tail);
+        }
+    }
+    slot->ptr = ptr;
+    atomic_long_set_release(&slot->seq, pos + 1);
+    return 0;
+}
+
+#define DMA_MEM_DEFER_BATCH     64
+
+/*
+ * Allocations drain once a batch has built up, or half the ring when that
+ * is smaller, so the cost is paid in bulk and the ring never runs full
+ * while allocations keep coming. Two reads, cheap enough for every call.
+ */
+static int defer_pending(DmaMem_t* mm) {
+    long pending, batch;
+
+    if (mm->defer_slots == NULL) {
+        return 0;
+    }
+    batch   = (mm->defer_mask >= 2 * DMA_MEM_DEFER_BATCH) ? DMA_MEM_DEFER_BATCH : (long)(mm->defer_mask + 2) / 2;
+    pending = atomic_long_read(&mm->defer_tail) - atomic_long_read(&mm->defer_head);
+    return pending >= batch;
+}
+
+/*
+ * Slots are emptied a batch at a time under defer_Lock, a mutex as freeing
+ * may unmap, and it stays held while the batch is freed. Without wait, as
+ * from the allocation paths, which must not sleep, a drain already under
+ * way is left to finish the job. A slot still being written by its
+ * producer ends the drain; the next one picks it up. An address queued
+ * twice is refused by free_bulk, logged and freed once, whether or not
+ * both land in the same batch.
+ */
+static long drain_deferred(DmaMem_t* mm, int wait) {
+    unsigned long  batch[DMA_MEM_DEFER_BATCH];
+    DmaMemDefer_t* slot;
+    long drained = 0, head, n;
+
+    if ((mm == NULL) || (mm->defer_slots == NULL)) {
+        return 0;
+    }
+
+    if (wait) {
+        mutex_lock(&(mm->defer_Lock));
+    } else if (!mutex_trylock(&(mm->defer_Lock))) {
+        return 0;
+    }
+    do {
+        head = atomic_long_read(&mm->defer_head);
+        for (n = 0; n < DMA_MEM_DEFER_BATCH; ++n, ++head) {
+            slot = &mm->defer_slots[head & mm->defer_mask];
+            if (atomic_long_read_acquire(&slot->seq) != head + 1) {
+                break;
+            }
+            batch[n] = slot->ptr;
+            atomic_long_set_release(&slot->seq, head + mm->defer_mask + 1);
+        }
+        atomic_long_set(&mm->defer_head, head);
+        if (n > 0) {
+            DmaMem_free_bulk(mm, batch, n);
+        }
+        drained += n;
+    } while (n == DMA_MEM_DEFER_BATCH);
+    mutex_unlock(&(mm->defer_Lock));
+    return drained;
+}
+
+long DmaMem_drain_deferred(DmaMem_t* mm) {
+    return drain_deferred(mm, 1);
+}
+
+/* hands back everything set aside; wait as for drain_deferred */
+static void flush(DmaMem_t* mm, int wait) {
+    unsigned int cpu;
+    int cls;
+
+    drain_deferred(mm, wait);
+
+    /* first, as empty slabs free their pages into the magazines */
+    if (mm->slab_caches) {
+        DmaSlab_shrink(mm);
+    }
+    if (mm->mags == NULL) {
+        return;
+    }
+
+    for (cpu = 0; cpu < mm->nr_mags; ++cpu) {
+        DmaMag_t* mag = &mm->mags[cpu];
+        spin_lock(&mag->lock);
+        for (cls = 0; cls < DMA_MEM_MAG_CLASSES; ++cls) {
+            mag_flush_class(mm, mag, cls);
+        }
+        spin_unlock(&mag->lock);
+    }
+}
+
+int DmaMem_flush(DmaMem_t* mm) {
+    if (mm == NULL) {
+        DmaMem_log(mm, "vmem_flush: invalid handle\n");
+        return -1;
+    }
+    flush(mm, 1);
+    return 0;
+}
+
+/* tries the home shard of this CPU first, then steals from its neighbours */
+static unsigned long shard_alloc(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags) {
+    DmaMem_t* region;
+    long pageno;
+    int i, home;
+
+    if (mm->shards == NULL) {
+        pageno = region_alloc(mm, npages, align_pages, flags);
+        return (pageno < 0) ? (unsigned long)-1 : mm->base_addr + (unsigned long)pageno * mm->page_size;
+    }
+
+    home = raw_smp_processor_id() % mm->num_shards;
+    for (i = 0; i < mm->num_shards; ++i) {
+        region = &mm->shards[(home + i) % mm->num_shards];
+        pageno = region_alloc(region, npages, align_pages, flags);
+        if (pageno >= 0) {
+            return region->base_addr + (unsigned long)pageno * region->page_size;
+        }
+    }
+    return (unsigned long)-1;
+}
+
+static unsigned long shard_alloc_bulk(DmaMem_t* mm, unsigned long npages, unsigned long count, unsigned long* ptrs) {
+    unsigned long done = 0;
+    int i, home;
+
+    if (mm->shards == NULL) {
+        return region_alloc_bulk(mm, npages, count, ptrs);
+    }
+
+    home = raw_smp_processor_id() % mm->num_shards;
+    for (i = 0; (i < mm->num_shards) && (done < count); ++i) {
+        done += region_alloc_bulk(&mm->shards[(home + i) % mm->num_shards], npages, count - done, ptrs + done);
+    }
+    return done;
+}
+
+unsigned long DmaMem_alloc(DmaMem_t* mm, unsigned long size) {
+    return DmaMem_alloc_aligned(mm, size, 0);
+}
+
+static int policy_of(unsigned int flags) {
+    switch (flags) {
+    case 0:                     return DMA_MEM_POLICY_DEFAULT;
+    case DMA_MEM_SHORT_LIVED:   return DMA_MEM_POLICY_SHORT_LIVED;
+    case DMA_MEM_LONG_LIVED:    return DMA_MEM_POLICY_LONG_LIVED;
+    case DMA_MEM_FIRST_FIT:     return DMA_MEM_POLICY_FIRST_FIT;
+    default:                    return -1;
+    }
+}
+
+/* free pages in the engines, parked blocks are flushed before a failure */
+static unsigned long engine_free_pages(DmaMem_t* mm) {
+    unsigned long pages = 0;
+    int i;
+    for (i = 0; i < (mm->shards ? mm->num_shards : 1); ++i) {
+        DmaMem_t* region = mm->shards ? &mm->shards[i] : mm;
+        spin_lock(&(region->node_Lock));
+        pages += region->free_page_count;
+        spin_unlock(&(region->node_Lock));
+    }
+    return pages;
+}
+
+/* called with node_Lock held */
+static unsigned long largest_free(DmaMem_t* mm) {
+    switch (mm->engine) {
+    case DMA_MEM_ENGINE_TLSF:
+        return DmaTlsf_largest_free(mm);
+    case DMA_MEM_ENGINE_BUDDY:
+        return DmaBuddy_largest_free(mm);
+    default:
+        return NODE(mm, mm->block_tree)->maxfree;
+    }
+}
+
+/*
+ * With config.accounting, mm->avail counts the free pages outside every
+ * reservation. A client's pages come out of its reservation up to
+ * client->pages in use and out of avail past that; each call works out
+ * its share from the used count it moved, so concurrent calls still add
+ * up. A charge that takes avail below zero is undone and fails.
+ */
+static void watermark_check(DmaMem_t* mm, long avail) {
+    if (mm->wm_notify == NULL) {
+        return;
+    }
+    if (avail < (long)mm->wm_low) {
+        if (atomic_long_cmpxchg(&mm->wm_below, 0, 1) == 0) {
+            mm->wm_notify(mm->wm_ctx, 1);
+        }
+    } else if (avail > (long)mm->wm_high) {
+        if (atomic_long_cmpxchg(&mm->wm_below, 1, 0) == 1) {
+            mm->wm_notify(mm->wm_ctx, 0);
+        }
+    }
+}
+
+static void uncharge(DmaMem_t* mm, DmaMemClient_t* client, long npages) {
+    long shared = npages, used, reserved;
+
+    if (!mm->config.accounting || (npages <= 0)) {
+        return;
+    }
+    if (client) {
+        used     = atomic_long_sub_return(npages, &client->used);
+        reserved = (long)client->pages;
+        shared   = MAX(used + npages, reserved) - MAX(used, reserved);
+    }
+    watermark_check(mm, atomic_long_add_return(shared, &mm->avail));
+}
+
+static int charge(DmaMem_t* mm, DmaMemClient_t* client, long npages) {
+    long shared = npages, used, reserved, avail;
+
+    if (!mm->config.accounting) {
+        return 0;
+    }
+    if (client) {
+        used     = atomic_long_add_return(npages, &client->used);
+        reserved = (long)client->pages;
+        shared   = MAX(used, reserved) - MAX(used - npages, reserved);
+    }
+    if (shared == 0) {
+        return 0;
+    }
+    avail = atomic_long_sub_return(shared, &mm->avail);
+    if (avail < 0) {
+        if (client) {
+            uncharge(mm, client, npages);
+        } else {
+            atomic_long_add(shared, &mm->avail);
+        }
+        return -1;
+    }
+    watermark_check(mm, avail);
+    return 0;
+}
+
+/*
+ * Wakes DmaMem_alloc_wait sleepers once region holds a free block of the
+ * smallest size they want, npages being what the caller just released.
+ * Sleepers register before they try, and the try and the free both take
+ * the region lock, so a free either helps the try or sees the sleeper.
+ */
+static void wake_waiters(DmaMem_t* mm, DmaMem_t* region, unsigned long npages) {
+    long want = atomic_long_read(&mm->wait_pages);
+
+    if (want == LONG_MAX) {
+        return;
+    }
+    if ((long)npages < want) {
+        spin_lock(&(region->node_Lock));
+        npages = largest_free(region);
+        spin_unlock(&(region->node_Lock));
+    }
+    if ((long)npages >= want) {
+        atomic_long_set(&mm->wait_pages, LONG_MAX);
+        wake_up_all(&mm->free_wait);
+    }
+}
+
+/*
+ * Clears the first size bytes of the block just allocated at ptr: all of
+ * them for a block out of a magazine, which never went through the dirty
+ * map, or without config.prezero, and otherwise only the runs of pages
+ * still dirty. -1 when the block has no mapping to clear it through.
+ */
+static int zero_block(DmaMem_t* mm, unsigned long ptr, unsigned long size, int parked) {
+    DmaMem_t*      region = DmaMem_region_of(mm, ptr);
+    unsigned char* kaddr  = (unsigned char*)DmaMem_get_kaddr(mm, ptr);
+    unsigned long  pageno = (ptr - region->base_addr) / region->page_size;
+    unsigned long  npages = (size + region->page_size - 1) / region->page_size;
+    unsigned long  first, last;
+
+    if (kaddr == NULL) {
+        return -1;
+    }
+    if (parked || (region->dirty == NULL)) {
+        memset(kaddr, 0, size);
+        return 0;
+    }
+    for (first = dirty_next(region, pageno, pageno + npages); first < pageno + npages;
+         first = dirty_next(region, last, pageno + npages)) {
+        for (last = first + 1; (last < pageno + npages) && dirty_test(region, last); ++last) {
+        }
+        memset(kaddr + (first - pageno) * region->page_size, 0,
+               MIN((last - pageno) * region->page_size, size) - (first - pageno) * region->page_size);
+    }
+    return 0;
+}
+
+static unsigned long do_alloc_aligned(DmaMem_t* mm, unsigned long size, unsigned long align, unsigned int flags,
+                                      DmaMemClient_t* client, int report) {
+    DmaMemPolicyCount_t* count;
+    DmaMemInfo_t   info;
+    DmaMem_t*      region;
+    void*          kaddr;
+    unsigned long  npages;
+    unsigned long  align_pages;
+    unsigned long  ptr = (unsigned long)-1;
+    unsigned int   zero = flags & DMA_MEM_ZERO;
+    int            cls, policy, parked = 0;
+    if (mm == NULL) {
+    	DmaMem_log(mm, "vmem_alloc: invalid handle\n");
+        return (unsigned long)-1;
+    }
+
+    flags &= ~DMA_MEM_ZERO;
+    policy = policy_of(flags);
+    if (policy < 0) {
+        DmaMem_log(mm, "vmem_alloc: invalid flags 0x%x\n", flags);
+        return (unsigned long)-1;
+    }
+    count = &cpu_stats(mm)->policy[policy];
+
+    if ((size == 0) || (size > mm->mem_size)) {
+        DmaMem_log(mm, "%lu size of vmem_alloc, failed\n", size);
+        return (unsigned long)-1;
+    }
+
+    if (align & (align - 1)) {
+        DmaMem_log(mm, "vmem_alloc: alignment 0x%lx is not a power of two\n", align);
+        return (unsigned long)-1;
+    }
+    if (defer_pending(mm)) {
+        drain_deferred(mm, 0);
+    }
+    /* slab objects share pages whatever their lifetime, placement does not apply */
+    cls = client ? -1 : DmaSlab_class(mm, size, align);
+    if (cls >= 0) {
+        ptr = DmaSlab_alloc(mm, cls);
+        if (zero && (ptr != (unsigned long)-1)) {
+            kaddr = DmaMem_get_kaddr(mm, ptr);
+            if (kaddr) {
+                memset(kaddr, 0, size);
+            } else {
+                DmaSlab_free(mm, slab_page_of(mm, ptr), ptr);
+                ptr = (unsigned long)-1;
+            }
+        }
+        atomic_long_inc((ptr == (unsigned long)-1) ? &count->failed : &count->allocs);
+        return ptr;
+    }
+    align_pages = (align > mm->page_size) ? (align / mm->page_size) : 1;
+
+    npages = (size + mm->page_size - 1) / mm->page_size;
+    if (mm->config.engine == DMA_MEM_ENGINE_BUDDY) {
+        /* account and cache the block that is actually handed out */
+        npages = DmaBuddy_round_pages(npages);
+    }
+    if (charge(mm, client, npages) != 0) {
+        atomic_long_inc(&count->failed);
+        if (report) {
+            DmaMem_log(mm, "vmem_alloc: %lu pages would take reserved ones\n", npages);
+        }
+        return (unsigned long)-1;
+    }
+    if ((align_pages <= 1) && !(flags & (DMA_MEM_LONG_LIVED | DMA_MEM_FIRST_FIT))) {
+        /* parked blocks carry no alignment beyond a page, nor any placement */
+        ptr = mag_pop(mm, npages);
+        parked = (ptr != (unsigned long)-1);
+    }
+    if (ptr == (unsigned long)-1) {
+        ptr = shard_alloc(mm, npages, align_pages, flags);
+    }
+    if ((ptr == (unsigned long)-1) && ((mm->mags != NULL) || (mm->defer_slots != NULL))) {
+        /* parked blocks and frees queued meanwhile may coalesce into a fit */
+        flush(mm, 0);
+        ptr = shard_alloc(mm, npages, align_pages, flags);
+    }
+    if (ptr == (unsigned long)-1) {
+        uncharge(mm, client, npages);
+        atomic_long_inc(&count->failed);
+        if (engine_free_pages(mm) >= npages) {
+            atomic_long_inc(&count->frag_failed);
+        }
+        if (report) {
+            DmaMem_get_info(mm, &info);
+            DmaMem_log(mm, "pages all:%lu used:%lu free:%lu, no fit for %lu pages aligned to %lu\n", info.total_pages, info.alloc_pages, info.free_pages, npages, align_pages);
+        }
+        return (unsigned long)-1;
+    }
+
+    if (mm->kbase == NULL) {
+        DmaMem_lookup_block(DmaMem_region_of(mm, ptr), ptr)->kaddr = DmaMem_map(mm, ptr, size);
+    }
+    if (zero && (zero_block(mm, ptr, size, parked) != 0)) {
+        /* a block that could not be cleared is no zeroed block */
+        region = DmaMem_region_of(mm, ptr);
+        region_free(region, ptr);
+        uncharge(mm, client, npages);
+        wake_waiters(mm, region, npages);
+        atomic_long_inc(&count->failed);
+        return (unsigned long)-1;
+    }
+    atomic_long_inc(&count->allocs);
+    atomic_long_add(npages, &count->pages);
+    return ptr;
+}
+
+/* do_alloc_aligned, timed with config.stats and recorded with config.trace unless DMA_MEM_NESTED */
+static unsigned long alloc_aligned(DmaMem_t* mm, unsigned long size, unsigned long align, unsigned int flags,
+                                   DmaMemClient_t* client, int report) {
+    DmaMemTrace_t rec;
+    unsigned long ptr;
+    u64 start, ns;
+    int trace;
+
+    if (mm == NULL) {
+        return do_alloc_aligned(mm, size, align, flags, client, report);
+    }
+    trace  = (mm->trace_slots != NULL) && !(flags & DMA_MEM_NESTED);
+    flags &= ~DMA_MEM_NESTED;
+    if (!mm->config.stats && !trace) {
+        return do_alloc_aligned(mm, size, align, flags, client, report);
+    }
+    start = ktime_get_ns();
+    ptr   = do_alloc_aligned(mm, size, align, flags, client, report);
+    ns    = ktime_get_ns() - start;
+    if (mm->config.stats) {
+        atomic_long_inc(&cpu_stats(mm)->alloc_ns[lat_bucket(ns)]);
+    }
+    if (trace) {
+        rec = (DmaMemTrace_t){ .ts = start, .size = size, .align = align, .ptr = ptr, .old = 0,
+                               .latency = trace_ns(ns), .flags = flags, .op = DMA_MEM_TRACE_ALLOC };
+        trace_put(mm, &rec);
+    }
+    return ptr;
+}
+
+unsigned long DmaMem_alloc_nested(DmaMem_t* mm, unsigned long size) {
+    return alloc_aligned(mm, size, 0, DMA_MEM_NESTED, NULL, 1);
+}
+
+unsigned long DmaMem_alloc_zeroed(DmaMem_t* mm, unsigned long size) {
+    return alloc_aligned(mm, size, 0, DMA_MEM_ZERO, NULL, 1);
+}
+
+unsigned long DmaMem_alloc_aligned(DmaMem_t* mm, unsigned long size, unsigned long align) {
+    return alloc_aligned(mm, size, align, 0, NULL, 1);
+}
+
+unsigned long DmaMem_alloc_flags(DmaMem_t* mm, unsigned long size, unsigned long align, unsigned int flags) {
+    return alloc_aligned(mm, size, align, flags, NULL, 1);
+}
+
+unsigned long DmaMem_try_alloc(DmaMem_t* mm, unsigned long size, unsigned long align, unsigned int flags) {
+    return alloc_aligned(mm, size, align, flags, NULL, 0);
+}
+
+/*
+ * Bulk requests bypass the magazines: the point is to hand out blocks
+ * carved next to each other, which free_bulk can coalesce in one pass.
+ */
+static int cmp_addr(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+    return (x > y) - (x < y);
+}
+
+/* with trace and config.trace, records every block freed; slab objects are timed one by one */
+static int free_bulk(DmaMem_t* mm, unsigned long* ptrs, unsigned long count, int trace) {
+    DmaMem_t*     region;
+    avl_node_t*   node;
+    unsigned long kept = 0, failed = 0, pages = 0, last = 0, i, j;
+    u64           start = 0;
+    long          n = 0;
+
+    if ((mm == NULL) || ((ptrs == NULL) && (count > 0))) {
+        DmaMem_log(mm, "vmem_free_bulk: invalid handle\n");
+        return -1;
+    }
+
+    trace = trace && (mm->trace_slots != NULL);
+    sort(ptrs, count, sizeof(unsigned long), cmp_addr, NULL);
+    /* frees slab objects, drops repeats and what is not an allocated block, unmaps the rest */
+    for (i = 0; i < count; ++i) {
+        if ((i > 0) && (ptrs[i] == last)) {
+            DmaMem_log(mm, "vmem_free_bulk: 0x%08lx freed twice\n", ptrs[i]);
+            failed++;
+            continue;
+        }
+        last = ptrs[i];
+        node = slab_page_of(mm, ptrs[i]);
+        if (node) {
+            if (!trace) {
+                failed += (DmaSlab_free(mm, node, ptrs[i]) != 0);
+                continue;
+            }
+            start = ktime_get_ns();
+            n     = trace_claim(mm, 1);
+            if (DmaSlab_free(mm, node, ptrs[i]) != 0) {
+                failed++;
+                trace_bulk(mm, n, DMA_MEM_TRACE_FREE, start, 0, NULL, 1);
+            } else {
+                trace_bulk(mm, n, DMA_MEM_TRACE_FREE, start, 0, &ptrs[i], 1);
+            }
+            continue;
+        }
+        region = DmaMem_region_of(mm, ptrs[i]);
+        node   = DmaMem_lookup_block(region, ptrs[i]);
+        if ((node == NULL) || !DmaMem_page_used(region, node->pageno) || READ_ONCE(node->parked)) {
+            DmaMem_log(mm, "vmem_free_bulk: 0x%08lx not found\n", ptrs[i]);
+            failed++;
+            continue;
+        }
+        if (node->kaddr) {
+            DmaMem_unmap(mm, node->kaddr);
+            node->kaddr = NULL;
+        }
+        pages += node->npages;
+        ptrs[kept++] = ptrs[i];
+    }
+
+    if (trace) {
+        start = ktime_get_ns();
+        n     = trace_claim_bulk(mm, kept);
+    }
+    /* one lock hold per region; sorted addresses keep each region's blocks together */
+    for (i = 0; i < kept; i = j) {
+        region = DmaMem_region_of(mm, ptrs[i]);
+        for (j = i + 1; (j < kept) && (DmaMem_region_of(mm, ptrs[j]) == region); ++j) {
+        }
+        spin_lock(&(region->node_Lock));
+        failed += free_blocks_bulk(region, ptrs + i, j - i);
+        spin_unlock(&(region->node_Lock));
+    }
+    /* sleepers woken before the pages are credited would find them still charged */
+    uncharge(mm, NULL, pages);
+    for (i = 0; i < kept; i = j) {
+        region = DmaMem_region_of(mm, ptrs[i]);
+        for (j = i + 1; (j < kept) && (DmaMem_region_of(mm, ptrs[j]) == region); ++j) {
+        }
+        wake_waiters(mm, region, 0);
+    }
+    zero_kick(mm);
+    if (trace) {
+        trace_bulk(mm, n, DMA_MEM_TRACE_FREE, start, 0, ptrs, kept);
+    }
+    return failed ? -1 : 0;
+}
+
+int DmaMem_free_bulk(DmaMem_t* mm, unsigned long* ptrs, unsigned long count) {
+    return free_bulk(mm, ptrs, count, 1);
+}
+
+static int alloc_bulk(DmaMem_t* mm, unsigned long size, unsigned long count, unsigned long* ptrs) {
+    DmaMemInfo_t   info;
+    unsigned long  npages, done, i;
+    int            cls;
+    if ((mm == NULL) || (ptrs == NULL)) {
+        DmaMem_log(mm, "vmem_alloc_bulk: invalid handle\n");
+        return -1;
+    }
+
+    if ((size == 0) || (size > mm->mem_size)) {
+        DmaMem_log(mm, "%lu size of vmem_alloc_bulk, failed\n", size);
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    if (defer_pending(mm)) {
+        drain_deferred(mm, 0);
+    }
+
+    /* slab objects come one by one, they never touch the engines anyway */
+    cls = DmaSlab_class(mm, size, 0);
+    if (cls >= 0) {
+        for (i = 0; i < count; ++i) {
+            ptrs[i] = DmaSlab_alloc(mm, cls);
+            if (ptrs[i] == (unsigned long)-1) {
+                free_bulk(mm, ptrs, i, 0);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    npages = (size + mm->page_size - 1) / mm->page_size;
+    if (mm->config.engine == DMA_MEM_ENGINE_BUDDY) {
+        npages = DmaBuddy_round_pages(npages);
+    }
+    if (charge(mm, NULL, npages * count) != 0) {
+        DmaMem_log(mm, "vmem_alloc_bulk: %lu blocks of %lu pages would take reserved ones\n", count, npages);
+        return -1;
+    }
+    done = shard_alloc_bulk(mm, npages, count, ptrs);
+    if ((done < count) && ((mm->mags != NULL) || (mm->defer_slots != NULL))) {
+        flush(mm, 0);
+        done += shard_alloc_bulk(mm, npages, count - done, ptrs + done);
+    }
+    if (done < count) {
+        uncharge(mm, NULL, npages * (count - done));
+        free_bulk(mm, ptrs, done, 0);
+        DmaMem_get_info(mm, &info);
+        DmaMem_log(mm, "pages all:%lu used:%lu free:%lu, no fit for %lu blocks of %lu pages\n", info.total_pages, info.alloc_pages, info.free_pages, count, npages);
+        return -1;
+    }
+
+    if (mm->kbase == NULL) {
+        for (i = 0; i < count; ++i) {
+            DmaMem_lookup_block(DmaMem_region_of(mm, ptrs[i]), ptrs[i])->kaddr = DmaMem_map(mm, ptrs[i], size);
+        }
+    }
+    return 0;
+}
+
+/* alloc_bulk, a record per block in the trace */
+int DmaMem_alloc_bulk(DmaMem_t* mm, unsigned long size, unsigned long count, unsigned long* ptrs) {
+    u64 start;
+    int ret;
+
+    if ((mm == NULL) || (ptrs == NULL) || (mm->trace_slots == NULL)) {
+        return alloc_bulk(mm, size, count, ptrs);
+    }
+    start = ktime_get_ns();
+    ret   = alloc_bulk(mm, size, count, ptrs);
+    trace_bulk(mm, trace_claim_bulk(mm, count), DMA_MEM_TRACE_ALLOC, start, size, (ret == 0) ? ptrs : NULL, count);
+    return ret;
+}
+
+static int do_free_block(DmaMem_t* mm, DmaMemClient_t* client, unsigned long ptr) {
+    DmaMem_t*   region;
+    avl_node_t* node;
+    void*       kaddr = NULL;
+    long free_page_size = -1;
+    int  parked = 0;
+
+    region = DmaMem_region_of(mm, ptr);
+    if (region == NULL) {
+        DmaMem_log(mm, "vmem_free: 0x%08lx not found\n", ptr);
+        return -1;
+    }
+
+    node = slab_page_of(mm, ptr);
+    if (node) {
+        return DmaSlab_free(mm, node, ptr);
+    }
+
+    /* the block is claimed under the lock, so a racing free of ptr finds nothing to unmap or park */
+    spin_lock(&(region->node_Lock));
+    node = DmaMem_lookup_block(region, ptr);
+    if ((node != NULL) && node->parked) {
+        spin_unlock(&(region->node_Lock));
+        DmaMem_log(mm, "vmem_free: 0x%08lx already freed\n", ptr);
+        return -1;
+    }
+    if ((node != NULL) && DmaMem_page_used(region, node->pageno)) {
+        kaddr       = node->kaddr;
+        node->kaddr = NULL;
+        parked      = (mm->mags != NULL) && (mag_class(mm, node->npages) >= 0);
+        if (parked) {
+            WRITE_ONCE(node->parked, 1);
+            free_page_size = node->npages;
+        }
+    }
+    if (!parked) {
+        free_page_size = free_blocks(region, ptr);
+    }
+    spin_unlock(&(region->node_Lock));
+    if (kaddr) {
+        DmaMem_unmap(mm, kaddr);
+    }
+    if (free_page_size < 0) {
+        return -1;
+    }
+
+    /* once parked the block may be handed out again */
+    if (parked) {
+        mag_push(mm, region, node);
+        uncharge(mm, client, free_page_size);
+        wake_waiters(mm, region, free_page_size);
+        return 0;
+    }
+    uncharge(mm, client, free_page_size);
+    wake_waiters(mm, region, free_page_size);
+    zero_kick(mm);
+    //DmaMem_log(mm, "FREE: total(%d) alloc(%d) free(%d)\n", mm->num_pages, mm->alloc_page_count, mm->free_page_count);
+    return 0;
+}
+
+/* do_free_block, counted, timed with config.stats and recorded with config.trace and trace */
+static int free_block(DmaMem_t* mm, DmaMemClient_t* client, unsigned long ptr, int trace) {
+    DmaMemTrace_t rec;
+    u64  start, ns;
+    long n = 0;
+    int  ret;
+
+    trace = trace && (mm->trace_slots != NULL);
+    start = (mm->config.stats || trace) ? ktime_get_ns() : 0;
+    if (trace) {
+        n = trace_claim(mm, 1);
+    }
+    ret   = do_free_block(mm, client, ptr);
+    ns    = (mm->config.stats || trace) ? ktime_get_ns() - start : 0;
+
+    if (ret == 0) {
+        atomic_long_inc(&cpu_stats(mm)->frees);
+    }
+    if (mm->config.stats) {
+        atomic_long_inc(&cpu_stats(mm)->free_ns[lat_bucket(ns)]);
+    }
+    if (trace) {
+        rec = (DmaMemTrace_t){ .ts = start, .size = 0, .align = 0, .ptr = (ret == 0) ? ptr : (unsigned long)-1, .old = 0,
+                               .latency = trace_ns(ns), .flags = 0, .op = DMA_MEM_TRACE_FREE };
+        trace_commit(mm, n, &rec);
+    }
+    return ret;
+}
+
+int DmaMem_free(DmaMem_t* mm, unsigned long ptr) {
+    if (mm == NULL) {
+	    DmaMem_log(mm, "vmem_free: invalid handle\n");
+        return -1;
+    }
+    return free_block(mm, NULL, ptr, 1);
+}
+
+int DmaMem_free_nested(DmaMem_t* mm, unsigned long ptr) {
+    return free_block(mm, NULL, ptr, 0);
+}
+
+/* registers npages as wanted, then tries; evaluated as the wait condition */
+static int alloc_wait_try(DmaMem_t* mm, unsigned long size, unsigned long npages, unsigned long* ptr) {
+    long want = atomic_long_read(&mm->wait_pages);
+
+    while ((long)npages < want) {
+        want = atomic_long_cmpxchg(&mm->wait_pages, want, npages);
+    }
+    *ptr = alloc_aligned(mm, size, 0, DMA_MEM_NESTED, NULL, 0);
+    return *ptr != (unsigned long)-1;
+}
+
+static unsigned long alloc_wait(DmaMem_t* mm, unsigned long size, long timeout) {
+    unsigned long ptr, npages;
+    long left;
+
+    ptr = alloc_aligned(mm, size, 0, DMA_MEM_NESTED, NULL, timeout == 0);
+    if ((ptr != (unsigned long)-1) || (timeout == 0) || (size == 0) || (size > mm->mem_size)) {
+        return ptr;
+    }
+
+    /* a slab object waits for a fresh page like the smallest block */
+    npages = (size + mm->page_size - 1) / mm->page_size;
+    if (mm->config.engine == DMA_MEM_ENGINE_BUDDY) {
+        npages = DmaBuddy_round_pages(npages);
+    }
+    /* the tries above leave a busy deferred ring alone, this one may sleep for it */
+    drain_deferred(mm, 1);
+    left = wait_event_interruptible_timeout(mm->free_wait, alloc_wait_try(mm, size, npages, &ptr), timeout);
+    if (left <= 0) {
+        DmaMem_log(mm, "vmem_alloc_wait: no fit for %lu pages within %ld jiffies\n", npages, timeout);
+        return (unsigned long)-1;
+    }
+    return ptr;
+}
+
+/* alloc_wait, one record in the trace however many attempts it took */
+unsigned long DmaMem_alloc_wait(DmaMem_t* mm, unsigned long size, long timeout) {
+    DmaMemTrace_t rec;
+    unsigned long ptr;
+    u64 start;
+
+    if ((mm == NULL) || (mm->trace_slots == NULL)) {
+        return alloc_wait(mm, size, timeout);
+    }
+    start = ktime_get_ns();
+    ptr   = alloc_wait(mm, size, timeout);
+    rec   = (DmaMemTrace_t){ .ts = start, .size = size, .align = 0, .ptr = ptr, .old = 0,
+                             .latency = trace_ns(ktime_get_ns() - start), .flags = 0, .op = DMA_MEM_TRACE_ALLOC };
+    trace_put(mm, &rec);
+    return ptr;
+}
+
+int DmaMem_reserve(DmaMem_t* mm, DmaMemClient_t* client, unsigned long bytes) {
+    if ((mm == NULL) || (client == NULL) || !mm->config.accounting) {
+        DmaMem_log(mm, "vmem_reserve: invalid handle\n");
+        return -1;
+    }
+
+    client->pages = 0;
+    atomic_long_set(&client->used, 0);
+    if (charge(mm, NULL, (bytes + mm->page_size - 1) / mm->page_size) != 0) {
+        DmaMem_log(mm, "vmem_reserve: %lu bytes exceed the unreserved free pages\n", bytes);
+        return -1;
+    }
+    client->pages = (bytes + mm->page_size - 1) / mm->page_size;
+    return 0;
+}
+
+int DmaMem_unreserve(DmaMem_t* mm, DmaMemClient_t* client) {
+    long used;
+
+    if ((mm == NULL) || (client == NULL) || !mm->config.accounting) {
+        DmaMem_log(mm, "vmem_unreserve: invalid handle\n");
+        return -1;
+    }
+
+    /* the live blocks past the reservation were charged to avail already */
+    used = atomic_long_read(&client->used);
+    uncharge(mm, NULL, (long)client->pages - MIN(used, (long)client->pages));
+    client->pages = 0;
+    return 0;
+}
+
+unsigned long DmaMem_alloc_reserved(DmaMem_t* mm, DmaMemClient_t* client, unsigned long size, unsigned long align, unsigned int flags) {
+    if ((mm == NULL) || (client == NULL) || !mm->config.accounting) {
+        DmaMem_log(mm, "vmem_alloc_reserved: invalid handle\n");
+        return (unsigned long)-1;
+    }
+    return alloc_aligned(mm, size, align, flags, client, 1);
+}
+
+int DmaMem_free_reserved(DmaMem_t* mm, DmaMemClient_t* client, unsigned long ptr) {
+    if ((mm == NULL) || (client == NULL) || !mm->config.accounting) {
+        DmaMem_log(mm, "vmem_free_reserved: invalid handle\n");
+        return -1;
+    }
+    return free_block(mm, client, ptr, 1);
+}
+
+int DmaMem_set_watermarks(DmaMem_t* mm, unsigned long low_pages, unsigned long high_pages, DmaMemWatermark_t notify, void* ctx) {
+    if ((mm == NULL) || !mm->config.accounting || (low_pages > high_pages)) {
+        DmaMem_log(mm, "vmem_set_watermarks: invalid handle\n");
+        return -1;
+    }
+
+    mm->wm_low    = low_pages;
+    mm->wm_high   = high_pages;
+    mm->wm_ctx    = ctx;
+    mm->wm_notify = notify;
+    atomic_long_set(&mm->wm_below, 0);
+    watermark_check(mm, atomic_long_read(&mm->avail));
+    return 0;
+}
+
+/* copies the first bytes of the block or object at src to the new one at dst; -1 when either side is unmapped */
+static int resize_copy(DmaMem_t* mm, unsigned long dst, unsigned long src, avl_node_t* slab_page, unsigned long bytes) {
+    void* to = DmaMem_get_kaddr(mm, dst);
+    void* from;
+
+    if (slab_page) {
+        from = DmaSlab_kaddr(mm, slab_page, src);
+    } else if (mm->kbase) {
+        from = mm->kbase + (src - mm->base_addr);
+    } else {
+        /* the block's own mapping only covers the size it was allocated with */
+        from = DmaMem_map(mm, src, bytes);
+    }
+    if (to && from) {
+        memcpy(to, from, bytes);
+    }
+    if (!slab_page && !mm->kbase && from) {
+        DmaMem_unmap(mm, from);
+    }
+    return (to && from) ? 0 : -1;
+}
+
+/* with record, claims the trace record before a move frees ptr, leaving it -1 otherwise */
+static unsigned long resize(DmaMem_t* mm, unsigned long ptr, unsigned long new_size, long* record) {
+    DmaMem_t*     region;
+    avl_node_t*   node;
+    unsigned long npages, old_bytes, new_ptr;
+    void*         kaddr;
+    int ret;
+
+    if (mm == NULL) {
+        DmaMem_log(mm, "vmem_resize: invalid handle\n");
+        return (unsigned long)-1;
+    }
+    if ((new_size == 0) || (new_size > mm->mem_size)) {
+        DmaMem_log(mm, "%lu size of vmem_resize, failed\n", new_size);
+        return (unsigned long)-1;
+    }
+    region = DmaMem_region_of(mm, ptr);
+    if (region == NULL) {
+        DmaMem_log(mm, "vmem_resize: 0x%08lx not found\n", ptr);
+        return (unsigned long)-1;
+    }
+
+    /* an object stays while it still fits its slot, like krealloc */
+    node = slab_page_of(mm, ptr);
+    if (node) {
+        old_bytes = DmaSlab_size(mm, node);
+        if (new_size <= old_bytes) {
+            atomic_long_inc(&mm->resize_in_place);
+            return ptr;
+        }
+    } else {
+        npages = (new_size + mm->page_size - 1) / mm->page_size;
+        if (mm->config.engine == DMA_MEM_ENGINE_BUDDY) {
+            npages = DmaBuddy_round_pages(npages);
+        }
+        /* a slab-sized request still keeps its pages, moving it would only save memory */
+        ret = region_resize(region, ptr, npages, &old_bytes);
+        if (ret < 0) {
+            return (unsigned long)-1;
+        }
+        if ((ret == 0) && (npages > old_bytes) && (charge(mm, NULL, npages - old_bytes) != 0)) {
+            /* the pages it grew into are reserved for someone else */
+            region_resize(region, ptr, old_bytes, &old_bytes);
+            return (unsigned long)-1;
+        }
+        if (ret == 0) {
+            /* the new mapping replaces the old one only once it exists */
+            node  = DmaMem_lookup_block(region, ptr);
+            kaddr = node->kaddr ? DmaMem_map(mm, ptr, new_size) : NULL;
+            if (node->kaddr && kaddr) {
+                DmaMem_unmap(mm, node->kaddr);
+                node->kaddr = kaddr;
+            } else if (node->kaddr && (npages > old_bytes)) {
+                /* a shrunk block keeps its old mapping, a grown one goes back to its old size */
+                DmaMem_log(mm, "vmem_resize: 0x%08lx could not be mapped at its new size\n", ptr);
+                region_resize(region, ptr, old_bytes, &npages);
+                uncharge(mm, NULL, npages - old_bytes);
+                return (unsigned long)-1;
+            }
+            if (npages < old_bytes) {
+                uncharge(mm, NULL, old_bytes - npages);
+                wake_waiters(mm, region, old_bytes - npages);
+                zero_kick(mm);
+            }
+            atomic_long_inc(&mm->resize_in_place);
+            return ptr;
+        }
+        old_bytes *= mm->page_size;
+        node = NULL;
+    }
+
+    new_ptr = alloc_aligned(mm, new_size, 0, DMA_MEM_NESTED, NULL, 1);
+    if (new_ptr == (unsigned long)-1) {
+        return (unsigned long)-1;
+    }
+    if (resize_copy(mm, new_ptr, ptr, node, MIN(old_bytes, new_size)) != 0) {
+        DmaMem_log(mm, "vmem_resize: 0x%08lx could not be mapped for the move\n", ptr);
+        free_block(mm, NULL, new_ptr, 0);
+        return (unsigned long)-1;
+    }
+    if (record) {
+        *record = trace_claim(mm, 1);
+    }
+    free_block(mm, NULL, ptr, 0);
+    atomic_long_inc(&mm->resize_moved);
+    return new_ptr;
+}
+
+/* resize, one record in the trace rather than the allocation and free of a move */
+unsigned long DmaMem_resize(DmaMem_t* mm, unsigned long ptr, unsigned long new_size) {
+    DmaMemTrace_t rec;
+    unsigned long new_ptr;
+    long record = -1;
+    u64  start;
+
+    if ((mm == NULL) || (mm->trace_slots == NULL)) {
+        return resize(mm, ptr, new_size, NULL);
+    }
+    start   = ktime_get_ns();
+    new_ptr = resize(mm, ptr, new_size, &record);
+    rec     = (DmaMemTrace_t){ .ts = start, .size = new_size, .align = 0, .ptr = new_ptr, .old = ptr,
+                               .latency = trace_ns(ktime_get_ns() - start), .flags = 0, .op = DMA_MEM_TRACE_RESIZE };
+    trace_commit(mm, (record >= 0) ? record : trace_claim(mm, 1), &rec);
+    return new_ptr;
+}
+
+/* the lowest free block of at least npages, or NULL */
+static avl_node_t* lowest_fit(DmaMem_t* mm, unsigned long npages) {
+    u32 path[DMA_TREE_MAX_DEPTH];
+    int depth;
+
+    if (mm->engine != DMA_MEM_ENGINE_TREE) {
+        return DmaMem_walk_fit(mm, npages, 1, 0);
+    }
+    depth = first_fit(mm, npages, path);
+    return depth ? NODE(mm, path[depth - 1]) : NULL;
+}
+
+/* unmaps and frees a block straight into its region, past the magazines */
+static void release_block(DmaMem_t* region, unsigned long ptr) {
+    avl_node_t* node = DmaMem_lookup_block(region, ptr);
+
+    if (node->kaddr) {
+        DmaMem_unmap(region, node->kaddr);
+        node->kaddr = NULL;
+    }
+    region_free(region, ptr);
+}
+
+unsigned long DmaMem_migrate(DmaMem_t* mm, unsigned long ptr, unsigned long size, DmaMemCopy_t copy, void* ctx) {
+    DmaMem_t*     region = DmaMem_region_of(mm, ptr);
+    avl_node_t*   node;
+    avl_node_t*   lowest;
+    DmaMemTrace_t rec;
+    unsigned long new_ptr, old_pageno;
+    u64  start = mm->trace_slots ? ktime_get_ns() : 0;
+    long pageno = -1, record;
+    int  ret = 0;
+
+    if ((region == NULL) || slab_page_of(mm, ptr)) {
+        return (unsigned long)-1;
+    }
+    spin_lock(&(region->node_Lock));
+    node = DmaMem_lookup_block(region, ptr);
+    if ((node != NULL) && node->used && !node->parked) {
+        old_pageno = node->pageno;
+        lowest = lowest_fit(region, node->npages);
+        if ((lowest != NULL) && (lowest->pageno < old_pageno)) {
+            pageno = alloc_blocks(region, node->npages, 1, DMA_MEM_FIRST_FIT);
+        }
+        /* buddy places by order, which may land above the hole that fit */
+        if ((pageno >= 0) && ((unsigned long)pageno > old_pageno)) {
+            free_blocks(region, region->base_addr + (unsigned long)pageno * region->page_size);
+            pageno = -1;
+        }
+    }
+    spin_unlock(&(region->node_Lock));
+    if (pageno < 0) {
+        return (unsigned long)-1;
+    }
+
+    new_ptr = region->base_addr + (unsigned long)pageno * region->page_size;
+    if (mm->kbase == NULL) {
+        DmaMem_lookup_block(region, new_ptr)->kaddr = DmaMem_map(mm, new_ptr, size);
+    }
+    if (copy) {
+        ret = copy(ctx, new_ptr, ptr, size);
+    } else {
+        ret = resize_copy(mm, new_ptr, ptr, NULL, size);
+    }
+    if (ret != 0) {
+        release_block(region, new_ptr);
+        return (unsigned long)-1;
+    }
+    record = mm->trace_slots ? trace_claim(mm, 1) : 0;
+    release_block(region, ptr);
+    if (mm->trace_slots) {
+        rec = (DmaMemTrace_t){ .ts = start, .size = size, .align = 0, .ptr = new_ptr, .old = ptr,
+                               .latency = trace_ns(ktime_get_ns() - start), .flags = 0, .op = DMA_MEM_TRACE_MOVE };
+        trace_commit(mm, record, &rec);
+    }
+    return new_ptr;
+}
+
+void* DmaMem_get_kaddr(DmaMem_t* mm, unsigned long ptr) {
+    DmaMem_t*   region;
+    avl_node_t* node;
+
+    if (mm == NULL) {
+        DmaMem_log(mm, "vmem_get_kaddr: invalid handle\n");
+        return NULL;
+    }
+
+    if (mm->kbase) {
+        if ((ptr < mm->base_addr) || (ptr - mm->base_addr >= mm->mem_size)) {
+            DmaMem_log(mm, "vmem_get_kaddr: 0x%08lx outside the pool\n", ptr);
+            return NULL;
+        }
+        return mm->kbase + (ptr - mm->base_addr);
+    }
+
+    node = slab_page_of(mm, ptr);
+    if (node) {
+        return DmaSlab_kaddr(mm, node, ptr);
+    }
+
+    region = DmaMem_region_of(mm, ptr);
+    node   = DmaMem_lookup_block(region, ptr);
+    if ((node == NULL) || !DmaMem_page_used(region, node->pageno) || READ_ONCE(node->parked)) {
+        DmaMem_log(mm, "vmem_get_kaddr: 0x%08lx not found\n", ptr);
+        return NULL;
+    }
+    return node->kaddr;
+}
+
+int DmaMem_get_info(DmaMem_t* mm, DmaMemInfo_t* info) {
+    unsigned long parked = 0, largest, pb;
+    unsigned int cpu;
+    int i, p;
+    if ((mm == NULL) || (info == NULL)) {
+		//DmaMem_log(mm, "vmem_get_info: invalid handle\n");
         return -1;
     }
 
     info->total_pages = mm->num_pages;
-    info->alloc_pages = mm->alloc_page_count;
-    info->free_pages  = mm->free_page_count;
+    info->alloc_pages = 0;
+    info->free_pages  = 0;
     info->page_size   = mm->page_size;
-    printk("FREE: total(%d) alloc(%d) free(%d), page_size: %d =====================\n", mm->num_pages, mm->alloc_page_count, mm->free_page_count, info->page_size);
+    info->meta_bytes  = 0;
+    info->largest_free = 0;
+    info->total_pageblocks = 0;
+    info->free_pageblocks  = 0;
+    info->dirty_pages      = 0;
+    for (i = 0; i < (mm->shards ? mm->num_shards : 1); ++i) {
+        DmaMem_t* region = mm->shards ? &mm->shards[i] : mm;
+        spin_lock(&(region->node_Lock));
+        if (region->pb_used) {
+            info->total_pageblocks += region->nr_pageblocks;
+            for (pb = 0; pb < region->nr_pageblocks; ++pb) {
+                if (region->pb_used[pb] == 0) {
+                    info->free_pageblocks++;
+                }
+            }
+            info->meta_bytes += region->nr_pageblocks * sizeof(u32);
+        }
+        largest = largest_free(region);
+        if (largest > info->largest_free) {
+            info->largest_free = largest;
+        }
+        info->alloc_pages += region->alloc_page_count;
+        info->free_pages  += region->free_page_count;
+        info->dirty_pages += region->dirty ? region->dirty_pages : region->free_page_count;
+        if (region->dirty) {
+            info->meta_bytes += BITS_TO_LONGS(region->num_pages) * sizeof(unsigned long);
+        }
+        info->meta_bytes  += region->num_pages * sizeof(u32) + region->node_chunk_max * sizeof(avl_node_t*) +
+                             region->node_chunk_count * DMA_MEM_NODE_CHUNK * sizeof(avl_node_t);
+        spin_unlock(&(region->node_Lock));
+    }
+
+    /* blocks parked in magazines are free from the caller's point of view */
+    for (cpu = 0; cpu < mm->nr_mags; ++cpu) {
+        spin_lock(&(mm->mags[cpu].lock));
+        parked += mm->mags[cpu].parked_pages;
+        spin_unlock(&(mm->mags[cpu].lock));
+    }
+    info->alloc_pages -= parked;
+    info->free_pages  += parked;
+    info->dirty_pages += parked;
+    info->clean_pages  = info->free_pages - info->dirty_pages;
+    memset(info->policy, 0, sizeof(info->policy));
+    for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+        for (p = 0; p < DMA_MEM_POLICIES; ++p) {
+            const DmaMemPolicyCount_t* count = &mm->stats[cpu].policy[p];
+            info->policy[p].allocs      += atomic_long_read(&count->allocs);
+            info->policy[p].pages       += atomic_long_read(&count->pages);
+            info->policy[p].failed      += atomic_long_read(&count->failed);
+            info->policy[p].frag_failed += atomic_long_read(&count->frag_failed);
+        }
+    }
+    info->resize_in_place = atomic_long_read(&mm->resize_in_place);
+    info->resize_moved    = atomic_long_read(&mm->resize_moved);
+    info->deferred_pending = atomic_long_read(&mm->defer_tail) - atomic_long_read(&mm->defer_head);
+    info->reserved_pages   = 0;
+    if (mm->config.accounting && (info->free_pages > (unsigned long)atomic_long_read(&mm->avail))) {
+        info->reserved_pages = info->free_pages - atomic_long_read(&mm->avail);
+    }
+    return 0;
+}
+
+int DmaMem_get_stats(DmaMem_t* mm, DmaMemStats_t* stats) {
+    const DmaMemCpuStats_t* cpu_count;
+    avl_node_t*   node;
+    unsigned long pageno, allocated = 0;
+    unsigned int  cpu;
+    int i, p;
+    if ((mm == NULL) || (stats == NULL)) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < (mm->shards ? mm->num_shards : 1); ++i) {
+        DmaMem_t* region = mm->shards ? &mm->shards[i] : mm;
+        spin_lock(&(region->node_Lock));
+        for (pageno = 0; pageno < region->num_pages; pageno += node->npages) {
+            node = DmaMem_block_at(region, pageno);
+            if (node == NULL) {
+                break;
+            }
+            if (!node->used) {
+                stats->free_pages += node->npages;
+                stats->free_blocks++;
+                stats->free_hist[MIN(__fls(node->npages), DMA_MEM_HIST_BUCKETS - 1)]++;
+                stats->largest_free = MAX(stats->largest_free, (unsigned long)node->npages);
+            }
+        }
+        stats->tree_height = MAX(stats->tree_height, (unsigned int)NODE(region, region->block_tree)->height);
+        stats->tree_peak   = MAX(stats->tree_peak, region->tree_peak);
+        spin_unlock(&(region->node_Lock));
+    }
+    if (stats->free_pages) {
+        stats->frag_index = 1000 - (unsigned int)(stats->largest_free * 1000 / stats->free_pages);
+    }
+
+    for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+        cpu_count = &mm->stats[cpu];
+        for (p = 0; p < DMA_MEM_POLICIES; ++p) {
+            allocated           += atomic_long_read(&cpu_count->policy[p].allocs);
+            stats->failed       += atomic_long_read(&cpu_count->policy[p].failed);
+            stats->frag_failed  += atomic_long_read(&cpu_count->policy[p].frag_failed);
+        }
+        stats->frees += atomic_long_read(&cpu_count->frees);
+        for (i = 0; i < DMA_MEM_LAT_BUCKETS; ++i) {
+            stats->alloc_ns[i] += atomic_long_read(&cpu_count->alloc_ns[i]);
+            stats->free_ns[i]  += atomic_long_read(&cpu_count->free_ns[i]);
+        }
+    }
+    stats->allocs = allocated;
+    return 0;
+}
+
+/*
+ * The checks behind DmaMem_validate. Each logs every inconsistency it
+ * finds and returns how many, so one pass reports all of them.
+ */
+
+/*
+ * In-order walk of block_tree, which must list every block once in address
+ * order, *pageno tracking the next one. Returns the subtree's height, -1
+ * when a link leaves the pool or the tree is too deep to be a tree.
+ */
+static int tree_check(DmaMem_t* mm, u32 idx, int depth, unsigned long* pageno, unsigned long* count, int* bad) {
+    const avl_node_t* node;
+    u32 maxfree;
+    int lh, rh;
+
+    if (idx == DMA_TREE_NIL) {
+        return 0;
+    }
+    if ((idx >= mm->node_next) || (depth >= DMA_TREE_MAX_DEPTH) || (++*count > mm->node_next)) {
+        DmaMem_log(mm, "vmem_validate: tree link %u at depth %d leaves the pool\n", idx, depth);
+        ++*bad;
+        return -1;
+    }
+    node = NODE(mm, idx);
+    lh = tree_check(mm, node->left, depth + 1, pageno, count, bad);
+    if (lh < 0) {
+        return -1;
+    }
+    if (node->pageno != *pageno) {
+        DmaMem_log(mm, "vmem_validate: tree node %u holds page %u, expected %lu\n", idx, node->pageno, *pageno);
+        ++*bad;
+    }
+    *pageno = node->pageno + node->npages;
+    rh = tree_check(mm, node->right, depth + 1, pageno, count, bad);
+    if (rh < 0) {
+        return -1;
+    }
+
+    maxfree = MAX(own_free(node), MAX(NODE(mm, node->left)->maxfree, NODE(mm, node->right)->maxfree));
+    if ((node->height != MAX(lh, rh) + 1) || (lh > rh + 1) || (rh > lh + 1)) {
+        DmaMem_log(mm, "vmem_validate: tree node %u has height %u over subtrees of %d and %d\n", idx, node->height, lh, rh);
+        ++*bad;
+    }
+    if (node->maxfree != maxfree) {
+        DmaMem_log(mm, "vmem_validate: tree node %u has maxfree %u, expected %u\n", idx, node->maxfree, maxfree);
+        ++*bad;
+    }
+    return MAX(lh, rh) + 1;
+}
+
+/* recounts the allocated pages of every pageblock from the blocks, which region_check has vetted */
+static int pb_check(DmaMem_t* mm) {
+    unsigned long pb_pages = 1UL << mm->pb_shift, first_pfn = mm->base_addr / mm->page_size;
+    unsigned long pageno = 0, pb = 0, end, next, count;
+    avl_node_t*   node;
+    int bad = 0;
+
+    count = first_pfn & (pb_pages - 1);
+    while (pageno < mm->num_pages) {
+        node = DmaMem_block_at(mm, pageno);
+        end  = pageno + node->npages;
+        for (; pageno < end; pageno = next) {
+            next = MIN(end, pageno + pb_pages - ((first_pfn + pageno) & (pb_pages - 1)));
+            if (DmaMem_pb_of(mm, pageno) != pb) {
+                if (mm->pb_used[pb] != count) {
+                    DmaMem_log(mm, "vmem_validate: pageblock %lu counts %u allocated pages, expected %lu\n", pb, mm->pb_used[pb], count);
+                    bad++;
+                }
+                pb    = DmaMem_pb_of(mm, pageno);
+                count = 0;
+            }
+            if (node->used) {
+                count += next - pageno;
+            }
+        }
+    }
+    count += (pb_pages - 1) - ((first_pfn + mm->num_pages - 1) & (pb_pages - 1));
+    if (mm->pb_used[pb] != count) {
+        DmaMem_log(mm, "vmem_validate: pageblock %lu counts %u allocated pages, expected %lu\n", pb, mm->pb_used[pb], count);
+        bad++;
+    }
+    return bad;
+}
+
+/* one region, under its lock */
+static int region_check(DmaMem_t* mm) {
+    unsigned long pageno, end, blocks = 0, free_blocks = 0, free_pages = 0, used_pages = 0, dirty = 0, count = 0;
+    avl_node_t*   node;
+    int bad = 0;
+
+    /* the tags must tile the region with blocks whose head and tail agree */
+    for (pageno = 0; pageno < mm->num_pages; pageno = end) {
+        node = DmaMem_block_at(mm, pageno);
+        if ((node == NULL) || (node->npages == 0) || (pageno + node->npages > mm->num_pages)) {
+            DmaMem_log(mm, "vmem_validate: no block starts at page %lu, tag 0x%08x\n", pageno, mm->tags[pageno]);
+            return bad + 1;
+        }
+        end = pageno + node->npages;
+        if (DmaMem_page_used(mm, pageno) != node->used) {
+            DmaMem_log(mm, "vmem_validate: head tag 0x%08x of page %lu disagrees with its node\n", mm->tags[pageno], pageno);
+            bad++;
+        }
+        if ((node->npages > 1) && (mm->tags[end - 1] != ((node->used ? DMA_TAG_USED : 0) | (u32)pageno))) {
+            DmaMem_log(mm, "vmem_validate: tail tag 0x%08x of the block at page %lu+%u\n", mm->tags[end - 1], pageno, node->npages);
+            bad++;
+        }
+        if (!node->used && (READ_ONCE(node->parked) || READ_ONCE(node->is_slab))) {
+            DmaMem_log(mm, "vmem_validate: free block at page %lu is parked or a slab page\n", pageno);
+            bad++;
+        }
+        blocks++;
+        if (node->used) {
+            used_pages += node->npages;
+            continue;
+        }
+        /* the buddy engine only merges buddies, the others every free neighbour */
+        if ((pageno > 0) && !DmaMem_page_used(mm, pageno - 1) && (mm->engine != DMA_MEM_ENGINE_BUDDY)) {
+            DmaMem_log(mm, "vmem_validate: free block at page %lu follows another\n", pageno);
+            bad++;
+        }
+        free_blocks++;
+        free_pages += node->npages;
+        if (mm->dirty) {
+            dirty += dirty_bits(mm, pageno, node->npages, 0);
+        }
+    }
+
+    if ((free_pages != mm->free_page_count) || (used_pages != mm->alloc_page_count)) {
+        DmaMem_log(mm, "vmem_validate: %lu free and %lu allocated pages, counted as %lu and %lu\n",
+                   free_pages, used_pages, mm->free_page_count, mm->alloc_page_count);
+        bad++;
+    }
+    if (blocks != mm->node_next - 1 - mm->node_free_count) {
+        DmaMem_log(mm, "vmem_validate: %lu blocks hold %u nodes\n", blocks, mm->node_next - 1 - mm->node_free_count);
+        bad++;
+    }
+    list_for_each_entry(node, &(mm->node_Free), ListEntry) {
+        if (++count > mm->node_free_count) {
+            break;
+        }
+        if ((node->index == DMA_TREE_NIL) || (node->index >= mm->node_next) || (node->pageno != DMA_MEM_NO_PAGE)) {
+            DmaMem_log(mm, "vmem_validate: node %u on the free list holds page %u\n", node->index, node->pageno);
+            bad++;
+        }
+    }
+    if (count != mm->node_free_count) {
+        DmaMem_log(mm, "vmem_validate: %s than %u nodes on the free list\n", (count > mm->node_free_count) ? "more" : "fewer", mm->node_free_count);
+        bad++;
+    }
+    if (mm->dirty && (dirty != mm->dirty_pages)) {
+        DmaMem_log(mm, "vmem_validate: %lu dirty free pages, counted as %lu\n", dirty, mm->dirty_pages);
+        bad++;
+    }
+    if (mm->pb_used) {
+        bad += pb_check(mm);
+    }
+
+    switch (mm->engine) {
+    case DMA_MEM_ENGINE_TLSF:
+        bad += DmaTlsf_validate(mm, free_blocks, free_pages);
+        break;
+    case DMA_MEM_ENGINE_BUDDY:
+        bad += DmaBuddy_validate(mm, free_blocks, free_pages);
+        break;
+    default:
+        pageno = 0;
+        count  = 0;
+        if ((tree_check(mm, mm->block_tree, 0, &pageno, &count, &bad) >= 0) && ((pageno != mm->num_pages) || (count != blocks))) {
+            DmaMem_log(mm, "vmem_validate: the tree holds %lu blocks up to page %lu, not %lu up to %lu\n", count, pageno, blocks, mm->num_pages);
+            bad++;
+        }
+        break;
+    }
+    return bad;
+}
+
+/* every parked block must be allocated, marked parked and of its class's size */
+static int mag_check(DmaMem_t* mm) {
+    DmaMem_t*     region;
+    DmaMag_t*     mag;
+    avl_node_t*   node;
+    unsigned long parked, ptr;
+    unsigned int  cpu;
+    int cls, i, bad = 0;
+
+    for (cpu = 0; cpu < mm->nr_mags; ++cpu) {
+        mag    = &mm->mags[cpu];
+        parked = 0;
+        spin_lock(&mag->lock);
+        for (cls = 0; cls < DMA_MEM_MAG_CLASSES; ++cls) {
+            for (i = 0; i < mag->count[cls]; ++i) {
+                ptr    = mag_slots(mm, mag, cls)[i];
+                region = DmaMem_region_of(mm, ptr);
+                if (region == NULL) {
+                    node = NULL;
+                } else {
+                    spin_lock(&(region->node_Lock));
+                    node = DmaMem_lookup_block(region, ptr);
+                    if (node && (!node->used || !READ_ONCE(node->parked) || (node->npages != (u32)mm->config.mag_pages[cls]))) {
+                        node = NULL;
+                    }
+                    spin_unlock(&(region->node_Lock));
+                }
+                if (node == NULL) {
+                    DmaMem_log(mm, "vmem_validate: magazine %u holds 0x%08lx, which is not a parked block of %d pages\n",
+                               cpu, ptr, mm->config.mag_pages[cls]);
+                    bad++;
+                }
+                parked += mm->config.mag_pages[cls];
+            }
+        }
+        if (parked != mag->parked_pages) {
+            DmaMem_log(mm, "vmem_validate: magazine %u parks %lu pages, counted as %lu\n", cpu, parked, mag->parked_pages);
+            bad++;
+        }
+        spin_unlock(&mag->lock);
+    }
+    return bad;
+}
+
+int DmaMem_validate(DmaMem_t* mm) {
+    DmaMem_t* region;
+    int i, bad = 0;
+
+    if ((mm == NULL) || (mm->num_pages == 0)) {
+        DmaMem_log(mm, "vmem_validate: invalid handle\n");
+        return -1;
+    }
+
+    for (i = 0; i < (mm->shards ? mm->num_shards : 1); ++i) {
+        region = mm->shards ? &mm->shards[i] : mm;
+        spin_lock(&(region->node_Lock));
+        bad += region_check(region);
+        spin_unlock(&(region->node_Lock));
+    }
+    if (mm->mags) {
+        bad += mag_check(mm);
+    }
+    return bad ? -1 : 0;
+}
+
+long DmaMem_trace_read(DmaMem_t* mm, unsigned long* pos, DmaMemTrace_t* records, unsigned long max) {
+    DmaMemTraceSlot_t* slot;
+    unsigned long head, n = 0;
+    long seq;
+
+    if ((mm == NULL) || (mm->trace_slots == NULL) || (pos == NULL) || ((records == NULL) && (max > 0))) {
+        DmaMem_log(mm, "vmem_trace_read: invalid handle\n");
+        return -1;
+    }
+
+    head = atomic_long_read(&mm->trace_head);
+    if (head - *pos > mm->trace_mask + 1) {
+        *pos = head - (mm->trace_mask + 1);
+    }
+    for (; (n < max) && (*pos < head); ++*pos) {
+        slot = &mm->trace_slots[*pos & mm->trace_mask];
+        seq  = atomic_long_read_acquire(&slot->seq);
+        if (seq < 2 * (long)*pos + 2) {
+            /* claimed, not complete yet */
+            break;
+        }
+        if (seq == 2 * (long)*pos + 2) {
+            records[n] = slot->rec;
+            smp_rmb();
+            n += (atomic_long_read(&slot->seq) == seq);
+        }
+    }
+    return n;
+}
+
+static void seq_buckets(struct seq_file* m, const char* name, const unsigned long* buckets, int n) {
+    int i;
+
+    seq_printf(m, "%-13s", name);
+    for (i = 0; i < n; ++i) {
+        seq_printf(m, " %lu", buckets[i]);
+    }
+    seq_putc(m, '\n');
+}
+
+/* the counters, then one line per free block: address and pages */
+static int stats_show(struct seq_file* m, void* v) {
+    DmaMem_t*     mm = (DmaMem_t*)m->private;
+    DmaMemStats_t stats;
+    avl_node_t*   node;
+    unsigned long pageno;
+    int i;
+
+    DmaMem_get_stats(mm, &stats);
+    seq_printf(m, "allocs        %lu\nfailed        %lu\nfrag_failed   %lu\nfrees         %lu\n",
+               stats.allocs, stats.failed, stats.frag_failed, stats.frees);
+    seq_printf(m, "free_pages    %lu\nfree_blocks   %lu\nlargest_free  %lu\nfrag_index    %u\n",
+               stats.free_pages, stats.free_blocks, stats.largest_free, stats.frag_index);
+    seq_printf(m, "tree_height   %u\ntree_peak     %u\n", stats.tree_height, stats.tree_peak);
+    seq_buckets(m, "free_hist", stats.free_hist, DMA_MEM_HIST_BUCKETS);
+    seq_buckets(m, "alloc_ns", stats.alloc_ns, DMA_MEM_LAT_BUCKETS);
+    seq_buckets(m, "free_ns", stats.free_ns, DMA_MEM_LAT_BUCKETS);
+
+    seq_puts(m, "free blocks:\n");
+    for (i = 0; i < (mm->shards ? mm->num_shards : 1); ++i) {
+        DmaMem_t* region = mm->shards ? &mm->shards[i] : mm;
+        spin_lock(&(region->node_Lock));
+        for (pageno = 0; pageno < region->num_pages; pageno += node->npages) {
+            node = DmaMem_block_at(region, pageno);
+            if (node == NULL) {
+                break;
+            }
+            if (!node->used) {
+                seq_printf(m, "0x%08lx %u\n", DmaMem_block_addr(region, node), node->npages);
+            }
+        }
+        spin_unlock(&(region->node_Lock));
+    }
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+#define DMA_MEM_TRACE_CHUNK     8
+
+/* the records the ring holds when the read starts, oldest first; reading leaves them in place */
+static int trace_show(struct seq_file* m, void* v) {
+    static const char ops[] = { [DMA_MEM_TRACE_ALLOC] = 'a', [DMA_MEM_TRACE_FREE] = 'f',
+                                [DMA_MEM_TRACE_RESIZE] = 'r', [DMA_MEM_TRACE_MOVE] = 'm' };
+    DmaMem_t*     mm = (DmaMem_t*)m->private;
+    DmaMemTrace_t records[DMA_MEM_TRACE_CHUNK];
+    unsigned long pos = 0, last, end = atomic_long_read(&mm->trace_head);
+    long n, i;
+
+    seq_puts(m, "# ts op size align flags ptr old latency\n");
+    /* a read may return nothing yet move pos past overwritten records, only a stall ends it early */
+    while (pos < end) {
+        last = pos;
+        n    = DmaMem_trace_read(mm, &pos, records, MIN(end - pos, DMA_MEM_TRACE_CHUNK));
+        if ((n < 0) || ((n == 0) && (pos == last))) {
+            break;
+        }
+        for (i = 0; i < n; ++i) {
+            const DmaMemTrace_t* rec = &records[i];
+            seq_printf(m, "%llu %c %llu %llu 0x%x 0x%llx 0x%llx %u\n", (unsigned long long)rec->ts, ops[rec->op & 3],
+                       (unsigned long long)rec->size, (unsigned long long)rec->align, rec->flags,
+                       (unsigned long long)rec->ptr, (unsigned long long)rec->old, rec->latency);
+        }
+    }
     return 0;
 }
 
+DEFINE_SHOW_ATTRIBUTE(trace);
 
+int DmaMem_debugfs_init(DmaMem_t* mm, const char* name, struct dentry* parent) {
+    char trace_name[64];
+
+    if ((mm == NULL) || (mm->stats == NULL)) {
+        DmaMem_log(mm, "vmem_debugfs_init: invalid handle\n");
+        return -1;
+    }
+    mm->debugfs = debugfs_create_file(name, 0444, parent, mm, &stats_fops);
+    if (mm->trace_slots) {
+        snprintf(trace_name, sizeof(trace_name), "%s_trace", name);
+        mm->debugfs_trace = debugfs_create_file(trace_name, 0444, parent, mm, &trace_fops);
+    }
+    return 0;
+}
@@ -1,73 +1,491 @@
 #ifndef __DMA_PHYSICAL_MEM_H
 #define __DMA_PHYSICAL_MEM_H
 
+#include <linux/types.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+
+/*
+ * Placement hints for DmaMem_alloc_flags, at most one per call. Keeping
+ * long-lived buffers at the top of a region and short-lived ones at the
+ * bottom stops them from interleaving, so the middle stays coalesced.
+ */
+#define DMA_MEM_SHORT_LIVED     0x1u    /* bottom-up, lowest block that fits */
+#define DMA_MEM_LONG_LIVED      0x2u    /* top-down, highest block that fits, carved from its top */
+#define DMA_MEM_FIRST_FIT       0x4u    /* lowest block that fits by address, whatever the engine */
+
+/* may be combined with a hint: hand the buffer out zeroed, see DmaMem_alloc_zeroed */
+#define DMA_MEM_ZERO            0x100u
+
+/* counters are kept per placement policy: no hint, then one per hint above */
+typedef enum {
+    DMA_MEM_POLICY_DEFAULT,
+    DMA_MEM_POLICY_SHORT_LIVED,
+    DMA_MEM_POLICY_LONG_LIVED,
+    DMA_MEM_POLICY_FIRST_FIT,
+    DMA_MEM_POLICIES
+} DmaMemPolicy_t;
+
+typedef struct {
+    unsigned long   allocs;
+    unsigned long   pages;
+    unsigned long   failed;
+    unsigned long   frag_failed;    /* failed although enough pages were free */
+} DmaMemPolicyStats_t;
 
 typedef struct {
     unsigned long   total_pages; 
     unsigned long   alloc_pages; 
     unsigned long   free_pages;
     unsigned long   page_size;
+    unsigned long   meta_bytes;     /* boundary tags, node pool and pageblock counts */
+    unsigned long   largest_free;   /* pages in the largest free block of any region */
+    unsigned long   total_pageblocks;   /* 0 unless config.pageblock_pages */
+    unsigned long   free_pageblocks;    /* pageblocks without an allocated page */
+    unsigned long   resize_in_place;    /* DmaMem_resize calls that kept the address */
+    unsigned long   resize_moved;
+    unsigned long   deferred_pending;   /* DmaMem_free_deferred calls not drained yet */
+    unsigned long   reserved_pages;     /* free pages held for DmaMem_reserve clients, with config.accounting */
+    unsigned long   clean_pages;        /* free pages known to be zero, with config.prezero */
+    unsigned long   dirty_pages;        /* the other free pages */
+    DmaMemPolicyStats_t policy[DMA_MEM_POLICIES];
 } DmaMemInfo_t;
 
+/* free block sizes: bucket i counts blocks of 2^i up to 2^(i+1) - 1 pages, the last also all bigger ones */
+#define DMA_MEM_HIST_BUCKETS    20
+/* call latencies: bucket 0 counts calls under 128 ns, bucket i those from 2^(i+6) ns, the last also all slower ones */
+#define DMA_MEM_LAT_BUCKETS     16
 
+/*
+ * What DmaMem_get_stats gathers. The block figures come from a walk of
+ * every region under its lock; the counters from every CPU.
+ */
 typedef struct {
-    unsigned long key[2];
-} DmaMemKey_t;
+    unsigned long   free_pages;     /* in free blocks of the engines, parked blocks excluded */
+    unsigned long   free_blocks;
+    unsigned long   largest_free;
+    unsigned long   free_hist[DMA_MEM_HIST_BUCKETS];
+    unsigned int    frag_index;     /* per mille of free_pages outside the largest free block */
+    unsigned int    tree_height;    /* levels of the tallest block_tree, 0 unless the tree engine */
+    unsigned int    tree_peak;      /* the tallest any block_tree has been */
+    unsigned long   allocs;         /* single-block calls, slab pages included; bulk and deferred calls are not counted */
+    unsigned long   failed;
+    unsigned long   frag_failed;    /* failed although enough pages were free */
+    unsigned long   frees;
+    unsigned long   alloc_ns[DMA_MEM_LAT_BUCKETS];     /* with config.stats */
+    unsigned long   free_ns[DMA_MEM_LAT_BUCKETS];
+} DmaMemStats_t;
 
+/* DmaMemTrace_t.op */
+#define DMA_MEM_TRACE_ALLOC     0       /* size, align and flags asked for; ptr the block, -1 when it failed */
+#define DMA_MEM_TRACE_FREE      1       /* ptr, -1 when it failed; a deferred free once it is drained */
+#define DMA_MEM_TRACE_RESIZE    2       /* old resized to size bytes; ptr the block now, -1 when it failed */
+#define DMA_MEM_TRACE_MOVE      3       /* old relocated to ptr by compaction */
 
-typedef enum {
-    LEFT,
-    RIGHT
-} DmaRotate_t;
+/*
+ * One call recorded with config.trace. Bulk calls leave a record per
+ * block, each charged an equal share of the call's latency.
+ */
+typedef struct {
+    u64     ts;             /* ktime_get_ns when the call started */
+    u64     size;
+    u64     align;
+    u64     ptr;
+    u64     old;
+    u32     latency;        /* ns, saturating */
+    u16     flags;
+    u16     op;
+} DmaMemTrace_t;
 
+#define DMA_MEM_MAG_CLASSES     4
 
+/* copies bytes from physical src to physical dst, e.g. with a DMA engine; 0 on success */
+typedef int (*DmaMemCopy_t)(void* ctx, unsigned long dst, unsigned long src, unsigned long bytes);
+
+/* a relocatable allocation; 0 is never a valid handle */
+typedef u32 DmaMemHandle_t;
+
+/* a user that DmaMem_reserve guarantees pages to */
 typedef struct {
-    int             pageno;
-    unsigned long   addr;
-    unsigned char  *kaddr;
-    int             used;
-    int             alloc_pages;
-    int             first_pageno;
-} DmaPage_t;
+    unsigned long   pages;          /* reserved */
+    atomic_long_t   used;           /* pages in the client's live blocks */
+} DmaMemClient_t;
+
+/* low is 1 after the free pages fell below the low watermark, 0 once they are back above the high one */
+typedef void (*DmaMemWatermark_t)(void* ctx, int low);
+
+/*
+ * Boundary tags, one u32 per page, only meaningful on the first and the last
+ * page of a block. The first page carries DMA_TAG_HEAD and the pool index of
+ * the block's node; the last page of a multi-page block carries the first
+ * page number. DMA_TAG_USED is set on both while the block is allocated.
+ */
+#define DMA_TAG_HEAD            0x80000000u
+#define DMA_TAG_USED            0x40000000u
+#define DMA_TAG_VALUE           0x3fffffffu
+#define DMA_MEM_MAX_PAGES       DMA_TAG_VALUE
+
+/* nodes are kmalloc'ed in chunks as blocks appear */
+#define DMA_MEM_NODE_CHUNK      64
+#define DMA_MEM_NO_PAGE         0xffffffffu
+
+/* tree links are pool indices; node 0 of a region is the empty-tree sentinel */
+#define DMA_TREE_NIL            0u
+
+/* smallest slab object; classes are powers of two up to half a page */
+#define DMA_MEM_SLAB_MIN        64
+#define DMA_MEM_SLAB_CLASSES    16
 
+struct DmaSlab_struct;
+
+/* one per block, free or allocated; page numbers fit in 32 bits as a region holds at most DMA_MEM_MAX_PAGES */
 typedef struct avl_node_struct{
-    struct list_head           ListEntry;
-    DmaMemKey_t                key;
-    int                        height;
-    DmaPage_t*                 page;
-    struct avl_node_struct*    left;
-    struct avl_node_struct*    right;
+    union {
+        struct list_head       ListEntry;  /* engine free lists and node_Free */
+        struct DmaSlab_struct* slab;       /* the objects carved from this page, while is_slab */
+    };
+    unsigned char             *kaddr;
+    u32                        index;      /* position in the node pool */
+    u32                        pageno;     /* first page of the block, DMA_MEM_NO_PAGE when unused */
+    u32                        npages;
+    u32                        left;
+    u32                        right;
+    u32                        maxfree;    /* largest free block in the subtree */
+    u8                         height;     /* 0 for DMA_TREE_NIL */
+    u8                         used;       /* mirrors DMA_TAG_USED */
+    u8                         parked;     /* freed into a magazine, still allocated for the engine */
+    u8                         is_slab;    /* allocated page split into slab objects */
 } avl_node_t;
 
+/*
+ * What DmaMem takes from its environment: memory for its metadata, mappings
+ * of the pool and an outlet for its messages. alloc gets GFP_KERNEL, or
+ * GFP_ATOMIC under a spinlock, with __GFP_ZERO for cleared memory; map gets
+ * config.map_flags. The pool addresses are whatever the backend maps, so a
+ * userspace backend can hand out offsets into a file.
+ */
+typedef struct {
+    void*   (*alloc)(void* ctx, unsigned long bytes, gfp_t gfp);
+    void    (*free)(void* ctx, const void* ptr);
+    void*   (*map)(void* ctx, unsigned long addr, unsigned long size, unsigned long flags);
+    void    (*unmap)(void* ctx, void* kaddr);
+    void    (*log)(void* ctx, const char* msg);
+} DmaMemBackend_t;
+
+/* kvmalloc, memremap and printk; what a NULL config.backend means */
+extern const DmaMemBackend_t DmaMem_kernel_backend;
+
+typedef enum {
+    DMA_MEM_ENGINE_TREE,        /* best fit over the address-ordered AVL block_tree */
+    DMA_MEM_ENGINE_TLSF,        /* O(1) two-level segregated fit */
+    DMA_MEM_ENGINE_BUDDY,       /* power-of-two blocks, naturally aligned */
+} DmaMemEngine_t;
+
+typedef struct {
+    /* allocation engine used by every region of the pool */
+    DmaMemEngine_t  engine;
+    /* block sizes (in pages) that get a per-CPU magazine, 0 = unused */
+    int             mag_pages[DMA_MEM_MAG_CLASSES];
+    /* blocks parked per size per CPU before the magazine is flushed */
+    int             mag_depth;
+    /* number of independently locked sub-regions, 0 or 1 = unsharded */
+    int             shards;
+    /* map the whole pool once at init instead of memremap per allocation */
+    int             map_once;
+    /* MEMREMAP_WB or MEMREMAP_WC for the kernel mappings, 0 = MEMREMAP_WB */
+    unsigned long   map_flags;
+    /* serve requests of up to half a page from per-size object slabs */
+    int             slab;
+    /* group pages into naturally aligned pageblocks of this many pages (a
+     * power of two) and keep smaller requests out of whole free ones, 0 = off */
+    unsigned long   pageblock_pages;
+    /* entries in the handle table for DmaMem_handle_alloc, 0 = no handles */
+    unsigned int    handles;
+    /* slots in the DmaMem_free_deferred ring (a power of two), 0 = off */
+    unsigned long   deferred;
+    /* count the pages handed out in one shared counter, which reservations
+     * and watermarks need; costs an atomic per allocation and free */
+    int             accounting;
+    /* track which free pages are known to be zero and clear the others from
+     * a low-priority kernel thread, for DmaMem_alloc_zeroed; needs map_once */
+    int             prezero;
+    /* time every allocation and free into per-CPU latency histograms */
+    int             stats;
+    /* slots in a ring (a power of two) keeping the last calls as
+     * DmaMemTrace_t records, for DmaMem_trace_read, 0 = off */
+    unsigned long   trace;
+    /* where metadata, mappings and messages come from, NULL = DmaMem_kernel_backend */
+    const DmaMemBackend_t* backend;
+    void*           backend_ctx;
+} DmaMemConfig_t;
+
 typedef struct {
-    avl_node_t*             free_tree;
-    avl_node_t*             alloc_tree;
-    avl_node_t*             node_list;
+    atomic_long_t   allocs;
+    atomic_long_t   pages;
+    atomic_long_t   failed;
+    atomic_long_t   frag_failed;
+} DmaMemPolicyCount_t;
+
+/* the counters of one CPU, on cache lines of their own */
+typedef struct {
+    DmaMemPolicyCount_t policy[DMA_MEM_POLICIES];
+    atomic_long_t       frees;
+    atomic_long_t       alloc_ns[DMA_MEM_LAT_BUCKETS];
+    atomic_long_t       free_ns[DMA_MEM_LAT_BUCKETS];
+} ____cacheline_aligned_in_smp DmaMemCpuStats_t;
+
+typedef struct {
+    spinlock_t      lock;
+    int             count[DMA_MEM_MAG_CLASSES];
+    unsigned long*  addrs;
+    unsigned long   parked_pages;
+} DmaMag_t;
+
+/* one slot of the deferred free ring; seq tells whose turn the slot is */
+typedef struct {
+    atomic_long_t   seq;
+    unsigned long   ptr;
+} DmaMemDefer_t;
+
+/* one slot of the trace ring: seq is 2 * n + 1 while record n is written, 2 * n + 2 once it is complete */
+typedef struct {
+    atomic_long_t   seq;
+    DmaMemTrace_t   rec;
+} DmaMemTraceSlot_t;
+
+struct DmaTlsf_struct;
+struct DmaBuddy_struct;
+struct DmaSlabCache_struct;
+struct DmaHandleTable_struct;
+struct task_struct;
+struct dentry;
+
+typedef struct DmaMem_struct {
+    DmaMemEngine_t          engine;
+    struct DmaTlsf_struct*  tlsf;
+    struct DmaBuddy_struct* buddy;
+    u32                     block_tree;         /* root index, DMA_TREE_NIL when empty */
     struct list_head        node_Free;
-//	spinlock_t              node_Lock;
-    DmaPage_t*              page_list;
-    int                     num_pages;
+    spinlock_t              node_Lock;
+    u32*                    tags;
+    avl_node_t**            node_chunks;
+    unsigned int            node_chunk_count;
+    unsigned int            node_chunk_max;
+    unsigned int            node_next;          /* nodes handed out so far, in index order */
+    unsigned int            node_free_count;
+    unsigned long           num_pages;
     unsigned long           base_addr;
     unsigned long           mem_size;
     unsigned long           page_size;
-    int                     free_page_count;
-    int                     alloc_page_count;
+    unsigned long           free_page_count;
+    unsigned long           alloc_page_count;
     int                     usedcount;
+    DmaMemConfig_t          config;
+    const DmaMemBackend_t*  backend;        /* config.backend resolved, shared by the shards */
+    void*                   backend_ctx;
+    DmaMag_t*               mags;
+    unsigned int            nr_mags;
+    struct DmaMem_struct*   shards;
+    int                     num_shards;
+    unsigned long           shard_size;
+    unsigned char*          kbase;          /* pool mapping in map_once mode */
+    struct DmaSlabCache_struct* slab_caches;    /* one per slab class when config.slab */
+    int                     nr_slab_classes;
+    DmaMemCpuStats_t*       stats;          /* one per possible CPU */
+    struct dentry*          debugfs;        /* from DmaMem_debugfs_init */
+    struct dentry*          debugfs_trace;
+    DmaMemTraceSlot_t*      trace_slots;    /* when config.trace */
+    unsigned long           trace_mask;
+    atomic_long_t           trace_head;     /* records claimed so far */
+    atomic_long_t           resize_in_place;
+    atomic_long_t           resize_moved;
+    struct DmaHandleTable_struct* handles;      /* when config.handles */
+    DmaMemDefer_t*          defer_slots;    /* when config.deferred */
+    unsigned long           defer_mask;
+    atomic_long_t           defer_head;     /* next slot to drain, moved under defer_Lock */
+    atomic_long_t           defer_tail;     /* next slot to fill */
+    struct mutex            defer_Lock;     /* one drain at a time, held while it frees */
+    wait_queue_head_t       free_wait;      /* DmaMem_alloc_wait sleepers */
+    atomic_long_t           wait_pages;     /* smallest request asleep, LONG_MAX when none */
+    atomic_long_t           avail;          /* with config.accounting, free pages outside reservations */
+    atomic_long_t           wm_below;       /* 1 between a low and a high watermark notification */
+    unsigned long           wm_low;
+    unsigned long           wm_high;
+    DmaMemWatermark_t       wm_notify;
+    void*                   wm_ctx;
+    u32*                    pb_used;        /* allocated pages per pageblock, NULL when not grouped */
+    unsigned long           pb_first;       /* pfn >> pb_shift of page 0 */
+    unsigned long           nr_pageblocks;
+    unsigned int            pb_shift;
+    unsigned int            tree_peak;      /* levels block_tree has reached */
+    unsigned long*          dirty;          /* with config.prezero, pages not zeroed since their last free */
+    unsigned long           dirty_pages;    /* free pages with their dirty bit set */
+    unsigned long           zero_cursor;    /* block the zeroing thread resumes at */
+    struct task_struct*     zero_task;      /* the zeroing thread, when config.prezero */
+    wait_queue_head_t       zero_wait;
+    atomic_long_t           zero_idle;      /* 1 while the zeroing thread found nothing to do */
 } DmaMem_t;
 
 
 
 int DmaMem_init(DmaMem_t* mm, unsigned long addr, unsigned long size, unsigned long pageSize);
 
+int DmaMem_init_config(DmaMem_t* mm, unsigned long addr, unsigned long size, unsigned long pageSize, const DmaMemConfig_t* config);
+
 int DmaMem_exit(DmaMem_t* mm);
 
-unsigned long DmaMem_alloc(DmaMem_t* mm, int size);
+unsigned long DmaMem_alloc(DmaMem_t* mm, unsigned long size);
+
+/* align is a power of two in bytes; the block's physical address is a multiple of it */
+unsigned long DmaMem_alloc_aligned(DmaMem_t* mm, unsigned long size, unsigned long align);
+
+/* DmaMem_alloc_aligned with a DMA_MEM_* placement hint; align may be 0 */
+unsigned long DmaMem_alloc_flags(DmaMem_t* mm, unsigned long size, unsigned long align, unsigned int flags);
 
 int DmaMem_free(DmaMem_t* mm, unsigned long ptr);
 
+/*
+ * DmaMem_alloc with the buffer cleared, as DMA_MEM_ZERO does for the other
+ * calls. With config.prezero only the pages freed since the zeroing thread
+ * last passed over them are cleared here, so a pool given time to settle
+ * hands out zeroed memory at the cost of a plain allocation.
+ */
+unsigned long DmaMem_alloc_zeroed(DmaMem_t* mm, unsigned long size);
+
+/*
+ * DmaMem_alloc that sleeps up to timeout jiffies for a fit instead of
+ * failing, woken by the frees that leave a large enough free block. 0
+ * tries once, MAX_SCHEDULE_TIMEOUT waits for good. Process context only.
+ */
+unsigned long DmaMem_alloc_wait(DmaMem_t* mm, unsigned long size, long timeout);
+
+/*
+ * Reservations, with config.accounting. DmaMem_reserve initializes client
+ * with bytes set aside, failing when fewer pages are free outside other
+ * reservations, and ordinary allocations leave those pages alone. The
+ * client allocates with DmaMem_alloc_reserved, which always takes whole
+ * pages and draws on the reservation before the shared pages, and frees
+ * with DmaMem_free_reserved. The guarantee is a page count: fragmentation
+ * can still fail a large request. Reserved blocks must not be resized.
+ */
+int DmaMem_reserve(DmaMem_t* mm, DmaMemClient_t* client, unsigned long bytes);
+
+/* returns the unused part of the reservation, with none of the client's calls in flight */
+int DmaMem_unreserve(DmaMem_t* mm, DmaMemClient_t* client);
+
+unsigned long DmaMem_alloc_reserved(DmaMem_t* mm, DmaMemClient_t* client, unsigned long size, unsigned long align, unsigned int flags);
+
+int DmaMem_free_reserved(DmaMem_t* mm, DmaMemClient_t* client, unsigned long ptr);
+
+/*
+ * With config.accounting, calls notify(ctx, 1) once the free pages outside
+ * reservations drop below low_pages and notify(ctx, 0) once they climb back
+ * above high_pages. notify runs in the allocating or freeing thread and
+ * must neither sleep nor call into the pool. Set before the pool is shared.
+ */
+int DmaMem_set_watermarks(DmaMem_t* mm, unsigned long low_pages, unsigned long high_pages, DmaMemWatermark_t notify, void* ctx);
+
+/*
+ * Grows or shrinks the allocation at ptr to new_size bytes, in place when
+ * the following pages allow it and by a move otherwise. Returns ptr itself
+ * after an in-place resize, the new address after a move, which copies the
+ * contents up to the smaller size and frees ptr, and -1 when neither works,
+ * ptr then staying valid. The kernel address may change either way.
+ */
+unsigned long DmaMem_resize(DmaMem_t* mm, unsigned long ptr, unsigned long new_size);
+
+/* allocates count blocks of size bytes into ptrs, all of them or none */
+int DmaMem_alloc_bulk(DmaMem_t* mm, unsigned long size, unsigned long count, unsigned long* ptrs);
+
+/*
+ * Frees count blocks; ptrs is sorted and compacted in place so neighbours
+ * coalesce in one pass. Addresses that are not allocated blocks, or given
+ * more than once, are dropped and fail the call after the rest are freed.
+ */
+int DmaMem_free_bulk(DmaMem_t* mm, unsigned long* ptrs, unsigned long count);
+
+/*
+ * Queues ptr for DmaMem_free without touching the engines or unmapping,
+ * so it is safe from hard-IRQ context: a few atomics on a lock-free ring
+ * of config.deferred slots. The pending frees are drained in bulk by
+ * DmaMem_flush, by DmaMem_drain_deferred, or by the next allocation when
+ * no drain is under way, allocations never waiting for one. Fails with -1
+ * only while the ring is full, ptr then staying allocated.
+ */
+int DmaMem_free_deferred(DmaMem_t* mm, unsigned long ptr);
+
+/*
+ * Frees everything DmaMem_free_deferred queued so far, from process
+ * context, and returns the count. An address queued twice is logged and
+ * freed once.
+ */
+long DmaMem_drain_deferred(DmaMem_t* mm);
+
+/* returns parked magazine blocks, empty slabs and deferred frees to the engines */
+int DmaMem_flush(DmaMem_t* mm);
+
+/*
+ * Relocatable allocations, with config.handles. DmaMem_compact may move the
+ * block of a handle that is not pinned; DmaMem_handle_pin returns its
+ * current address and keeps it there until the matching unpin. Handles
+ * small enough for a slab object are never moved. These calls may sleep.
+ */
+DmaMemHandle_t DmaMem_handle_alloc(DmaMem_t* mm, unsigned long size);
+
+/* fails while the handle is pinned */
+int DmaMem_handle_free(DmaMem_t* mm, DmaMemHandle_t handle);
+
+unsigned long DmaMem_handle_pin(DmaMem_t* mm, DmaMemHandle_t handle);
+
+int DmaMem_handle_unpin(DmaMem_t* mm, DmaMemHandle_t handle);
+
+/*
+ * Moves unpinned handle blocks, highest first, into the lowest free block
+ * that holds them, with copy or with memcpy when copy is NULL. Returns the
+ * pages moved, or -1.
+ */
+long DmaMem_compact(DmaMem_t* mm, DmaMemCopy_t copy, void* ctx);
+
+/* kernel address of the allocated address ptr, or NULL */
+void* DmaMem_get_kaddr(DmaMem_t* mm, unsigned long ptr);
+
 int DmaMem_get_info(DmaMem_t* mm, DmaMemInfo_t* info);
 
+/* walks every block, so meant for diagnostics rather than to be polled */
+int DmaMem_get_stats(DmaMem_t* mm, DmaMemStats_t* stats);
+
+/*
+ * Cross-checks the bookkeeping of every region: the boundary tags must tile
+ * it with blocks whose head and tail tags agree with their nodes, the
+ * engine's index (block_tree's order, heights and maxfree, or the TLSF and
+ * buddy free lists and bitmaps) must hold exactly the free blocks, and the
+ * node pool, the page counters, the pageblock counts, the dirty map and the
+ * magazines must match them. Logs each inconsistency and returns -1, or 0.
+ * Walks every block under each region's lock, so meant for debugging.
+ */
+int DmaMem_validate(DmaMem_t* mm);
+
+/*
+ * With config.trace, copies up to max records into records, oldest first,
+ * starting with record number *pos and advancing it; 0 starts at the oldest
+ * one still held. Records overwritten before they were read are skipped, so
+ * *pos moving further than the count shows how many were lost. Stops at a
+ * record still being written. Returns the count, or -1.
+ */
+long DmaMem_trace_read(DmaMem_t* mm, unsigned long* pos, DmaMemTrace_t* records, unsigned long max);
+
+/*
+ * Creates the debugfs file name under parent, which dumps DmaMem_get_stats
+ * and the free blocks of every region, and with config.trace name_trace,
+ * which lists the records of the trace ring one per line as
+ * "ts op size align flags ptr old latency" with op one of a, f, r and m,
+ * the input of the userspace replay tool. DmaMem_exit removes them.
+ */
+int DmaMem_debugfs_init(DmaMem_t* mm, const char* name, struct dentry* parent);
+
 #endif
 
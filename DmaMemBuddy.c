@@ -0,0 +1,299 @@
+#include "DmaMemEngine.h"
+#include <linux/slab.h>
+#include <linux/bitops.h>
+
+/*
+ * Binary buddy engine.
+ *
+ * Every block is 2^order pages and naturally aligned in physical address
+ * space, so a block's buddy is found by flipping bit `order` of its page
+ * frame number and coalescing on free is O(1) per order without any tree.
+ * Requests are rounded up to a power of two by DmaMem_alloc.
+ *
+ * The nodes of free blocks of each order are linked through ListEntry;
+ * order_bitmap has bit N set while free_list[N] is non-empty. A buddy is
+ * free and whole when a free block of the same order starts at its page.
+ */
+
+#define BUDDY_MAX_ORDER     32
+
+struct DmaBuddy_struct {
+    unsigned long       base_pfn;
+    unsigned long       order_bitmap;
+    struct list_head    free_list[BUDDY_MAX_ORDER];
+};
+
+static void insert_free(DmaMem_t* mm, avl_node_t* node, int order) {
+    struct DmaBuddy_struct* buddy = mm->buddy;
+
+    node->npages = 1UL << order;
+    DmaMem_mark_block(mm, node, 0);
+    list_add(&(node->ListEntry), &(buddy->free_list[order]));
+    buddy->order_bitmap |= 1UL << order;
+}
+
+/* a new free block, with a node taken from the pool reserved by the caller */
+static int make_free(DmaMem_t* mm, unsigned long pageno, int order) {
+    avl_node_t* node = DmaMem_popfront(mm);
+
+    if (node == NULL) {
+        return -1;
+    }
+    node->pageno = pageno;
+    insert_free(mm, node, order);
+    return 0;
+}
+
+static void remove_free(DmaMem_t* mm, avl_node_t* node, int order) {
+    struct DmaBuddy_struct* buddy = mm->buddy;
+
+    list_del(&(node->ListEntry));
+    if (list_empty(&(buddy->free_list[order]))) {
+        buddy->order_bitmap &= ~(1UL << order);
+    }
+}
+
+/* page number of the buddy, which wraps to a huge value below the region */
+static unsigned long buddy_of(DmaMem_t* mm, unsigned long pageno, int order) {
+    unsigned long pfn = mm->buddy->base_pfn + pageno;
+    return (pfn ^ (1UL << order)) - mm->buddy->base_pfn;
+}
+
+unsigned long DmaBuddy_round_pages(unsigned long npages) {
+    if (npages <= 1) {
+        return 1;
+    }
+    return 1UL << (__fls(npages - 1) + 1);
+}
+
+int DmaBuddy_init(DmaMem_t* mm) {
+    unsigned long pageno = 0;
+    int order;
+
+    mm->buddy = (struct DmaBuddy_struct*)DmaMem_meta_alloc(mm, sizeof(struct DmaBuddy_struct), GFP_KERNEL | __GFP_ZERO);
+    if (mm->buddy == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate buddy when vmem_init\n");
+        return -1;
+    }
+
+    mm->buddy->base_pfn = mm->base_addr / mm->page_size;
+    for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+        INIT_LIST_HEAD(&(mm->buddy->free_list[order]));
+    }
+
+    /* carve the region into the largest naturally aligned blocks */
+    while (pageno < mm->num_pages) {
+        unsigned long pfn = mm->buddy->base_pfn + pageno;
+        order = __fls(mm->num_pages - pageno);
+        if (pfn && ((int)__ffs(pfn) < order)) {
+            order = __ffs(pfn);
+        }
+        if (order >= BUDDY_MAX_ORDER) {
+            order = BUDDY_MAX_ORDER - 1;
+        }
+        if (make_free(mm, pageno, order) != 0) {
+            return -1;
+        }
+        pageno += 1UL << order;
+    }
+    return 0;
+}
+
+void DmaBuddy_exit(DmaMem_t* mm) {
+    if (mm->buddy) {
+        DmaMem_meta_free(mm, mm->buddy);
+        mm->buddy = NULL;
+    }
+}
+
+/*
+ * Long-lived and first-fit requests pick their block by address through
+ * DmaMem_walk_fit; long-lived ones then keep the upper halves when the
+ * block is split, so they end up at its top.
+ */
+long DmaBuddy_alloc(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags) {
+    struct DmaBuddy_struct* buddy = mm->buddy;
+    unsigned long orders;
+    avl_node_t* node;
+    unsigned long pageno;
+    int order, search_order, free_order;
+    int top_down = (flags & DMA_MEM_LONG_LIVED) != 0;
+
+    order = __fls(DmaBuddy_round_pages(npages));
+    /* blocks are naturally aligned, so any block of the alignment order fits */
+    search_order = order;
+    if ((int)__fls(align_pages) > search_order) {
+        search_order = __fls(align_pages);
+    }
+    if (search_order >= BUDDY_MAX_ORDER) {
+        return -1;
+    }
+    if (flags & (DMA_MEM_LONG_LIVED | DMA_MEM_FIRST_FIT)) {
+        node = DmaMem_walk_fit(mm, 1UL << search_order, 1UL << search_order, top_down);
+        if (node == NULL) {
+            return -1;
+        }
+        free_order = __fls(node->npages);
+    } else {
+        orders = buddy->order_bitmap >> search_order;
+        if (orders == 0) {
+            return -1;
+        }
+        free_order = search_order + __ffs(orders);
+        node = list_first_entry(&(buddy->free_list[free_order]), avl_node_t, ListEntry);
+    }
+    pageno = node->pageno;
+    remove_free(mm, node, free_order);
+
+    /*
+     * split, returning the upper halves; the lower half keeps the alignment.
+     * Top-down the lower halves go back instead, down to the alignment order.
+     */
+    while (free_order > order) {
+        free_order--;
+        if (top_down && (free_order >= search_order)) {
+            make_free(mm, pageno, free_order);
+            pageno += 1UL << free_order;
+        } else {
+            make_free(mm, pageno + (1UL << free_order), free_order);
+        }
+    }
+    node->pageno = pageno;
+    node->npages = 1UL << order;
+    node->parked = 0;
+    node->kaddr  = NULL;
+    DmaMem_mark_block(mm, node, 1);
+    return pageno;
+}
+
+long DmaBuddy_free(DmaMem_t* mm, unsigned long ptr) {
+    avl_node_t* node = DmaMem_lookup_block(mm, ptr);
+    avl_node_t* neighbour;
+    unsigned long pageno, npages, buddy;
+    int order;
+
+    if ((node == NULL) || !DmaMem_page_used(mm, node->pageno)) {
+        DmaMem_log(mm, "vmem_free: 0x%08lx not found\n", ptr);
+        return -1;
+    }
+    pageno = node->pageno;
+    npages = node->npages;
+    order  = __fls(npages);
+    DmaMem_clear_block(mm, pageno, npages);
+
+    while (order < BUDDY_MAX_ORDER - 1) {
+        buddy = buddy_of(mm, pageno, order);
+        if ((buddy >= mm->num_pages) || (buddy + (1UL << order) > mm->num_pages) || DmaMem_page_used(mm, buddy)) {
+            break;
+        }
+        neighbour = DmaMem_block_at(mm, buddy);
+        if ((neighbour == NULL) || (neighbour->npages != (1UL << order))) {
+            break;
+        }
+        remove_free(mm, neighbour, order);
+        DmaMem_clear_block(mm, buddy, 1UL << order);
+        DmaMem_pushback(mm, neighbour);
+        if (buddy < pageno) {
+            pageno = buddy;
+        }
+        order++;
+    }
+    node->pageno = pageno;
+    insert_free(mm, node, order);
+    return npages;
+}
+
+/*
+ * A shrink frees the upper halves down to the new order; their buddies
+ * are the lower halves still allocated, so nothing coalesces. A grow needs
+ * the block to be the lower buddy at every order it climbs, with each
+ * upper buddy free and whole.
+ */
+int DmaBuddy_resize(DmaMem_t* mm, avl_node_t* node, unsigned long npages) {
+    unsigned long pageno = node->pageno, buddy;
+    int order     = __fls(node->npages);
+    int new_order = __fls(npages);
+    int o;
+
+    if (new_order < order) {
+        while (order > new_order) {
+            order--;
+            make_free(mm, pageno + (1UL << order), order);
+        }
+        node->npages = npages;
+        DmaMem_mark_block(mm, node, 1);
+        return 0;
+    }
+
+    for (o = order; o < new_order; ++o) {
+        avl_node_t* upper;
+        buddy = buddy_of(mm, pageno, o);
+        if ((buddy != pageno + (1UL << o)) || (buddy + (1UL << o) > mm->num_pages) || DmaMem_page_used(mm, buddy)) {
+            return -1;
+        }
+        upper = DmaMem_block_at(mm, buddy);
+        if ((upper == NULL) || (upper->npages != (1UL << o))) {
+            return -1;
+        }
+    }
+    for (o = order; o < new_order; ++o) {
+        avl_node_t* upper = DmaMem_block_at(mm, pageno + (1UL << o));
+        remove_free(mm, upper, o);
+        DmaMem_clear_block(mm, upper->pageno, upper->npages);
+        DmaMem_pushback(mm, upper);
+    }
+    node->npages = npages;
+    DmaMem_mark_block(mm, node, 1);
+    return 0;
+}
+
+unsigned long DmaBuddy_largest_free(DmaMem_t* mm) {
+    return mm->buddy->order_bitmap ? 1UL << __fls(mm->buddy->order_bitmap) : 0;
+}
+
+int DmaBuddy_validate(DmaMem_t* mm, unsigned long free_blocks, unsigned long free_pages) {
+    struct DmaBuddy_struct* buddy = mm->buddy;
+    unsigned long blocks = 0, pages = 0, pageno, other;
+    avl_node_t* node;
+    int order, bad = 0;
+
+    for (pageno = 0; pageno < mm->num_pages; pageno += node->npages) {
+        node = DmaMem_block_at(mm, pageno);
+        if ((node->npages & (node->npages - 1)) || ((buddy->base_pfn + pageno) & (node->npages - 1))) {
+            DmaMem_log(mm, "vmem_validate: buddy block at page %lu+%u is not a naturally aligned power of two\n", pageno, node->npages);
+            bad++;
+        }
+    }
+
+    for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+        if (((buddy->order_bitmap >> order) & 1) == (unsigned long)list_empty(&(buddy->free_list[order]))) {
+            DmaMem_log(mm, "vmem_validate: buddy order %d bit disagrees with its list\n", order);
+            bad++;
+        }
+        list_for_each_entry(node, &(buddy->free_list[order]), ListEntry) {
+            if (++blocks > free_blocks) {
+                break;
+            }
+            if ((node->pageno >= mm->num_pages) || (DmaMem_block_at(mm, node->pageno) != node) || node->used ||
+                (node->npages != (1UL << order))) {
+                DmaMem_log(mm, "vmem_validate: buddy order %d lists node %u, page %u+%u\n", order, node->index, node->pageno, node->npages);
+                bad++;
+                continue;
+            }
+            pages += node->npages;
+            /* a free block with a whole free buddy should have merged with it */
+            other = buddy_of(mm, node->pageno, order);
+            if ((order < BUDDY_MAX_ORDER - 1) && (other < mm->num_pages) && (other + node->npages <= mm->num_pages) &&
+                !DmaMem_page_used(mm, other) && DmaMem_block_at(mm, other) && (DmaMem_block_at(mm, other)->npages == node->npages)) {
+                DmaMem_log(mm, "vmem_validate: buddy blocks at page %u and %lu of order %d are not merged\n", node->pageno, other, order);
+                bad++;
+            }
+        }
+    }
+    if ((blocks != free_blocks) || (pages != free_pages)) {
+        DmaMem_log(mm, "vmem_validate: buddy lists %lu%s blocks of %lu pages, the tags %lu of %lu\n",
+                   blocks, (blocks > free_blocks) ? " or more" : "", pages, free_blocks, free_pages);
+        bad++;
+    }
+    return bad;
+}
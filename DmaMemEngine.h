@@ -0,0 +1,222 @@
+#ifndef __DMA_MEM_ENGINE_H
+#define __DMA_MEM_ENGINE_H
+
+/*
+ * Allocation engines behind DmaMem_alloc/DmaMem_free. Each engine manages
+ * the pages of one region (a DmaMem_t or one of its shards) and is called
+ * with the region's node_Lock held. Allocation returns the first page
+ * number of the block or -1; free returns the number of pages released or
+ * -1. Page numbers and counts are unsigned long; a region holds at most
+ * DMA_MEM_MAX_PAGES pages so they also fit the tags. Both keep the boundary
+ * tags up to date. align_pages is a power of two and asks for a block whose
+ * physical address is a multiple of align_pages pages; 1 means no constraint.
+ * flags carries the caller's DMA_MEM_* placement hint.
+ *
+ * Every block, free or allocated, owns one node from the region's pool.
+ * Before an allocation DmaMem reserves DMA_MEM_NODE_RESERVE nodes, so
+ * DmaMem_popfront cannot fail inside an engine; frees never need more
+ * nodes than they release.
+ */
+
+#include "DmaMem.h"
+#include <asm/barrier.h>
+#include <linux/compiler.h>
+#include <linux/stdarg.h>
+
+#define DMA_MEM_NODE_RESERVE    32
+
+avl_node_t* DmaMem_popfront(DmaMem_t* mm);
+void        DmaMem_pushback(DmaMem_t* mm, avl_node_t* node);
+
+static inline avl_node_t* DmaMem_node(const DmaMem_t* mm, unsigned int index) {
+    return &mm->node_chunks[index / DMA_MEM_NODE_CHUNK][index % DMA_MEM_NODE_CHUNK];
+}
+
+/*
+ * The node of the block starting at pageno, or NULL when no block starts
+ * there. Only nodes below the bump pointer have ever been initialised. Also
+ * used without node_Lock by DmaMem_free, hence the acquire that pairs with
+ * the release in DmaMem_popfront.
+ */
+static inline avl_node_t* DmaMem_block_at(const DmaMem_t* mm, unsigned long pageno) {
+    u32 tag = mm->tags[pageno];
+    avl_node_t* node;
+    if (!(tag & DMA_TAG_HEAD) || ((tag & DMA_TAG_VALUE) >= smp_load_acquire(&mm->node_next))) {
+        return NULL;
+    }
+    node = DmaMem_node(mm, tag & DMA_TAG_VALUE);
+    return (node->pageno == pageno) ? node : NULL;
+}
+
+/* first page of the block whose last page is last_pageno */
+static inline unsigned long DmaMem_block_head(const DmaMem_t* mm, unsigned long last_pageno) {
+    u32 tag = mm->tags[last_pageno];
+    return (tag & DMA_TAG_HEAD) ? last_pageno : (tag & DMA_TAG_VALUE);
+}
+
+static inline int DmaMem_page_used(const DmaMem_t* mm, unsigned long pageno) {
+    return (mm->tags[pageno] & DMA_TAG_USED) != 0;
+}
+
+static inline unsigned long DmaMem_block_addr(const DmaMem_t* mm, const avl_node_t* node) {
+    return mm->base_addr + node->pageno * mm->page_size;
+}
+
+/* writes the head and tail tags of the block described by node */
+static inline void DmaMem_mark_block(DmaMem_t* mm, avl_node_t* node, int used) {
+    u32 flags = used ? DMA_TAG_USED : 0;
+    node->used = used ? 1 : 0;
+    mm->tags[node->pageno] = DMA_TAG_HEAD | flags | node->index;
+    if (node->npages > 1) {
+        mm->tags[node->pageno + node->npages - 1] = flags | (u32)node->pageno;
+    }
+}
+
+/* clears the tags of a block that becomes the interior of a bigger one */
+static inline void DmaMem_clear_block(DmaMem_t* mm, unsigned long pageno, unsigned long npages) {
+    mm->tags[pageno]              = 0;
+    mm->tags[pageno + npages - 1] = 0;
+}
+
+/* metadata memory and mappings of the pool, through the backend of mm */
+static inline void* DmaMem_meta_alloc(const DmaMem_t* mm, unsigned long bytes, gfp_t gfp) {
+    return mm->backend->alloc(mm->backend_ctx, bytes, gfp);
+}
+
+static inline void DmaMem_meta_free(const DmaMem_t* mm, const void* ptr) {
+    if (ptr) {
+        mm->backend->free(mm->backend_ctx, ptr);
+    }
+}
+
+static inline void* DmaMem_map(const DmaMem_t* mm, unsigned long addr, unsigned long size) {
+    return mm->backend->map(mm->backend_ctx, addr, size, mm->config.map_flags);
+}
+
+static inline void DmaMem_unmap(const DmaMem_t* mm, void* kaddr) {
+    mm->backend->unmap(mm->backend_ctx, kaddr);
+}
+
+/* printk through the backend of mm, plain printk when mm is NULL */
+void DmaMem_log(const DmaMem_t* mm, const char* fmt, ...) __printf(2, 3);
+/* DmaMem_log for callers holding a backend rather than a DmaMem_t, NULL meaning printk */
+void DmaMem_vlog(const DmaMemBackend_t* backend, void* ctx, const char* fmt, va_list args);
+
+/* the node of the block at address ptr, or NULL when no block starts at ptr */
+avl_node_t* DmaMem_lookup_block(DmaMem_t* mm, unsigned long ptr);
+
+/* the region (shard) of mm that owns ptr */
+DmaMem_t*   DmaMem_region_of(DmaMem_t* mm, unsigned long ptr);
+
+/* DmaMem_alloc_flags without the report when nothing fits, for callers with a fallback */
+unsigned long DmaMem_try_alloc(DmaMem_t* mm, unsigned long size, unsigned long align, unsigned int flags);
+
+/* DmaMem_alloc and DmaMem_free for the allocator's own blocks, e.g. slab pages, kept out of the trace */
+unsigned long DmaMem_alloc_nested(DmaMem_t* mm, unsigned long size);
+int           DmaMem_free_nested(DmaMem_t* mm, unsigned long ptr);
+
+/*
+ * Moves the allocated block at ptr, mapped for size bytes, into the lowest
+ * free block that holds it if that lies below ptr, bypassing the
+ * magazines. Returns the new address, or -1 when nothing lower fits or the
+ * copy failed, the block then staying where it was. The caller keeps
+ * everyone else off the block meanwhile.
+ */
+unsigned long DmaMem_migrate(DmaMem_t* mm, unsigned long ptr, unsigned long size, DmaMemCopy_t copy, void* ctx);
+
+/* first page at or after pageno whose address is aligned to align_pages */
+static inline unsigned long DmaMem_align_pageno(const DmaMem_t* mm, unsigned long pageno, unsigned long align_pages) {
+    unsigned long pfn = mm->base_addr / mm->page_size + pageno;
+    return pageno + (((pfn + align_pages - 1) & ~(align_pages - 1)) - pfn);
+}
+
+/* highest aligned page of the block node where npages fit, or -1 */
+static inline long DmaMem_fit_top(const DmaMem_t* mm, const avl_node_t* node, unsigned long npages, unsigned long align_pages) {
+    unsigned long top, slack;
+    if (node->npages < npages) {
+        return -1;
+    }
+    top   = node->pageno + node->npages - npages;
+    slack = (mm->base_addr / mm->page_size + top) & (align_pages - 1);
+    return (slack <= top - node->pageno) ? (long)(top - slack) : -1;
+}
+
+/*
+ * Address-ordered search of the free blocks through the tags, for engines
+ * without an address index: the lowest free block that holds npages at an
+ * aligned page, or the highest one when top_down. Linear in the number of
+ * blocks, so only used for the placement hints.
+ */
+avl_node_t* DmaMem_walk_fit(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, int top_down);
+
+/*
+ * Pageblock grouping, config.pageblock_pages. pb_used counts the allocated
+ * pages of each pageblock of a region; pageblocks cut by the region's ends
+ * count their missing pages as allocated, so they are never whole. The
+ * engines place requests smaller than a pageblock where they touch no
+ * pageblock without allocated pages, if one of the first DMA_MEM_PB_SCAN
+ * free blocks they would consider allows it, and otherwise fall back to
+ * their plain choice. The long-lived and first-fit hints take precedence.
+ */
+#define DMA_MEM_PB_SCAN         16
+
+static inline int DmaMem_pb_small(const DmaMem_t* mm, unsigned long npages) {
+    return (mm->pb_used != NULL) && (npages < mm->config.pageblock_pages);
+}
+
+static inline unsigned long DmaMem_pb_of(const DmaMem_t* mm, unsigned long pageno) {
+    return ((mm->base_addr / mm->page_size + pageno) >> mm->pb_shift) - mm->pb_first;
+}
+
+/*
+ * Page of the free block node where npages at an aligned page leave every
+ * free pageblock whole, its bottom tried before its top; -1 when neither
+ * end will do.
+ */
+long DmaMem_pb_place(const DmaMem_t* mm, const avl_node_t* node, unsigned long npages, unsigned long align_pages);
+
+/* two-level segregated fit, DmaMemTlsf.c */
+int  DmaTlsf_init(DmaMem_t* mm);
+void DmaTlsf_exit(DmaMem_t* mm);
+long DmaTlsf_alloc(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags);
+long DmaTlsf_free(DmaMem_t* mm, unsigned long ptr);
+/* resizes the allocated block node in place; 0, or -1 when its successor has no room */
+int  DmaTlsf_resize(DmaMem_t* mm, avl_node_t* node, unsigned long npages);
+unsigned long DmaTlsf_largest_free(DmaMem_t* mm);
+/* checks the free lists against the free_blocks and free_pages the tags hold; returns the problems logged */
+int  DmaTlsf_validate(DmaMem_t* mm, unsigned long free_blocks, unsigned long free_pages);
+
+/* binary buddy, DmaMemBuddy.c */
+int  DmaBuddy_init(DmaMem_t* mm);
+void DmaBuddy_exit(DmaMem_t* mm);
+long DmaBuddy_alloc(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags);
+long DmaBuddy_free(DmaMem_t* mm, unsigned long ptr);
+/* npages is a power of two; 0, or -1 when the buddies needed to grow are not free */
+int  DmaBuddy_resize(DmaMem_t* mm, avl_node_t* node, unsigned long npages);
+unsigned long DmaBuddy_largest_free(DmaMem_t* mm);
+/* the block size in pages a request of npages is served from */
+unsigned long DmaBuddy_round_pages(unsigned long npages);
+/* DmaTlsf_validate for the buddy lists, also checking every block's size and alignment */
+int  DmaBuddy_validate(DmaMem_t* mm, unsigned long free_blocks, unsigned long free_pages);
+
+/*
+ * Sub-page object slabs, DmaMemSlab.c. They sit above the engines on the
+ * whole pool and take their pages through DmaMem_alloc/DmaMem_free, so
+ * they are called without any region lock held. page is the node of the
+ * slab page an object lives in.
+ */
+int           DmaSlab_init(DmaMem_t* mm);
+void          DmaSlab_exit(DmaMem_t* mm);
+int           DmaSlab_class(DmaMem_t* mm, unsigned long size, unsigned long align);
+unsigned long DmaSlab_alloc(DmaMem_t* mm, int cls);
+/* bytes in each object of the slab page */
+unsigned long DmaSlab_size(DmaMem_t* mm, avl_node_t* page);
+int           DmaSlab_free(DmaMem_t* mm, avl_node_t* page, unsigned long ptr);
+void*         DmaSlab_kaddr(DmaMem_t* mm, avl_node_t* page, unsigned long ptr);
+void          DmaSlab_shrink(DmaMem_t* mm);
+
+/* handle table, DmaMemHandle.c */
+int  DmaHandle_init(DmaMem_t* mm);
+void DmaHandle_exit(DmaMem_t* mm);
+
+#endif
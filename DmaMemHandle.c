@@ -0,0 +1,262 @@
+#include "DmaMemEngine.h"
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+
+/*
+ * Handle table for relocatable allocations.
+ *
+ * A handle names an entry of a fixed table sized by config.handles: the
+ * low DMA_HANDLE_INDEX_BITS bits are the entry index plus one, the bits
+ * above a generation that changes whenever the entry is reused, so a stale
+ * handle is refused instead of reaching someone else's block.
+ *
+ * One mutex covers the table. DmaMem_compact holds it while it moves a
+ * block, so a pin either sees the block before the move or after it and
+ * never while its contents are in flight; it is dropped between blocks to
+ * let pins and frees through.
+ */
+
+#define DMA_HANDLE_INDEX_BITS   20
+#define DMA_HANDLE_INDEX_MASK   ((1u << DMA_HANDLE_INDEX_BITS) - 1)
+#define DMA_HANDLE_MAX          DMA_HANDLE_INDEX_MASK
+#define DMA_HANDLE_NONE         0xffffffffu
+
+typedef struct {
+    unsigned long       ptr;            /* 0 while the entry is free */
+    unsigned long       size;
+    u32                 pins;
+    u32                 gen;
+    u32                 next_free;
+} DmaHandleEntry_t;
+
+struct DmaHandleTable_struct {
+    struct mutex        lock;
+    u32                 nr_entries;
+    u32                 free_head;
+    DmaHandleEntry_t    entries[];
+};
+
+int DmaHandle_init(DmaMem_t* mm) {
+    struct DmaHandleTable_struct* table;
+    u32 i;
+
+    if (mm->config.handles > DMA_HANDLE_MAX) {
+        DmaMem_log(mm, "[VDI] vmem_init: at most %u handles\n", DMA_HANDLE_MAX);
+        return -1;
+    }
+    table = (struct DmaHandleTable_struct*)DmaMem_meta_alloc(mm, sizeof(*table) + mm->config.handles * sizeof(DmaHandleEntry_t), GFP_KERNEL);
+    if (table == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate the handle table when vmem_init\n");
+        return -1;
+    }
+    mutex_init(&table->lock);
+    table->nr_entries = mm->config.handles;
+    table->free_head  = 0;
+    for (i = 0; i < table->nr_entries; ++i) {
+        table->entries[i].ptr       = 0;
+        table->entries[i].size      = 0;
+        table->entries[i].pins      = 0;
+        table->entries[i].gen       = 0;
+        table->entries[i].next_free = (i + 1 < table->nr_entries) ? i + 1 : DMA_HANDLE_NONE;
+    }
+    mm->handles = table;
+    return 0;
+}
+
+/* the blocks still behind handles go away with the regions */
+void DmaHandle_exit(DmaMem_t* mm) {
+    mutex_destroy(&mm->handles->lock);
+    DmaMem_meta_free(mm, mm->handles);
+    mm->handles = NULL;
+}
+
+static DmaMemHandle_t handle_of(u32 index, u32 gen) {
+    return (gen << DMA_HANDLE_INDEX_BITS) | (index + 1);
+}
+
+/* the live entry a handle names, or NULL; called with the table lock held */
+static DmaHandleEntry_t* handle_entry(struct DmaHandleTable_struct* table, DmaMemHandle_t handle) {
+    u32 index = (handle & DMA_HANDLE_INDEX_MASK) - 1;
+    DmaHandleEntry_t* entry;
+
+    if (((handle & DMA_HANDLE_INDEX_MASK) == 0) || (index >= table->nr_entries)) {
+        return NULL;
+    }
+    entry = &table->entries[index];
+    if ((entry->ptr == 0) || (handle_of(index, entry->gen) != handle)) {
+        return NULL;
+    }
+    return entry;
+}
+
+DmaMemHandle_t DmaMem_handle_alloc(DmaMem_t* mm, unsigned long size) {
+    struct DmaHandleTable_struct* table;
+    DmaHandleEntry_t* entry;
+    unsigned long ptr;
+    u32 index;
+
+    if ((mm == NULL) || (mm->handles == NULL)) {
+        DmaMem_log(mm, "vmem_handle_alloc: invalid handle\n");
+        return 0;
+    }
+    table = mm->handles;
+
+    ptr = DmaMem_alloc(mm, size);
+    if (ptr == (unsigned long)-1) {
+        return 0;
+    }
+    mutex_lock(&table->lock);
+    if (table->free_head == DMA_HANDLE_NONE) {
+        mutex_unlock(&table->lock);
+        DmaMem_free(mm, ptr);
+        DmaMem_log(mm, "vmem_handle_alloc: all %u handles in use\n", table->nr_entries);
+        return 0;
+    }
+    index = table->free_head;
+    entry = &table->entries[index];
+    table->free_head = entry->next_free;
+    entry->ptr  = ptr;
+    entry->size = size;
+    entry->pins = 0;
+    mutex_unlock(&table->lock);
+    return handle_of(index, entry->gen);
+}
+
+int DmaMem_handle_free(DmaMem_t* mm, DmaMemHandle_t handle) {
+    struct DmaHandleTable_struct* table;
+    DmaHandleEntry_t* entry;
+    unsigned long ptr;
+
+    if ((mm == NULL) || (mm->handles == NULL)) {
+        DmaMem_log(mm, "vmem_handle_free: invalid handle\n");
+        return -1;
+    }
+    table = mm->handles;
+
+    mutex_lock(&table->lock);
+    entry = handle_entry(table, handle);
+    if ((entry == NULL) || (entry->pins > 0)) {
+        mutex_unlock(&table->lock);
+        DmaMem_log(mm, "vmem_handle_free: handle 0x%x %s\n", handle, entry ? "is pinned" : "not found");
+        return -1;
+    }
+    ptr        = entry->ptr;
+    entry->ptr = 0;
+    entry->gen = (entry->gen + 1) & ((1u << (32 - DMA_HANDLE_INDEX_BITS)) - 1);
+    entry->next_free = table->free_head;
+    table->free_head = entry - table->entries;
+    mutex_unlock(&table->lock);
+    return DmaMem_free(mm, ptr);
+}
+
+unsigned long DmaMem_handle_pin(DmaMem_t* mm, DmaMemHandle_t handle) {
+    DmaHandleEntry_t* entry;
+    unsigned long ptr = (unsigned long)-1;
+
+    if ((mm == NULL) || (mm->handles == NULL)) {
+        DmaMem_log(mm, "vmem_handle_pin: invalid handle\n");
+        return (unsigned long)-1;
+    }
+
+    mutex_lock(&mm->handles->lock);
+    entry = handle_entry(mm->handles, handle);
+    if (entry) {
+        entry->pins++;
+        ptr = entry->ptr;
+    }
+    mutex_unlock(&mm->handles->lock);
+    if (entry == NULL) {
+        DmaMem_log(mm, "vmem_handle_pin: handle 0x%x not found\n", handle);
+    }
+    return ptr;
+}
+
+int DmaMem_handle_unpin(DmaMem_t* mm, DmaMemHandle_t handle) {
+    DmaHandleEntry_t* entry;
+    int ret = -1;
+
+    if ((mm == NULL) || (mm->handles == NULL)) {
+        DmaMem_log(mm, "vmem_handle_unpin: invalid handle\n");
+        return -1;
+    }
+
+    mutex_lock(&mm->handles->lock);
+    entry = handle_entry(mm->handles, handle);
+    if (entry && (entry->pins > 0)) {
+        entry->pins--;
+        ret = 0;
+    }
+    mutex_unlock(&mm->handles->lock);
+    if (ret != 0) {
+        DmaMem_log(mm, "vmem_handle_unpin: handle 0x%x is not pinned\n", handle);
+    }
+    return ret;
+}
+
+typedef struct {
+    unsigned long       ptr;
+    DmaMemHandle_t      handle;
+} DmaHandleMove_t;
+
+/* highest address first */
+static int cmp_move(const void* a, const void* b) {
+    unsigned long x = ((const DmaHandleMove_t*)a)->ptr, y = ((const DmaHandleMove_t*)b)->ptr;
+    return (x < y) - (x > y);
+}
+
+/*
+ * The candidates are the handles unpinned when the pass starts, taken from
+ * the top down so the blocks furthest up fill the lowest holes. Each one is
+ * checked again under the lock before it moves, as it may have been pinned
+ * or freed since.
+ */
+long DmaMem_compact(DmaMem_t* mm, DmaMemCopy_t copy, void* ctx) {
+    struct DmaHandleTable_struct* table;
+    DmaHandleEntry_t* entry;
+    DmaHandleMove_t*  moves;
+    unsigned long     n = 0, i, new_ptr;
+    long pages = 0;
+    u32  index;
+
+    if ((mm == NULL) || (mm->handles == NULL)) {
+        DmaMem_log(mm, "vmem_compact: invalid handle\n");
+        return -1;
+    }
+    table = mm->handles;
+
+    /* parked blocks and empty slabs are free space the moves can use */
+    DmaMem_flush(mm);
+
+    moves = (DmaHandleMove_t*)DmaMem_meta_alloc(mm, table->nr_entries * sizeof(DmaHandleMove_t), GFP_KERNEL);
+    if (moves == NULL) {
+        DmaMem_log(mm, "vmem_compact: failed to allocate the move list\n");
+        return -1;
+    }
+    mutex_lock(&table->lock);
+    for (index = 0; index < table->nr_entries; ++index) {
+        entry = &table->entries[index];
+        if ((entry->ptr != 0) && (entry->pins == 0)) {
+            moves[n].ptr    = entry->ptr;
+            moves[n].handle = handle_of(index, entry->gen);
+            n++;
+        }
+    }
+    mutex_unlock(&table->lock);
+    sort(moves, n, sizeof(DmaHandleMove_t), cmp_move, NULL);
+
+    for (i = 0; i < n; ++i) {
+        mutex_lock(&table->lock);
+        entry = handle_entry(table, moves[i].handle);
+        if (entry && (entry->pins == 0) && (entry->ptr == moves[i].ptr)) {
+            new_ptr = DmaMem_migrate(mm, entry->ptr, entry->size, copy, ctx);
+            if (new_ptr != (unsigned long)-1) {
+                entry->ptr = new_ptr;
+                pages += (entry->size + mm->page_size - 1) / mm->page_size;
+            }
+        }
+        mutex_unlock(&table->lock);
+    }
+    DmaMem_meta_free(mm, moves);
+    return pages;
+}
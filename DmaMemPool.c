@@ -0,0 +1,359 @@
+#include "DmaMemPool.h"
+#include "DmaMemEngine.h"
+#include <linux/slab.h>
+#include <linux/topology.h>
+
+/* printk, kzalloc and kfree through the pool's backend */
+static __printf(2, 3) void pool_log(const DmaPool_t* pool, const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    DmaMem_vlog(pool ? pool->backend : NULL, pool ? pool->backend_ctx : NULL, fmt, args);
+    va_end(args);
+}
+
+static void* pool_zalloc(const DmaPool_t* pool, unsigned long bytes) {
+    return pool->backend->alloc(pool->backend_ctx, bytes, GFP_KERNEL | __GFP_ZERO);
+}
+
+static void pool_free(const DmaPool_t* pool, const void* ptr) {
+    if (ptr) {
+        pool->backend->free(pool->backend_ctx, ptr);
+    }
+}
+
+/*
+ * Every node gets its own fallback order over the regions: ascending
+ * node_distance, ties in address order. It is rebuilt whenever a region
+ * is added, so the allocation path is a plain walk of one row.
+ */
+static void fallback_build(DmaPool_t* pool) {
+    int node, i, j;
+
+    for (node = 0; node < pool->nr_nodes; ++node) {
+        u8* order = pool->fallback + node * DMA_POOL_MAX_REGIONS;
+        for (i = 0; i < pool->nr_regions; ++i) {
+            int dist = node_distance(node, pool->regions[i]->nid);
+            for (j = i; (j > 0) && (node_distance(node, pool->regions[order[j - 1]]->nid) > dist); --j) {
+                order[j] = order[j - 1];
+            }
+            order[j] = i;
+        }
+    }
+}
+
+int DmaPool_init(DmaPool_t* pool) {
+    return DmaPool_init_backend(pool, NULL, NULL);
+}
+
+int DmaPool_init_backend(DmaPool_t* pool, const DmaMemBackend_t* backend, void* backend_ctx) {
+    if (pool == NULL) {
+        pool_log(pool, "vmem_pool_init: invalid handle\n");
+        return -1;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    pool->backend     = backend ? backend : &DmaMem_kernel_backend;
+    pool->backend_ctx = backend_ctx;
+    pool->nr_nodes    = nr_node_ids;
+    pool->fallback    = (u8*)pool_zalloc(pool, pool->nr_nodes * DMA_POOL_MAX_REGIONS);
+    if (pool->fallback == NULL) {
+        pool_log(pool, "[VDI] failed to allocate fallback lists when vmem_pool_init\n");
+        return -1;
+    }
+    return 0;
+}
+
+int DmaPool_exit(DmaPool_t* pool) {
+    int i;
+    if (pool == NULL) {
+        pool_log(pool, "vmem_pool_exit: invalid handle\n");
+        return -1;
+    }
+
+    for (i = 0; i < pool->nr_regions; ++i) {
+        DmaMem_exit(&pool->regions[i]->mm);
+        pool_free(pool, pool->regions[i]);
+        pool->regions[i] = NULL;
+    }
+    pool->nr_regions = 0;
+    pool_free(pool, pool->fallback);
+    pool->fallback = NULL;
+    return 0;
+}
+
+int DmaPool_add_region(DmaPool_t* pool, unsigned long addr, unsigned long size, unsigned long pageSize, int nid, const DmaMemConfig_t* config) {
+    DmaPoolRegion_t* region;
+    DmaMemConfig_t   cfg;
+    int i, pos = 0;
+
+    if ((pool == NULL) || (pool->fallback == NULL)) {
+        pool_log(pool, "vmem_pool_add: invalid handle\n");
+        return -1;
+    }
+    if (pool->nr_regions == DMA_POOL_MAX_REGIONS) {
+        pool_log(pool, "vmem_pool_add: at most %d regions\n", DMA_POOL_MAX_REGIONS);
+        return -1;
+    }
+    if ((nid < 0) || (nid >= pool->nr_nodes)) {
+        pool_log(pool, "vmem_pool_add: invalid node %d\n", nid);
+        return -1;
+    }
+    /* one page size keeps the combined page counts meaningful */
+    if ((pool->nr_regions > 0) && (pageSize != pool->regions[0]->mm.page_size)) {
+        pool_log(pool, "vmem_pool_add: page size %lu differs from the pool's %lu\n", pageSize, pool->regions[0]->mm.page_size);
+        return -1;
+    }
+    for (i = 0; i < pool->nr_regions; ++i) {
+        DmaMem_t* mm = &pool->regions[i]->mm;
+        if ((addr < mm->base_addr + mm->mem_size) && (mm->base_addr < addr + size)) {
+            pool_log(pool, "vmem_pool_add: 0x%lx+0x%lx overlaps 0x%lx+0x%lx\n", addr, size, mm->base_addr, mm->mem_size);
+            return -1;
+        }
+        if (mm->base_addr < addr) {
+            pos = i + 1;
+        }
+    }
+
+    if (config) {
+        cfg = *config;
+    } else {
+        memset(&cfg, 0, sizeof(cfg));
+    }
+    if (cfg.backend == NULL) {
+        cfg.backend     = pool->backend;
+        cfg.backend_ctx = pool->backend_ctx;
+    }
+
+    region = (DmaPoolRegion_t*)pool_zalloc(pool, sizeof(DmaPoolRegion_t));
+    if (region == NULL) {
+        pool_log(pool, "[VDI] failed to allocate region when vmem_pool_add\n");
+        return -1;
+    }
+    if (DmaMem_init_config(&region->mm, addr, size, pageSize, &cfg) != 0) {
+        pool_free(pool, region);
+        return -1;
+    }
+    region->nid = nid;
+
+    for (i = pool->nr_regions; i > pos; --i) {
+        pool->regions[i] = pool->regions[i - 1];
+    }
+    pool->regions[pos] = region;
+    pool->nr_regions++;
+    fallback_build(pool);
+    return 0;
+}
+
+/* binary search over the regions, which are sorted and disjoint */
+DmaPoolRegion_t* DmaPool_region_of(DmaPool_t* pool, unsigned long ptr) {
+    int lo = 0, hi = pool->nr_regions;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        DmaMem_t* mm = &pool->regions[mid]->mm;
+        if (ptr < mm->base_addr) {
+            hi = mid;
+        } else if (ptr - mm->base_addr >= mm->mem_size) {
+            lo = mid + 1;
+        } else {
+            return pool->regions[mid];
+        }
+    }
+    return NULL;
+}
+
+unsigned long DmaPool_alloc(DmaPool_t* pool, unsigned long size) {
+    return DmaPool_alloc_node(pool, size, 0, 0, NUMA_NO_NODE);
+}
+
+unsigned long DmaPool_alloc_node(DmaPool_t* pool, unsigned long size, unsigned long align, unsigned int flags, int nid) {
+    DmaMemInfo_t   info;
+    const u8*      order;
+    unsigned long  ptr;
+    int i;
+
+    if ((pool == NULL) || (pool->nr_regions == 0)) {
+        pool_log(pool, "vmem_pool_alloc: invalid handle\n");
+        return (unsigned long)-1;
+    }
+    if (size == 0) {
+        pool_log(pool, "%lu size of vmem_pool_alloc, failed\n", size);
+        return (unsigned long)-1;
+    }
+    if (nid == NUMA_NO_NODE) {
+        nid = numa_node_id();
+    }
+    if ((nid < 0) || (nid >= pool->nr_nodes)) {
+        pool_log(pool, "vmem_pool_alloc: invalid node %d\n", nid);
+        return (unsigned long)-1;
+    }
+
+    order = pool->fallback + nid * DMA_POOL_MAX_REGIONS;
+    for (i = 0; i < pool->nr_regions; ++i) {
+        DmaMem_t* mm = &pool->regions[order[i]]->mm;
+        if (size > mm->mem_size) {
+            continue;
+        }
+        ptr = DmaMem_try_alloc(mm, size, align, flags);
+        if (ptr != (unsigned long)-1) {
+            return ptr;
+        }
+    }
+
+    DmaPool_get_info(pool, &info);
+    pool_log(pool, "pages all:%lu used:%lu free:%lu, no region fits %lu bytes near node %d\n", info.total_pages, info.alloc_pages, info.free_pages, size, nid);
+    return (unsigned long)-1;
+}
+
+int DmaPool_free(DmaPool_t* pool, unsigned long ptr) {
+    DmaPoolRegion_t* region;
+
+    if (pool == NULL) {
+        pool_log(pool, "vmem_pool_free: invalid handle\n");
+        return -1;
+    }
+
+    region = DmaPool_region_of(pool, ptr);
+    if (region == NULL) {
+        pool_log(pool, "vmem_pool_free: 0x%08lx not found\n", ptr);
+        return -1;
+    }
+    return DmaMem_free(&region->mm, ptr);
+}
+
+int DmaPool_free_deferred(DmaPool_t* pool, unsigned long ptr) {
+    DmaPoolRegion_t* region;
+
+    if (pool == NULL) {
+        pool_log(pool, "vmem_pool_free_deferred: invalid handle\n");
+        return -1;
+    }
+
+    region = DmaPool_region_of(pool, ptr);
+    if (region == NULL) {
+        pool_log(pool, "vmem_pool_free_deferred: 0x%08lx not found\n", ptr);
+        return -1;
+    }
+    return DmaMem_free_deferred(&region->mm, ptr);
+}
+
+unsigned long DmaPool_resize(DmaPool_t* pool, unsigned long ptr, unsigned long new_size) {
+    DmaPoolRegion_t* region;
+
+    if (pool == NULL) {
+        pool_log(pool, "vmem_pool_resize: invalid handle\n");
+        return (unsigned long)-1;
+    }
+
+    region = DmaPool_region_of(pool, ptr);
+    if (region == NULL) {
+        pool_log(pool, "vmem_pool_resize: 0x%08lx not found\n", ptr);
+        return (unsigned long)-1;
+    }
+    return DmaMem_resize(&region->mm, ptr, new_size);
+}
+
+int DmaPool_flush(DmaPool_t* pool) {
+    int i;
+    if (pool == NULL) {
+        pool_log(pool, "vmem_pool_flush: invalid handle\n");
+        return -1;
+    }
+
+    for (i = 0; i < pool->nr_regions; ++i) {
+        DmaMem_flush(&pool->regions[i]->mm);
+    }
+    return 0;
+}
+
+void* DmaPool_get_kaddr(DmaPool_t* pool, unsigned long ptr) {
+    DmaPoolRegion_t* region;
+
+    if (pool == NULL) {
+        pool_log(pool, "vmem_pool_get_kaddr: invalid handle\n");
+        return NULL;
+    }
+
+    region = DmaPool_region_of(pool, ptr);
+    if (region == NULL) {
+        pool_log(pool, "vmem_pool_get_kaddr: 0x%08lx not found\n", ptr);
+        return NULL;
+    }
+    return DmaMem_get_kaddr(&region->mm, ptr);
+}
+
+int DmaPool_get_info(DmaPool_t* pool, DmaMemInfo_t* info) {
+    DmaMemInfo_t part;
+    int i, p;
+    if ((pool == NULL) || (info == NULL)) {
+        return -1;
+    }
+
+    memset(info, 0, sizeof(*info));
+    for (i = 0; i < pool->nr_regions; ++i) {
+        DmaMem_get_info(&pool->regions[i]->mm, &part);
+        info->total_pages += part.total_pages;
+        info->alloc_pages += part.alloc_pages;
+        info->free_pages  += part.free_pages;
+        info->meta_bytes  += part.meta_bytes;
+        info->page_size    = part.page_size;
+        info->total_pageblocks += part.total_pageblocks;
+        info->free_pageblocks  += part.free_pageblocks;
+        info->resize_in_place  += part.resize_in_place;
+        info->resize_moved     += part.resize_moved;
+        info->deferred_pending += part.deferred_pending;
+        info->reserved_pages   += part.reserved_pages;
+        info->clean_pages      += part.clean_pages;
+        info->dirty_pages      += part.dirty_pages;
+        if (part.largest_free > info->largest_free) {
+            info->largest_free = part.largest_free;
+        }
+        for (p = 0; p < DMA_MEM_POLICIES; ++p) {
+            info->policy[p].allocs      += part.policy[p].allocs;
+            info->policy[p].pages       += part.policy[p].pages;
+            info->policy[p].failed      += part.policy[p].failed;
+            info->policy[p].frag_failed += part.policy[p].frag_failed;
+        }
+    }
+    return 0;
+}
+
+int DmaPool_get_stats(DmaPool_t* pool, DmaMemStats_t* stats) {
+    DmaMemStats_t part;
+    int i, b;
+    if ((pool == NULL) || (stats == NULL)) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < pool->nr_regions; ++i) {
+        DmaMem_get_stats(&pool->regions[i]->mm, &part);
+        stats->free_pages  += part.free_pages;
+        stats->free_blocks += part.free_blocks;
+        stats->allocs      += part.allocs;
+        stats->failed      += part.failed;
+        stats->frag_failed += part.frag_failed;
+        stats->frees       += part.frees;
+        if (part.largest_free > stats->largest_free) {
+            stats->largest_free = part.largest_free;
+        }
+        if (part.tree_height > stats->tree_height) {
+            stats->tree_height = part.tree_height;
+        }
+        if (part.tree_peak > stats->tree_peak) {
+            stats->tree_peak = part.tree_peak;
+        }
+        for (b = 0; b < DMA_MEM_HIST_BUCKETS; ++b) {
+            stats->free_hist[b] += part.free_hist[b];
+        }
+        for (b = 0; b < DMA_MEM_LAT_BUCKETS; ++b) {
+            stats->alloc_ns[b] += part.alloc_ns[b];
+            stats->free_ns[b]  += part.free_ns[b];
+        }
+    }
+    if (stats->free_pages) {
+        stats->frag_index = 1000 - (unsigned int)(stats->largest_free * 1000 / stats->free_pages);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef __DMA_MEM_POOL_H
+#define __DMA_MEM_POOL_H
+
+/*
+ * A pool of DmaMem_t regions, one per reserved-memory carve-out, each
+ * tagged with the NUMA node it is attached to. Allocations try the
+ * caller's node first and fall back to the other regions by node
+ * distance; frees and lookups route to the owning region by address.
+ *
+ * Regions are registered with DmaPool_add_region before the pool is used;
+ * adding regions is not safe against concurrent allocations.
+ */
+
+#include "DmaMem.h"
+
+#define DMA_POOL_MAX_REGIONS    16
+
+typedef struct {
+    DmaMem_t        mm;
+    int             nid;
+} DmaPoolRegion_t;
+
+typedef struct {
+    DmaPoolRegion_t* regions[DMA_POOL_MAX_REGIONS];    /* sorted by base address */
+    int              nr_regions;
+    int              nr_nodes;
+    u8*              fallback;      /* per node, region indices by distance */
+    const DmaMemBackend_t* backend; /* the pool's own metadata and messages */
+    void*            backend_ctx;
+} DmaPool_t;
+
+int DmaPool_init(DmaPool_t* pool);
+
+/*
+ * DmaPool_init taking the pool's metadata and messages from backend, NULL
+ * for DmaMem_kernel_backend. Regions added without a config.backend use
+ * it too.
+ */
+int DmaPool_init_backend(DmaPool_t* pool, const DmaMemBackend_t* backend, void* backend_ctx);
+
+int DmaPool_exit(DmaPool_t* pool);
+
+/* registers [addr, addr + size) on NUMA node nid; regions must not overlap */
+int DmaPool_add_region(DmaPool_t* pool, unsigned long addr, unsigned long size, unsigned long pageSize, int nid, const DmaMemConfig_t* config);
+
+unsigned long DmaPool_alloc(DmaPool_t* pool, unsigned long size);
+
+/* allocates near nid, NUMA_NO_NODE for the caller's node; align and flags as for DmaMem_alloc_flags */
+unsigned long DmaPool_alloc_node(DmaPool_t* pool, unsigned long size, unsigned long align, unsigned int flags, int nid);
+
+int DmaPool_free(DmaPool_t* pool, unsigned long ptr);
+
+/* DmaMem_free_deferred on the owning region, which needs config.deferred */
+int DmaPool_free_deferred(DmaPool_t* pool, unsigned long ptr);
+
+/* DmaMem_resize on the owning region; a move stays within that region */
+unsigned long DmaPool_resize(DmaPool_t* pool, unsigned long ptr, unsigned long new_size);
+
+int DmaPool_flush(DmaPool_t* pool);
+
+void* DmaPool_get_kaddr(DmaPool_t* pool, unsigned long ptr);
+
+/* the region owning ptr, or NULL */
+DmaPoolRegion_t* DmaPool_region_of(DmaPool_t* pool, unsigned long ptr);
+
+/* totals over every region, largest_free is the largest of any region */
+int DmaPool_get_info(DmaPool_t* pool, DmaMemInfo_t* info);
+
+/* DmaMem_get_stats over every region: counts add up, largest_free and the tree heights are the largest of any region */
+int DmaPool_get_stats(DmaPool_t* pool, DmaMemStats_t* stats);
+
+#endif
@@ -0,0 +1,232 @@
+#include "DmaMemEngine.h"
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/compiler.h>
+
+/*
+ * Sub-page object slabs.
+ *
+ * Requests of up to half a page are served from power-of-two classes
+ * between DMA_MEM_SLAB_MIN bytes and half a page. Each slab is one page
+ * allocated through DmaMem_alloc and split into objects of its class, with
+ * a bitmap of the objects handed out. The page's node carries is_slab and
+ * a pointer to the slab, so DmaMem_free finds the slab of any object from
+ * the head tag of its page and the engines never see single objects.
+ *
+ * The slab headers live in kernel memory, not in the DMA page. A class
+ * keeps its slabs on two lists under its own lock: partial, with free
+ * objects, and full. Emptied slabs go to the tail of partial so the head
+ * is always the fullest one; one empty slab per class is kept to absorb
+ * alloc/free bursts, the rest are given back at once and DmaMem_flush
+ * gives back all of them.
+ */
+
+struct DmaSlab_struct {
+    struct list_head    list;           /* partial or full list of its class */
+    unsigned long       addr;           /* physical address of the page */
+    unsigned char*      kaddr;          /* kernel mapping of the page */
+    unsigned int        cls;
+    unsigned int        inuse;
+    unsigned int        nobj;
+    unsigned long       bitmap[];       /* set bits are allocated objects */
+};
+
+struct DmaSlabCache_struct {
+    spinlock_t          lock;
+    unsigned int        shift;          /* object size is 1 << shift */
+    unsigned int        nr_empty;
+    struct list_head    partial;
+    struct list_head    full;
+};
+
+int DmaSlab_init(DmaMem_t* mm) {
+    int i;
+
+    mm->nr_slab_classes = 0;
+    while ((mm->nr_slab_classes < DMA_MEM_SLAB_CLASSES) &&
+           ((DMA_MEM_SLAB_MIN << mm->nr_slab_classes) <= mm->page_size / 2)) {
+        mm->nr_slab_classes++;
+    }
+    if (mm->nr_slab_classes == 0) {
+        DmaMem_log(mm, "[VDI] vmem_init: page size %lu is too small for slabs\n", mm->page_size);
+        return -1;
+    }
+
+    mm->slab_caches = (struct DmaSlabCache_struct*)DmaMem_meta_alloc(mm, mm->nr_slab_classes * sizeof(struct DmaSlabCache_struct), GFP_KERNEL | __GFP_ZERO);
+    if (mm->slab_caches == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate slab caches when vmem_init\n");
+        mm->nr_slab_classes = 0;
+        return -1;
+    }
+    for (i = 0; i < mm->nr_slab_classes; ++i) {
+        struct DmaSlabCache_struct* cache = &mm->slab_caches[i];
+        spin_lock_init(&cache->lock);
+        cache->shift = __fls(DMA_MEM_SLAB_MIN) + i;
+        INIT_LIST_HEAD(&cache->partial);
+        INIT_LIST_HEAD(&cache->full);
+    }
+    return 0;
+}
+
+/* the headers only; the pages go away with the regions */
+void DmaSlab_exit(DmaMem_t* mm) {
+    struct DmaSlab_struct *slab, *next;
+    int i;
+
+    for (i = 0; i < mm->nr_slab_classes; ++i) {
+        struct DmaSlabCache_struct* cache = &mm->slab_caches[i];
+        list_for_each_entry_safe(slab, next, &cache->partial, list) {
+            DmaMem_meta_free(mm, slab);
+        }
+        list_for_each_entry_safe(slab, next, &cache->full, list) {
+            DmaMem_meta_free(mm, slab);
+        }
+    }
+    DmaMem_meta_free(mm, mm->slab_caches);
+    mm->slab_caches     = NULL;
+    mm->nr_slab_classes = 0;
+}
+
+/* the class serving size bytes aligned to align, or -1 when it needs whole pages */
+int DmaSlab_class(DmaMem_t* mm, unsigned long size, unsigned long align) {
+    unsigned long bytes = (size > align) ? size : align;
+    int cls;
+
+    if ((mm->slab_caches == NULL) || (bytes > mm->page_size / 2)) {
+        return -1;
+    }
+    if (bytes <= DMA_MEM_SLAB_MIN) {
+        return 0;
+    }
+    cls = __fls(bytes - 1) + 1 - __fls(DMA_MEM_SLAB_MIN);
+    return (cls < mm->nr_slab_classes) ? cls : -1;
+}
+
+static struct DmaSlab_struct* slab_create(DmaMem_t* mm, int cls) {
+    struct DmaSlab_struct* slab;
+    avl_node_t*   page;
+    unsigned int  nobj = mm->page_size >> mm->slab_caches[cls].shift;
+    unsigned long addr;
+
+    slab = (struct DmaSlab_struct*)DmaMem_meta_alloc(mm, sizeof(struct DmaSlab_struct) + BITS_TO_LONGS(nobj) * sizeof(unsigned long), GFP_ATOMIC | __GFP_ZERO);
+    if (slab == NULL) {
+        DmaMem_log(mm, "vmem_alloc: failed to allocate a slab header\n");
+        return NULL;
+    }
+    addr = DmaMem_alloc_nested(mm, mm->page_size);
+    if (addr == (unsigned long)-1) {
+        DmaMem_meta_free(mm, slab);
+        return NULL;
+    }
+    slab->addr  = addr;
+    slab->kaddr = (unsigned char*)DmaMem_get_kaddr(mm, addr);
+    slab->cls   = cls;
+    slab->nobj  = nobj;
+
+    page = DmaMem_lookup_block(DmaMem_region_of(mm, addr), addr);
+    page->slab = slab;
+    WRITE_ONCE(page->is_slab, 1);
+    return slab;
+}
+
+/* returns the page to the pool; the slab is already off its class lists */
+static void slab_destroy(DmaMem_t* mm, struct DmaSlab_struct* slab) {
+    avl_node_t* page = DmaMem_lookup_block(DmaMem_region_of(mm, slab->addr), slab->addr);
+
+    WRITE_ONCE(page->is_slab, 0);
+    DmaMem_free_nested(mm, slab->addr);
+    DmaMem_meta_free(mm, slab);
+}
+
+unsigned long DmaSlab_alloc(DmaMem_t* mm, int cls) {
+    struct DmaSlabCache_struct* cache = &mm->slab_caches[cls];
+    struct DmaSlab_struct* slab;
+    unsigned long idx;
+
+    spin_lock(&cache->lock);
+    if (list_empty(&cache->partial)) {
+        /* DmaMem_alloc may memremap, which must not run under a spinlock */
+        spin_unlock(&cache->lock);
+        slab = slab_create(mm, cls);
+        if (slab == NULL) {
+            return (unsigned long)-1;
+        }
+        spin_lock(&cache->lock);
+        list_add(&slab->list, &cache->partial);
+    } else {
+        slab = list_first_entry(&cache->partial, struct DmaSlab_struct, list);
+        if (slab->inuse == 0) {
+            cache->nr_empty--;
+        }
+    }
+
+    idx = find_first_zero_bit(slab->bitmap, slab->nobj);
+    __set_bit(idx, slab->bitmap);
+    if (++slab->inuse == slab->nobj) {
+        list_move(&slab->list, &cache->full);
+    }
+    spin_unlock(&cache->lock);
+    return slab->addr + (idx << cache->shift);
+}
+
+int DmaSlab_free(DmaMem_t* mm, avl_node_t* page, unsigned long ptr) {
+    struct DmaSlab_struct* slab = page->slab;
+    struct DmaSlabCache_struct* cache = &mm->slab_caches[slab->cls];
+    unsigned long off = ptr - slab->addr;
+    unsigned long idx = off >> cache->shift;
+
+    spin_lock(&cache->lock);
+    if ((off & ((1UL << cache->shift) - 1)) || !test_bit(idx, slab->bitmap)) {
+        spin_unlock(&cache->lock);
+        DmaMem_log(mm, "vmem_free: 0x%08lx not found\n", ptr);
+        return -1;
+    }
+    __clear_bit(idx, slab->bitmap);
+    if (slab->inuse-- == slab->nobj) {
+        list_move(&slab->list, &cache->partial);
+    }
+    if (slab->inuse == 0) {
+        if (cache->nr_empty == 0) {
+            cache->nr_empty++;
+            list_move_tail(&slab->list, &cache->partial);
+        } else {
+            list_del(&slab->list);
+            spin_unlock(&cache->lock);
+            slab_destroy(mm, slab);
+            return 0;
+        }
+    }
+    spin_unlock(&cache->lock);
+    return 0;
+}
+
+unsigned long DmaSlab_size(DmaMem_t* mm, avl_node_t* page) {
+    return 1UL << mm->slab_caches[page->slab->cls].shift;
+}
+
+void* DmaSlab_kaddr(DmaMem_t* mm, avl_node_t* page, unsigned long ptr) {
+    struct DmaSlab_struct* slab = page->slab;
+    return slab->kaddr ? slab->kaddr + (ptr - slab->addr) : NULL;
+}
+
+/* gives every empty slab back to the pool */
+void DmaSlab_shrink(DmaMem_t* mm) {
+    struct DmaSlab_struct *slab, *next;
+    LIST_HEAD(empty);
+    int i;
+
+    for (i = 0; i < mm->nr_slab_classes; ++i) {
+        struct DmaSlabCache_struct* cache = &mm->slab_caches[i];
+        spin_lock(&cache->lock);
+        list_for_each_entry_safe(slab, next, &cache->partial, list) {
+            if (slab->inuse == 0) {
+                list_move(&slab->list, &empty);
+            }
+        }
+        cache->nr_empty = 0;
+        spin_unlock(&cache->lock);
+    }
+    list_for_each_entry_safe(slab, next, &empty, list) {
+        slab_destroy(mm, slab);
+    }
+}
@@ -0,0 +1,388 @@
+#include "DmaMemEngine.h"
+#include <linux/slab.h>
+#include <linux/bitops.h>
+
+/*
+ * Two-level segregated fit (TLSF) engine.
+ *
+ * Free blocks are binned by size in pages: the first level is the power of
+ * two, the second level splits each power of two into TLSF_SL_COUNT linear
+ * classes (blocks below TLSF_SL_COUNT pages get one class per size). A
+ * bitmap per level finds the smallest non-empty class that is guaranteed to
+ * fit with two bit searches, so alloc and free are O(1) regardless of
+ * fragmentation.
+ *
+ * Each free block's node is linked into its class list through ListEntry.
+ * Neighbours are found through the boundary tags: the head tag of the next
+ * block, the tail tag of the previous one.
+ */
+
+#define TLSF_SL_SHIFT       4
+#define TLSF_SL_COUNT       (1 << TLSF_SL_SHIFT)
+#define TLSF_FL_COUNT       28      /* blocks of up to 2^31 pages */
+
+struct DmaTlsf_struct {
+    unsigned int        fl_bitmap;
+    unsigned int        sl_bitmap[TLSF_FL_COUNT];
+    struct list_head    free_list[TLSF_FL_COUNT][TLSF_SL_COUNT];
+};
+
+static void mapping_insert(unsigned long npages, int* fl, int* sl) {
+    int msb;
+    if (npages < TLSF_SL_COUNT) {
+        *fl = 0;
+        *sl = npages;
+        return;
+    }
+    msb = __fls(npages);
+    *sl = (npages >> (msb - TLSF_SL_SHIFT)) ^ TLSF_SL_COUNT;
+    *fl = msb - TLSF_SL_SHIFT + 1;
+}
+
+/* rounds up to the next class boundary so every block in the class fits */
+static void mapping_search(unsigned long npages, int* fl, int* sl) {
+    if (npages >= TLSF_SL_COUNT) {
+        npages += (1UL << (__fls(npages) - TLSF_SL_SHIFT)) - 1;
+    }
+    mapping_insert(npages, fl, sl);
+}
+
+static void insert_free(DmaMem_t* mm, avl_node_t* node) {
+    struct DmaTlsf_struct* tlsf = mm->tlsf;
+    int fl, sl;
+
+    DmaMem_mark_block(mm, node, 0);
+    mapping_insert(node->npages, &fl, &sl);
+    list_add(&(node->ListEntry), &(tlsf->free_list[fl][sl]));
+    tlsf->fl_bitmap     |= 1U << fl;
+    tlsf->sl_bitmap[fl] |= 1U << sl;
+}
+
+/* a new free block, with a node taken from the pool reserved by the caller */
+static void make_free(DmaMem_t* mm, unsigned long pageno, unsigned long npages) {
+    avl_node_t* node = DmaMem_popfront(mm);
+
+    node->pageno = pageno;
+    node->npages = npages;
+    insert_free(mm, node);
+}
+
+static void remove_free(DmaMem_t* mm, avl_node_t* node) {
+    struct DmaTlsf_struct* tlsf = mm->tlsf;
+    int fl, sl;
+
+    mapping_insert(node->npages, &fl, &sl);
+    list_del(&(node->ListEntry));
+    if (list_empty(&(tlsf->free_list[fl][sl]))) {
+        tlsf->sl_bitmap[fl] &= ~(1U << sl);
+        if (tlsf->sl_bitmap[fl] == 0) {
+            tlsf->fl_bitmap &= ~(1U << fl);
+        }
+    }
+}
+
+int DmaTlsf_init(DmaMem_t* mm) {
+    int fl, sl;
+
+    mm->tlsf = (struct DmaTlsf_struct*)DmaMem_meta_alloc(mm, sizeof(struct DmaTlsf_struct), GFP_KERNEL | __GFP_ZERO);
+    if (mm->tlsf == NULL) {
+        DmaMem_log(mm, "[VDI] failed to allocate tlsf when vmem_init\n");
+        return -1;
+    }
+
+    for (fl = 0; fl < TLSF_FL_COUNT; ++fl) {
+        for (sl = 0; sl < TLSF_SL_COUNT; ++sl) {
+            INIT_LIST_HEAD(&(mm->tlsf->free_list[fl][sl]));
+        }
+    }
+    make_free(mm, 0, mm->num_pages);
+    return 0;
+}
+
+void DmaTlsf_exit(DmaMem_t* mm) {
+    if (mm->tlsf) {
+        DmaMem_meta_free(mm, mm->tlsf);
+        mm->tlsf = NULL;
+    }
+}
+
+/* the first block of the smallest non-empty class at or above (fl, sl), or NULL */
+static avl_node_t* find_free(DmaMem_t* mm, int fl, int sl) {
+    struct DmaTlsf_struct* tlsf = mm->tlsf;
+    unsigned int sl_map, fl_map;
+
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+    sl_map = tlsf->sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        fl_map = (fl + 1 < TLSF_FL_COUNT) ? (tlsf->fl_bitmap & (~0U << (fl + 1))) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl     = __ffs(fl_map);
+        sl_map = tlsf->sl_bitmap[fl];
+    }
+    sl = __ffs(sl_map);
+
+    return list_first_entry(&(tlsf->free_list[fl][sl]), avl_node_t, ListEntry);
+}
+
+/*
+ * Any block of npages + align_pages - 1 pages holds an aligned sub-range,
+ * so that class is tried first. When it is empty the classes that may hold
+ * npages are walked block by block, which only happens close to exhaustion.
+ */
+static avl_node_t* find_aligned(DmaMem_t* mm, unsigned long npages, unsigned long align_pages) {
+    struct DmaTlsf_struct* tlsf = mm->tlsf;
+    avl_node_t* node;
+    int fl, sl;
+
+    mapping_search(npages + align_pages - 1, &fl, &sl);
+    node = find_free(mm, fl, sl);
+    if (node) {
+        return node;
+    }
+
+    mapping_insert(npages, &fl, &sl);
+    for (; fl < TLSF_FL_COUNT; ++fl, sl = 0) {
+        for (; sl < TLSF_SL_COUNT; ++sl) {
+            if ((tlsf->sl_bitmap[fl] & (1U << sl)) == 0) {
+                continue;
+            }
+            list_for_each_entry(node, &(tlsf->free_list[fl][sl]), ListEntry) {
+                if (DmaMem_align_pageno(mm, node->pageno, align_pages) + npages <= node->pageno + node->npages) {
+                    return node;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Pageblock grouping: the first DMA_MEM_PB_SCAN blocks from the class of
+ * npages upwards, in class order, for one where npages leave the free
+ * pageblocks whole. Stores the page in *pageno, NULL when none does.
+ */
+static avl_node_t* find_pageblock(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned long* pageno) {
+    struct DmaTlsf_struct* tlsf = mm->tlsf;
+    avl_node_t* node;
+    int fl, sl, scanned = 0;
+    long place;
+
+    mapping_insert(npages, &fl, &sl);
+    for (; fl < TLSF_FL_COUNT; ++fl, sl = 0) {
+        for (; sl < TLSF_SL_COUNT; ++sl) {
+            if ((tlsf->sl_bitmap[fl] & (1U << sl)) == 0) {
+                continue;
+            }
+            list_for_each_entry(node, &(tlsf->free_list[fl][sl]), ListEntry) {
+                place = DmaMem_pb_place(mm, node, npages, align_pages);
+                if (place >= 0) {
+                    *pageno = place;
+                    return node;
+                }
+                if (++scanned == DMA_MEM_PB_SCAN) {
+                    return NULL;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The size classes know nothing about addresses, so the long-lived and
+ * first-fit hints walk the blocks instead; short-lived requests keep the
+ * O(1) search, which carves from the bottom of the block it finds, unless
+ * pageblock grouping picks the block and the end to carve from.
+ */
+long DmaTlsf_alloc(DmaMem_t* mm, unsigned long npages, unsigned long align_pages, unsigned int flags) {
+    avl_node_t* node = NULL;
+    unsigned long pageno, free_pageno, free_npages;
+    int fl, sl, placed = 0;
+
+    if (flags & (DMA_MEM_LONG_LIVED | DMA_MEM_FIRST_FIT)) {
+        node = DmaMem_walk_fit(mm, npages, align_pages, (flags & DMA_MEM_LONG_LIVED) != 0);
+    } else {
+        if (DmaMem_pb_small(mm, npages)) {
+            node   = find_pageblock(mm, npages, align_pages, &pageno);
+            placed = (node != NULL);
+        }
+        if ((node == NULL) && (align_pages > 1)) {
+            node = find_aligned(mm, npages, align_pages);
+        } else if (node == NULL) {
+            mapping_search(npages, &fl, &sl);
+            node = find_free(mm, fl, sl);
+        }
+    }
+    if (node == NULL) {
+        return -1;
+    }
+    free_pageno = node->pageno;
+    free_npages = node->npages;
+    if (flags & DMA_MEM_LONG_LIVED) {
+        pageno = DmaMem_fit_top(mm, node, npages, align_pages);
+    } else if (!placed) {
+        pageno = (align_pages > 1) ? DmaMem_align_pageno(mm, free_pageno, align_pages) : free_pageno;
+    }
+    remove_free(mm, node);
+
+    /* leading and trailing remainders go back to the free lists */
+    if (pageno > free_pageno) {
+        make_free(mm, free_pageno, pageno - free_pageno);
+    }
+    if (pageno + npages < free_pageno + free_npages) {
+        make_free(mm, pageno + npages, free_pageno + free_npages - pageno - npages);
+    }
+    node->pageno = pageno;
+    node->npages = npages;
+    node->parked = 0;
+    node->kaddr  = NULL;
+    DmaMem_mark_block(mm, node, 1);
+    return pageno;
+}
+
+long DmaTlsf_free(DmaMem_t* mm, unsigned long ptr) {
+    avl_node_t* node = DmaMem_lookup_block(mm, ptr);
+    avl_node_t* neighbour;
+    unsigned long pageno, npages;
+
+    if ((node == NULL) || !DmaMem_page_used(mm, node->pageno)) {
+        DmaMem_log(mm, "vmem_free: 0x%08lx not found\n", ptr);
+        return -1;
+    }
+    pageno = node->pageno;
+    npages = node->npages;
+    DmaMem_clear_block(mm, pageno, npages);
+
+    /* previous block, found through its tail tag */
+    if ((pageno > 0) && !DmaMem_page_used(mm, pageno - 1)) {
+        neighbour = DmaMem_block_at(mm, DmaMem_block_head(mm, pageno - 1));
+        remove_free(mm, neighbour);
+        DmaMem_clear_block(mm, neighbour->pageno, neighbour->npages);
+        node->pageno  = neighbour->pageno;
+        node->npages += neighbour->npages;
+        DmaMem_pushback(mm, neighbour);
+    }
+
+    /* next block, found through its head tag */
+    if ((pageno + npages < mm->num_pages) && !DmaMem_page_used(mm, pageno + npages)) {
+        neighbour = DmaMem_block_at(mm, pageno + npages);
+        remove_free(mm, neighbour);
+        DmaMem_clear_block(mm, neighbour->pageno, neighbour->npages);
+        node->npages += neighbour->npages;
+        DmaMem_pushback(mm, neighbour);
+    }
+
+    insert_free(mm, node);
+    return npages;
+}
+
+/* the top class only bounds the size, its blocks are compared one by one */
+unsigned long DmaTlsf_largest_free(DmaMem_t* mm) {
+    struct DmaTlsf_struct* tlsf = mm->tlsf;
+    unsigned long largest = 0;
+    avl_node_t* node;
+    int fl, sl;
+
+    if (tlsf->fl_bitmap == 0) {
+        return 0;
+    }
+    fl = __fls(tlsf->fl_bitmap);
+    sl = __fls(tlsf->sl_bitmap[fl]);
+    list_for_each_entry(node, &(tlsf->free_list[fl][sl]), ListEntry) {
+        if (node->npages > largest) {
+            largest = node->npages;
+        }
+    }
+    return largest;
+}
+
+/*
+ * A shrink hands the tail to a free successor or makes it a free block of
+ * its own; a grow takes the missing pages from the bottom of a free
+ * successor, which is filed again under its new size.
+ */
+int DmaTlsf_resize(DmaMem_t* mm, avl_node_t* node, unsigned long npages) {
+    unsigned long end = node->pageno + node->npages;
+    unsigned long extra;
+    avl_node_t*   next = NULL;
+
+    if ((end < mm->num_pages) && !DmaMem_page_used(mm, end)) {
+        next = DmaMem_block_at(mm, end);
+    }
+
+    if (npages < node->npages) {
+        extra        = node->npages - npages;
+        node->npages = npages;
+        DmaMem_mark_block(mm, node, 1);
+        if (next) {
+            remove_free(mm, next);
+            DmaMem_clear_block(mm, next->pageno, next->npages);
+            next->pageno -= extra;
+            next->npages += extra;
+            insert_free(mm, next);
+        } else {
+            make_free(mm, end - extra, extra);
+        }
+        return 0;
+    }
+
+    extra = npages - node->npages;
+    if ((next == NULL) || (next->npages < extra)) {
+        return -1;
+    }
+    remove_free(mm, next);
+    DmaMem_clear_block(mm, next->pageno, next->npages);
+    if (next->npages == extra) {
+        DmaMem_pushback(mm, next);
+    } else {
+        next->pageno += extra;
+        next->npages -= extra;
+        insert_free(mm, next);
+    }
+    node->npages = npages;
+    DmaMem_mark_block(mm, node, 1);
+    return 0;
+}
+
+int DmaTlsf_validate(DmaMem_t* mm, unsigned long free_blocks, unsigned long free_pages) {
+    struct DmaTlsf_struct* tlsf = mm->tlsf;
+    unsigned long blocks = 0, pages = 0;
+    avl_node_t* node;
+    int fl, sl, node_fl, node_sl, bad = 0;
+
+    for (fl = 0; fl < TLSF_FL_COUNT; ++fl) {
+        if (!(tlsf->fl_bitmap & (1U << fl)) != !tlsf->sl_bitmap[fl]) {
+            DmaMem_log(mm, "vmem_validate: tlsf first level %d has bit %u over 0x%x\n", fl, (tlsf->fl_bitmap >> fl) & 1, tlsf->sl_bitmap[fl]);
+            bad++;
+        }
+        for (sl = 0; sl < TLSF_SL_COUNT; ++sl) {
+            if (((tlsf->sl_bitmap[fl] >> sl) & 1) == list_empty(&(tlsf->free_list[fl][sl]))) {
+                DmaMem_log(mm, "vmem_validate: tlsf class %d.%d bit disagrees with its list\n", fl, sl);
+                bad++;
+            }
+            list_for_each_entry(node, &(tlsf->free_list[fl][sl]), ListEntry) {
+                if (++blocks > free_blocks) {
+                    break;
+                }
+                mapping_insert(node->npages, &node_fl, &node_sl);
+                if ((node->pageno >= mm->num_pages) || (DmaMem_block_at(mm, node->pageno) != node) || node->used ||
+                    (node_fl != fl) || (node_sl != sl)) {
+                    DmaMem_log(mm, "vmem_validate: tlsf class %d.%d lists node %u, page %u+%u\n", fl, sl, node->index, node->pageno, node->npages);
+                    bad++;
+                    continue;
+                }
+                pages += node->npages;
+            }
+        }
+    }
+    if ((blocks != free_blocks) || (pages != free_pages)) {
+        DmaMem_log(mm, "vmem_validate: tlsf lists %lu%s blocks of %lu pages, the tags %lu of %lu\n",
+                   blocks, (blocks > free_blocks) ? " or more" : "", pages, free_blocks, free_pages);
+        bad++;
+    }
+    return bad;
+}
@@ -0,0 +1,1180 @@
+/*
+ * DmaMem microbenchmark.
+ *
+ * Runs configurable alloc/free mixes against a fake carve-out and reports
+ * ns/op percentiles, the peak AVL tree height and end-of-run fragmentation.
+ *
+ * Each run starts --threads workers on one pool. Every worker fills it
+ * with --live allocations, then performs --ops churn steps (free one live
+ * block, allocate a new one) and finally frees everything that is still
+ * live. With --bulk N a churn step instead allocates N equal buffers with
+ * DmaMem_alloc_bulk and releases them with DmaMem_free_bulk, one sample per
+ * call. With --long-pct P that share of the churn allocates long-lived
+ * buffers instead, which are kept until --live * P / 100 newer ones exist;
+ * --hints tags both kinds with their DMA_MEM_* lifetime hint. With
+ * --resize-pct P that share of the churn resizes a live buffer with
+ * DmaMem_resize instead, mostly growing it by a few pages. With
+ * --handles the buffers are relocatable handles, pinned around every
+ * touch, and --compact runs DmaMem_compact once after the churn. With
+ * --deferred N churn frees go through DmaMem_free_deferred on a ring of N
+ * slots, as a DMA completion handler would, and the allocations drain them.
+ * With --wait MS churn allocations sleep in DmaMem_alloc_wait for up to MS
+ * milliseconds instead of failing. With --reserve P thread 0 is a client
+ * holding a reservation of P% of the pool, and --watermarks LOW,HIGH counts
+ * the watermark notifications. With --zeroed buffers come from
+ * DmaMem_alloc_zeroed, with --touch checked to read back as zero, and
+ * --prezero adds the background zeroing thread. --stats turns on the
+ * allocator's latency histograms and prints its debugfs file after the
+ * churn. --trace FILE records every call in the allocator's trace ring
+ * and writes the ring to FILE after the drain, as its debugfs file reads,
+ * for DmaMemReplay. With
+ * --nodes N the carve-out is split into N regions of a DmaPool_t,
+ * one per fake NUMA node, and the workers allocate near their CPU's node.
+ * Statistics cover the fill and churn phases; the final drain only checks
+ * that no pages leaked and that every region coalesced back into a single
+ * free block.
+ */
+
+#include "DmaMem.h"
+#include "DmaMemEngine.h"
+#include "DmaMemPool.h"
+#include <linux/debugfs.h>
+#include <linux/io.h>
+#include <linux/printk.h>
+#include <linux/topology.h>
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define BENCH_PHYS_BASE     0x80000000UL
+
+static const char* const engine_names[] = {
+    [DMA_MEM_ENGINE_TREE] = "tree",
+    [DMA_MEM_ENGINE_TLSF] = "tlsf",
+    [DMA_MEM_ENGINE_BUDDY] = "buddy",
+};
+
+static const char* const policy_names[] = {
+    [DMA_MEM_POLICY_DEFAULT]     = "none",
+    [DMA_MEM_POLICY_SHORT_LIVED] = "short",
+    [DMA_MEM_POLICY_LONG_LIVED]  = "long",
+    [DMA_MEM_POLICY_FIRST_FIT]   = "first",
+};
+
+typedef enum {
+    SIZES_FIXED,
+    SIZES_POWERLAW
+} BenchSizes_t;
+
+typedef enum {
+    ORDER_LIFO,
+    ORDER_RANDOM
+} BenchOrder_t;
+
+typedef struct {
+    unsigned long   pool_size;
+    unsigned long   page_size;
+    unsigned long   ops;
+    unsigned long   live;
+    BenchSizes_t    sizes;
+    unsigned long   size;
+    unsigned long   min_pages;
+    unsigned long   max_pages;
+    double          alpha;
+    BenchOrder_t    order;
+    int             runs;
+    unsigned long   seed;
+    int             touch;
+    unsigned long   align;
+    int             threads;
+    unsigned long   bulk;
+    unsigned long   long_pct;
+    unsigned long   resize_pct;
+    int             hints;
+    int             handles;
+    int             compact;
+    int             nodes;
+    unsigned long   wait_ms;
+    unsigned long   reserve_pct;
+    unsigned long   wm_low;
+    unsigned long   wm_high;
+    int             zeroed;
+    const char*     trace_path;
+    DmaMemConfig_t  mm_config;
+} BenchConfig_t;
+
+typedef struct {
+    uint32_t       *ns;
+    unsigned long   count;
+    unsigned long   failures;
+} BenchLatency_t;
+
+typedef struct {
+    BenchLatency_t  alloc;
+    BenchLatency_t  free;
+    BenchLatency_t  resize;
+    int             peak_height;
+    unsigned long   free_blocks;
+    unsigned long   free_pages;
+    unsigned long   largest_free;
+    unsigned long   free_pageblocks;
+    unsigned long   leaked_pages;
+    unsigned long   drained_blocks;
+    unsigned long   initial_blocks;
+    unsigned long   misaligned;
+    unsigned long   local;
+    unsigned long   corrupt;        /* --touch bytes lost by a resize or a compaction */
+    unsigned long   defer_full;     /* deferred frees that found the ring full */
+    unsigned long   nonzero;        /* --zeroed --touch buffers handed out with stale bytes */
+    unsigned long   meta_bytes;
+    uint64_t        init_ns;
+    double          seconds;
+} BenchResult_t;
+
+typedef struct {
+    const BenchConfig_t* cfg;
+    const double*   cdf;
+    DmaMem_t*       mm;
+    DmaPool_t*      pool;           /* --nodes, NULL otherwise */
+    DmaMemClient_t* client;         /* thread 0 with --reserve */
+    uint64_t        rng;
+    unsigned long*  live;
+    unsigned long*  live_size;
+    unsigned long   nlive;
+    unsigned long*  pinned;         /* long-lived buffers, a FIFO ring */
+    unsigned long   npinned;
+    unsigned long   pinned_head;
+    unsigned long   pinned_cap;
+    unsigned long*  batch;
+    BenchResult_t   res;
+} BenchThread_t;
+
+static uint64_t rng_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(uint64_t* state) {
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* P(npages = k) is proportional to k^-alpha over [min_pages, max_pages]. */
+static double* powerlaw_cdf(const BenchConfig_t* cfg) {
+    unsigned long n = cfg->max_pages - cfg->min_pages + 1, i;
+    double *cdf = malloc(n * sizeof(double));
+    double sum = 0.0;
+    if (cdf == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < n; ++i) {
+        sum += pow((double)(cfg->min_pages + i), -cfg->alpha);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < n; ++i) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+static unsigned long next_size(BenchThread_t* t) {
+    const BenchConfig_t* cfg = t->cfg;
+    unsigned long lo = 0, hi, mid;
+    double u;
+    if (cfg->sizes == SIZES_FIXED) {
+        return cfg->size;
+    }
+
+    u  = rng_unit(&t->rng);
+    hi = cfg->max_pages - cfg->min_pages;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (t->cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (cfg->min_pages + lo) * cfg->page_size;
+}
+
+/* walks the blocks through their head tags, which every engine keeps */
+/* pb_pages is a power of two; counts the free blocks of pb_pages at an aligned pfn */
+static void free_block_walk(DmaMem_t* region, unsigned long pb_pages, BenchResult_t* res) {
+    unsigned long npages, pageno = 0, pfn, first, last;
+    while (pageno < region->num_pages) {
+        npages = DmaMem_block_at(region, pageno)->npages;
+        if (!DmaMem_page_used(region, pageno)) {
+            res->free_blocks++;
+            res->free_pages += npages;
+            if (npages > res->largest_free) {
+                res->largest_free = npages;
+            }
+            pfn   = region->base_addr / region->page_size + pageno;
+            first = (pfn + pb_pages - 1) & ~(pb_pages - 1);
+            last  = (pfn + npages) & ~(pb_pages - 1);
+            if (last > first) {
+                res->free_pageblocks += (last - first) / pb_pages;
+            }
+        }
+        pageno += npages;
+    }
+}
+
+/* --handles returns the handle, -1 on failure like the rest */
+static unsigned long bench_alloc(BenchThread_t* t, unsigned long size, unsigned int flags) {
+    if (t->cfg->handles) {
+        DmaMemHandle_t h = DmaMem_handle_alloc(t->mm, size);
+        return h ? h : (unsigned long)-1;
+    }
+    if (t->pool) {
+        return DmaPool_alloc_node(t->pool, size, t->cfg->align, flags, NUMA_NO_NODE);
+    }
+    if (t->client) {
+        return DmaMem_alloc_reserved(t->mm, t->client, size, t->cfg->align, flags);
+    }
+    if (t->cfg->wait_ms && !t->cfg->align && !flags) {
+        return DmaMem_alloc_wait(t->mm, size, msecs_to_jiffies(t->cfg->wait_ms));
+    }
+    if (flags) {
+        return DmaMem_alloc_flags(t->mm, size, t->cfg->align, flags);
+    }
+    return t->cfg->align ? DmaMem_alloc_aligned(t->mm, size, t->cfg->align) : DmaMem_alloc(t->mm, size);
+}
+
+/* a full ring falls back to an ordinary free, as a handler would punt to a worker */
+static int bench_free_deferred(BenchThread_t* t, unsigned long ptr) {
+    int ret = t->pool ? DmaPool_free_deferred(t->pool, ptr) : DmaMem_free_deferred(t->mm, ptr);
+
+    if (ret != 0) {
+        t->res.defer_full++;
+        ret = t->pool ? DmaPool_free(t->pool, ptr) : DmaMem_free(t->mm, ptr);
+    }
+    return ret;
+}
+
+static int bench_free(BenchThread_t* t, unsigned long ptr) {
+    if (t->cfg->handles) {
+        return DmaMem_handle_free(t->mm, (DmaMemHandle_t)ptr);
+    }
+    if (t->client) {
+        return DmaMem_free_reserved(t->mm, t->client, ptr);
+    }
+    return t->pool ? DmaPool_free(t->pool, ptr) : DmaMem_free(t->mm, ptr);
+}
+
+static void* bench_kaddr(BenchThread_t* t, unsigned long ptr) {
+    return t->pool ? DmaPool_get_kaddr(t->pool, ptr) : DmaMem_get_kaddr(t->mm, ptr);
+}
+
+/* fills the buffer, pinning a handle for the duration */
+static void bench_touch(BenchThread_t* t, unsigned long ptr, unsigned long size) {
+    if (t->cfg->handles) {
+        memset(DmaMem_get_kaddr(t->mm, DmaMem_handle_pin(t->mm, (DmaMemHandle_t)ptr)), 0xa5, size);
+        DmaMem_handle_unpin(t->mm, (DmaMemHandle_t)ptr);
+        return;
+    }
+    memset(bench_kaddr(t, ptr), 0xa5, size);
+}
+
+/* whether a --zeroed buffer reads back as zero, before it is touched */
+static int bench_zero(BenchThread_t* t, unsigned long ptr, unsigned long size) {
+    const unsigned char* k = bench_kaddr(t, ptr);
+    unsigned long i;
+
+    for (i = 0; i < size; ++i) {
+        if (k[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* compares the first and last byte of a touched handle buffer */
+static int bench_check(BenchThread_t* t, unsigned long ptr, unsigned long size) {
+    unsigned char* k = DmaMem_get_kaddr(t->mm, DmaMem_handle_pin(t->mm, (DmaMemHandle_t)ptr));
+    int ok = (k[0] == 0xa5) && (k[size - 1] == 0xa5);
+
+    DmaMem_handle_unpin(t->mm, (DmaMemHandle_t)ptr);
+    return ok;
+}
+
+/* stands in for a DMA engine: the carve-out is mapped linearly at ctx */
+static int bench_copy(void* ctx, unsigned long dst, unsigned long src, unsigned long bytes) {
+    unsigned char* carveout = ctx;
+
+    memcpy(carveout + (dst - BENCH_PHYS_BASE), carveout + (src - BENCH_PHYS_BASE), bytes);
+    return 0;
+}
+
+static atomic_long_t wm_events[2];
+
+static void bench_watermark(void* ctx, int low) {
+    atomic_long_inc(&wm_events[low]);
+}
+
+static unsigned long bench_resize(BenchThread_t* t, unsigned long ptr, unsigned long size) {
+    return t->pool ? DmaPool_resize(t->pool, ptr, size) : DmaMem_resize(t->mm, ptr, size);
+}
+
+static unsigned long do_alloc(BenchThread_t* t, int long_lived) {
+    unsigned long size = next_size(t), ptr;
+    unsigned int flags = 0;
+    BenchResult_t* res = &t->res;
+    uint64_t t0, t1;
+
+    if (t->cfg->hints) {
+        flags = long_lived ? DMA_MEM_LONG_LIVED : DMA_MEM_SHORT_LIVED;
+    }
+    if (t->cfg->zeroed) {
+        flags |= DMA_MEM_ZERO;
+    }
+    t0  = now_ns();
+    ptr = bench_alloc(t, size, flags);
+    t1  = now_ns();
+    res->alloc.ns[res->alloc.count++] = (uint32_t)(t1 - t0);
+    if (ptr == (unsigned long)-1) {
+        res->alloc.failures++;
+        return ptr;
+    }
+    if (t->cfg->align && (ptr & (t->cfg->align - 1))) {
+        res->misaligned++;
+    }
+    if (t->pool && (DmaPool_region_of(t->pool, ptr)->nid == numa_node_id())) {
+        res->local++;
+    }
+
+    if (t->cfg->zeroed && t->cfg->touch && !bench_zero(t, ptr, size)) {
+        res->nonzero++;
+    }
+    if (t->cfg->touch) {
+        bench_touch(t, ptr, size);
+    }
+    if (!long_lived) {
+        t->live_size[t->nlive] = size;
+        t->live[t->nlive++]    = ptr;
+    }
+    return ptr;
+}
+
+static void free_one(BenchThread_t* t, unsigned long ptr, int record) {
+    BenchResult_t* res = &t->res;
+    uint64_t t0, t1;
+    int ret;
+
+    t0  = now_ns();
+    ret = (record && t->cfg->mm_config.deferred && !t->client) ? bench_free_deferred(t, ptr) : bench_free(t, ptr);
+    t1  = now_ns();
+    if (!record) {
+        return;
+    }
+    res->free.ns[res->free.count++] = (uint32_t)(t1 - t0);
+    if (ret != 0) {
+        res->free.failures++;
+    }
+}
+
+static void do_free(BenchThread_t* t, int record) {
+    unsigned long idx = t->nlive - 1, ptr;
+
+    if ((t->cfg->order == ORDER_RANDOM) && (t->nlive > 1)) {
+        idx = rng_next(&t->rng) % t->nlive;
+    }
+    ptr = t->live[idx];
+    t->live[idx]      = t->live[--t->nlive];
+    t->live_size[idx] = t->live_size[t->nlive];
+    free_one(t, ptr, record);
+}
+
+/* grows a random live buffer by one to four pages, or one time in four halves it */
+static void do_resize(BenchThread_t* t) {
+    unsigned long idx = rng_next(&t->rng) % t->nlive;
+    unsigned long old = t->live_size[idx], size, ptr, keep;
+    unsigned long page = t->cfg->page_size;
+    BenchResult_t* res = &t->res;
+    unsigned char* k;
+    uint64_t t0, t1;
+
+    if (rng_next(&t->rng) % 4 == 0) {
+        size = (old / 2 > page) ? old / 2 : page;
+    } else {
+        size = old + page * (1 + rng_next(&t->rng) % 4);
+    }
+    t0  = now_ns();
+    ptr = bench_resize(t, t->live[idx], size);
+    t1  = now_ns();
+    res->resize.ns[res->resize.count++] = (uint32_t)(t1 - t0);
+    if (ptr == (unsigned long)-1) {
+        res->resize.failures++;
+        return;
+    }
+    t->live[idx]      = ptr;
+    t->live_size[idx] = size;
+    if (t->cfg->touch) {
+        keep = (size < old) ? size : old;
+        k = bench_kaddr(t, ptr);
+        if ((k[0] != 0xa5) || (k[keep - 1] != 0xa5)) {
+            res->corrupt++;
+        }
+        memset(k, 0xa5, size);
+    }
+}
+
+/* the oldest long-lived buffer makes room for the new one */
+static void do_long(BenchThread_t* t) {
+    unsigned long ptr;
+
+    if (t->npinned == t->pinned_cap) {
+        free_one(t, t->pinned[t->pinned_head], 1);
+        t->pinned_head = (t->pinned_head + 1) % t->pinned_cap;
+        t->npinned--;
+    }
+    ptr = do_alloc(t, 1);
+    if (ptr != (unsigned long)-1) {
+        t->pinned[(t->pinned_head + t->npinned++) % t->pinned_cap] = ptr;
+    }
+}
+
+/* one bulk allocation of --bulk buffers of one size, then one bulk free */
+static void do_bulk(BenchThread_t* t) {
+    unsigned long size = next_size(t), i;
+    BenchResult_t* res = &t->res;
+    uint64_t t0, t1;
+    int ret;
+
+    t0  = now_ns();
+    ret = DmaMem_alloc_bulk(t->mm, size, t->cfg->bulk, t->batch);
+    t1  = now_ns();
+    res->alloc.ns[res->alloc.count++] = (uint32_t)(t1 - t0);
+    if (ret != 0) {
+        res->alloc.failures++;
+        return;
+    }
+    if (t->cfg->touch) {
+        for (i = 0; i < t->cfg->bulk; ++i) {
+            memset(DmaMem_get_kaddr(t->mm, t->batch[i]), 0xa5, size);
+        }
+    }
+
+    t0  = now_ns();
+    ret = DmaMem_free_bulk(t->mm, t->batch, t->cfg->bulk);
+    t1  = now_ns();
+    res->free.ns[res->free.count++] = (uint32_t)(t1 - t0);
+    if (ret != 0) {
+        res->free.failures++;
+    }
+}
+
+static void* bench_thread(void* arg) {
+    BenchThread_t* t = arg;
+    unsigned long i;
+
+    for (i = 0; i < t->cfg->live; ++i) {
+        do_alloc(t, 0);
+    }
+    for (i = 0; i < t->cfg->ops; ++i) {
+        if (t->cfg->bulk) {
+            do_bulk(t);
+            continue;
+        }
+        if (t->pinned_cap && (rng_next(&t->rng) % 100 < t->cfg->long_pct)) {
+            do_long(t);
+            continue;
+        }
+        if (t->cfg->resize_pct && (t->nlive > 0) && (rng_next(&t->rng) % 100 < t->cfg->resize_pct)) {
+            do_resize(t);
+            continue;
+        }
+        if (t->nlive > 0) {
+            do_free(t, 1);
+        }
+        do_alloc(t, 0);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report_latency(const char* name, BenchLatency_t* lat) {
+    static const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+    unsigned long i;
+    double sum = 0.0;
+
+    if (lat->count == 0) {
+        printf("  %-5s: no samples\n", name);
+        return;
+    }
+    qsort(lat->ns, lat->count, sizeof(uint32_t), cmp_u32);
+    for (i = 0; i < lat->count; ++i) {
+        sum += lat->ns[i];
+    }
+    printf("  %-5s: n=%lu fail=%lu mean=%.0f", name, lat->count, lat->failures, sum / lat->count);
+    for (i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i) {
+        unsigned long idx = (unsigned long)(pct[i] / 100.0 * (lat->count - 1));
+        printf(" p%g=%u", pct[i], lat->ns[idx]);
+    }
+    printf(" max=%u ns\n", lat->ns[lat->count - 1]);
+}
+
+static void merge_latency(BenchLatency_t* dst, const BenchLatency_t* src) {
+    memcpy(dst->ns + dst->count, src->ns, src->count * sizeof(uint32_t));
+    dst->count    += src->count;
+    dst->failures += src->failures;
+}
+
+/* every tree-owning region: the shards of each top-level DmaMem_t, or the DmaMem_t itself */
+static int collect_regions(DmaMem_t* mm, DmaMem_t** regions, int nregions) {
+    int i;
+    if (mm->shards == NULL) {
+        regions[nregions++] = mm;
+        return nregions;
+    }
+    for (i = 0; i < mm->num_shards; ++i) {
+        regions[nregions++] = &mm->shards[i];
+    }
+    return nregions;
+}
+
+static int bench_init(const BenchConfig_t* cfg, DmaMem_t* mm, DmaPool_t* pool) {
+    unsigned long part;
+    int i;
+
+    if (cfg->nodes == 0) {
+        return DmaMem_init_config(mm, BENCH_PHYS_BASE, cfg->pool_size, cfg->page_size, &cfg->mm_config);
+    }
+    part = cfg->pool_size / cfg->nodes / cfg->page_size * cfg->page_size;
+    if (DmaPool_init_backend(pool, cfg->mm_config.backend, cfg->mm_config.backend_ctx) != 0) {
+        return -1;
+    }
+    for (i = 0; i < cfg->nodes; ++i) {
+        if (DmaPool_add_region(pool, BENCH_PHYS_BASE + i * part, part, cfg->page_size, i, &cfg->mm_config) != 0) {
+            DmaPool_exit(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_once(const BenchConfig_t* cfg, const double* cdf, void* carveout, int run) {
+    DmaMem_t        mm;
+    DmaPool_t       pool;
+    DmaMem_t       *top = &mm;
+    DmaMem_t      **regions;
+    DmaMemInfo_t    info, churn;
+    DmaMemStats_t   stats;
+    char           *dump = NULL;
+    size_t          dump_len = 0;
+    FILE           *dump_file;
+    DmaMemClient_t  client;
+    unsigned long   reserved = 0;
+    BenchResult_t   res, compacted;
+    BenchThread_t  *threads;
+    pthread_t      *tids;
+    unsigned long   per_thread_allocs = cfg->live + cfg->ops;
+    unsigned long   pb_pages = cfg->mm_config.pageblock_pages;
+    uint64_t        t0, compact_ns = 0;
+    FILE           *trace_file;
+    long            moved = 0;
+    int             i, nregions, trace_err = 0;
+
+    memset(&mm, 0, sizeof(mm));
+    memset(&pool, 0, sizeof(pool));
+    memset(&res, 0, sizeof(res));
+    res.peak_height = -1;
+    if (pb_pages == 0) {
+        /* report against 2 MiB, the usual huge mapping */
+        pb_pages = (cfg->page_size < (2UL << 20)) ? (2UL << 20) / cfg->page_size : 1;
+    }
+    threads       = calloc(cfg->threads, sizeof(BenchThread_t));
+    tids          = calloc(cfg->threads, sizeof(pthread_t));
+    res.alloc.ns  = malloc(cfg->threads * per_thread_allocs * sizeof(uint32_t));
+    res.free.ns   = malloc(cfg->threads * (cfg->ops + 1) * sizeof(uint32_t));
+    res.resize.ns = malloc(cfg->threads * (cfg->ops + 1) * sizeof(uint32_t));
+    if ((threads == NULL) || (tids == NULL) || (res.alloc.ns == NULL) || (res.free.ns == NULL) || (res.resize.ns == NULL)) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    shim_carveout_register(BENCH_PHYS_BASE, carveout, cfg->pool_size);
+    t0 = now_ns();
+    if (bench_init(cfg, &mm, &pool) != 0) {
+        fprintf(stderr, "%s failed\n", cfg->nodes ? "DmaPool_add_region" : "DmaMem_init_config");
+        return -1;
+    }
+    res.init_ns = now_ns() - t0;
+    for (i = 0; (cfg->mm_config.stats || cfg->trace_path) && (i < (cfg->nodes ? pool.nr_regions : 1)); ++i) {
+        DmaMem_debugfs_init(cfg->nodes ? &pool.regions[i]->mm : &mm, "vmem", NULL);
+    }
+    memset(&client, 0, sizeof(client));
+    atomic_long_set(&wm_events[0], 0);
+    atomic_long_set(&wm_events[1], 0);
+    if (cfg->reserve_pct && (DmaMem_reserve(&mm, &client, cfg->pool_size / 100 * cfg->reserve_pct) != 0)) {
+        fprintf(stderr, "DmaMem_reserve failed\n");
+        return -1;
+    }
+    if (cfg->wm_high && (DmaMem_set_watermarks(&mm, cfg->wm_low, cfg->wm_high, bench_watermark, NULL) != 0)) {
+        fprintf(stderr, "DmaMem_set_watermarks failed\n");
+        return -1;
+    }
+    nregions = 0;
+    if (cfg->nodes) {
+        top = &pool.regions[0]->mm;
+        for (i = 0; i < pool.nr_regions; ++i) {
+            nregions += pool.regions[i]->mm.shards ? pool.regions[i]->mm.num_shards : 1;
+        }
+    } else {
+        nregions = mm.shards ? mm.num_shards : 1;
+    }
+    regions = malloc(nregions * sizeof(DmaMem_t*));
+    if (regions == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    nregions = 0;
+    for (i = 0; i < (cfg->nodes ? pool.nr_regions : 1); ++i) {
+        nregions = collect_regions(cfg->nodes ? &pool.regions[i]->mm : &mm, regions, nregions);
+    }
+    for (i = 0; i < nregions; ++i) {
+        BenchResult_t initial;
+        memset(&initial, 0, sizeof(initial));
+        free_block_walk(regions[i], pb_pages, &initial);
+        res.initial_blocks += initial.free_blocks;
+    }
+
+    for (i = 0; i < cfg->threads; ++i) {
+        BenchThread_t* t = &threads[i];
+        t->cfg          = cfg;
+        t->cdf          = cdf;
+        t->mm           = &mm;
+        t->pool         = cfg->nodes ? &pool : NULL;
+        t->client       = (cfg->reserve_pct && (i == 0)) ? &client : NULL;
+        t->rng          = cfg->seed + (uint64_t)(run * cfg->threads + i + 1) * 0x9E3779B97F4A7C15ULL;
+        t->live         = malloc((cfg->live + 1) * sizeof(unsigned long));
+        t->live_size    = malloc((cfg->live + 1) * sizeof(unsigned long));
+        t->batch        = malloc((cfg->bulk + 1) * sizeof(unsigned long));
+        t->pinned_cap   = cfg->long_pct ? (cfg->live * cfg->long_pct + 99) / 100 : 0;
+        t->pinned       = malloc((t->pinned_cap + 1) * sizeof(unsigned long));
+        t->res.alloc.ns = malloc(per_thread_allocs * sizeof(uint32_t));
+        t->res.free.ns  = malloc((cfg->ops + 1) * sizeof(uint32_t));
+        t->res.resize.ns = malloc((cfg->ops + 1) * sizeof(uint32_t));
+        if ((t->live == NULL) || (t->live_size == NULL) || (t->batch == NULL) || (t->pinned == NULL) ||
+            (t->res.alloc.ns == NULL) || (t->res.free.ns == NULL) || (t->res.resize.ns == NULL)) {
+            fprintf(stderr, "out of memory\n");
+            return -1;
+        }
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < cfg->threads; ++i) {
+        pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+    for (i = 0; i < cfg->threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    res.seconds = (double)(now_ns() - t0) / 1e9;
+
+    for (i = 0; i < nregions; ++i) {
+        free_block_walk(regions[i], pb_pages, &res);
+    }
+    if (cfg->nodes) {
+        DmaPool_get_info(&pool, &info);
+    } else {
+        DmaMem_get_info(&mm, &info);
+    }
+    res.meta_bytes = info.meta_bytes;
+    churn = info;
+    if (cfg->nodes) {
+        DmaPool_get_stats(&pool, &stats);
+    } else {
+        DmaMem_get_stats(&mm, &stats);
+    }
+    /* the bench counts a single node as height 0 */
+    res.peak_height = (int)stats.tree_peak - 1;
+    if (cfg->mm_config.stats && ((dump_file = open_memstream(&dump, &dump_len)) != NULL)) {
+        for (i = 0; i < (cfg->nodes ? pool.nr_regions : 1); ++i) {
+            DmaMem_t* region_mm = cfg->nodes ? &pool.regions[i]->mm : &mm;
+            fprintf(dump_file, "  debugfs %s after churn, region %d:\n", region_mm->debugfs->name, i);
+            shim_debugfs_read(region_mm->debugfs, dump_file);
+        }
+        fclose(dump_file);
+    }
+    if (cfg->compact) {
+        memset(&compacted, 0, sizeof(compacted));
+        t0 = now_ns();
+        moved = DmaMem_compact(&mm, bench_copy, carveout);
+        compact_ns = now_ns() - t0;
+        for (i = 0; i < nregions; ++i) {
+            free_block_walk(regions[i], pb_pages, &compacted);
+        }
+        for (i = 0; (i < cfg->threads) && cfg->touch; ++i) {
+            BenchThread_t* t = &threads[i];
+            unsigned long j;
+            for (j = 0; j < t->nlive; ++j) {
+                if (!bench_check(t, t->live[j], t->live_size[j])) {
+                    res.corrupt++;
+                }
+            }
+        }
+    }
+    for (i = 0; i < cfg->threads; ++i) {
+        BenchThread_t* t = &threads[i];
+        merge_latency(&res.alloc, &t->res.alloc);
+        merge_latency(&res.free, &t->res.free);
+        merge_latency(&res.resize, &t->res.resize);
+        res.misaligned += t->res.misaligned;
+        res.corrupt    += t->res.corrupt;
+        res.defer_full += t->res.defer_full;
+        res.nonzero    += t->res.nonzero;
+        res.local      += t->res.local;
+        while (t->nlive > 0) {
+            do_free(t, 0);
+        }
+        for (; t->npinned > 0; t->npinned--) {
+            free_one(t, t->pinned[t->pinned_head], 0);
+            t->pinned_head = (t->pinned_head + 1) % t->pinned_cap;
+        }
+    }
+    if (cfg->nodes) {
+        DmaPool_flush(&pool);
+        DmaPool_get_info(&pool, &info);
+    } else {
+        DmaMem_flush(&mm);
+        DmaMem_get_info(&mm, &info);
+    }
+    res.leaked_pages = info.total_pages - info.free_pages;
+    if (cfg->mm_config.accounting) {
+        /* with the reservation returned, the shared count must be whole again */
+        reserved = client.pages;
+        if (cfg->reserve_pct) {
+            DmaMem_unreserve(&mm, &client);
+        }
+        res.leaked_pages += info.total_pages - atomic_long_read(&mm.avail);
+    }
+    for (i = 0; i < nregions; ++i) {
+        BenchResult_t drained;
+        memset(&drained, 0, sizeof(drained));
+        free_block_walk(regions[i], pb_pages, &drained);
+        res.drained_blocks += drained.free_blocks;
+    }
+    if (cfg->trace_path) {
+        trace_file = fopen(cfg->trace_path, "w");
+        if ((trace_file == NULL) || (shim_debugfs_read(mm.debugfs_trace, trace_file) != 0) || (fclose(trace_file) != 0)) {
+            perror(cfg->trace_path);
+            trace_err = 1;
+        }
+    }
+
+    printf("run %d/%d: engine=%s pool=%luMiB page=%lu threads=%d shards=%d live=%lu ops=%lu order=%s sizes=",
+           run, cfg->runs, engine_names[cfg->mm_config.engine], cfg->pool_size >> 20, cfg->page_size, cfg->threads, nregions,
+           cfg->live, cfg->ops, cfg->order == ORDER_LIFO ? "lifo" : "random");
+    if (cfg->sizes == SIZES_FIXED) {
+        printf("fixed(%lu)\n", cfg->size);
+    } else {
+        printf("powerlaw(%lu..%lu pages, alpha=%.2f)\n", cfg->min_pages, cfg->max_pages, cfg->alpha);
+    }
+    report_latency("alloc", &res.alloc);
+    report_latency("free", &res.free);
+    if (top->mags) {
+        printf("  mag  : pages=%d,%d,%d,%d depth=%d\n", cfg->mm_config.mag_pages[0], cfg->mm_config.mag_pages[1],
+               cfg->mm_config.mag_pages[2], cfg->mm_config.mag_pages[3], cfg->mm_config.mag_depth);
+    }
+    printf("  map  : %s %s\n", cfg->mm_config.map_once ? "once" : "per-alloc",
+           cfg->mm_config.map_flags == MEMREMAP_WC ? "wc" : "wb");
+    if (cfg->bulk) {
+        printf("  bulk : %lu buffers per call, samples are per call\n", cfg->bulk);
+    }
+    if (top->slab_caches) {
+        printf("  slab : %d classes, %d..%d bytes\n", top->nr_slab_classes, DMA_MEM_SLAB_MIN,
+               DMA_MEM_SLAB_MIN << (top->nr_slab_classes - 1));
+    }
+    if (cfg->nodes) {
+        printf("  numa : %d nodes, local=%.1f%% of allocations\n", cfg->nodes,
+               res.alloc.count ? 100.0 * res.local / (res.alloc.count - res.alloc.failures) : 0.0);
+    }
+    if (cfg->align) {
+        printf("  align: %lu bytes, misaligned=%lu\n", cfg->align, res.misaligned);
+    }
+    if (cfg->resize_pct) {
+        report_latency("resiz", &res.resize);
+        printf("  resiz: in place=%lu moved=%lu", churn.resize_in_place, churn.resize_moved);
+        if (cfg->touch) {
+            printf(" corrupt=%lu", res.corrupt);
+        }
+        printf("\n");
+    }
+    if (cfg->wait_ms) {
+        printf("  wait : allocations sleep up to %lu ms for a fit\n", cfg->wait_ms);
+    }
+    if (cfg->reserve_pct) {
+        printf("  resv : thread 0 reserved %lu pages, its failures=%lu, others=%lu, reserved free after churn=%lu\n",
+               reserved, threads[0].res.alloc.failures, res.alloc.failures - threads[0].res.alloc.failures,
+               churn.reserved_pages);
+    }
+    if (cfg->wm_high) {
+        printf("  wmark: below %lu / above %lu pages, low=%ld high=%ld notifications\n", cfg->wm_low, cfg->wm_high,
+               atomic_long_read(&wm_events[1]), atomic_long_read(&wm_events[0]));
+    }
+    if (cfg->mm_config.deferred) {
+        printf("  defer: ring=%lu slots, full=%lu, pending after churn=%lu\n", cfg->mm_config.deferred, res.defer_full,
+               churn.deferred_pending);
+    }
+    if (cfg->zeroed) {
+        printf("  zero : prezero=%s, free after churn clean=%lu dirty=%lu pages", cfg->mm_config.prezero ? "on" : "off",
+               churn.clean_pages, churn.dirty_pages);
+        if (cfg->touch) {
+            printf(" nonzero=%lu", res.nonzero);
+        }
+        printf("\n");
+    }
+    for (i = 0; i < DMA_MEM_POLICIES; ++i) {
+        if (churn.policy[i].allocs || churn.policy[i].failed) {
+            printf("  hint : %-5s allocs=%lu pages=%lu failed=%lu frag_failed=%lu\n", policy_names[i], churn.policy[i].allocs,
+                   churn.policy[i].pages, churn.policy[i].failed, churn.policy[i].frag_failed);
+        }
+    }
+    printf("  tree : peak block_tree height=%d\n", res.peak_height);
+    if (cfg->mm_config.stats) {
+        printf("  stats: free blocks=%lu largest=%lu frag_index=%u/1000, allocs=%lu failed=%lu frees=%lu\n",
+               stats.free_blocks, stats.largest_free, stats.frag_index, stats.allocs, stats.failed, stats.frees);
+        if (dump) {
+            fputs(dump, stdout);
+        }
+    }
+    free(dump);
+    if (cfg->trace_path) {
+        printf("  trace: %ld calls into a ring of %lu, written to %s\n", atomic_long_read(&mm.trace_head),
+               cfg->mm_config.trace, cfg->trace_path);
+    }
+    printf("  frag : free=%lu pages in %lu blocks, largest=%lu pages, fragmentation=%.4f\n",
+           res.free_pages, res.free_blocks, res.largest_free,
+           res.free_pages ? 1.0 - (double)res.largest_free / res.free_pages : 0.0);
+    if (cfg->compact) {
+        printf("  cmpct: moved=%ld pages in %.1f us, largest free %lu -> %lu pages, free blocks %lu -> %lu",
+               moved, compact_ns / 1e3, res.largest_free, compacted.largest_free, res.free_blocks, compacted.free_blocks);
+        if (cfg->touch) {
+            printf(" corrupt=%lu", res.corrupt);
+        }
+        printf("\n");
+    }
+    printf("  pblk : %lu free aligned blocks of %lu pages", res.free_pageblocks, pb_pages);
+    if (info.total_pageblocks) {
+        printf(", grouped, %lu/%lu pageblocks whole after drain", info.free_pageblocks, info.total_pageblocks);
+    }
+    printf("\n");
+    printf("  meta : %lu KiB, %.2f bytes/page, init %.1f us\n", res.meta_bytes >> 10, (double)res.meta_bytes / info.total_pages,
+           res.init_ns / 1e3);
+    printf("  total: %.3f s, %.0f ops/s, leaked=%lu pages, free blocks after drain=%lu/%lu\n", res.seconds,
+           (res.alloc.count + res.free.count) / (res.seconds > 0 ? res.seconds : 1e-9),
+           res.leaked_pages, res.drained_blocks, res.initial_blocks);
+
+    if (cfg->nodes) {
+        DmaPool_exit(&pool);
+    } else {
+        DmaMem_exit(&mm);
+    }
+    free(regions);
+    for (i = 0; i < cfg->threads; ++i) {
+        free(threads[i].live);
+        free(threads[i].live_size);
+        free(threads[i].batch);
+        free(threads[i].pinned);
+        free(threads[i].res.alloc.ns);
+        free(threads[i].res.free.ns);
+        free(threads[i].res.resize.ns);
+    }
+    free(threads);
+    free(tids);
+    free(res.alloc.ns);
+    free(res.free.ns);
+    free(res.resize.ns);
+    /* everything must have coalesced back into the blocks the pool started with */
+    return (res.leaked_pages || res.misaligned || res.corrupt || res.nonzero || trace_err ||
+            (res.drained_blocks != res.initial_blocks)) ? -1 : 0;
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [options]\n"
+           "  --pool BYTES       carve-out size (default 256M)\n"
+           "  --page BYTES       allocator page size (default 4096)\n"
+           "  --ops N            churn steps per thread and run (default 1000000)\n"
+           "  --live N           live allocations per thread during churn (default 1024)\n"
+           "  --threads N        worker threads sharing the pool (default 1)\n"
+           "  --engine NAME      tree | tlsf | buddy (default tree)\n"
+           "  --shards N         split the pool into N locked sub-regions (default 1)\n"
+           "  --sizes MODE       fixed | powerlaw (default powerlaw)\n"
+           "  --size BYTES       allocation size for --sizes fixed (default 64K)\n"
+           "  --min-pages N      smallest power-law size in pages (default 1)\n"
+           "  --max-pages N      largest power-law size in pages (default 256)\n"
+           "  --alpha A          power-law exponent (default 1.5)\n"
+           "  --order MODE       lifo | random free order (default random)\n"
+           "  --runs N           number of runs (default 1)\n"
+           "  --seed N           PRNG seed (default 1)\n"
+           "  --mag PAGES[,...]  per-CPU magazine block sizes in pages (up to %d)\n"
+           "  --mag-depth N      blocks parked per magazine (default 32)\n"
+           "  --bulk N           churn with DmaMem_alloc_bulk/DmaMem_free_bulk of N buffers\n"
+           "  --align BYTES      allocate with DmaMem_alloc_aligned and check the alignment\n"
+           "  --touch            write every allocated buffer through DmaMem_get_kaddr\n"
+           "  --map-once         map the pool once at init instead of per allocation\n"
+           "  --wc               use write-combined kernel mappings\n"
+           "  --slab             serve sizes up to half a page from object slabs\n"
+           "  --nodes N          split the carve-out into a DmaPool_t of N regions on N fake NUMA nodes\n"
+           "  --long-pct P       P%% of the churn allocates long-lived buffers\n"
+           "  --hints            pass DMA_MEM_LONG_LIVED/DMA_MEM_SHORT_LIVED with every allocation\n"
+           "  --pageblock PAGES  group pages into aligned pageblocks of PAGES pages (a power of two)\n"
+           "  --resize-pct P     P%% of the churn resizes a live buffer with DmaMem_resize\n"
+           "  --handles          allocate relocatable handles with DmaMem_handle_alloc\n"
+           "  --compact          run DmaMem_compact once after the churn (needs --handles)\n"
+           "  --deferred N       churn frees go through DmaMem_free_deferred on a ring of N slots\n"
+           "  --wait MS          allocate with DmaMem_alloc_wait, sleeping up to MS ms for a fit\n"
+           "  --reserve P        thread 0 allocates from a reservation of P%% of the pool\n"
+           "  --watermarks L,H   count notifications below L and back above H free pages\n"
+           "  --zeroed           allocate with DMA_MEM_ZERO, checking the buffers with --touch\n"
+           "  --prezero          zero free pages in a background thread (needs --map-once)\n"
+           "  --stats            time every call and print the allocator's debugfs file\n"
+           "  --trace FILE       write a trace of every call to FILE, for DmaMemReplay\n"
+           "  --verbose          let the allocator printk to stderr\n"
+           "Sizes accept K/M/G suffixes.\n", prog, DMA_MEM_MAG_CLASSES);
+}
+
+static unsigned long parse_size(const char* arg) {
+    char *end;
+    unsigned long v = strtoul(arg, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; /* fall through */
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10; break;
+    default: break;
+    }
+    return v;
+}
+
+int main(int argc, char** argv) {
+    static const struct option longopts[] = {
+        { "pool",      required_argument, NULL, 'p' },
+        { "page",      required_argument, NULL, 'g' },
+        { "ops",       required_argument, NULL, 'n' },
+        { "live",      required_argument, NULL, 'l' },
+        { "sizes",     required_argument, NULL, 'S' },
+        { "size",      required_argument, NULL, 's' },
+        { "min-pages", required_argument, NULL, 'm' },
+        { "max-pages", required_argument, NULL, 'M' },
+        { "alpha",     required_argument, NULL, 'a' },
+        { "order",     required_argument, NULL, 'o' },
+        { "runs",      required_argument, NULL, 'r' },
+        { "seed",      required_argument, NULL, 'x' },
+        { "mag",       required_argument, NULL, 'c' },
+        { "mag-depth", required_argument, NULL, 'd' },
+        { "threads",   required_argument, NULL, 'T' },
+        { "shards",    required_argument, NULL, 'H' },
+        { "engine",    required_argument, NULL, 'e' },
+        { "align",     required_argument, NULL, 'A' },
+        { "bulk",      required_argument, NULL, 'B' },
+        { "touch",     no_argument,       NULL, 't' },
+        { "map-once",  no_argument,       NULL, 'O' },
+        { "wc",        no_argument,       NULL, 'W' },
+        { "slab",      no_argument,       NULL, 'L' },
+        { "nodes",     required_argument, NULL, 'N' },
+        { "long-pct",  required_argument, NULL, 'P' },
+        { "hints",     no_argument,       NULL, 'I' },
+        { "pageblock", required_argument, NULL, 'b' },
+        { "resize-pct", required_argument, NULL, 'R' },
+        { "handles",   no_argument,       NULL, 'D' },
+        { "compact",   no_argument,       NULL, 'C' },
+        { "deferred",  required_argument, NULL, 'F' },
+        { "wait",      required_argument, NULL, 'w' },
+        { "reserve",   required_argument, NULL, 'V' },
+        { "watermarks", required_argument, NULL, 'K' },
+        { "zeroed",    no_argument,       NULL, 'Z' },
+        { "prezero",   no_argument,       NULL, 'z' },
+        { "stats",     no_argument,       NULL, 'X' },
+        { "trace",     required_argument, NULL, 'Y' },
+        { "verbose",   no_argument,       NULL, 'v' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    BenchConfig_t cfg = {
+        .pool_size = 256UL << 20,
+        .page_size = 4096,
+        .ops       = 1000000,
+        .live      = 1024,
+        .sizes     = SIZES_POWERLAW,
+        .size      = 64UL << 10,
+        .min_pages = 1,
+        .max_pages = 256,
+        .alpha     = 1.5,
+        .order     = ORDER_RANDOM,
+        .runs      = 1,
+        .seed      = 1,
+        .touch     = 0,
+        .threads   = 1,
+        .mm_config = { .mag_depth = 32 },
+    };
+    double *cdf = NULL;
+    void   *carveout;
+    char   *tok;
+    int     opt, run, ret = 0, nmag = 0, i;
+
+    shim_printk_enabled = 0;
+    while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'p': cfg.pool_size = parse_size(optarg); break;
+        case 'g': cfg.page_size = parse_size(optarg); break;
+        case 'n': cfg.ops       = strtoul(optarg, NULL, 0); break;
+        case 'l': cfg.live      = strtoul(optarg, NULL, 0); break;
+        case 's': cfg.size      = parse_size(optarg); break;
+        case 'm': cfg.min_pages = strtoul(optarg, NULL, 0); break;
+        case 'M': cfg.max_pages = strtoul(optarg, NULL, 0); break;
+        case 'a': cfg.alpha     = strtod(optarg, NULL); break;
+        case 'r': cfg.runs      = atoi(optarg); break;
+        case 'x': cfg.seed      = strtoul(optarg, NULL, 0); break;
+        case 'd': cfg.mm_config.mag_depth = atoi(optarg); break;
+        case 'T': cfg.threads   = atoi(optarg); break;
+        case 'H': cfg.mm_config.shards = atoi(optarg); break;
+        case 'A': cfg.align     = parse_size(optarg); break;
+        case 'B': cfg.bulk      = strtoul(optarg, NULL, 0); break;
+        case 't': cfg.touch     = 1; break;
+        case 'O': cfg.mm_config.map_once  = 1; break;
+        case 'W': cfg.mm_config.map_flags = MEMREMAP_WC; break;
+        case 'L': cfg.mm_config.slab      = 1; break;
+        case 'N': cfg.nodes     = atoi(optarg); break;
+        case 'P': cfg.long_pct  = strtoul(optarg, NULL, 0); break;
+        case 'I': cfg.hints     = 1; break;
+        case 'b': cfg.mm_config.pageblock_pages = strtoul(optarg, NULL, 0); break;
+        case 'R': cfg.resize_pct = strtoul(optarg, NULL, 0); break;
+        case 'D': cfg.handles   = 1; break;
+        case 'C': cfg.compact   = 1; break;
+        case 'F': cfg.mm_config.deferred = strtoul(optarg, NULL, 0); break;
+        case 'w': cfg.wait_ms   = strtoul(optarg, NULL, 0); break;
+        case 'V': cfg.reserve_pct = strtoul(optarg, NULL, 0); break;
+        case 'Z': cfg.zeroed    = 1; break;
+        case 'z': cfg.mm_config.prezero = 1; break;
+        case 'X': cfg.mm_config.stats   = 1; break;
+        case 'Y': cfg.trace_path = optarg; break;
+        case 'K':
+            if (sscanf(optarg, "%lu,%lu", &cfg.wm_low, &cfg.wm_high) != 2) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'c':
+            for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                if (nmag == DMA_MEM_MAG_CLASSES) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                cfg.mm_config.mag_pages[nmag++] = atoi(tok);
+            }
+            break;
+        case 'v': shim_printk_enabled = 1; break;
+        case 'S':
+            if (strcmp(optarg, "fixed") == 0) {
+                cfg.sizes = SIZES_FIXED;
+            } else if (strcmp(optarg, "powerlaw") == 0) {
+                cfg.sizes = SIZES_POWERLAW;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'e':
+            for (i = 0; i < (int)(sizeof(engine_names) / sizeof(engine_names[0])); ++i) {
+                if (strcmp(optarg, engine_names[i]) == 0) {
+                    break;
+                }
+            }
+            if (i == (int)(sizeof(engine_names) / sizeof(engine_names[0]))) {
+                usage(argv[0]);
+                return 2;
+            }
+            cfg.mm_config.engine = (DmaMemEngine_t)i;
+            break;
+        case 'o':
+            if (strcmp(optarg, "lifo") == 0) {
+                cfg.order = ORDER_LIFO;
+            } else if (strcmp(optarg, "random") == 0) {
+                cfg.order = ORDER_RANDOM;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if ((cfg.page_size == 0) || (cfg.page_size & (cfg.page_size - 1)) ||
+        (cfg.pool_size < cfg.page_size) || (cfg.min_pages == 0) ||
+        (cfg.max_pages < cfg.min_pages) || (cfg.runs <= 0) || (cfg.threads <= 0) ||
+        (cfg.align & (cfg.align - 1)) || (cfg.nodes < 0) || (cfg.nodes > DMA_POOL_MAX_REGIONS) ||
+        (cfg.nodes && cfg.bulk) || (cfg.long_pct > 100) || (cfg.long_pct && cfg.bulk) ||
+        (cfg.resize_pct > 100) || (cfg.resize_pct && cfg.bulk) || (cfg.compact && !cfg.handles) ||
+        (cfg.mm_config.deferred && (cfg.bulk || cfg.handles)) || (cfg.reserve_pct > 100) ||
+        (cfg.wm_low > cfg.wm_high) || ((cfg.wait_ms || cfg.reserve_pct || cfg.wm_high) && (cfg.nodes || cfg.bulk || cfg.handles)) ||
+        (cfg.reserve_pct && cfg.resize_pct) || (cfg.zeroed && (cfg.bulk || cfg.handles || cfg.wait_ms)) ||
+        (cfg.mm_config.prezero && !cfg.mm_config.map_once) || (cfg.trace_path && cfg.nodes) ||
+        (cfg.handles && (cfg.bulk || cfg.nodes || cfg.resize_pct || cfg.long_pct || cfg.align))) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (cfg.nodes) {
+        nr_node_ids = cfg.nodes;
+    }
+    if (cfg.handles) {
+        cfg.mm_config.handles = cfg.threads * (cfg.live + 1);
+    }
+    if (cfg.reserve_pct || cfg.wm_high) {
+        cfg.mm_config.accounting = 1;
+    }
+    if (cfg.trace_path) {
+        /* room for every call of a run: an allocation and a free per buffer, plus compaction moves */
+        unsigned long calls = cfg.threads * ((cfg.live + cfg.ops) * 2 * (cfg.bulk ? cfg.bulk : 1) + cfg.live);
+        for (cfg.mm_config.trace = 1; cfg.mm_config.trace < calls; cfg.mm_config.trace <<= 1) {
+        }
+    }
+
+    if (cfg.sizes == SIZES_POWERLAW) {
+        cdf = powerlaw_cdf(&cfg);
+        if (cdf == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    carveout = mmap(NULL, cfg.pool_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (carveout == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    for (run = 1; run <= cfg.runs; ++run) {
+        if (run_once(&cfg, cdf, carveout, run) != 0) {
+            ret = 1;
+        }
+    }
+
+    munmap(carveout, cfg.pool_size);
+    free(cdf);
+    return ret;
+}
@@ -0,0 +1,543 @@
+/*
+ * DmaMem trace replay.
+ *
+ * Reads a trace in the format of the allocator's debugfs trace file, as
+ * captured on a target or written by DmaMemBench --trace, and issues the
+ * same calls in the same order against a fresh pool, once per engine
+ * given. Trace addresses are mapped to the replay's own blocks, so frees,
+ * resizes and compaction moves hit the block the matching allocation got.
+ * Reports throughput, replay latency percentiles next to the recorded ones
+ * and a fragmentation sample every --interval records.
+ *
+ * A ring that wrapped starts in the middle of the workload: frees of blocks
+ * allocated before the first record count as unmatched. An allocation that
+ * failed in the trace but fits in the replay is freed again at once.
+ */
+
+#include "DmaMem.h"
+#include "DmaMemEngine.h"
+#include <linux/io.h>
+#include <linux/printk.h>
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define REPLAY_PHYS_BASE    0x80000000UL
+#define REPLAY_NONE         ((unsigned long)-1)
+
+static const char* const engine_names[] = {
+    [DMA_MEM_ENGINE_TREE] = "tree",
+    [DMA_MEM_ENGINE_TLSF] = "tlsf",
+    [DMA_MEM_ENGINE_BUDDY] = "buddy",
+};
+
+typedef struct {
+    unsigned long   pool_size;
+    unsigned long   page_size;
+    unsigned long   interval;
+    int             engines[DMA_MEM_ENGINE_BUDDY + 1];
+    int             nengines;
+    DmaMemConfig_t  mm_config;
+} ReplayConfig_t;
+
+typedef struct {
+    uint32_t       *ns;
+    unsigned long   count;
+    unsigned long   failures;
+} ReplayLatency_t;
+
+/* trace address to replay address, open addressing with linear probing */
+typedef struct {
+    unsigned long  *keys;
+    unsigned long  *vals;
+    unsigned long   mask;
+    unsigned long   count;
+} ReplayMap_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int map_init(ReplayMap_t* map, unsigned long records) {
+    unsigned long size;
+
+    for (size = 16; size < 2 * records; size <<= 1) {
+    }
+    map->keys  = malloc(size * sizeof(unsigned long));
+    map->vals  = malloc(size * sizeof(unsigned long));
+    map->mask  = size - 1;
+    map->count = 0;
+    if ((map->keys == NULL) || (map->vals == NULL)) {
+        return -1;
+    }
+    memset(map->keys, 0xff, size * sizeof(unsigned long));
+    return 0;
+}
+
+static void map_destroy(ReplayMap_t* map) {
+    free(map->keys);
+    free(map->vals);
+}
+
+static unsigned long map_slot(const ReplayMap_t* map, unsigned long key) {
+    unsigned long i = (unsigned long)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 17) & map->mask;
+
+    while ((map->keys[i] != REPLAY_NONE) && (map->keys[i] != key)) {
+        i = (i + 1) & map->mask;
+    }
+    return i;
+}
+
+/* the replay address of key, REPLAY_NONE when it is not live */
+static int map_find(const ReplayMap_t* map, unsigned long key, unsigned long* val) {
+    unsigned long i = map_slot(map, key);
+
+    if (map->keys[i] == REPLAY_NONE) {
+        return 0;
+    }
+    *val = map->vals[i];
+    return 1;
+}
+
+/* returns 1 when key was live already, its value then replaced */
+static int map_put(ReplayMap_t* map, unsigned long key, unsigned long val) {
+    unsigned long i = map_slot(map, key);
+    int found = (map->keys[i] != REPLAY_NONE);
+
+    map->keys[i] = key;
+    map->vals[i] = val;
+    map->count  += !found;
+    return found;
+}
+
+/* removes key, shifting back the entries that probed past it */
+static void map_del(ReplayMap_t* map, unsigned long key) {
+    unsigned long i = map_slot(map, key), j, home;
+
+    if (map->keys[i] == REPLAY_NONE) {
+        return;
+    }
+    map->keys[i] = REPLAY_NONE;
+    map->count--;
+    for (j = (i + 1) & map->mask; map->keys[j] != REPLAY_NONE; j = (j + 1) & map->mask) {
+        home = (unsigned long)(((uint64_t)map->keys[j] * 0x9E3779B97F4A7C15ULL) >> 17) & map->mask;
+        /* stays unless i lies cyclically within [home, j) */
+        if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+            map->keys[i] = map->keys[j];
+            map->vals[i] = map->vals[j];
+            map->keys[j] = REPLAY_NONE;
+            i = j;
+        }
+    }
+}
+
+/* parses the debugfs trace format; returns the record count or -1 */
+static long load_trace(const char* path, DmaMemTrace_t** out) {
+    unsigned long long ts, size, align, ptr, old;
+    unsigned int flags, latency;
+    DmaMemTrace_t* recs = NULL;
+    DmaMemTrace_t* grown;
+    unsigned long n = 0, cap = 0, lineno = 0;
+    char line[256], op;
+    FILE* f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if ((line[0] == '#') || (line[0] == '\n')) {
+            continue;
+        }
+        if (sscanf(line, "%llu %c %llu %llu %x %llx %llx %u", &ts, &op, &size, &align, &flags, &ptr, &old, &latency) != 8) {
+            fprintf(stderr, "%s:%lu: malformed record\n", path, lineno);
+            goto fail;
+        }
+        if (n == cap) {
+            cap   = cap ? 2 * cap : 4096;
+            grown = realloc(recs, cap * sizeof(DmaMemTrace_t));
+            if (grown == NULL) {
+                fprintf(stderr, "out of memory\n");
+                goto fail;
+            }
+            recs = grown;
+        }
+        recs[n].ts      = ts;
+        recs[n].size    = size;
+        recs[n].align   = align;
+        recs[n].ptr     = ptr;
+        recs[n].old     = old;
+        recs[n].latency = latency;
+        recs[n].flags   = (uint16_t)flags;
+        switch (op) {
+        case 'a': recs[n].op = DMA_MEM_TRACE_ALLOC; break;
+        case 'f': recs[n].op = DMA_MEM_TRACE_FREE; break;
+        case 'r': recs[n].op = DMA_MEM_TRACE_RESIZE; break;
+        case 'm': recs[n].op = DMA_MEM_TRACE_MOVE; break;
+        default:
+            fprintf(stderr, "%s:%lu: unknown op '%c'\n", path, lineno, op);
+            goto fail;
+        }
+        n++;
+    }
+    fclose(f);
+    *out = recs;
+    return (long)n;
+
+fail:
+    fclose(f);
+    free(recs);
+    return -1;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report_latency(const char* name, ReplayLatency_t* lat) {
+    static const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+    unsigned long i;
+    double sum = 0.0;
+
+    if (lat->count == 0) {
+        return;
+    }
+    qsort(lat->ns, lat->count, sizeof(uint32_t), cmp_u32);
+    for (i = 0; i < lat->count; ++i) {
+        sum += lat->ns[i];
+    }
+    printf("  %-12s: n=%lu fail=%lu mean=%.0f", name, lat->count, lat->failures, sum / lat->count);
+    for (i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i) {
+        unsigned long idx = (unsigned long)(pct[i] / 100.0 * (lat->count - 1));
+        printf(" p%g=%u", pct[i], lat->ns[idx]);
+    }
+    printf(" max=%u ns\n", lat->ns[lat->count - 1]);
+}
+
+static void sample(DmaMem_t* mm, const DmaMemTrace_t* rec, const DmaMemTrace_t* first, unsigned long done) {
+    DmaMemStats_t stats;
+    DmaMemInfo_t  info;
+
+    DmaMem_get_stats(mm, &stats);
+    DmaMem_get_info(mm, &info);
+    printf("  @%-9lu t=%9.3f s used=%lu free=%lu pages in %lu blocks, largest=%lu, frag_index=%u/1000\n",
+           done, (rec->ts - first->ts) / 1e9, info.alloc_pages, stats.free_pages, stats.free_blocks,
+           stats.largest_free, stats.frag_index);
+}
+
+static int replay(const ReplayConfig_t* cfg, DmaMemEngine_t engine, const DmaMemTrace_t* recs, unsigned long n,
+                  void* carveout) {
+    ReplayLatency_t lat[3], traced[3];
+    DmaMemConfig_t  config = cfg->mm_config;
+    DmaMemInfo_t    info;
+    ReplayMap_t     map;
+    DmaMem_t        mm;
+    unsigned long   i, ptr, mapped, unmatched = 0, stale = 0, extra = 0, live, leaked;
+    uint64_t        t0, t1, sampling = 0, wall;
+    double          seconds;
+    int             k, ret = 0;
+
+    memset(&mm, 0, sizeof(mm));
+    memset(lat, 0, sizeof(lat));
+    memset(traced, 0, sizeof(traced));
+    for (k = 0; k < 3; ++k) {
+        lat[k].ns    = malloc((n + 1) * sizeof(uint32_t));
+        traced[k].ns = malloc((n + 1) * sizeof(uint32_t));
+        if ((lat[k].ns == NULL) || (traced[k].ns == NULL)) {
+            fprintf(stderr, "out of memory\n");
+            return -1;
+        }
+    }
+    if (map_init(&map, n) != 0) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    config.engine = engine;
+    shim_carveout_register(REPLAY_PHYS_BASE, carveout, cfg->pool_size);
+    if (DmaMem_init_config(&mm, REPLAY_PHYS_BASE, cfg->pool_size, cfg->page_size, &config) != 0) {
+        fprintf(stderr, "DmaMem_init_config failed\n");
+        return -1;
+    }
+
+    printf("replay: engine=%s pool=%luMiB page=%lu records=%lu\n", engine_names[engine], cfg->pool_size >> 20,
+           cfg->page_size, n);
+    wall = now_ns();
+    for (i = 0; i < n; ++i) {
+        const DmaMemTrace_t* rec = &recs[i];
+
+        if ((rec->op == DMA_MEM_TRACE_ALLOC) || (rec->op == DMA_MEM_TRACE_FREE) || (rec->op == DMA_MEM_TRACE_RESIZE)) {
+            traced[rec->op].ns[traced[rec->op].count++] = rec->latency;
+            traced[rec->op].failures += (rec->op != DMA_MEM_TRACE_FREE) && (rec->ptr == REPLAY_NONE);
+        }
+        switch (rec->op) {
+        case DMA_MEM_TRACE_ALLOC:
+            t0  = now_ns();
+            ptr = DmaMem_alloc_flags(&mm, rec->size, rec->align, rec->flags);
+            t1  = now_ns();
+            lat[0].ns[lat[0].count++] = (uint32_t)(t1 - t0);
+            lat[0].failures += (ptr == REPLAY_NONE);
+            if (rec->ptr == REPLAY_NONE) {
+                if (ptr != REPLAY_NONE) {
+                    extra++;
+                    DmaMem_free(&mm, ptr);
+                }
+                break;
+            }
+            /* a live address handed out again: its free fell before the trace started */
+            if (map_find(&map, rec->ptr, &mapped)) {
+                stale++;
+                if (mapped != REPLAY_NONE) {
+                    DmaMem_free(&mm, mapped);
+                }
+            }
+            map_put(&map, rec->ptr, ptr);
+            break;
+
+        case DMA_MEM_TRACE_FREE:
+            if (rec->ptr == REPLAY_NONE) {
+                /* failed in the trace, nothing to free */
+                break;
+            }
+            if (!map_find(&map, rec->ptr, &mapped)) {
+                unmatched++;
+                break;
+            }
+            map_del(&map, rec->ptr);
+            if (mapped == REPLAY_NONE) {
+                /* the replay never got this block */
+                break;
+            }
+            t0 = now_ns();
+            if (DmaMem_free(&mm, mapped) != 0) {
+                lat[1].failures++;
+            }
+            t1 = now_ns();
+            lat[1].ns[lat[1].count++] = (uint32_t)(t1 - t0);
+            break;
+
+        case DMA_MEM_TRACE_RESIZE:
+            if (!map_find(&map, rec->old, &mapped)) {
+                unmatched++;
+                break;
+            }
+            ptr = REPLAY_NONE;
+            if (mapped != REPLAY_NONE) {
+                t0  = now_ns();
+                ptr = DmaMem_resize(&mm, mapped, rec->size);
+                t1  = now_ns();
+                lat[2].ns[lat[2].count++] = (uint32_t)(t1 - t0);
+                lat[2].failures += (ptr == REPLAY_NONE);
+            }
+            /* a failed resize keeps the block, in the trace and here */
+            if (ptr == REPLAY_NONE) {
+                ptr = mapped;
+            }
+            if (rec->ptr != REPLAY_NONE) {
+                map_del(&map, rec->old);
+                map_put(&map, rec->ptr, ptr);
+            } else {
+                map_put(&map, rec->old, ptr);
+            }
+            break;
+
+        case DMA_MEM_TRACE_MOVE:
+            /* compaction moved the block in the trace; the replay's block stays put */
+            if (!map_find(&map, rec->old, &mapped)) {
+                unmatched++;
+                break;
+            }
+            map_del(&map, rec->old);
+            map_put(&map, rec->ptr, mapped);
+            break;
+        }
+
+        if (cfg->interval && ((i + 1) % cfg->interval == 0)) {
+            t0 = now_ns();
+            sample(&mm, rec, &recs[0], i + 1);
+            sampling += now_ns() - t0;
+        }
+    }
+    wall    = now_ns() - wall - sampling;
+    seconds = wall / 1e9;
+    if (n && (!cfg->interval || (n % cfg->interval))) {
+        sample(&mm, &recs[n - 1], &recs[0], n);
+    }
+
+    report_latency("alloc", &lat[0]);
+    report_latency("free", &lat[1]);
+    report_latency("resize", &lat[2]);
+    report_latency("alloc (rec)", &traced[DMA_MEM_TRACE_ALLOC]);
+    report_latency("free (rec)", &traced[DMA_MEM_TRACE_FREE]);
+    report_latency("resize (rec)", &traced[DMA_MEM_TRACE_RESIZE]);
+
+    /* frees what the trace left allocated, then everything must be free again */
+    live = map.count;
+    for (i = 0; i <= map.mask; ++i) {
+        if ((map.keys[i] != REPLAY_NONE) && (map.vals[i] != REPLAY_NONE)) {
+            DmaMem_free(&mm, map.vals[i]);
+        }
+    }
+    DmaMem_flush(&mm);
+    DmaMem_get_info(&mm, &info);
+    leaked = info.total_pages - info.free_pages;
+
+    printf("  calls       : alloc failed %lu, in the trace %lu, fit only here %lu; unmatched %lu, reused live %lu\n",
+           lat[0].failures, traced[DMA_MEM_TRACE_ALLOC].failures, extra, unmatched, stale);
+    printf("  total       : %.3f s, %.0f calls/s, %lu blocks live at the end of the trace, leaked=%lu pages\n", seconds,
+           (lat[0].count + lat[1].count + lat[2].count) / (seconds > 0 ? seconds : 1e-9), live, leaked);
+
+    DmaMem_exit(&mm);
+    map_destroy(&map);
+    for (k = 0; k < 3; ++k) {
+        free(lat[k].ns);
+        free(traced[k].ns);
+    }
+    if (leaked) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [options] TRACE\n"
+           "  --pool BYTES       carve-out size, at least the traced pool's (default 256M)\n"
+           "  --page BYTES       allocator page size (default 4096)\n"
+           "  --engine LIST      comma separated tree | tlsf | buddy, each replayed in turn (default tree)\n"
+           "  --shards N         split the pool into N locked sub-regions (default 1)\n"
+           "  --mag PAGES[,...]  per-CPU magazine block sizes in pages (up to %d)\n"
+           "  --mag-depth N      blocks parked per magazine (default 32)\n"
+           "  --map-once         map the pool once at init instead of per allocation\n"
+           "  --slab             serve sizes up to half a page from object slabs\n"
+           "  --pageblock PAGES  group pages into aligned pageblocks of PAGES pages (a power of two)\n"
+           "  --interval N       fragmentation sample every N records (default a tenth of the trace, 0 = end only)\n"
+           "  --verbose          let the allocator printk to stderr\n"
+           "TRACE is the allocator's debugfs trace file or the output of DmaMemBench --trace.\n"
+           "Sizes accept K/M/G suffixes.\n", prog, DMA_MEM_MAG_CLASSES);
+}
+
+static unsigned long parse_size(const char* arg) {
+    char *end;
+    unsigned long v = strtoul(arg, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; /* fall through */
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10; break;
+    default: break;
+    }
+    return v;
+}
+
+int main(int argc, char** argv) {
+    static const struct option longopts[] = {
+        { "pool",      required_argument, NULL, 'p' },
+        { "page",      required_argument, NULL, 'g' },
+        { "engine",    required_argument, NULL, 'e' },
+        { "shards",    required_argument, NULL, 'H' },
+        { "mag",       required_argument, NULL, 'c' },
+        { "mag-depth", required_argument, NULL, 'd' },
+        { "map-once",  no_argument,       NULL, 'O' },
+        { "slab",      no_argument,       NULL, 'L' },
+        { "pageblock", required_argument, NULL, 'b' },
+        { "interval",  required_argument, NULL, 'i' },
+        { "verbose",   no_argument,       NULL, 'v' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    ReplayConfig_t cfg = {
+        .pool_size = 256UL << 20,
+        .page_size = 4096,
+        .interval  = REPLAY_NONE,
+        .mm_config = { .mag_depth = 32 },
+    };
+    DmaMemTrace_t *recs = NULL;
+    void   *carveout;
+    char   *tok;
+    long    n;
+    int     opt, ret = 0, nmag = 0, i, k;
+
+    shim_printk_enabled = 0;
+    while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'p': cfg.pool_size = parse_size(optarg); break;
+        case 'g': cfg.page_size = parse_size(optarg); break;
+        case 'H': cfg.mm_config.shards = atoi(optarg); break;
+        case 'd': cfg.mm_config.mag_depth = atoi(optarg); break;
+        case 'O': cfg.mm_config.map_once = 1; break;
+        case 'L': cfg.mm_config.slab     = 1; break;
+        case 'b': cfg.mm_config.pageblock_pages = strtoul(optarg, NULL, 0); break;
+        case 'i': cfg.interval  = strtoul(optarg, NULL, 0); break;
+        case 'v': shim_printk_enabled = 1; break;
+        case 'c':
+            for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                if (nmag == DMA_MEM_MAG_CLASSES) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                cfg.mm_config.mag_pages[nmag++] = atoi(tok);
+            }
+            break;
+        case 'e':
+            for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                for (i = 0; i < (int)(sizeof(engine_names) / sizeof(engine_names[0])); ++i) {
+                    if (strcmp(tok, engine_names[i]) == 0) {
+                        break;
+                    }
+                }
+                if ((i == (int)(sizeof(engine_names) / sizeof(engine_names[0]))) ||
+                    (cfg.nengines == (int)(sizeof(cfg.engines) / sizeof(cfg.engines[0])))) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                cfg.engines[cfg.nengines++] = i;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if ((optind != argc - 1) || (cfg.page_size == 0) || (cfg.page_size & (cfg.page_size - 1)) ||
+        (cfg.pool_size < cfg.page_size)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (cfg.nengines == 0) {
+        cfg.engines[cfg.nengines++] = DMA_MEM_ENGINE_TREE;
+    }
+
+    n = load_trace(argv[optind], &recs);
+    if (n < 0) {
+        return 1;
+    }
+    if (cfg.interval == REPLAY_NONE) {
+        cfg.interval = (n >= 10) ? (unsigned long)n / 10 : 0;
+    }
+
+    carveout = mmap(NULL, cfg.pool_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (carveout == MAP_FAILED) {
+        perror("mmap");
+        free(recs);
+        return 1;
+    }
+
+    for (k = 0; k < cfg.nengines; ++k) {
+        if (replay(&cfg, (DmaMemEngine_t)cfg.engines[k], recs, (unsigned long)n, carveout) != 0) {
+            ret = 1;
+        }
+    }
+
+    munmap(carveout, cfg.pool_size);
+    free(recs);
+    return ret;
+}
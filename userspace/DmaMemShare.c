@@ -0,0 +1,340 @@
+/*
+ * DmaMem zero-copy hand-off between processes.
+ *
+ * Puts one pool in a shared file with DmaMemShm_create, a memfd or with
+ * --file a file on hugetlbfs, and runs --producers forked processes that
+ * allocate frames from it, fill them and pass their offsets down a pipe
+ * to a consumer. The consumer is a fresh exec of this program that maps
+ * the pool with DmaMemShm_attach, checks every frame in place and frees
+ * it, so blocks are allocated in one process and freed in another. A
+ * producer that finds the pool full sleeps in DmaMem_alloc_wait until the
+ * consumer's frees make room.
+ *
+ * Frames are between half of --size and --size bytes. Reports the frames
+ * handed over per second, the metadata the pool used and whether every
+ * page came back.
+ */
+
+#include "DmaMem.h"
+#include "DmaMemShm.h"
+#include <linux/jiffies.h>
+#include <linux/printk.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* const engine_names[] = {
+    [DMA_MEM_ENGINE_TREE] = "tree",
+    [DMA_MEM_ENGINE_TLSF] = "tlsf",
+    [DMA_MEM_ENGINE_BUDDY] = "buddy",
+};
+
+typedef struct {
+    unsigned long   pool_size;
+    unsigned long   page_size;
+    unsigned long   size;
+    unsigned long   frames;
+    int             producers;
+    uint64_t        seed;
+    const char*     path;
+    DmaMemConfig_t  mm_config;
+} ShareConfig_t;
+
+/* what goes down the pipe, and what a frame starts with */
+typedef struct {
+    uint64_t    ptr;
+    uint64_t    seq;
+    uint32_t    size;
+    uint32_t    producer;
+} ShareFrame_t;
+
+static uint64_t rng_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned char frame_byte(const ShareFrame_t* frame) {
+    return (unsigned char)(frame->seq * 131 + frame->producer);
+}
+
+static int producer(const ShareConfig_t* cfg, DmaMemShm_t* shm, int id, int out) {
+    DmaMem_t*     mm    = DmaMemShm_mem(shm);
+    uint64_t      state = cfg->seed * 0x9E3779B97F4A7C15ULL + id + 1;
+    unsigned long lo    = cfg->size / 2, failed = 0, seq;
+    ShareFrame_t  frame;
+    unsigned char* buf;
+
+    for (seq = 0; seq < cfg->frames; ++seq) {
+        frame.size     = (uint32_t)(lo + rng_next(&state) % (cfg->size - lo + 1));
+        frame.seq      = seq;
+        frame.producer = id;
+        frame.ptr      = DmaMem_alloc_wait(mm, frame.size, HZ);
+        if (frame.ptr == (uint64_t)-1) {
+            failed++;
+            continue;
+        }
+        buf = (unsigned char*)DmaMemShm_addr(shm, frame.ptr);
+        memcpy(buf, &frame, sizeof(frame));
+        memset(buf + sizeof(frame), frame_byte(&frame), frame.size - sizeof(frame));
+        if (write(out, &frame, sizeof(frame)) != (ssize_t)sizeof(frame)) {
+            perror("write");
+            return 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "producer %d: %lu allocations timed out\n", id, failed);
+    }
+    return failed ? 1 : 0;
+}
+
+static int read_frame(int in, ShareFrame_t* frame) {
+    size_t  done = 0;
+    ssize_t n;
+
+    while (done < sizeof(*frame)) {
+        n = read(in, (char*)frame + done, sizeof(*frame) - done);
+        if (n <= 0) {
+            return (n == 0) && (done == 0) ? 0 : -1;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+/* the exec'd side: attaches to the pool in fd and drains the pipe in */
+static int consumer(int fd, int in) {
+    DmaMemShm_t*   shm = DmaMemShm_attach(fd);
+    ShareFrame_t   frame;
+    unsigned char* buf;
+    unsigned long  frames = 0, bytes = 0, bad = 0, i;
+    int ret;
+
+    close(fd);
+    if (shm == NULL) {
+        fprintf(stderr, "consumer: DmaMemShm_attach failed\n");
+        return 1;
+    }
+    while ((ret = read_frame(in, &frame)) > 0) {
+        buf = (unsigned char*)DmaMemShm_addr(shm, frame.ptr);
+        if ((buf == NULL) || (memcmp(buf, &frame, sizeof(frame)) != 0)) {
+            bad++;
+            continue;
+        }
+        for (i = sizeof(frame); (i < frame.size) && (buf[i] == frame_byte(&frame)); ++i) {
+        }
+        bad += (i != frame.size);
+        bad += (DmaMem_free(DmaMemShm_mem(shm), frame.ptr) != 0);
+        frames++;
+        bytes += frame.size;
+    }
+    printf("  consumer: %lu frames, %lu MiB checked in place, %lu bad%s\n", frames, bytes >> 20, bad,
+           (ret < 0) ? ", pipe cut mid-frame" : "");
+    DmaMemShm_detach(shm);
+    return (bad || (ret < 0)) ? 1 : 0;
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [options]\n"
+           "  --pool BYTES       pool size (default 64M)\n"
+           "  --page BYTES       allocator page size, the huge page size with --file on hugetlbfs (default 4096)\n"
+           "  --size BYTES       largest frame, the smallest is half of it (default 64K)\n"
+           "  --frames N         frames per producer (default 100000)\n"
+           "  --producers N      producer processes (default 2)\n"
+           "  --engine NAME      tree | tlsf | buddy (default tree)\n"
+           "  --shards N         split the pool into N locked sub-regions (default 1)\n"
+           "  --mag PAGES[,...]  per-CPU magazine block sizes in pages (up to %d)\n"
+           "  --mag-depth N      blocks parked per magazine (default 32)\n"
+           "  --map-once         map the pool once at init instead of per allocation\n"
+           "  --slab             serve sizes up to half a page from object slabs\n"
+           "  --file PATH        back the pool with PATH, e.g. on hugetlbfs, instead of a memfd; removed at the end\n"
+           "  --seed N           PRNG seed (default 1)\n"
+           "  --verbose          let the allocator printk to stderr\n"
+           "Sizes accept K/M/G suffixes.\n", prog, DMA_MEM_MAG_CLASSES);
+}
+
+static unsigned long parse_size(const char* arg) {
+    char *end;
+    unsigned long v = strtoul(arg, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; /* fall through */
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10; break;
+    default: break;
+    }
+    return v;
+}
+
+int main(int argc, char** argv) {
+    static const struct option longopts[] = {
+        { "pool",      required_argument, NULL, 'p' },
+        { "page",      required_argument, NULL, 'g' },
+        { "size",      required_argument, NULL, 'z' },
+        { "frames",    required_argument, NULL, 'n' },
+        { "producers", required_argument, NULL, 'P' },
+        { "engine",    required_argument, NULL, 'e' },
+        { "shards",    required_argument, NULL, 'H' },
+        { "mag",       required_argument, NULL, 'c' },
+        { "mag-depth", required_argument, NULL, 'd' },
+        { "map-once",  no_argument,       NULL, 'O' },
+        { "slab",      no_argument,       NULL, 'L' },
+        { "file",      required_argument, NULL, 'f' },
+        { "seed",      required_argument, NULL, 's' },
+        { "verbose",   no_argument,       NULL, 'v' },
+        { "consume",   required_argument, NULL, 'C' },     /* internal: FD,PIPE of the exec'd consumer */
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    ShareConfig_t cfg = {
+        .pool_size = 64UL << 20,
+        .page_size = 4096,
+        .size      = 64UL << 10,
+        .frames    = 100000,
+        .producers = 2,
+        .seed      = 1,
+        .mm_config = { .mag_depth = 32 },
+    };
+    DmaMemShm_t*  shm;
+    DmaMemInfo_t  info;
+    unsigned long meta_used, meta_size;
+    uint64_t      start;
+    double        secs;
+    pid_t         pid, consumer_pid;
+    char          fds[32], *tok;
+    int           pipefd[2], opt, nmag = 0, i, status, ret = 0, consume_fd = -1, consume_in = -1;
+
+    shim_printk_enabled = 0;
+    while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'p': cfg.pool_size = parse_size(optarg); break;
+        case 'g': cfg.page_size = parse_size(optarg); break;
+        case 'z': cfg.size      = parse_size(optarg); break;
+        case 'n': cfg.frames    = strtoul(optarg, NULL, 0); break;
+        case 'P': cfg.producers = atoi(optarg); break;
+        case 'H': cfg.mm_config.shards    = atoi(optarg); break;
+        case 'd': cfg.mm_config.mag_depth = atoi(optarg); break;
+        case 'O': cfg.mm_config.map_once  = 1; break;
+        case 'L': cfg.mm_config.slab      = 1; break;
+        case 'f': cfg.path = optarg; break;
+        case 's': cfg.seed = strtoull(optarg, NULL, 0); break;
+        case 'v': shim_printk_enabled = 1; break;
+        case 'C':
+            if (sscanf(optarg, "%d,%d", &consume_fd, &consume_in) != 2) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'c':
+            for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                if (nmag == DMA_MEM_MAG_CLASSES) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                cfg.mm_config.mag_pages[nmag++] = atoi(tok);
+            }
+            break;
+        case 'e':
+            for (i = 0; i < (int)(sizeof(engine_names) / sizeof(engine_names[0])); ++i) {
+                if (strcmp(optarg, engine_names[i]) == 0) {
+                    break;
+                }
+            }
+            if (i == (int)(sizeof(engine_names) / sizeof(engine_names[0]))) {
+                usage(argv[0]);
+                return 2;
+            }
+            cfg.mm_config.engine = (DmaMemEngine_t)i;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (consume_fd >= 0) {
+        return consumer(consume_fd, consume_in);
+    }
+    if ((optind != argc) || (cfg.producers <= 0) || (cfg.size < 2 * sizeof(ShareFrame_t)) || (cfg.size > UINT32_MAX)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    shm = DmaMemShm_create(cfg.path, cfg.pool_size, cfg.page_size, 0, &cfg.mm_config);
+    if (shm == NULL) {
+        fprintf(stderr, "DmaMemShm_create failed\n");
+        return 1;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        perror("pipe2");
+        DmaMemShm_destroy(shm);
+        return 1;
+    }
+    fflush(stdout);
+
+    start = now_ns();
+    consumer_pid = fork();
+    if (consumer_pid == 0) {
+        fcntl(DmaMemShm_fd(shm), F_SETFD, 0);
+        fcntl(pipefd[0], F_SETFD, 0);
+        snprintf(fds, sizeof(fds), "%d,%d", DmaMemShm_fd(shm), pipefd[0]);
+        execl("/proc/self/exe", argv[0], "--consume", fds, shim_printk_enabled ? "--verbose" : NULL, (char*)NULL);
+        perror("execl");
+        _exit(1);
+    }
+    for (i = 0; (consumer_pid > 0) && (i < cfg.producers); ++i) {
+        pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+            _exit(producer(&cfg, shm, i, pipefd[1]));
+        }
+        if (pid < 0) {
+            perror("fork");
+            ret = 1;
+            break;
+        }
+    }
+    if (consumer_pid < 0) {
+        perror("fork");
+        ret = 1;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+            ret = 1;
+        }
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    /* parked magazine blocks still count as allocated */
+    DmaMem_flush(DmaMemShm_mem(shm));
+    DmaMem_get_info(DmaMemShm_mem(shm), &info);
+    DmaMemShm_meta(shm, &meta_used, &meta_size);
+    printf("  pool : %s, %lu MiB in pages of %lu, %s engine, metadata %lu of %lu KiB\n", cfg.path ? cfg.path : "memfd",
+           cfg.pool_size >> 20, cfg.page_size, engine_names[cfg.mm_config.engine], meta_used >> 10, meta_size >> 10);
+    printf("  total: %.3f s, %d producers, %.0f frames/s handed over, leaked=%lu pages\n", secs, cfg.producers,
+           cfg.producers * cfg.frames / secs, info.alloc_pages);
+    if (info.alloc_pages != 0) {
+        ret = 1;
+    }
+    DmaMemShm_destroy(shm);
+    if (cfg.path) {
+        unlink(cfg.path);
+    }
+    return ret;
+}
@@ -0,0 +1,333 @@
+/*
+ * Process-shared DmaMem pools, see DmaMemShm.h.
+ *
+ * The file holds the header with the DmaMem_t at offset 0, then the
+ * metadata arena, then the pool pages from data_off to the end. The arena
+ * keeps a free list per power-of-two payload size: most of DmaMem's
+ * metadata is allocated once at init, and what comes and goes at run time,
+ * node chunks and slab headers, comes in a few sizes only.
+ */
+
+#include "DmaMemShm.h"
+#include "DmaMemEngine.h"
+#include <linux/cpumask.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SHM_MAGIC       0x444d5348u     /* "DMSH" */
+#define SHM_CLASSES     48
+#define SHM_MIN_CLASS   5               /* 32-byte payloads */
+#define SHM_CHUNK_HDR   64              /* keeps payloads cache-line aligned, as the per-CPU counters want */
+
+#define MAX(_a, _b)         (_a >= _b ? _a : _b)
+#define ROUND_UP(_x, _a)    (((_x) + (_a) - 1) / (_a) * (_a))
+
+typedef struct {
+    u32                 magic;          /* set once the pool is ready */
+    u32                 hdr_size;       /* of the creator's build */
+    unsigned long       file_size;
+    unsigned long       map_addr;       /* where every process maps the file */
+    unsigned long       arena_off;
+    unsigned long       data_off;
+    pthread_spinlock_t  arena_lock;
+    unsigned long       arena_next;     /* offset of the arena's untouched part */
+    unsigned long       arena_used;     /* payload bytes handed out */
+    unsigned long       arena_free[SHM_CLASSES];    /* offset of the first free chunk per class, 0 when none */
+    DmaMem_t            mm;
+} DmaMemShmHdr_t;
+
+struct DmaMemShm_struct {
+    DmaMemShmHdr_t*     hdr;
+    int                 fd;
+    unsigned long       ops_size;       /* the private backend page below the file */
+};
+
+/* a chunk is its class and, while free, the offset of the next free chunk, then the payload */
+static void* shm_alloc(void* ctx, unsigned long bytes, gfp_t gfp) {
+    DmaMemShmHdr_t* hdr = (DmaMemShmHdr_t*)ctx;
+    unsigned long*  chunk = NULL;
+    unsigned long   off;
+    int cls = SHM_MIN_CLASS;
+
+    while ((cls < SHM_CLASSES) && ((1UL << cls) < bytes)) {
+        ++cls;
+    }
+    if (cls == SHM_CLASSES) {
+        return NULL;
+    }
+    pthread_spin_lock(&hdr->arena_lock);
+    off = hdr->arena_free[cls];
+    if (off) {
+        chunk = (unsigned long*)((unsigned char*)hdr + off);
+        hdr->arena_free[cls] = chunk[1];
+    } else if (hdr->arena_next + SHM_CHUNK_HDR + (1UL << cls) <= hdr->data_off) {
+        chunk = (unsigned long*)((unsigned char*)hdr + hdr->arena_next);
+        chunk[0] = cls;
+        hdr->arena_next += SHM_CHUNK_HDR + (1UL << cls);
+    }
+    if (chunk) {
+        hdr->arena_used += 1UL << cls;
+    }
+    pthread_spin_unlock(&hdr->arena_lock);
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+    if (gfp & __GFP_ZERO) {
+        memset((unsigned char*)chunk + SHM_CHUNK_HDR, 0, bytes);
+    }
+    return (unsigned char*)chunk + SHM_CHUNK_HDR;
+}
+
+static void shm_free(void* ctx, const void* ptr) {
+    DmaMemShmHdr_t* hdr = (DmaMemShmHdr_t*)ctx;
+    unsigned long*  chunk = (unsigned long*)((const unsigned char*)ptr - SHM_CHUNK_HDR);
+    unsigned long   cls = chunk[0];
+
+    pthread_spin_lock(&hdr->arena_lock);
+    chunk[1] = hdr->arena_free[cls];
+    hdr->arena_free[cls] = (unsigned char*)chunk - (unsigned char*)hdr;
+    hdr->arena_used -= 1UL << cls;
+    pthread_spin_unlock(&hdr->arena_lock);
+}
+
+/* pool addresses are file offsets, and the file is mapped at the same address everywhere */
+static void* shm_map(void* ctx, unsigned long addr, unsigned long size, unsigned long flags) {
+    DmaMemShmHdr_t* hdr = (DmaMemShmHdr_t*)ctx;
+
+    if ((addr < hdr->data_off) || (addr > hdr->file_size) || (size > hdr->file_size - addr)) {
+        printk("[%d] vmem_shm_map: 0x%lx+0x%lx outside the pool\n", (int)getpid(), addr, size);
+        return NULL;
+    }
+    return (unsigned char*)hdr + addr;
+}
+
+static void shm_unmap(void* ctx, void* kaddr) {
+}
+
+static void shm_log(void* ctx, const char* msg) {
+    printk("[%d] %s", (int)getpid(), msg);
+}
+
+static const DmaMemBackend_t shm_backend = {
+    .alloc = shm_alloc,
+    .free  = shm_free,
+    .map   = shm_map,
+    .unmap = shm_unmap,
+    .log   = shm_log,
+};
+
+/* metadata for one block per page; the power-of-two classes cost up to twice what is asked */
+static unsigned long meta_estimate(unsigned long size, unsigned long pageSize, const DmaMemConfig_t* config) {
+    unsigned long pages  = size / pageSize;
+    unsigned long chunks = (pages + DMA_MEM_NODE_RESERVE) / DMA_MEM_NODE_CHUNK + 2;
+    unsigned long shards = MAX(config->shards, 1) + pages / (DMA_MEM_MAX_PAGES / 2) + 1;
+    unsigned long bytes;
+
+    bytes  = 2 * pages * sizeof(u32);
+    bytes += chunks * (2 * DMA_MEM_NODE_CHUNK * sizeof(avl_node_t) + SHM_CHUNK_HDR + 2 * sizeof(avl_node_t*));
+    bytes += shards * (2 * sizeof(DmaMem_t) + 2 * DMA_MEM_NODE_CHUNK * sizeof(avl_node_t) + (64UL << 10));
+    bytes += 2 * nr_cpu_ids * sizeof(DmaMemCpuStats_t);
+    bytes += 2 * nr_cpu_ids * DMA_MEM_MAG_CLASSES * MAX(config->mag_depth, 0) * sizeof(unsigned long);
+    bytes += 2 * config->trace * sizeof(DmaMemTraceSlot_t);
+    bytes += 2 * config->deferred * sizeof(DmaMemDefer_t);
+    bytes += 4 * config->handles * 32UL;
+    bytes += config->slab ? pages * 256 : 0;
+    bytes += config->pageblock_pages ? 2 * (pages / config->pageblock_pages + 2) * sizeof(u32) : 0;
+    return bytes + (1UL << 20);
+}
+
+/*
+ * Maps the backend page and the file over the range reserved at map_addr
+ * minus the page. The page gets this process's function pointers and is
+ * made read-only.
+ */
+static int map_pool(DmaMemShm_t* shm, int fd, unsigned long map_addr, unsigned long file_size) {
+    void* ops = (void*)(map_addr - shm->ops_size);
+
+    if ((mmap(ops, shm->ops_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != ops) ||
+        (mmap((void*)map_addr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != (void*)map_addr)) {
+        munmap(ops, shm->ops_size + file_size);
+        return -1;
+    }
+    *(DmaMemBackend_t*)ops = shm_backend;
+    mprotect(ops, shm->ops_size, PROT_READ);
+    shm->hdr = (DmaMemShmHdr_t*)map_addr;
+    shm->fd  = fd;
+    return 0;
+}
+
+DmaMemShm_t* DmaMemShm_create(const char* path, unsigned long size, unsigned long pageSize, unsigned long metaSize, const DmaMemConfig_t* config) {
+    DmaMemConfig_t  cfg;
+    DmaMemShm_t*    shm;
+    DmaMemShmHdr_t* hdr;
+    unsigned long   align, arena_off, data_off, file_size, map_addr, resv_size;
+    unsigned char*  resv;
+    int fd;
+
+    if (config) {
+        cfg = *config;
+    } else {
+        memset(&cfg, 0, sizeof(cfg));
+    }
+    if ((pageSize == 0) || (pageSize & (pageSize - 1)) || (size < pageSize)) {
+        printk("vmem_shm_create: %lu bytes in pages of %lu\n", size, pageSize);
+        return NULL;
+    }
+    if (cfg.prezero) {
+        printk("vmem_shm_create: prezero is not available in a shared pool\n");
+        return NULL;
+    }
+    shm = (DmaMemShm_t*)calloc(1, sizeof(DmaMemShm_t));
+    if (shm == NULL) {
+        return NULL;
+    }
+    shm->ops_size = (unsigned long)sysconf(_SC_PAGESIZE);
+
+    /* data_off and the file size are whole pool pages, as hugetlbfs wants */
+    align     = MAX(pageSize, shm->ops_size);
+    size     &= ~(pageSize - 1);
+    arena_off = ROUND_UP(sizeof(DmaMemShmHdr_t), SHM_CHUNK_HDR);
+    data_off  = ROUND_UP(arena_off + (metaSize ? metaSize : meta_estimate(size, pageSize, &cfg)), align);
+    file_size = ROUND_UP(data_off + size, align);
+
+    fd = path ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : memfd_create("DmaMemShm", MFD_CLOEXEC);
+    if ((fd < 0) || (ftruncate(fd, file_size) != 0)) {
+        printk("vmem_shm_create: cannot make a file of %lu bytes\n", file_size);
+        goto fail;
+    }
+
+    /* any free range of the right size and alignment will do, trimmed to what map_pool covers */
+    resv_size = shm->ops_size + file_size + align;
+    resv      = (unsigned char*)mmap(NULL, resv_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (resv == MAP_FAILED) {
+        printk("vmem_shm_create: no room for %lu bytes\n", resv_size);
+        goto fail;
+    }
+    map_addr = ROUND_UP((unsigned long)resv + shm->ops_size, align);
+    if (map_addr - shm->ops_size > (unsigned long)resv) {
+        munmap(resv, map_addr - shm->ops_size - (unsigned long)resv);
+    }
+    munmap((void*)(map_addr + file_size), (unsigned long)resv + resv_size - (map_addr + file_size));
+    if (map_pool(shm, fd, map_addr, file_size) != 0) {
+        printk("vmem_shm_create: failed to map the file\n");
+        goto fail;
+    }
+
+    hdr = shm->hdr;
+    hdr->hdr_size   = sizeof(DmaMemShmHdr_t);
+    hdr->file_size  = file_size;
+    hdr->map_addr   = map_addr;
+    hdr->arena_off  = arena_off;
+    hdr->data_off   = data_off;
+    hdr->arena_next = arena_off;
+    pthread_spin_init(&hdr->arena_lock, PTHREAD_PROCESS_SHARED);
+    cfg.backend     = (const DmaMemBackend_t*)(map_addr - shm->ops_size);
+    cfg.backend_ctx = hdr;
+    if (DmaMem_init_config(&hdr->mm, data_off, size, pageSize, &cfg) != 0) {
+        DmaMemShm_detach(shm);
+        return NULL;
+    }
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(shm);
+    return NULL;
+}
+
+DmaMemShm_t* DmaMemShm_attach(int fd) {
+    DmaMemShmHdr_t probe;
+    DmaMemShm_t*   shm;
+    unsigned char* resv;
+    unsigned long  want;
+
+    if ((pread(fd, &probe, offsetof(DmaMemShmHdr_t, arena_lock), 0) != (ssize_t)offsetof(DmaMemShmHdr_t, arena_lock)) ||
+        (probe.magic != SHM_MAGIC) || (probe.hdr_size != sizeof(DmaMemShmHdr_t))) {
+        printk("vmem_shm_attach: no pool in fd %d\n", fd);
+        return NULL;
+    }
+    shm = (DmaMemShm_t*)calloc(1, sizeof(DmaMemShm_t));
+    if (shm == NULL) {
+        return NULL;
+    }
+    shm->ops_size = (unsigned long)sysconf(_SC_PAGESIZE);
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        free(shm);
+        return NULL;
+    }
+
+    want = probe.map_addr - shm->ops_size;
+    resv = (unsigned char*)mmap((void*)want, shm->ops_size + probe.file_size, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if ((resv != MAP_FAILED) && ((unsigned long)resv != want)) {
+        /* kernels before 4.17 take the flag as a hint */
+        munmap(resv, shm->ops_size + probe.file_size);
+        resv = MAP_FAILED;
+    }
+    if ((resv == MAP_FAILED) || (map_pool(shm, fd, probe.map_addr, probe.file_size) != 0)) {
+        printk("vmem_shm_attach: 0x%lx+0x%lx is taken in this process\n", want, shm->ops_size + probe.file_size);
+        close(fd);
+        free(shm);
+        return NULL;
+    }
+    return shm;
+}
+
+void DmaMemShm_detach(DmaMemShm_t* shm) {
+    if (shm == NULL) {
+        return;
+    }
+    munmap((unsigned char*)shm->hdr - shm->ops_size, shm->ops_size + shm->hdr->file_size);
+    close(shm->fd);
+    free(shm);
+}
+
+int DmaMemShm_destroy(DmaMemShm_t* shm) {
+    if (shm == NULL) {
+        printk("vmem_shm_destroy: invalid handle\n");
+        return -1;
+    }
+    shm->hdr->magic = 0;
+    DmaMem_exit(&shm->hdr->mm);
+    DmaMemShm_detach(shm);
+    return 0;
+}
+
+DmaMem_t* DmaMemShm_mem(DmaMemShm_t* shm) {
+    return &shm->hdr->mm;
+}
+
+int DmaMemShm_fd(const DmaMemShm_t* shm) {
+    return shm->fd;
+}
+
+void* DmaMemShm_addr(DmaMemShm_t* shm, unsigned long ptr) {
+    DmaMemShmHdr_t* hdr = shm->hdr;
+
+    if ((ptr < hdr->data_off) || (ptr >= hdr->file_size)) {
+        return NULL;
+    }
+    return (unsigned char*)hdr + ptr;
+}
+
+void DmaMemShm_meta(DmaMemShm_t* shm, unsigned long* used, unsigned long* size) {
+    DmaMemShmHdr_t* hdr = shm->hdr;
+
+    pthread_spin_lock(&hdr->arena_lock);
+    *used = hdr->arena_used;
+    pthread_spin_unlock(&hdr->arena_lock);
+    *size = hdr->data_off - hdr->arena_off;
+}
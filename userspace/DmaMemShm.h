@@ -0,0 +1,57 @@
+#ifndef __DMA_MEM_SHM_H
+#define __DMA_MEM_SHM_H
+
+/*
+ * A DmaMem pool whose pages and metadata both live in one shared file, a
+ * memfd or a file on hugetlbfs, so that several processes allocate from it,
+ * free each other's buffers and hand them over without copying.
+ *
+ * Pool addresses are offsets into the file: every process finds a buffer
+ * at DmaMemShm_addr, and could just as well mmap it from the fd on its
+ * own. The metadata links its parts by pointer, so every process maps the
+ * file at the address the creator chose, and DmaMemShm_attach fails where
+ * that range is taken. The backend sits on a private page just below the
+ * file, at the same address everywhere, holding each process's own
+ * function pointers.
+ *
+ * The locks are process-shared, but a process that dies inside a call
+ * leaves the pool locked. config.prezero, whose thread belongs to one
+ * process, and DmaMem_set_watermarks, whose callback does, are not for
+ * shared pools; DmaMem_alloc_wait sleepers are woken by frees in any
+ * process.
+ */
+
+#include "DmaMem.h"
+
+typedef struct DmaMemShm_struct DmaMemShm_t;
+
+/*
+ * Creates a pool of size bytes in pages of pageSize. path NULL makes a
+ * memfd, otherwise the file is created or truncated, e.g. on hugetlbfs with
+ * pageSize the huge page size. metaSize bytes are set aside for the
+ * metadata, 0 for an estimate that covers one block per page.
+ */
+DmaMemShm_t* DmaMemShm_create(const char* path, unsigned long size, unsigned long pageSize, unsigned long metaSize, const DmaMemConfig_t* config);
+
+/* maps the pool in fd, made by DmaMemShm_create in another process; fd is duplicated */
+DmaMemShm_t* DmaMemShm_attach(int fd);
+
+/* unmaps the pool, which lives on for the other processes */
+void DmaMemShm_detach(DmaMemShm_t* shm);
+
+/* DmaMem_exit and detach, once no other process uses the pool */
+int DmaMemShm_destroy(DmaMemShm_t* shm);
+
+/* the pool, for every DmaMem_* call */
+DmaMem_t* DmaMemShm_mem(DmaMemShm_t* shm);
+
+/* the shared file, for passing to other processes */
+int DmaMemShm_fd(const DmaMemShm_t* shm);
+
+/* this process's address of the pool offset ptr, or NULL */
+void* DmaMemShm_addr(DmaMemShm_t* shm, unsigned long ptr);
+
+/* metadata bytes in use and set aside */
+void DmaMemShm_meta(DmaMemShm_t* shm, unsigned long* used, unsigned long* size);
+
+#endif
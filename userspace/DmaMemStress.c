@@ -0,0 +1,732 @@
+/*
+ * DmaMem randomized stress and fault injection.
+ *
+ * Runs --threads workers on one pool, each taking --ops random steps:
+ * plain, aligned, hinted and zeroed allocations of up to --size bytes,
+ * frees, resizes, bulk allocations and frees, deferred frees with
+ * --deferred, and frees the allocator has to refuse: below and above the
+ * pool, inside a live block and off an object's start. Every live buffer
+ * is filled with a byte of its own and checked before it goes and after
+ * it moves, so overlapping blocks and lost contents show up. Every --check
+ * steps the workers meet at a barrier, and one of them frees a block twice,
+ * once by itself, once within a bulk free and once through the deferred
+ * ring, and runs DmaMem_validate on the quiet pool.
+ *
+ * With --fail-pct P the pool's backend fails that share of its metadata
+ * allocations and mappings: first while the pool is set up, which has to
+ * fail cleanly until an attempt gets through, then throughout the run.
+ * After the drain every page must be back and the pool valid, and a
+ * corrupted tag and page counter must each fail DmaMem_validate. Exits 1
+ * when anything was wrong.
+ */
+
+#include "DmaMem.h"
+#include "DmaMemEngine.h"
+#include <linux/io.h>
+#include <linux/printk.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define STRESS_PHYS_BASE    0x80000000UL
+#define STRESS_BULK_MAX     8
+
+static const char* const engine_names[] = {
+    [DMA_MEM_ENGINE_TREE] = "tree",
+    [DMA_MEM_ENGINE_TLSF] = "tlsf",
+    [DMA_MEM_ENGINE_BUDDY] = "buddy",
+};
+
+typedef struct {
+    unsigned long   pool_size;
+    unsigned long   page_size;
+    unsigned long   size;
+    unsigned long   ops;
+    unsigned long   live;
+    unsigned long   check;
+    unsigned int    fail_pct;
+    int             threads;
+    uint64_t        seed;
+    DmaMemConfig_t  mm_config;
+} StressConfig_t;
+
+/*
+ * The backend wrapped around DmaMem_kernel_backend. While armed it fails
+ * the fail_nth call when that is set, and fail_pct of the calls otherwise.
+ */
+typedef struct {
+    unsigned int    fail_pct;
+    int             armed;
+    long            fail_nth;
+    long            calls;
+    int             verbose;
+    int             quiet;          /* holds back the validator's messages while it is fed corruption */
+    atomic_long_t   faults;
+} StressFaults_t;
+
+typedef struct {
+    unsigned long   ptr;
+    unsigned long   size;
+    unsigned char*  k;              /* NULL when the mapping was failed */
+    unsigned char   fill;
+} StressBuf_t;
+
+typedef struct {
+    unsigned long   allocs;
+    unsigned long   alloc_failed;
+    unsigned long   frees;
+    unsigned long   resizes;
+    unsigned long   resize_failed;
+    unsigned long   bulks;
+    unsigned long   rejected;       /* invalid frees refused */
+    unsigned long   validations;
+    unsigned long   errors;
+} StressCount_t;
+
+typedef struct {
+    const StressConfig_t* cfg;
+    DmaMem_t*           mm;
+    pthread_barrier_t*  barrier;
+    int                 id;
+    uint64_t            rng;
+    unsigned char       next_fill;
+    StressBuf_t*        bufs;
+    unsigned long       nbufs;
+    StressCount_t       count;
+} StressThread_t;
+
+static __thread uint64_t fault_state;
+
+static uint64_t rng_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int fault_hit(StressFaults_t* faults) {
+    if (!faults->armed) {
+        return 0;
+    }
+    if (faults->fail_nth) {
+        if (++faults->calls != faults->fail_nth) {
+            return 0;
+        }
+        atomic_long_inc(&faults->faults);
+        return 1;
+    }
+    if (faults->fail_pct == 0) {
+        return 0;
+    }
+    if (fault_state == 0) {
+        fault_state = (uintptr_t)&fault_state | 1;
+    }
+    if (rng_next(&fault_state) % 100 >= faults->fail_pct) {
+        return 0;
+    }
+    atomic_long_inc(&faults->faults);
+    return 1;
+}
+
+static void* fault_alloc(void* ctx, unsigned long bytes, gfp_t gfp) {
+    return fault_hit(ctx) ? NULL : DmaMem_kernel_backend.alloc(NULL, bytes, gfp);
+}
+
+static void fault_free(void* ctx, const void* ptr) {
+    DmaMem_kernel_backend.free(NULL, ptr);
+}
+
+static void* fault_map(void* ctx, unsigned long addr, unsigned long size, unsigned long flags) {
+    return fault_hit(ctx) ? NULL : DmaMem_kernel_backend.map(NULL, addr, size, flags);
+}
+
+static void fault_unmap(void* ctx, void* kaddr) {
+    DmaMem_kernel_backend.unmap(NULL, kaddr);
+}
+
+/* the validator's findings always show, the rest with --verbose */
+static void fault_log(void* ctx, const char* msg) {
+    StressFaults_t* faults = ctx;
+
+    if (faults->verbose || (!faults->quiet && (strncmp(msg, "vmem_validate", 13) == 0))) {
+        fputs(msg, stderr);
+    }
+}
+
+static const DmaMemBackend_t fault_backend = {
+    .alloc = fault_alloc,
+    .free  = fault_free,
+    .map   = fault_map,
+    .unmap = fault_unmap,
+    .log   = fault_log,
+};
+
+static void stress_error(StressThread_t* t, const char* what, unsigned long ptr) {
+    fprintf(stderr, "thread %d: %s at 0x%lx\n", t->id, what, ptr);
+    t->count.errors++;
+}
+
+static void buf_fill(StressThread_t* t, StressBuf_t* buf) {
+    buf->fill = t->next_fill;
+    t->next_fill = (unsigned char)(t->next_fill + 2);
+    if (buf->k) {
+        memset(buf->k, buf->fill, buf->size);
+    }
+}
+
+/* samples every 32nd byte and the last of the first bytes, against value */
+static int bytes_are(const unsigned char* k, unsigned long bytes, unsigned char value) {
+    unsigned long i;
+
+    for (i = 0; i < bytes; i += 32) {
+        if (k[i] != value) {
+            return 0;
+        }
+    }
+    return k[bytes - 1] == value;
+}
+
+static void buf_check(StressThread_t* t, const StressBuf_t* buf, unsigned long bytes, const char* when) {
+    if (buf->k && !bytes_are(buf->k, bytes, buf->fill)) {
+        stress_error(t, when, buf->ptr);
+    }
+}
+
+static void do_alloc(StressThread_t* t) {
+    const StressConfig_t* cfg = t->cfg;
+    StressBuf_t*  buf = &t->bufs[t->nbufs];
+    unsigned long align = 0;
+    unsigned int  flags = 0;
+    int kind = rng_next(&t->rng) % 4;
+
+    buf->size = 1 + rng_next(&t->rng) % cfg->size;
+    if (kind == 1) {
+        align = cfg->page_size << (rng_next(&t->rng) % 5);
+    } else if (kind == 2) {
+        flags = 1U << (rng_next(&t->rng) % 3);
+    } else if (kind == 3) {
+        flags = DMA_MEM_ZERO;
+    }
+    buf->ptr = (kind == 0) ? DmaMem_alloc(t->mm, buf->size) : DmaMem_alloc_flags(t->mm, buf->size, align, flags);
+    if (buf->ptr == (unsigned long)-1) {
+        t->count.alloc_failed++;
+        return;
+    }
+    t->count.allocs++;
+    if (align && (buf->ptr & (align - 1))) {
+        stress_error(t, "misaligned block", buf->ptr);
+    }
+    buf->k = DmaMem_get_kaddr(t->mm, buf->ptr);
+    if ((flags & DMA_MEM_ZERO) && buf->k && !bytes_are(buf->k, buf->size, 0)) {
+        stress_error(t, "zeroed block with stale bytes", buf->ptr);
+    }
+    buf_fill(t, buf);
+    t->nbufs++;
+}
+
+static void do_free(StressThread_t* t) {
+    unsigned long idx = rng_next(&t->rng) % t->nbufs;
+    StressBuf_t   buf = t->bufs[idx];
+    int ret;
+
+    buf_check(t, &buf, buf.size, "block overwritten before its free");
+    t->bufs[idx] = t->bufs[--t->nbufs];
+    ret = -1;
+    if (t->cfg->mm_config.deferred && (rng_next(&t->rng) & 1)) {
+        ret = DmaMem_free_deferred(t->mm, buf.ptr);
+    }
+    if ((ret != 0) && (DmaMem_free(t->mm, buf.ptr) != 0)) {
+        stress_error(t, "free of a live block failed", buf.ptr);
+        return;
+    }
+    t->count.frees++;
+}
+
+/* halves a live buffer one time in four, grows it by up to four pages otherwise */
+static void do_resize(StressThread_t* t) {
+    StressBuf_t*  buf = &t->bufs[rng_next(&t->rng) % t->nbufs];
+    unsigned long size, ptr, keep;
+    int mapped;
+
+    if (rng_next(&t->rng) % 4 == 0) {
+        size = (buf->size + 1) / 2;
+    } else {
+        size = buf->size + 1 + rng_next(&t->rng) % (4 * t->cfg->page_size);
+    }
+    keep = (size < buf->size) ? size : buf->size;
+    ptr  = DmaMem_resize(t->mm, buf->ptr, size);
+    if (ptr == (unsigned long)-1) {
+        t->count.resize_failed++;
+        buf_check(t, buf, buf->size, "block changed by a failed resize");
+        return;
+    }
+    t->count.resizes++;
+    mapped   = (buf->k != NULL);
+    buf->ptr = ptr;
+    buf->k   = DmaMem_get_kaddr(t->mm, ptr);
+    if (mapped && (buf->k == NULL)) {
+        stress_error(t, "mapping lost by a resize", ptr);
+    } else if (mapped) {
+        buf_check(t, buf, keep, "contents lost by a resize");
+    }
+    buf->size = size;
+    buf_fill(t, buf);
+}
+
+static void do_bulk(StressThread_t* t) {
+    StressBuf_t   bulk[STRESS_BULK_MAX];
+    unsigned long ptrs[STRESS_BULK_MAX];
+    unsigned long count = 2 + rng_next(&t->rng) % (STRESS_BULK_MAX - 1);
+    unsigned long size  = 1 + rng_next(&t->rng) % t->cfg->size, i;
+
+    if (DmaMem_alloc_bulk(t->mm, size, count, ptrs) != 0) {
+        t->count.alloc_failed++;
+        return;
+    }
+    t->count.bulks++;
+    for (i = 0; i < count; ++i) {
+        bulk[i].ptr  = ptrs[i];
+        bulk[i].size = size;
+        bulk[i].k    = DmaMem_get_kaddr(t->mm, ptrs[i]);
+        buf_fill(t, &bulk[i]);
+    }
+    for (i = 0; i < count; ++i) {
+        buf_check(t, &bulk[i], size, "bulk block overwritten");
+    }
+    if (DmaMem_free_bulk(t->mm, ptrs, count) != 0) {
+        stress_error(t, "bulk free failed", ptrs[0]);
+    }
+}
+
+/* frees the allocator must refuse without touching anything */
+static void do_invalid(StressThread_t* t) {
+    const StressBuf_t* buf = t->nbufs ? &t->bufs[rng_next(&t->rng) % t->nbufs] : NULL;
+    unsigned long ptr;
+
+    switch (rng_next(&t->rng) % 4) {
+    case 0:
+        ptr = STRESS_PHYS_BASE - t->cfg->page_size;
+        break;
+    case 1:
+        ptr = STRESS_PHYS_BASE + t->cfg->pool_size;
+        break;
+    case 2:
+        if ((buf == NULL) || (buf->size <= t->cfg->page_size)) {
+            return;
+        }
+        ptr = buf->ptr + t->cfg->page_size;
+        break;
+    default:
+        if (buf == NULL) {
+            return;
+        }
+        ptr = buf->ptr + 1;
+        break;
+    }
+    if (DmaMem_free(t->mm, ptr) == 0) {
+        stress_error(t, "invalid free accepted", ptr);
+        return;
+    }
+    t->count.rejected++;
+}
+
+/* frees a block twice, then as two of a bulk free's three addresses, then queues one twice */
+static void double_free(StressThread_t* t) {
+    unsigned long size = 1 + rng_next(&t->rng) % t->cfg->size;
+    unsigned long ptr, pair[2], ptrs[3];
+
+    ptr = DmaMem_alloc(t->mm, size);
+    if (ptr != (unsigned long)-1) {
+        if (DmaMem_free(t->mm, ptr) != 0) {
+            stress_error(t, "free of a live block failed", ptr);
+        } else if (DmaMem_free(t->mm, ptr) == 0) {
+            stress_error(t, "double free accepted", ptr);
+        } else {
+            t->count.rejected++;
+        }
+    }
+
+    if (DmaMem_alloc_bulk(t->mm, size, 2, pair) != 0) {
+        return;
+    }
+    ptrs[0] = pair[0];
+    ptrs[1] = pair[1];
+    ptrs[2] = pair[0];
+    if (DmaMem_free_bulk(t->mm, ptrs, 3) == 0) {
+        stress_error(t, "bulk double free accepted", pair[0]);
+    } else {
+        t->count.rejected++;
+    }
+    if ((DmaMem_free(t->mm, pair[0]) == 0) || (DmaMem_free(t->mm, pair[1]) == 0)) {
+        stress_error(t, "block left allocated by a bulk double free", pair[0]);
+    }
+
+    if (!t->cfg->mm_config.deferred) {
+        return;
+    }
+    ptr = DmaMem_alloc(t->mm, size);
+    if (ptr == (unsigned long)-1) {
+        return;
+    }
+    /* a full ring refuses the second queueing, the drain then frees it once all the same */
+    if (DmaMem_free_deferred(t->mm, ptr) != 0) {
+        DmaMem_free(t->mm, ptr);
+        return;
+    }
+    DmaMem_free_deferred(t->mm, ptr);
+    DmaMem_drain_deferred(t->mm);
+    if (DmaMem_free(t->mm, ptr) == 0) {
+        stress_error(t, "block left allocated by a deferred double free", ptr);
+    } else {
+        t->count.rejected++;
+    }
+}
+
+/* runs alone while the other workers wait at the barrier */
+static void do_quiet_check(StressThread_t* t) {
+    double_free(t);
+    t->count.validations++;
+    if (DmaMem_validate(t->mm) != 0) {
+        stress_error(t, "DmaMem_validate failed", 0);
+    }
+}
+
+static void* stress_thread(void* arg) {
+    StressThread_t* t = arg;
+    unsigned long i;
+    unsigned int  r;
+
+    fault_state = t->rng | 1;
+    for (i = 0; i < t->cfg->ops; ++i) {
+        r = rng_next(&t->rng) % 100;
+        if ((t->nbufs == t->cfg->live) || ((r < 35) && (t->nbufs > 0))) {
+            do_free(t);
+        } else if ((r < 45) && (t->nbufs > 0)) {
+            do_resize(t);
+        } else if (r < 50) {
+            do_bulk(t);
+        } else if (r < 53) {
+            do_invalid(t);
+        } else {
+            do_alloc(t);
+        }
+        if (t->cfg->check && ((i + 1) % t->cfg->check == 0)) {
+            if (pthread_barrier_wait(t->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+                do_quiet_check(t);
+            }
+            pthread_barrier_wait(t->barrier);
+        }
+    }
+    while (t->nbufs > 0) {
+        do_free(t);
+    }
+    return NULL;
+}
+
+/* a flipped tail tag and a miscounted page must both be caught */
+static int corrupt_check(DmaMem_t* mm, StressFaults_t* faults) {
+    unsigned long ptr = DmaMem_alloc(mm, 2 * mm->page_size);
+    DmaMem_t*     region;
+    avl_node_t*   node;
+    u32*          tail;
+    int           caught = 0;
+
+    if (ptr == (unsigned long)-1) {
+        return -1;
+    }
+    region = DmaMem_region_of(mm, ptr);
+    node   = DmaMem_lookup_block(region, ptr);
+    tail   = &region->tags[node->pageno + node->npages - 1];
+
+    faults->quiet = 1;
+    *tail ^= DMA_TAG_USED;
+    caught += (DmaMem_validate(mm) != 0);
+    *tail ^= DMA_TAG_USED;
+    region->free_page_count++;
+    caught += (DmaMem_validate(mm) != 0);
+    region->free_page_count--;
+    faults->quiet = 0;
+
+    if ((DmaMem_free(mm, ptr) != 0) || (caught != 2)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int run(const StressConfig_t* cfg, void* carveout, StressFaults_t* faults) {
+    DmaMemConfig_t     mm_config = cfg->mm_config;
+    DmaMem_t           mm;
+    DmaMemInfo_t       info;
+    StressThread_t*    threads;
+    StressCount_t      total;
+    pthread_t*         tids;
+    pthread_barrier_t  barrier;
+    uint64_t           start;
+    double             secs;
+    int                i, tries, ret = 0;
+
+    mm_config.backend     = &fault_backend;
+    mm_config.backend_ctx = faults;
+    shim_carveout_register(STRESS_PHYS_BASE, carveout, cfg->pool_size);
+
+    /*
+     * With faults, the first attempt fails the backend's first call, the next
+     * its second and so on until one makes fewer calls: every error path of
+     * the set-up runs once, and has to give back what it took, which
+     * LeakSanitizer checks.
+     */
+    faults->armed = (faults->fail_pct != 0);
+    for (tries = 1; ; ++tries) {
+        faults->fail_nth = tries;
+        faults->calls    = 0;
+        memset(&mm, 0, sizeof(mm));
+        ret = DmaMem_init_config(&mm, STRESS_PHYS_BASE, cfg->pool_size, cfg->page_size, &mm_config);
+        if (faults->armed && (faults->calls >= faults->fail_nth)) {
+            if (ret == 0) {
+                DmaMem_exit(&mm);
+            }
+            continue;
+        }
+        if (ret != 0) {
+            fprintf(stderr, "DmaMem_init_config failed\n");
+            return 1;
+        }
+        break;
+    }
+    faults->fail_nth = 0;
+
+    threads = calloc(cfg->threads, sizeof(*threads));
+    tids    = calloc(cfg->threads, sizeof(*tids));
+    for (i = 0; threads && (i < cfg->threads); ++i) {
+        threads[i].cfg       = cfg;
+        threads[i].mm        = &mm;
+        threads[i].barrier   = &barrier;
+        threads[i].id        = i;
+        threads[i].rng       = cfg->seed * 0x9E3779B97F4A7C15ULL + i + 1;
+        threads[i].next_fill = (unsigned char)(2 * i + 1);
+        threads[i].bufs      = calloc(cfg->live, sizeof(StressBuf_t));
+        if (threads[i].bufs == NULL) {
+            break;
+        }
+    }
+    if ((threads == NULL) || (tids == NULL) || (i < cfg->threads)) {
+        fprintf(stderr, "out of memory\n");
+        while (threads && (i > 0)) {
+            free(threads[--i].bufs);
+        }
+        free(threads);
+        free(tids);
+        DmaMem_exit(&mm);
+        return 1;
+    }
+    pthread_barrier_init(&barrier, NULL, cfg->threads);
+
+    start = now_ns();
+    for (i = 0; i < cfg->threads; ++i) {
+        pthread_create(&tids[i], NULL, stress_thread, &threads[i]);
+    }
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < cfg->threads; ++i) {
+        pthread_join(tids[i], NULL);
+        total.allocs        += threads[i].count.allocs;
+        total.alloc_failed  += threads[i].count.alloc_failed;
+        total.frees         += threads[i].count.frees;
+        total.resizes       += threads[i].count.resizes;
+        total.resize_failed += threads[i].count.resize_failed;
+        total.bulks         += threads[i].count.bulks;
+        total.rejected      += threads[i].count.rejected;
+        total.validations   += threads[i].count.validations;
+        total.errors        += threads[i].count.errors;
+        free(threads[i].bufs);
+    }
+    secs = (now_ns() - start) / 1e9;
+    faults->armed = 0;
+
+    /* parked magazine blocks, empty slabs and deferred frees still count as allocated */
+    DmaMem_flush(&mm);
+    total.validations++;
+    if (DmaMem_validate(&mm) != 0) {
+        fprintf(stderr, "DmaMem_validate failed after the drain\n");
+        total.errors++;
+    }
+    DmaMem_get_info(&mm, &info);
+    if (info.alloc_pages != 0) {
+        fprintf(stderr, "%lu pages leaked\n", info.alloc_pages);
+        total.errors++;
+    }
+    if (corrupt_check(&mm, faults) != 0) {
+        fprintf(stderr, "DmaMem_validate missed a corrupted tag or counter\n");
+        total.errors++;
+    }
+
+    printf("  pool : %lu MiB in pages of %lu, %s engine, %d threads, %d faults in the set-up\n",
+           cfg->pool_size >> 20, cfg->page_size, engine_names[mm_config.engine], cfg->threads, tries - 1);
+    printf("  ops  : %.0f ops/s, %lu allocs (%lu failed), %lu frees, %lu resizes (%lu failed), %lu bulks\n",
+           cfg->threads * cfg->ops / secs, total.allocs, total.alloc_failed, total.frees, total.resizes,
+           total.resize_failed, total.bulks);
+    printf("  check: %lu validations, %lu invalid frees refused, %ld faults injected, %lu errors\n",
+           total.validations, total.rejected, atomic_long_read(&faults->faults), total.errors);
+    if (total.errors) {
+        ret = 1;
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+    free(tids);
+    DmaMem_exit(&mm);
+    return ret;
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [options]\n"
+           "  --pool BYTES       pool size (default 16M)\n"
+           "  --page BYTES       allocator page size (default 4096)\n"
+           "  --size BYTES       largest buffer (default 64K)\n"
+           "  --ops N            steps per thread (default 100000)\n"
+           "  --threads N        worker threads (default 4)\n"
+           "  --live N           live buffers per thread at most (default 64)\n"
+           "  --check N          validate the quiesced pool every N steps, 0 = only at the end (default 10000)\n"
+           "  --fail-pct P       fail P%% of the backend's allocations and mappings (default 0)\n"
+           "  --engine NAME      tree | tlsf | buddy (default tree)\n"
+           "  --shards N         split the pool into N locked sub-regions (default 1)\n"
+           "  --mag PAGES[,...]  per-CPU magazine block sizes in pages (up to %d)\n"
+           "  --mag-depth N      blocks parked per magazine (default 32)\n"
+           "  --map-once         map the pool once at init instead of per allocation\n"
+           "  --slab             serve sizes up to half a page from object slabs\n"
+           "  --pageblock PAGES  group pages into pageblocks of PAGES (a power of two)\n"
+           "  --deferred N       free half of the buffers through a deferred ring of N slots\n"
+           "  --prezero          clear free pages from the background zeroing thread, needs --map-once\n"
+           "  --seed N           PRNG seed (default 1)\n"
+           "  --verbose          let the allocator printk to stderr\n"
+           "Sizes accept K/M/G suffixes.\n", prog, DMA_MEM_MAG_CLASSES);
+}
+
+static unsigned long parse_size(const char* arg) {
+    char *end;
+    unsigned long v = strtoul(arg, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; /* fall through */
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10; break;
+    default: break;
+    }
+    return v;
+}
+
+int main(int argc, char** argv) {
+    static const struct option longopts[] = {
+        { "pool",      required_argument, NULL, 'p' },
+        { "page",      required_argument, NULL, 'g' },
+        { "size",      required_argument, NULL, 'z' },
+        { "ops",       required_argument, NULL, 'n' },
+        { "threads",   required_argument, NULL, 't' },
+        { "live",      required_argument, NULL, 'l' },
+        { "check",     required_argument, NULL, 'k' },
+        { "fail-pct",  required_argument, NULL, 'F' },
+        { "engine",    required_argument, NULL, 'e' },
+        { "shards",    required_argument, NULL, 'H' },
+        { "mag",       required_argument, NULL, 'c' },
+        { "mag-depth", required_argument, NULL, 'd' },
+        { "map-once",  no_argument,       NULL, 'O' },
+        { "slab",      no_argument,       NULL, 'L' },
+        { "pageblock", required_argument, NULL, 'B' },
+        { "deferred",  required_argument, NULL, 'D' },
+        { "prezero",   no_argument,       NULL, 'Z' },
+        { "seed",      required_argument, NULL, 's' },
+        { "verbose",   no_argument,       NULL, 'v' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    StressConfig_t cfg = {
+        .pool_size = 16UL << 20,
+        .page_size = 4096,
+        .size      = 64UL << 10,
+        .ops       = 100000,
+        .live      = 64,
+        .check     = 10000,
+        .threads   = 4,
+        .seed      = 1,
+        .mm_config = { .mag_depth = 32 },
+    };
+    StressFaults_t faults;
+    void*  carveout;
+    char*  tok;
+    int    opt, nmag = 0, i, ret;
+
+    memset(&faults, 0, sizeof(faults));
+    shim_printk_enabled = 0;
+    while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'p': cfg.pool_size = parse_size(optarg); break;
+        case 'g': cfg.page_size = parse_size(optarg); break;
+        case 'z': cfg.size      = parse_size(optarg); break;
+        case 'n': cfg.ops       = strtoul(optarg, NULL, 0); break;
+        case 't': cfg.threads   = atoi(optarg); break;
+        case 'l': cfg.live      = strtoul(optarg, NULL, 0); break;
+        case 'k': cfg.check     = strtoul(optarg, NULL, 0); break;
+        case 'F': cfg.fail_pct  = strtoul(optarg, NULL, 0); break;
+        case 'H': cfg.mm_config.shards          = atoi(optarg); break;
+        case 'd': cfg.mm_config.mag_depth       = atoi(optarg); break;
+        case 'O': cfg.mm_config.map_once        = 1; break;
+        case 'L': cfg.mm_config.slab            = 1; break;
+        case 'B': cfg.mm_config.pageblock_pages = strtoul(optarg, NULL, 0); break;
+        case 'D': cfg.mm_config.deferred        = strtoul(optarg, NULL, 0); break;
+        case 'Z': cfg.mm_config.prezero         = 1; break;
+        case 's': cfg.seed = strtoull(optarg, NULL, 0); break;
+        case 'v': shim_printk_enabled = 1; faults.verbose = 1; break;
+        case 'c':
+            for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                if (nmag == DMA_MEM_MAG_CLASSES) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                cfg.mm_config.mag_pages[nmag++] = atoi(tok);
+            }
+            break;
+        case 'e':
+            for (i = 0; i < (int)(sizeof(engine_names) / sizeof(engine_names[0])); ++i) {
+                if (strcmp(optarg, engine_names[i]) == 0) {
+                    break;
+                }
+            }
+            if (i == (int)(sizeof(engine_names) / sizeof(engine_names[0]))) {
+                usage(argv[0]);
+                return 2;
+            }
+            cfg.mm_config.engine = (DmaMemEngine_t)i;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if ((optind != argc) || (cfg.threads <= 0) || (cfg.live == 0) || (cfg.size == 0) || (cfg.fail_pct >= 100) ||
+        (cfg.page_size == 0) || (cfg.page_size & (cfg.page_size - 1)) || (cfg.pool_size < cfg.page_size)) {
+        usage(argv[0]);
+        return 2;
+    }
+    faults.fail_pct = cfg.fail_pct;
+
+    carveout = mmap(NULL, cfg.pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (carveout == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    ret = run(&cfg, carveout, &faults);
+    munmap(carveout, cfg.pool_size);
+    return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef __USERSPACE_ASM_BARRIER_H
+#define __USERSPACE_ASM_BARRIER_H
+
+/*
+ * Userspace stand-in for smp_load_acquire()/smp_store_release() and the
+ * smp_wmb()/smp_rmb() fences.
+ */
+
+#define smp_load_acquire(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, val)   __atomic_store_n((p), (val), __ATOMIC_RELEASE)
+#define smp_wmb()                   __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()                   __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#endif
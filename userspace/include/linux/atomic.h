@@ -0,0 +1,56 @@
+#ifndef __USERSPACE_LINUX_ATOMIC_H
+#define __USERSPACE_LINUX_ATOMIC_H
+
+/*
+ * Userspace stand-in for the atomic_long_t counters of <linux/atomic.h>,
+ * on top of the compiler's relaxed __atomic builtins.
+ */
+
+typedef struct {
+    long counter;
+} atomic_long_t;
+
+static inline long atomic_long_read(const atomic_long_t *v) {
+    return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_long_set(atomic_long_t *v, long i) {
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_long_add(long i, atomic_long_t *v) {
+    __atomic_fetch_add(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_long_inc(atomic_long_t *v) {
+    atomic_long_add(1, v);
+}
+
+static inline void atomic_long_sub(long i, atomic_long_t *v) {
+    __atomic_fetch_sub(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+/* the value returning operations are fully ordered, as in the kernel */
+static inline long atomic_long_add_return(long i, atomic_long_t *v) {
+    return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+static inline long atomic_long_sub_return(long i, atomic_long_t *v) {
+    return __atomic_sub_fetch(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+static inline long atomic_long_read_acquire(const atomic_long_t *v) {
+    return __atomic_load_n(&v->counter, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_long_set_release(atomic_long_t *v, long i) {
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELEASE);
+}
+
+/* fully ordered like the kernel's; returns the value found */
+static inline long atomic_long_cmpxchg(atomic_long_t *v, long old, long new) {
+    __atomic_compare_exchange_n(&v->counter, &old, new, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return old;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __USERSPACE_LINUX_BITOPS_H
+#define __USERSPACE_LINUX_BITOPS_H
+
+/*
+ * Userspace stand-in for the <linux/bitops.h> bit searches.
+ */
+
+#define BITS_PER_LONG       (8 * (int)sizeof(long))
+#define BITS_TO_LONGS(nr)   (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/* index of the lowest set bit, word must be non-zero */
+static inline unsigned long __ffs(unsigned long word) {
+    return (unsigned long)__builtin_ctzl(word);
+}
+
+/* index of the highest set bit, word must be non-zero */
+static inline unsigned long __fls(unsigned long word) {
+    return (unsigned long)(BITS_PER_LONG - 1 - __builtin_clzl(word));
+}
+
+/* 1-based index of the highest set bit, 0 if none */
+static inline int fls(unsigned int x) {
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+/* number of set bits */
+static inline unsigned long hweight_long(unsigned long word) {
+    return (unsigned long)__builtin_popcountl(word);
+}
+
+/* non-atomic bit updates, the caller serialises */
+static inline void __set_bit(unsigned long nr, unsigned long *addr) {
+    addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void __clear_bit(unsigned long nr, unsigned long *addr) {
+    addr[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr) {
+    return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+/* index of the first clear bit below size, or size if there is none */
+static inline unsigned long find_first_zero_bit(const unsigned long *addr, unsigned long size) {
+    unsigned long i;
+    for (i = 0; i < size; i += BITS_PER_LONG) {
+        if (~addr[i / BITS_PER_LONG]) {
+            i += __ffs(~addr[i / BITS_PER_LONG]);
+            return (i < size) ? i : size;
+        }
+    }
+    return size;
+}
+
+#endif
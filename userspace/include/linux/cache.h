@@ -0,0 +1,12 @@
+#ifndef __USERSPACE_LINUX_CACHE_H
+#define __USERSPACE_LINUX_CACHE_H
+
+/*
+ * Userspace stand-in for <linux/cache.h>, assuming 64-byte cache lines.
+ */
+
+#define L1_CACHE_BYTES                  64
+#define ____cacheline_aligned           __attribute__((__aligned__(L1_CACHE_BYTES)))
+#define ____cacheline_aligned_in_smp    ____cacheline_aligned
+
+#endif
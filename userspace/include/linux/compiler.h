@@ -0,0 +1,17 @@
+#ifndef __USERSPACE_LINUX_COMPILER_H
+#define __USERSPACE_LINUX_COMPILER_H
+
+/*
+ * Userspace stand-in for READ_ONCE()/WRITE_ONCE(), as relaxed atomics so
+ * that ThreadSanitizer treats them as marked accesses like KCSAN does.
+ */
+
+#define READ_ONCE(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val)  __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+
+#define likely(x)           __builtin_expect(!!(x), 1)
+#define unlikely(x)         __builtin_expect(!!(x), 0)
+
+#define __printf(a, b)      __attribute__((format(printf, a, b)))
+
+#endif
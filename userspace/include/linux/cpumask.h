@@ -0,0 +1,11 @@
+#ifndef __USERSPACE_LINUX_CPUMASK_H
+#define __USERSPACE_LINUX_CPUMASK_H
+
+/*
+ * Userspace stand-in for <linux/cpumask.h>: only nr_cpu_ids, sampled once
+ * at startup by shim.c.
+ */
+
+extern unsigned int nr_cpu_ids;
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __USERSPACE_LINUX_DEBUGFS_H
+#define __USERSPACE_LINUX_DEBUGFS_H
+
+/*
+ * Userspace stand-in for <linux/debugfs.h>. There is no filesystem: a file
+ * is a dentry remembering its data and show callback, and
+ * shim_debugfs_read() produces what reading it would return.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <linux/seq_file.h>
+
+struct dentry {
+    const char                   *name;
+    void                         *data;
+    const struct file_operations *fops;
+};
+
+static inline struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent,
+                                                 void *data, const struct file_operations *fops) {
+    struct dentry *d = calloc(1, sizeof(*d));
+    (void)mode;
+    (void)parent;
+    if (d) {
+        d->name = strdup(name);
+        d->data = data;
+        d->fops = fops;
+    }
+    return d;
+}
+
+static inline void debugfs_remove(struct dentry *d) {
+    if (d) {
+        free((char *)d->name);
+    }
+    free(d);
+}
+
+/* writes the contents of the file d to f */
+static inline int shim_debugfs_read(struct dentry *d, FILE *f) {
+    struct seq_file m = { f, d->data };
+    return d->fops->show(&m, NULL);
+}
+
+#endif
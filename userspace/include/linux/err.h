@@ -0,0 +1,25 @@
+#ifndef __USERSPACE_LINUX_ERR_H
+#define __USERSPACE_LINUX_ERR_H
+
+/*
+ * Userspace stand-in for <linux/err.h>: errors encoded in the top page of
+ * pointer values.
+ */
+
+#define MAX_ERRNO       4095
+
+#define IS_ERR_VALUE(x) ((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+
+static inline void *ERR_PTR(long error) {
+    return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr) {
+    return (long)ptr;
+}
+
+static inline int IS_ERR(const void *ptr) {
+    return IS_ERR_VALUE((unsigned long)ptr);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __USERSPACE_LINUX_IO_H
+#define __USERSPACE_LINUX_IO_H
+
+/*
+ * Userspace stand-in for memremap()/iounmap(). The "physical" carve-out is
+ * an ordinary mapping registered with shim_carveout_register(); remapping
+ * translates a physical address into that mapping and unmapping is a no-op.
+ */
+
+#include <stddef.h>
+
+#define MEMREMAP_WB     (1 << 0)
+#define MEMREMAP_WT     (1 << 1)
+#define MEMREMAP_WC     (1 << 2)
+
+void  shim_carveout_register(unsigned long phys, void *virt, unsigned long size);
+void *memremap(unsigned long offset, size_t size, unsigned long flags);
+void  memunmap(void *addr);
+void  iounmap(void *addr);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __USERSPACE_LINUX_JIFFIES_H
+#define __USERSPACE_LINUX_JIFFIES_H
+
+/*
+ * Userspace stand-in for <linux/jiffies.h>: a millisecond tick read from
+ * CLOCK_MONOTONIC.
+ */
+
+#include <time.h>
+
+#define HZ                      1000
+#define MAX_SCHEDULE_TIMEOUT    0x7fffffffffffffffL
+
+static inline unsigned long __shim_jiffies(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * HZ + (unsigned long)ts.tv_nsec / (1000000000UL / HZ);
+}
+
+#define jiffies                 __shim_jiffies()
+
+static inline unsigned long msecs_to_jiffies(unsigned int m) {
+    return m;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __USERSPACE_LINUX_KTHREAD_H
+#define __USERSPACE_LINUX_KTHREAD_H
+
+/*
+ * Userspace stand-in for <linux/kthread.h>: a kernel thread is a pthread.
+ * kthread_stop cannot interrupt a sleep the way the kernel's does, so the
+ * thread only notices it when its sleep ends; sleep with a timeout.
+ */
+
+#include <linux/err.h>
+
+struct task_struct;
+
+/* starts threadfn(data) right away; namefmt is not used */
+struct task_struct *kthread_run(int (*threadfn)(void *data), void *data, const char *namefmt, ...);
+
+/* asks the thread to stop, waits for it and returns what threadfn returned */
+int kthread_stop(struct task_struct *k);
+
+/* called from the thread itself */
+int kthread_should_stop(void);
+
+#endif
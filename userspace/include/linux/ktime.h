@@ -0,0 +1,17 @@
+#ifndef __USERSPACE_LINUX_KTIME_H
+#define __USERSPACE_LINUX_KTIME_H
+
+/*
+ * Userspace stand-in for ktime_get_ns(), read from CLOCK_MONOTONIC.
+ */
+
+#include <time.h>
+#include <linux/types.h>
+
+static inline u64 ktime_get_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __USERSPACE_LINUX_LIMITS_H
+#define __USERSPACE_LINUX_LIMITS_H
+
+/*
+ * Userspace stand-in for <linux/limits.h>: the UAPI header glibc expects
+ * under this name, plus LONG_MAX and friends as the kernel's provides.
+ */
+
+#include_next <linux/limits.h>
+#include <limits.h>
+
+#define U32_MAX     0xffffffffU
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef __USERSPACE_LINUX_MUTEX_H
+#define __USERSPACE_LINUX_MUTEX_H
+
+/*
+ * Userspace stand-in for <linux/mutex.h> on top of process-shared pthread
+ * mutexes, see <linux/spinlock.h>.
+ */
+
+#include <pthread.h>
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *lock) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&lock->m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+#define mutex_destroy(lock)     pthread_mutex_destroy(&(lock)->m)
+#define mutex_lock(lock)        pthread_mutex_lock(&(lock)->m)
+#define mutex_trylock(lock)     (pthread_mutex_trylock(&(lock)->m) == 0)
+#define mutex_unlock(lock)      pthread_mutex_unlock(&(lock)->m)
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __USERSPACE_LINUX_PRINTK_H
+#define __USERSPACE_LINUX_PRINTK_H
+
+/*
+ * Userspace stand-in for printk(). Messages go to stderr and can be
+ * silenced by the benchmark through shim_printk_enabled.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+extern int shim_printk_enabled;
+
+#define KERN_ERR        ""
+#define KERN_WARNING    ""
+#define KERN_INFO       ""
+#define KERN_DEBUG      ""
+
+#define printk(fmt, ...)                                    \
+    do {                                                    \
+        if (shim_printk_enabled)                            \
+            fprintf(stderr, fmt, ##__VA_ARGS__);            \
+    } while (0)
+
+#define vprintk(fmt, args)      (shim_printk_enabled ? vfprintf(stderr, fmt, args) : 0)
+
+#endif
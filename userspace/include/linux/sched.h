@@ -0,0 +1,28 @@
+#ifndef __USERSPACE_LINUX_SCHED_H
+#define __USERSPACE_LINUX_SCHED_H
+
+/*
+ * Userspace stand-in for the <linux/sched.h> calls a kernel thread makes
+ * about itself. Only the calling thread can be reniced, as current.
+ */
+
+#include <sched.h>
+#include <sys/resource.h>
+
+#define MAX_NICE        19
+
+struct task_struct;
+
+#define current         ((struct task_struct *)0)
+
+/* on Linux PRIO_PROCESS with 0 applies to the calling thread alone */
+static inline void set_user_nice(struct task_struct *p, long nice) {
+    (void)p;
+    setpriority(PRIO_PROCESS, 0, (int)nice);
+}
+
+static inline void cond_resched(void) {
+    sched_yield();
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __USERSPACE_LINUX_SEQ_FILE_H
+#define __USERSPACE_LINUX_SEQ_FILE_H
+
+/*
+ * Userspace stand-in for <linux/seq_file.h>: a seq_file writes straight to
+ * a stdio stream. struct file_operations only carries what
+ * DEFINE_SHOW_ATTRIBUTE fills in, the show callback.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+struct seq_file {
+    FILE   *file;
+    void   *private;
+};
+
+struct file_operations {
+    int   (*show)(struct seq_file *m, void *v);
+};
+
+static inline __attribute__((format(printf, 2, 3))) void seq_printf(struct seq_file *m, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(m->file, fmt, ap);
+    va_end(ap);
+}
+
+static inline void seq_puts(struct seq_file *m, const char *s) {
+    fputs(s, m->file);
+}
+
+static inline void seq_putc(struct seq_file *m, char c) {
+    fputc(c, m->file);
+}
+
+#define DEFINE_SHOW_ATTRIBUTE(__name)                                   \
+static const struct file_operations __name##_fops = {                   \
+    .show = __name##_show,                                              \
+}
+
+#endif
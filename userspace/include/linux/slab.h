@@ -0,0 +1,42 @@
+#ifndef __USERSPACE_LINUX_SLAB_H
+#define __USERSPACE_LINUX_SLAB_H
+
+/*
+ * Userspace stand-in for <linux/slab.h>: kmalloc/kvmalloc and kfree/kvfree
+ * map to malloc/free.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <linux/printk.h>
+#include <linux/types.h>
+
+#define GFP_KERNEL  0x01u
+#define GFP_ATOMIC  0x02u
+#define __GFP_ZERO  0x100u
+
+static inline void *kmalloc(size_t size, gfp_t flags) {
+    void *ptr = malloc(size);
+    if (ptr && (flags & __GFP_ZERO)) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags) {
+    return kmalloc(size, flags | __GFP_ZERO);
+}
+
+static inline void kfree(const void *ptr) {
+    free((void *)ptr);
+}
+
+static inline void *kvmalloc(size_t size, gfp_t flags) {
+    return kmalloc(size, flags);
+}
+
+static inline void kvfree(const void *ptr) {
+    free((void *)ptr);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __USERSPACE_LINUX_SMP_H
+#define __USERSPACE_LINUX_SMP_H
+
+/*
+ * Userspace stand-in for <linux/smp.h>. Threads can migrate at any time,
+ * so callers must treat the CPU number as a hint, exactly like the
+ * kernel's raw_smp_processor_id().
+ */
+
+#include <sched.h>
+#include <linux/cpumask.h>
+
+static inline unsigned int raw_smp_processor_id(void) {
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : (unsigned int)cpu % nr_cpu_ids;
+}
+
+#define smp_processor_id()  raw_smp_processor_id()
+
+#endif
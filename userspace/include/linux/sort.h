@@ -0,0 +1,20 @@
+#ifndef __USERSPACE_LINUX_SORT_H
+#define __USERSPACE_LINUX_SORT_H
+
+/*
+ * Userspace stand-in for <linux/sort.h>: sort maps to qsort, the swap
+ * callback is ignored.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+typedef int (*cmp_func_t)(const void *a, const void *b);
+typedef void (*swap_func_t)(void *a, void *b, int size);
+
+static inline void sort(void *base, size_t num, size_t size, cmp_func_t cmp, swap_func_t swap) {
+    (void)swap;
+    qsort(base, num, size, cmp);
+}
+
+#endif
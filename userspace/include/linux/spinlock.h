@@ -0,0 +1,19 @@
+#ifndef __USERSPACE_LINUX_SPINLOCK_H
+#define __USERSPACE_LINUX_SPINLOCK_H
+
+/*
+ * Userspace stand-in for <linux/spinlock.h> on top of pthread spinlocks,
+ * process-shared so that a pool in a shared mapping can be locked from
+ * every process that maps it.
+ */
+
+#include <pthread.h>
+
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(lock)    pthread_spin_init((lock), PTHREAD_PROCESS_SHARED)
+#define spin_lock(lock)         pthread_spin_lock(lock)
+#define spin_unlock(lock)       pthread_spin_unlock(lock)
+#define spin_trylock(lock)      (pthread_spin_trylock(lock) == 0)
+
+#endif
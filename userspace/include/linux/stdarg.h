@@ -0,0 +1,10 @@
+#ifndef __USERSPACE_LINUX_STDARG_H
+#define __USERSPACE_LINUX_STDARG_H
+
+/*
+ * Userspace stand-in for <linux/stdarg.h>.
+ */
+
+#include <stdarg.h>
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __USERSPACE_LINUX_TOPOLOGY_H
+#define __USERSPACE_LINUX_TOPOLOGY_H
+
+/*
+ * Userspace stand-in for the NUMA parts of <linux/topology.h>. There are
+ * nr_node_ids fake nodes (1 unless a program sets it), CPUs are spread
+ * over them round-robin and the distance grows with the node number gap.
+ */
+
+#include <linux/smp.h>
+
+#define NUMA_NO_NODE        (-1)
+#define LOCAL_DISTANCE      10
+#define REMOTE_DISTANCE     20
+
+extern unsigned int nr_node_ids;
+
+static inline int numa_node_id(void) {
+    return (int)(raw_smp_processor_id() % nr_node_ids);
+}
+
+static inline int node_distance(int from, int to) {
+    int gap = from > to ? from - to : to - from;
+    return gap ? REMOTE_DISTANCE + 10 * (gap - 1) : LOCAL_DISTANCE;
+}
+
+#endif
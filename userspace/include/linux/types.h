@@ -0,0 +1,17 @@
+#ifndef __USERSPACE_LINUX_TYPES_H
+#define __USERSPACE_LINUX_TYPES_H
+
+/*
+ * Userspace stand-in for the fixed width kernel types.
+ */
+
+#include <stdint.h>
+
+typedef uint8_t     u8;
+typedef uint16_t    u16;
+typedef uint32_t    u32;
+typedef uint64_t    u64;
+
+typedef unsigned int gfp_t;
+
+#endif
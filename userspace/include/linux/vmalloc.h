@@ -0,0 +1,22 @@
+#ifndef __USERSPACE_LINUX_VMALLOC_H
+#define __USERSPACE_LINUX_VMALLOC_H
+
+/*
+ * Userspace stand-in for <linux/vmalloc.h>: vmalloc/vfree map to malloc/free.
+ */
+
+#include <stdlib.h>
+
+static inline void *vmalloc(unsigned long size) {
+    return malloc(size);
+}
+
+static inline void *vzalloc(unsigned long size) {
+    return calloc(1, size);
+}
+
+static inline void vfree(const void *addr) {
+    free((void *)addr);
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __USERSPACE_LINUX_WAIT_H
+#define __USERSPACE_LINUX_WAIT_H
+
+/*
+ * Userspace stand-in for <linux/wait.h> on top of a pthread condition
+ * variable. Like the kernel's, the condition is evaluated without the
+ * queue's lock; wake_up_all bumps a sequence number that the sleeper read
+ * before evaluating it, so a wakeup in between is not lost, as with
+ * prepare_to_wait. Signals are not modelled, the interruptible variant
+ * never returns -ERESTARTSYS.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/jiffies.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    unsigned long   seq;
+} wait_queue_head_t;
+
+/* process-shared, see <linux/spinlock.h> */
+static inline void init_waitqueue_head(wait_queue_head_t *wq) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t  attr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&wq->lock, &mattr);
+    wq->seq = 0;
+    pthread_cond_init(&wq->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutexattr_destroy(&mattr);
+}
+
+static inline void wake_up_all(wait_queue_head_t *wq) {
+    pthread_mutex_lock(&wq->lock);
+    wq->seq++;
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+/* returns the jiffies left, at least 1, once condition holds, 0 on timeout */
+#define wait_event_interruptible_timeout(wq, condition, timeout)                \
+({                                                                              \
+    long __left = (timeout);                                                    \
+    unsigned long __end = jiffies + __left, __seq;                              \
+    struct timespec __ts;                                                       \
+    int __ok;                                                                   \
+    for (;;) {                                                                  \
+        pthread_mutex_lock(&(wq).lock);                                         \
+        __seq = (wq).seq;                                                       \
+        pthread_mutex_unlock(&(wq).lock);                                       \
+        if ((__ok = (condition))) {                                             \
+            break;                                                              \
+        }                                                                       \
+        if (__left != MAX_SCHEDULE_TIMEOUT) {                                   \
+            __left = (long)(__end - jiffies);                                   \
+        }                                                                       \
+        if (__left <= 0) {                                                      \
+            __ok = (condition);                                                 \
+            break;                                                              \
+        }                                                                       \
+        clock_gettime(CLOCK_MONOTONIC, &__ts);                                  \
+        __ts.tv_sec  += __left / HZ;                                            \
+        __ts.tv_nsec += (__left % HZ) * (1000000000L / HZ);                     \
+        if (__ts.tv_nsec >= 1000000000L) {                                      \
+            __ts.tv_sec++;                                                      \
+            __ts.tv_nsec -= 1000000000L;                                        \
+        }                                                                       \
+        pthread_mutex_lock(&(wq).lock);                                         \
+        while ((wq).seq == __seq) {                                             \
+            if (__left == MAX_SCHEDULE_TIMEOUT) {                               \
+                pthread_cond_wait(&(wq).cond, &(wq).lock);                      \
+            } else if (pthread_cond_timedwait(&(wq).cond, &(wq).lock, &__ts)) { \
+                break;                                                          \
+            }                                                                   \
+        }                                                                       \
+        pthread_mutex_unlock(&(wq).lock);                                       \
+    }                                                                           \
+    __ok ? (__left > 0 ? __left : 1) : 0;                                       \
+})
+
+#endif
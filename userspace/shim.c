@@ -0,0 +1,98 @@
+/*
+ * Userspace implementations backing the kernel shim headers in include/.
+ */
+
+#include <linux/cpumask.h>
+#include <linux/io.h>
+#include <linux/kthread.h>
+#include <linux/printk.h>
+#include <linux/topology.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int shim_printk_enabled = 1;
+
+unsigned int nr_cpu_ids = 1;
+
+unsigned int nr_node_ids = 1;
+
+static void __attribute__((constructor)) shim_init(void) {
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    nr_cpu_ids = ncpus > 0 ? (unsigned int)ncpus : 1;
+}
+
+static unsigned long  carveout_phys;
+static unsigned char *carveout_virt;
+static unsigned long  carveout_size;
+
+void shim_carveout_register(unsigned long phys, void *virt, unsigned long size) {
+    carveout_phys = phys;
+    carveout_virt = (unsigned char *)virt;
+    carveout_size = size;
+}
+
+void *memremap(unsigned long offset, size_t size, unsigned long flags) {
+    (void)flags;
+    if ((carveout_virt == NULL) || (offset < carveout_phys) ||
+        (offset + size > carveout_phys + carveout_size)) {
+        printk("memremap: 0x%lx+0x%zx outside the registered carve-out\n", offset, size);
+        return NULL;
+    }
+    return carveout_virt + (offset - carveout_phys);
+}
+
+void memunmap(void *addr) {
+    (void)addr;
+}
+
+void iounmap(void *addr) {
+    (void)addr;
+}
+
+struct task_struct {
+    pthread_t   thread;
+    int       (*threadfn)(void *data);
+    void       *data;
+    int         should_stop;
+    int         ret;
+};
+
+static __thread struct task_struct *kthread_self;
+
+static void *kthread_main(void *arg) {
+    struct task_struct *k = arg;
+    kthread_self = k;
+    k->ret = k->threadfn(k->data);
+    return NULL;
+}
+
+struct task_struct *kthread_run(int (*threadfn)(void *data), void *data, const char *namefmt, ...) {
+    struct task_struct *k = calloc(1, sizeof(*k));
+    (void)namefmt;
+    if (k == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+    k->threadfn = threadfn;
+    k->data     = data;
+    if (pthread_create(&k->thread, NULL, kthread_main, k) != 0) {
+        free(k);
+        return ERR_PTR(-EAGAIN);
+    }
+    return k;
+}
+
+int kthread_stop(struct task_struct *k) {
+    int ret;
+    __atomic_store_n(&k->should_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(k->thread, NULL);
+    ret = k->ret;
+    free(k);
+    return ret;
+}
+
+int kthread_should_stop(void) {
+    return kthread_self && __atomic_load_n(&kthread_self->should_stop, __ATOMIC_ACQUIRE);
+}